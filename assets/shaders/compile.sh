@@ -1,4 +1,30 @@
 #!/bin/sh
+# Compiles the shaders next to this script, from wherever it is run, and
+# generates embedded_shaders.hpp from them. Run by the build scripts in src/;
+# the .spv files and the header are build outputs and not checked in, so they
+# always match the GLSL sources
+set -e
+cd "$(dirname "$0")"
 glslangValidator -o shader.vert.spv -V shader.vert 
 glslangValidator -o shader.frag.spv -V shader.frag 
+glslangValidator -o cull.comp.spv -V cull.comp
 
+
+# Embed the compiled shaders for builds with EMBED_SHADERS (release builds by
+# default), see new_ShaderBlob in src/main.cpp. Names are relative to the
+# asset root, as the renderer asks for them
+{
+  echo "/* generated by compile.sh from the .spv files next to it, do not edit */"
+  table=""
+  for spv in shader.vert.spv shader.frag.spv cull.comp.spv; do
+    name=$(echo "$spv" | tr '.' '_')
+    echo "static constexpr uint32_t ${name}[] = {"
+    od -An -v -tx4 "$spv" | sed -e 's/ *\([0-9a-f]\{8\}\)/ 0x\1,/g'
+    echo "};"
+    table="$table    {\"shaders/$spv\", $name, sizeof($name)},
+"
+  done
+  echo "static constexpr EmbeddedShader embeddedShaders[] = {"
+  printf "%s" "$table"
+  echo "};"
+} > embedded_shaders.hpp
@@ -1,9 +1,32 @@
 #version 450
 
+// Specialization constant, see shader.vert
+layout(constant_id = 2) const uint LIGHT_COUNT = 0;
+
+// MAX_SCENE_LIGHTS in src/main.cpp
+const uint MAX_LIGHTS = 4;
+const vec3 lightDirections[MAX_LIGHTS] = vec3[](
+    vec3(0.577, 0.577, 0.577), vec3(-0.707, 0.0, 0.707), vec3(0.0, -0.707, 0.707), vec3(0.0, 0.0, -1.0));
+const vec3 lightColors[MAX_LIGHTS] = vec3[](
+    vec3(0.8, 0.8, 0.7), vec3(0.3, 0.3, 0.5), vec3(0.4, 0.3, 0.2), vec3(0.2, 0.2, 0.2));
+const float AMBIENT = 0.2;
+
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec3 fragPosition;
 
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    vec3 color = fragColor;
+    if (LIGHT_COUNT > 0) {
+        // the meshes carry no normals, so light the faces flat. Either side
+        // may face the camera
+        vec3 normal = normalize(cross(dFdx(fragPosition), dFdy(fragPosition)));
+        vec3 light = vec3(AMBIENT);
+        for (uint i = 0; i < min(LIGHT_COUNT, MAX_LIGHTS); i++) {
+            light += lightColors[i] * abs(dot(normal, lightDirections[i]));
+        }
+        color *= light;
+    }
+    outColor = vec4(color, 1.0);
 }
@@ -1,11 +1,33 @@
 #version 450
 
-layout(location = 0) in vec2 inPosition;
+// Specialization constants, folded when the pipeline is compiled. The ids
+// are PipelineFeature in src/main.cpp
+layout(constant_id = 0) const bool VERTEX_COLORS = true;
+layout(constant_id = 1) const bool INSTANCED = true;
+
+layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 
+// per instance, ignored when not INSTANCED
+layout(location = 2) in mat4 instanceTransform;
+layout(location = 6) in vec4 instanceColor;
+
+layout(push_constant) uniform Constants {
+  mat4 viewProjection;
+} constants;
+
 layout(location = 0) out vec3 fragColor;
+// world space, for the fragment shader's lighting
+layout(location = 1) out vec3 fragPosition;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
-    fragColor = inColor;
+    vec4 position = vec4(inPosition, 1.0);
+    vec3 color = VERTEX_COLORS ? inColor : vec3(1.0);
+    if (INSTANCED) {
+        position = instanceTransform * position;
+        color *= instanceColor.rgb;
+    }
+    gl_Position = constants.viewProjection * position;
+    fragColor = color;
+    fragPosition = position.xyz;
 }
@@ -0,0 +1,574 @@
+/* Micro-benchmarks for the linmath and camera hot paths.
+ *
+ * Every benchmark runs over batches of independent inputs at several batch
+ * sizes and reports the best ns/op over BENCH_SAMPLES samples, plus the
+ * throughput that implies. Before timing anything, each SIMD kernel is
+ * cross-checked against its _scalar reference and the run fails if they
+ * disagree. See bench.sh for how it is built.
+ *
+ * usage: bench [--json <file>] [--filter <substring>] [--min-time-ms <ms>]
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "camera.cpp"
+
+#define BENCH_SAMPLES 5
+#define BENCH_DEFAULT_MIN_TIME_MS 100
+#define BENCH_MAX_BATCH 4096
+#define BENCH_MAX_RESULTS 256
+#define BENCH_CHECK_ROUNDS 10000
+
+static const uint32_t benchBatchSizes[] = {1, 16, 256, BENCH_MAX_BATCH};
+static const uint32_t benchBatchSizeCount = sizeof(benchBatchSizes) / sizeof(benchBatchSizes[0]);
+
+/* updateCamera polls the keyboard through GLFW. The benchmark links no GLFW
+ * and has no window, so this stands in for it with movement and rotation
+ * keys held, which takes every branch that does work */
+int glfwGetKey(GLFWwindow *pWindow, int key) {
+  (void)pWindow;
+  switch (key) {
+  case GLFW_KEY_W:
+  case GLFW_KEY_A:
+  case GLFW_KEY_Q:
+  case GLFW_KEY_UP:
+  case GLFW_KEY_RIGHT:
+    return (GLFW_PRESS);
+  default:
+    return (GLFW_RELEASE);
+  }
+}
+
+static uint64_t getTimeNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec);
+}
+
+static const char *getSimdBackend() {
+#if defined(LINMATH_SIMD_AVX) && defined(__FMA__)
+  return ("avx+fma");
+#elif defined(LINMATH_SIMD_AVX)
+  return ("avx");
+#elif defined(LINMATH_SIMD_SSE) && defined(__FMA__)
+  return ("sse+fma");
+#elif defined(LINMATH_SIMD_SSE)
+  return ("sse");
+#elif defined(LINMATH_SIMD_NEON)
+  return ("neon");
+#else
+  return ("scalar");
+#endif
+}
+
+/* Inputs and outputs for every benchmark, BENCH_MAX_BATCH of each */
+typedef struct {
+  mat4x4 *pA;
+  mat4x4 *pB;
+  mat4x4 *pOut;
+  mat4x4a *pAlignedA;
+  mat4x4a *pAlignedB;
+  mat4x4a *pAlignedOut;
+  vec4 *pVectors;
+  vec4 *pVectorsOut;
+  quat *pQuats;
+  quat *pQuatsOut;
+  vec3 *pEyes;
+  Camera *pCameras;
+  float *pTrs;
+  trs_soa trs;
+  // folded into by every benchmark so no result can be optimized away
+  float sink;
+} BenchData;
+
+typedef void (*BenchFn)(BenchData *pData, uint32_t batch);
+
+typedef struct {
+  const char *pName;
+  uint32_t batch;
+  uint64_t iterations;
+  double nsPerOp;
+  double opsPerSecond;
+} BenchResult;
+
+typedef struct {
+  const char *pName;
+  float maxError;
+  bool ok;
+} BenchCheck;
+
+typedef struct {
+  const char *pFilter;
+  uint64_t minTimeNs;
+  BenchResult pResults[BENCH_MAX_RESULTS];
+  uint32_t resultCount;
+  BenchCheck pChecks[BENCH_MAX_RESULTS];
+  uint32_t checkCount;
+} BenchRun;
+
+static float randomFloat() { return ((float)rand() / (float)RAND_MAX * 2.0f - 1.0f); }
+
+/* Well conditioned matrices: a random rotation, scale and translation */
+static void randomTransform(mat4x4 M) {
+  quat q = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+  quat_norm(q, q);
+  mat4x4_from_quat(M, q);
+  vec4_scale(M[0], M[0], 1.5f + randomFloat());
+  vec4_scale(M[1], M[1], 1.5f + randomFloat());
+  vec4_scale(M[2], M[2], 1.5f + randomFloat());
+  M[3][0] = 10.0f * randomFloat();
+  M[3][1] = 10.0f * randomFloat();
+  M[3][2] = 10.0f * randomFloat();
+}
+
+static void *allocateBench(size_t size) {
+  // 64 byte alignment covers the aligned variants and keeps cache lines apart
+  void *p = aligned_alloc(64, (size + 63) & ~(size_t)63);
+  if (!p) {
+    fprintf(stderr, "failed to allocate %zu bytes\n", size);
+    exit(EXIT_FAILURE);
+  }
+  return (p);
+}
+
+static void new_BenchData(BenchData *pData) {
+  const uint32_t n = BENCH_MAX_BATCH;
+  pData->pA = (mat4x4 *)allocateBench(n * sizeof(mat4x4));
+  pData->pB = (mat4x4 *)allocateBench(n * sizeof(mat4x4));
+  pData->pOut = (mat4x4 *)allocateBench(2 * n * sizeof(mat4x4));
+  pData->pAlignedA = (mat4x4a *)allocateBench(n * sizeof(mat4x4a));
+  pData->pAlignedB = (mat4x4a *)allocateBench(n * sizeof(mat4x4a));
+  pData->pAlignedOut = (mat4x4a *)allocateBench(n * sizeof(mat4x4a));
+  pData->pVectors = (vec4 *)allocateBench(n * sizeof(vec4));
+  pData->pVectorsOut = (vec4 *)allocateBench(n * sizeof(vec4));
+  pData->pQuats = (quat *)allocateBench(2 * n * sizeof(quat));
+  pData->pQuatsOut = (quat *)allocateBench(n * sizeof(quat));
+  pData->pEyes = (vec3 *)allocateBench(n * sizeof(vec3));
+  pData->pCameras = (Camera *)allocateBench(n * sizeof(Camera));
+  pData->pTrs = (float *)allocateBench(10 * n * sizeof(float));
+
+  srand(1);
+  for (uint32_t i = 0; i < n; i++) {
+    randomTransform(pData->pA[i]);
+    randomTransform(pData->pB[i]);
+    memcpy(pData->pAlignedA[i], pData->pA[i], sizeof(mat4x4));
+    memcpy(pData->pAlignedB[i], pData->pB[i], sizeof(mat4x4));
+    for (int j = 0; j < 4; j++) {
+      pData->pVectors[i][j] = randomFloat();
+    }
+    for (uint32_t k = 0; k < 2; k++) {
+      quat *pQuat = &pData->pQuats[2 * i + k];
+      for (int j = 0; j < 4; j++) {
+        (*pQuat)[j] = randomFloat();
+      }
+      quat_norm(*pQuat, *pQuat);
+    }
+    for (int j = 0; j < 3; j++) {
+      pData->pEyes[i][j] = 10.0f * randomFloat();
+    }
+    vec3 position = {randomFloat(), randomFloat(), randomFloat()};
+    pData->pCameras[i] = new_Camera(position, (VkExtent2D){.width = 1920, .height = 1080});
+    pData->pCameras[i].pitch = randomFloat();
+    pData->pCameras[i].yaw = 3.0f * randomFloat();
+  }
+
+  float *pArrays[10];
+  for (int j = 0; j < 10; j++) {
+    pArrays[j] = pData->pTrs + j * n;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    quat q = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+    quat_norm(q, q);
+    for (int j = 0; j < 3; j++) {
+      pArrays[j][i] = 10.0f * randomFloat();
+      pArrays[7 + j][i] = 1.5f + randomFloat();
+    }
+    for (int j = 0; j < 4; j++) {
+      pArrays[3 + j][i] = q[j];
+    }
+  }
+  pData->trs = (trs_soa){.px = pArrays[0], .py = pArrays[1], .pz = pArrays[2],
+                         .qx = pArrays[3], .qy = pArrays[4], .qz = pArrays[5], .qw = pArrays[6],
+                         .sx = pArrays[7], .sy = pArrays[8], .sz = pArrays[9]};
+  pData->sink = 0.0f;
+}
+
+static void delete_BenchData(BenchData *pData) {
+  free(pData->pA);
+  free(pData->pB);
+  free(pData->pOut);
+  free(pData->pAlignedA);
+  free(pData->pAlignedB);
+  free(pData->pAlignedOut);
+  free(pData->pVectors);
+  free(pData->pVectorsOut);
+  free(pData->pQuats);
+  free(pData->pQuatsOut);
+  free(pData->pEyes);
+  free(pData->pCameras);
+  free(pData->pTrs);
+}
+
+/* The benchmarks themselves, one op per batch element */
+
+static void benchMat4x4Mul(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_mul(pData->pOut[i], pData->pA[i], pData->pB[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][3][3];
+}
+static void benchMat4x4MulScalar(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_mul_scalar(pData->pOut[i], pData->pA[i], pData->pB[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][3][3];
+}
+static void benchMat4x4aMul(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4a_mul(pData->pAlignedOut[i], pData->pAlignedA[i], pData->pAlignedB[i]);
+  }
+  pData->sink += pData->pAlignedOut[batch - 1][3][3];
+}
+static void benchMat4x4MulVec4(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_mul_vec4(pData->pVectorsOut[i], pData->pA[i], pData->pVectors[i]);
+  }
+  pData->sink += pData->pVectorsOut[batch - 1][3];
+}
+static void benchMat4x4MulVec4Scalar(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_mul_vec4_scalar(pData->pVectorsOut[i], pData->pA[i], pData->pVectors[i]);
+  }
+  pData->sink += pData->pVectorsOut[batch - 1][3];
+}
+static void benchMat4x4Invert(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_invert(pData->pOut[i], pData->pA[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][3][3];
+}
+static void benchMat4x4InvertScalar(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_invert_scalar(pData->pOut[i], pData->pA[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][3][3];
+}
+static void benchMat4x4aInvert(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4a_invert(pData->pAlignedOut[i], pData->pAlignedA[i]);
+  }
+  pData->sink += pData->pAlignedOut[batch - 1][3][3];
+}
+static void benchMat4x4LookAt(BenchData *pData, uint32_t batch) {
+  static const vec3 center = {0.0f, 0.0f, 0.0f};
+  static const vec3 up = {0.0f, 1.0f, 0.0f};
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_look_at(pData->pOut[i], pData->pEyes[i], center, up);
+  }
+  pData->sink += pData->pOut[batch - 1][3][0];
+}
+static void benchMat4x4Perspective(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_perspective(pData->pOut[i], 1.0f + 0.001f * i, 16.0f / 9.0f, 0.01f, 100.0f);
+  }
+  pData->sink += pData->pOut[batch - 1][0][0];
+}
+static void benchQuatMul(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    quat_mul(pData->pQuatsOut[i], pData->pQuats[2 * i], pData->pQuats[2 * i + 1]);
+  }
+  pData->sink += pData->pQuatsOut[batch - 1][3];
+}
+static void benchQuatMulScalar(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    quat_mul_scalar(pData->pQuatsOut[i], pData->pQuats[2 * i], pData->pQuats[2 * i + 1]);
+  }
+  pData->sink += pData->pQuatsOut[batch - 1][3];
+}
+static void benchQuatMulVec3(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    quat_mul_vec3(pData->pVectorsOut[i], pData->pQuats[i], pData->pVectors[i]);
+  }
+  pData->sink += pData->pVectorsOut[batch - 1][2];
+}
+static void benchQuatRotate(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    quat_rotate(pData->pQuatsOut[i], pData->pVectors[i][3], pData->pVectors[i]);
+  }
+  pData->sink += pData->pQuatsOut[batch - 1][3];
+}
+static void benchMat4x4FromQuat(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    mat4x4_from_quat(pData->pOut[i], pData->pQuats[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][2][2];
+}
+static void benchQuatFromMat4x4(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    quat_from_mat4x4(pData->pQuatsOut[i], pData->pA[i]);
+  }
+  pData->sink += pData->pQuatsOut[batch - 1][0];
+}
+static void benchBatchTrs(BenchData *pData, uint32_t batch) {
+  mat4x4_batch_trs(pData->pOut, NULL, sizeof(mat4x4), NULL, &pData->trs, 0, batch);
+  pData->sink += pData->pOut[batch - 1][3][0];
+}
+static void benchBatchTrsScalar(BenchData *pData, uint32_t batch) {
+  mat4x4_batch_trs_scalar(pData->pOut, NULL, sizeof(mat4x4), NULL, &pData->trs, 0, batch);
+  pData->sink += pData->pOut[batch - 1][3][0];
+}
+/* model and mvp interleaved, as an instance buffer would hold them */
+static void benchBatchTrsMvp(BenchData *pData, uint32_t batch) {
+  mat4x4_batch_trs(pData->pOut, pData->pOut + 1, 2 * sizeof(mat4x4), pData->pB[0], &pData->trs, 0, batch);
+  pData->sink += pData->pOut[2 * batch - 1][3][0];
+}
+static void benchBatchTrsMvpScalar(BenchData *pData, uint32_t batch) {
+  mat4x4_batch_trs_scalar(pData->pOut, pData->pOut + 1, 2 * sizeof(mat4x4), pData->pB[0], &pData->trs, 0, batch);
+  pData->sink += pData->pOut[2 * batch - 1][3][0];
+}
+static void benchNewCameraBasis(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    pData->pCameras[i].basis = new_CameraBasis(pData->pCameras[i].pitch, pData->pCameras[i].yaw);
+  }
+  pData->sink += pData->pCameras[batch - 1].basis.up[1];
+}
+static void benchUpdateCamera(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    updateCamera(&pData->pCameras[i], NULL);
+  }
+  pData->sink += pData->pCameras[batch - 1].pos[0];
+}
+static void benchGetMvpCamera(BenchData *pData, uint32_t batch) {
+  for (uint32_t i = 0; i < batch; i++) {
+    getMvpCamera(pData->pOut[i], &pData->pCameras[i]);
+  }
+  pData->sink += pData->pOut[batch - 1][3][2];
+}
+
+typedef struct {
+  const char *pName;
+  BenchFn fn;
+} BenchCase;
+
+static const BenchCase benchCases[] = {
+    {"mat4x4_mul", benchMat4x4Mul},
+    {"mat4x4_mul_scalar", benchMat4x4MulScalar},
+    {"mat4x4a_mul", benchMat4x4aMul},
+    {"mat4x4_mul_vec4", benchMat4x4MulVec4},
+    {"mat4x4_mul_vec4_scalar", benchMat4x4MulVec4Scalar},
+    {"mat4x4_invert", benchMat4x4Invert},
+    {"mat4x4_invert_scalar", benchMat4x4InvertScalar},
+    {"mat4x4a_invert", benchMat4x4aInvert},
+    {"mat4x4_look_at", benchMat4x4LookAt},
+    {"mat4x4_perspective", benchMat4x4Perspective},
+    {"quat_mul", benchQuatMul},
+    {"quat_mul_scalar", benchQuatMulScalar},
+    {"quat_mul_vec3", benchQuatMulVec3},
+    {"quat_rotate", benchQuatRotate},
+    {"mat4x4_from_quat", benchMat4x4FromQuat},
+    {"quat_from_mat4x4", benchQuatFromMat4x4},
+    {"mat4x4_batch_trs", benchBatchTrs},
+    {"mat4x4_batch_trs_scalar", benchBatchTrsScalar},
+    {"mat4x4_batch_trs_mvp", benchBatchTrsMvp},
+    {"mat4x4_batch_trs_mvp_scalar", benchBatchTrsMvpScalar},
+    {"new_CameraBasis", benchNewCameraBasis},
+    {"updateCamera", benchUpdateCamera},
+    {"getMvpCamera", benchGetMvpCamera},
+};
+
+/* Times one benchmark at one batch size. The repetition count is grown until
+ * a sample takes minTimeNs / BENCH_SAMPLES, then the fastest sample wins */
+static void runBench(BenchRun *pRun, BenchData *pData, const BenchCase *pCase, const uint32_t batch) {
+  uint64_t sampleNs = pRun->minTimeNs / BENCH_SAMPLES;
+  uint64_t repetitions = 1;
+  for (;;) {
+    uint64_t startNs = getTimeNs();
+    for (uint64_t r = 0; r < repetitions; r++) {
+      pCase->fn(pData, batch);
+    }
+    uint64_t elapsedNs = getTimeNs() - startNs;
+    if (elapsedNs >= sampleNs) {
+      break;
+    }
+    // aim a little past the target so the next round usually ends it
+    repetitions = elapsedNs == 0 ? repetitions * 16 : repetitions * sampleNs * 5 / (elapsedNs * 4) + 1;
+  }
+
+  double bestNsPerOp = 0.0;
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    uint64_t startNs = getTimeNs();
+    for (uint64_t r = 0; r < repetitions; r++) {
+      pCase->fn(pData, batch);
+    }
+    double nsPerOp = (double)(getTimeNs() - startNs) / (double)(repetitions * batch);
+    if (s == 0 || nsPerOp < bestNsPerOp) {
+      bestNsPerOp = nsPerOp;
+    }
+  }
+
+  if (pRun->resultCount == BENCH_MAX_RESULTS) {
+    return;
+  }
+  BenchResult *pResult = &pRun->pResults[pRun->resultCount++];
+  pResult->pName = pCase->pName;
+  pResult->batch = batch;
+  pResult->iterations = repetitions * batch;
+  pResult->nsPerOp = bestNsPerOp;
+  pResult->opsPerSecond = bestNsPerOp > 0.0 ? 1e9 / bestNsPerOp : 0.0;
+  printf("%-30s %6u %12.2f ns/op %10.2f Mops/s\n", pResult->pName, batch, pResult->nsPerOp,
+         pResult->opsPerSecond / 1e6);
+}
+
+static float maxError(const float *pA, const float *pB, const uint32_t count) {
+  float error = 0.0f;
+  for (uint32_t i = 0; i < count; i++) {
+    // relative once the values get large
+    float difference = fabsf(pA[i] - pB[i]) / fmaxf(1.0f, fabsf(pB[i]));
+    error = fmaxf(error, difference);
+  }
+  return (error);
+}
+
+static void addCheck(BenchRun *pRun, const char *pName, const float error, const float tolerance) {
+  BenchCheck *pCheck = &pRun->pChecks[pRun->checkCount++];
+  pCheck->pName = pName;
+  pCheck->maxError = error;
+  pCheck->ok = error <= tolerance;
+  printf("check %-24s max error %g %s\n", pName, error, pCheck->ok ? "ok" : "FAILED");
+}
+
+/* Cross-checks each vectorized function against its scalar reference on
+ * BENCH_CHECK_ROUNDS random inputs, including outputs aliasing inputs */
+static bool checkSimd(BenchRun *pRun, BenchData *pData) {
+  float mulError = 0.0f;
+  float mulVec4Error = 0.0f;
+  float invertError = 0.0f;
+  float quatError = 0.0f;
+  for (uint32_t round = 0; round < BENCH_CHECK_ROUNDS; round++) {
+    uint32_t i = round % BENCH_MAX_BATCH;
+    mat4x4 simd, scalar;
+    mat4x4_mul(simd, pData->pA[i], pData->pB[i]);
+    mat4x4_mul_scalar(scalar, pData->pA[i], pData->pB[i]);
+    mulError = fmaxf(mulError, maxError(&simd[0][0], &scalar[0][0], 16));
+    mat4x4a aligned;
+    mat4x4a_mul(aligned, pData->pAlignedA[i], pData->pAlignedB[i]);
+    mulError = fmaxf(mulError, maxError(&aligned[0][0], &scalar[0][0], 16));
+    mat4x4_dup(simd, pData->pA[i]);
+    mat4x4_mul(simd, simd, pData->pB[i]);
+    mulError = fmaxf(mulError, maxError(&simd[0][0], &scalar[0][0], 16));
+
+    vec4 simdVector, scalarVector;
+    mat4x4_mul_vec4(simdVector, pData->pA[i], pData->pVectors[i]);
+    mat4x4_mul_vec4_scalar(scalarVector, pData->pA[i], pData->pVectors[i]);
+    mulVec4Error = fmaxf(mulVec4Error, maxError(simdVector, scalarVector, 4));
+
+    mat4x4_invert(simd, pData->pA[i]);
+    mat4x4_invert_scalar(scalar, pData->pA[i]);
+    invertError = fmaxf(invertError, maxError(&simd[0][0], &scalar[0][0], 16));
+    mat4x4a_invert(aligned, pData->pAlignedA[i]);
+    invertError = fmaxf(invertError, maxError(&aligned[0][0], &scalar[0][0], 16));
+
+    quat simdQuat, scalarQuat;
+    quat_mul(simdQuat, pData->pQuats[2 * i], pData->pQuats[2 * i + 1]);
+    quat_mul_scalar(scalarQuat, pData->pQuats[2 * i], pData->pQuats[2 * i + 1]);
+    quatError = fmaxf(quatError, maxError(simdQuat, scalarQuat, 4));
+  }
+
+  // model and mvp, over a count that leaves a scalar tail
+  const uint32_t trsCount = BENCH_MAX_BATCH - 3;
+  mat4x4 *pSimd = pData->pOut;
+  mat4x4 *pScalar = (mat4x4 *)allocateBench(2 * BENCH_MAX_BATCH * sizeof(mat4x4));
+  mat4x4_batch_trs(pSimd, pSimd + 1, 2 * sizeof(mat4x4), pData->pB[0], &pData->trs, 0, trsCount);
+  mat4x4_batch_trs_scalar(pScalar, pScalar + 1, 2 * sizeof(mat4x4), pData->pB[0], &pData->trs, 0, trsCount);
+  float trsError = maxError(&pSimd[0][0][0], &pScalar[0][0][0], 2 * trsCount * 16);
+  free(pScalar);
+
+  // FMA contraction changes rounding, so allow a few ulps of slack
+  addCheck(pRun, "mat4x4_mul", mulError, 1e-5f);
+  addCheck(pRun, "mat4x4_mul_vec4", mulVec4Error, 1e-5f);
+  addCheck(pRun, "mat4x4_invert", invertError, 1e-4f);
+  addCheck(pRun, "quat_mul", quatError, 1e-5f);
+  addCheck(pRun, "mat4x4_batch_trs", trsError, 1e-4f);
+  for (uint32_t i = 0; i < pRun->checkCount; i++) {
+    if (!pRun->pChecks[i].ok) {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+static bool writeBenchJson(const BenchRun *pRun, const char *pPath) {
+  FILE *fp = fopen(pPath, "w");
+  if (!fp) {
+    fprintf(stderr, "could not open %s: %s\n", pPath, strerror(errno));
+    return (false);
+  }
+  fprintf(fp, "{\n  \"simd\": \"%s\",\n  \"compiler\": \"%s\",\n  \"samples\": %d,\n  \"min_time_ms\": %llu,\n",
+          getSimdBackend(), __VERSION__, BENCH_SAMPLES, (unsigned long long)(pRun->minTimeNs / 1000000));
+  fprintf(fp, "  \"checks\": [\n");
+  for (uint32_t i = 0; i < pRun->checkCount; i++) {
+    const BenchCheck *pCheck = &pRun->pChecks[i];
+    fprintf(fp, "    {\"name\": \"%s\", \"max_error\": %g, \"ok\": %s}%s\n", pCheck->pName, pCheck->maxError,
+            pCheck->ok ? "true" : "false", i + 1 < pRun->checkCount ? "," : "");
+  }
+  fprintf(fp, "  ],\n  \"results\": [\n");
+  for (uint32_t i = 0; i < pRun->resultCount; i++) {
+    const BenchResult *pResult = &pRun->pResults[i];
+    fprintf(fp,
+            "    {\"name\": \"%s\", \"batch\": %u, \"iterations\": %llu, \"ns_per_op\": %.4f, "
+            "\"ops_per_second\": %.1f}%s\n",
+            pResult->pName, pResult->batch, (unsigned long long)pResult->iterations, pResult->nsPerOp,
+            pResult->opsPerSecond, i + 1 < pRun->resultCount ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  fclose(fp);
+  return (true);
+}
+
+int main(int argc, char **argv) {
+  static BenchRun run;
+  run.pFilter = NULL;
+  run.minTimeNs = BENCH_DEFAULT_MIN_TIME_MS * 1000000ull;
+  const char *pJsonPath = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      pJsonPath = argv[++i];
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      run.pFilter = argv[++i];
+    } else if (strcmp(argv[i], "--min-time-ms") == 0 && i + 1 < argc) {
+      run.minTimeNs = strtoull(argv[++i], NULL, 10) * 1000000ull;
+    } else {
+      fprintf(stderr, "usage: %s [--json <file>] [--filter <substring>] [--min-time-ms <ms>]\n", argv[0]);
+      return (EXIT_FAILURE);
+    }
+  }
+
+  static BenchData data;
+  new_BenchData(&data);
+  printf("linmath backend: %s\n", getSimdBackend());
+  if (!checkSimd(&run, &data)) {
+    fprintf(stderr, "simd results disagree with the scalar reference\n");
+    delete_BenchData(&data);
+    return (EXIT_FAILURE);
+  }
+
+  for (uint32_t c = 0; c < sizeof(benchCases) / sizeof(benchCases[0]); c++) {
+    if (run.pFilter && !strstr(benchCases[c].pName, run.pFilter)) {
+      continue;
+    }
+    for (uint32_t b = 0; b < benchBatchSizeCount; b++) {
+      runBench(&run, &data, &benchCases[c], benchBatchSizes[b]);
+    }
+  }
+  // keeps the sink, and so every result, alive
+  printf("(sink %g)\n", data.sink);
+
+  bool ok = pJsonPath ? writeBenchJson(&run, pJsonPath) : true;
+  delete_BenchData(&data);
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,6 @@
+# Builds and runs the linmath and camera micro-benchmarks from src/, writing
+# bench.json next to them. Extra arguments go to the benchmark, e.g.
+# --filter mat4x4_mul. Built for the host CPU so the SIMD backend matches it;
+# set CXXFLAGS=-DLINMATH_NO_SIMD for a scalar baseline to compare against.
+g++ -std=c++17 -O2 -march=native $CXXFLAGS bench.cpp -o bench || exit 1
+./bench --json bench.json "$@"
@@ -2,6 +2,41 @@
 #define LINMATH_H
 
 #include <math.h>
+#include <stddef.h>
+
+/* The hot matrix and quaternion functions have a SIMD backend picked at
+ * compile time: SSE on x86 (with FMA when the target has it, e.g. -mavx2
+ * -mfma), NEON on AArch64. AVX targets multiply matrices two columns at a
+ * time. NEON needs __builtin_shufflevector (GCC 12, clang) for the inverse and
+ * quat_mul, without it those two stay scalar. Define LINMATH_NO_SIMD to build
+ * the scalar code only. Every vectorized function keeps its scalar version
+ * under a _scalar suffix as the reference to check it against, see
+ * linmath_test.cpp */
+#if !defined(LINMATH_NO_SIMD) && (defined(__SSE__) || defined(_M_X64))
+#define LINMATH_SIMD_SSE
+#include <immintrin.h>
+#if defined(__AVX__)
+#define LINMATH_SIMD_AVX
+#endif
+#elif !defined(LINMATH_NO_SIMD) && defined(__ARM_NEON)
+#define LINMATH_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+// shuffles, for the inverse and quat_mul
+#if defined(LINMATH_SIMD_SSE)
+#define LINMATH_SIMD_SHUFFLE
+#elif defined(LINMATH_SIMD_NEON) && defined(__has_builtin)
+#if __has_builtin(__builtin_shufflevector)
+#define LINMATH_SIMD_SHUFFLE
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define LINMATH_ALIGN16 __declspec(align(16))
+#else
+#define LINMATH_ALIGN16 __attribute__((aligned(16)))
+#endif
 
 #define PI 3.14159265359f
 
@@ -96,6 +131,148 @@ static inline void vec4_reflect(vec4 r, vec4 v, vec4 n) {
 }
 
 typedef vec4 mat4x4[4];
+
+/* 16 byte aligned storage, for the _a variants that use aligned loads and
+ * stores. They convert to vec4 and mat4x4 freely, but the reverse only holds
+ * if the storage really is aligned */
+typedef float vec4a[4] LINMATH_ALIGN16;
+typedef vec4a mat4x4a[4];
+
+#if defined(LINMATH_SIMD_SSE)
+typedef __m128 linmath_v4;
+#define linmath_load(p) _mm_load_ps(p)
+#define linmath_loadu(p) _mm_loadu_ps(p)
+#define linmath_store(p, v) _mm_store_ps(p, v)
+#define linmath_storeu(p, v) _mm_storeu_ps(p, v)
+#define linmath_splat(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+#if defined(__FMA__)
+#define linmath_madd(a, b, c) _mm_fmadd_ps(a, b, c)
+#else
+#define linmath_madd(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#endif
+#define linmath_mul(a, b) _mm_mul_ps(a, b)
+#define linmath_add(a, b) _mm_add_ps(a, b)
+#define linmath_sub(a, b) _mm_sub_ps(a, b)
+#define linmath_div(a, b) _mm_div_ps(a, b)
+#define linmath_set1(x) _mm_set1_ps(x)
+#define linmath_setr(x, y, z, w) _mm_setr_ps(x, y, z, w)
+#define linmath_transpose(r0, r1, r2, r3) _MM_TRANSPOSE4_PS(r0, r1, r2, r3)
+/* (a[x], a[y], b[z], b[w]) */
+#define linmath_shuffle(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+/* (a[0], a[1], b[0], b[1]) and (b[2], b[3], a[2], a[3]) */
+#define linmath_movelh(a, b) _mm_movelh_ps(a, b)
+#define linmath_movehl(a, b) _mm_movehl_ps(a, b)
+#elif defined(LINMATH_SIMD_NEON)
+typedef float32x4_t linmath_v4;
+#define linmath_load(p) vld1q_f32(p)
+#define linmath_loadu(p) vld1q_f32(p)
+#define linmath_store(p, v) vst1q_f32(p, v)
+#define linmath_storeu(p, v) vst1q_f32(p, v)
+#define linmath_splat(v, i) vdupq_laneq_f32(v, i)
+#define linmath_madd(a, b, c) vfmaq_f32(c, a, b)
+#define linmath_mul(a, b) vmulq_f32(a, b)
+#define linmath_add(a, b) vaddq_f32(a, b)
+#define linmath_sub(a, b) vsubq_f32(a, b)
+#define linmath_div(a, b) vdivq_f32(a, b)
+#define linmath_set1(x) vdupq_n_f32(x)
+#define linmath_setr(x, y, z, w) ((float32x4_t){x, y, z, w})
+#define linmath_shuffle(a, b, x, y, z, w) __builtin_shufflevector(a, b, x, y, (z) + 4, (w) + 4)
+#define linmath_movelh(a, b) vcombine_f32(vget_low_f32(a), vget_low_f32(b))
+#define linmath_movehl(a, b) vcombine_f32(vget_high_f32(b), vget_high_f32(a))
+#define linmath_transpose(r0, r1, r2, r3)                                      \
+  do {                                                                         \
+    float32x4x2_t t01 = vtrnq_f32(r0, r1);                                     \
+    float32x4x2_t t23 = vtrnq_f32(r2, r3);                                     \
+    r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));     \
+    r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));     \
+    r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));   \
+    r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));   \
+  } while (0)
+#endif
+
+#if defined(LINMATH_SIMD_SSE) || defined(LINMATH_SIMD_NEON)
+/* r = a * b on columns held in registers; r may alias either */
+static inline void linmath_mat4x4_mul_v4(linmath_v4 r[4], const linmath_v4 a[4], const linmath_v4 b[4]) {
+  linmath_v4 t[4];
+  int c;
+  for (c = 0; c < 4; ++c) {
+    t[c] = linmath_mul(a[0], linmath_splat(b[c], 0));
+    t[c] = linmath_madd(a[1], linmath_splat(b[c], 1), t[c]);
+    t[c] = linmath_madd(a[2], linmath_splat(b[c], 2), t[c]);
+    t[c] = linmath_madd(a[3], linmath_splat(b[c], 3), t[c]);
+  }
+  for (c = 0; c < 4; ++c) {
+    r[c] = t[c];
+  }
+}
+static inline linmath_v4 linmath_mat4x4_mul_vec4_v4(const linmath_v4 M[4], const linmath_v4 v) {
+  linmath_v4 r = linmath_mul(M[0], linmath_splat(v, 0));
+  r = linmath_madd(M[1], linmath_splat(v, 1), r);
+  r = linmath_madd(M[2], linmath_splat(v, 2), r);
+  return (linmath_madd(M[3], linmath_splat(v, 3), r));
+}
+#endif
+
+#if defined(LINMATH_SIMD_SHUFFLE)
+/* 2x2 blocks held as (m00, m01, m10, m11). Block products for the inverse:
+ * a * b, adj(a) * b and a * adj(b) */
+static inline linmath_v4 linmath_mat2_mul(linmath_v4 a, linmath_v4 b) {
+  return (linmath_add(linmath_mul(a, linmath_shuffle(b, b, 0, 3, 0, 3)),
+                      linmath_mul(linmath_shuffle(a, a, 1, 0, 3, 2), linmath_shuffle(b, b, 2, 1, 2, 1))));
+}
+static inline linmath_v4 linmath_mat2_adj_mul(linmath_v4 a, linmath_v4 b) {
+  return (linmath_sub(linmath_mul(linmath_shuffle(a, a, 3, 3, 0, 0), b),
+                      linmath_mul(linmath_shuffle(a, a, 1, 1, 2, 2), linmath_shuffle(b, b, 2, 3, 0, 1))));
+}
+static inline linmath_v4 linmath_mat2_mul_adj(linmath_v4 a, linmath_v4 b) {
+  return (linmath_sub(linmath_mul(a, linmath_shuffle(b, b, 3, 0, 3, 0)),
+                      linmath_mul(linmath_shuffle(a, a, 1, 0, 3, 2), linmath_shuffle(b, b, 2, 1, 2, 1))));
+}
+/* Blockwise inverse, see the scalar version for the cofactor form. Works on
+ * the transpose as well, so the column major layout needs no special care.
+ * r may alias M */
+static inline void linmath_mat4x4_invert_v4(linmath_v4 r[4], const linmath_v4 M[4]) {
+  linmath_v4 A = linmath_movelh(M[0], M[1]);
+  linmath_v4 B = linmath_movehl(M[1], M[0]);
+  linmath_v4 C = linmath_movelh(M[2], M[3]);
+  linmath_v4 D = linmath_movehl(M[3], M[2]);
+
+  // (|A|, |B|, |C|, |D|)
+  linmath_v4 detSub = linmath_sub(
+      linmath_mul(linmath_shuffle(M[0], M[2], 0, 2, 0, 2), linmath_shuffle(M[1], M[3], 1, 3, 1, 3)),
+      linmath_mul(linmath_shuffle(M[0], M[2], 1, 3, 1, 3), linmath_shuffle(M[1], M[3], 0, 2, 0, 2)));
+  linmath_v4 detA = linmath_splat(detSub, 0);
+  linmath_v4 detB = linmath_splat(detSub, 1);
+  linmath_v4 detC = linmath_splat(detSub, 2);
+  linmath_v4 detD = linmath_splat(detSub, 3);
+
+  linmath_v4 DC = linmath_mat2_adj_mul(D, C);
+  linmath_v4 AB = linmath_mat2_adj_mul(A, B);
+  linmath_v4 X = linmath_sub(linmath_mul(detD, A), linmath_mat2_mul(B, DC));
+  linmath_v4 W = linmath_sub(linmath_mul(detA, D), linmath_mat2_mul(C, AB));
+  linmath_v4 Y = linmath_sub(linmath_mul(detB, C), linmath_mat2_mul_adj(D, AB));
+  linmath_v4 Z = linmath_sub(linmath_mul(detC, B), linmath_mat2_mul_adj(A, DC));
+
+  // |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+  linmath_v4 tr = linmath_mul(AB, linmath_shuffle(DC, DC, 0, 2, 1, 3));
+  tr = linmath_add(tr, linmath_shuffle(tr, tr, 1, 0, 3, 2));
+  tr = linmath_add(tr, linmath_shuffle(tr, tr, 2, 3, 0, 1));
+  linmath_v4 det = linmath_sub(linmath_add(linmath_mul(detA, detD), linmath_mul(detB, detC)), tr);
+
+  /* Assumes it is invertible */
+  linmath_v4 idet = linmath_div(linmath_setr(1.0f, -1.0f, -1.0f, 1.0f), det);
+  X = linmath_mul(X, idet);
+  Y = linmath_mul(Y, idet);
+  Z = linmath_mul(Z, idet);
+  W = linmath_mul(W, idet);
+
+  r[0] = linmath_shuffle(X, Y, 3, 1, 3, 1);
+  r[1] = linmath_shuffle(X, Y, 2, 0, 2, 0);
+  r[2] = linmath_shuffle(Z, W, 3, 1, 3, 1);
+  r[3] = linmath_shuffle(Z, W, 2, 0, 2, 0);
+}
+#endif
+
 static inline void mat4x4_identity(mat4x4 M) {
   int i, j;
   for (i = 0; i < 4; ++i) {
@@ -160,7 +337,7 @@ static inline void mat4x4_scale_aniso(mat4x4 M, mat4x4 a, float x, float y,
     M[3][i] = a[3][i];
   }
 }
-static inline void mat4x4_mul(mat4x4 M, const mat4x4 a, const mat4x4 b) {
+static inline void mat4x4_mul_scalar(mat4x4 M, const mat4x4 a, const mat4x4 b) {
   mat4x4 temp;
   int k, r, c;
   for (c = 0; c < 4; ++c)
@@ -172,15 +349,90 @@ static inline void mat4x4_mul(mat4x4 M, const mat4x4 a, const mat4x4 b) {
     }
   mat4x4_dup(M, temp);
 }
-static inline void mat4x4_mul_vec4(vec4 r, const mat4x4 M, const vec4 v) {
+static inline void mat4x4_mul_vec4_scalar(vec4 r, const mat4x4 M, const vec4 v) {
+  vec4 temp;
   int i, j;
   for (j = 0; j < 4; ++j) {
-    r[j] = 0.0f;
+    temp[j] = 0.0f;
     for (i = 0; i < 4; ++i) {
-      r[j] += M[i][j] * v[i];
+      temp[j] += M[i][j] * v[i];
     }
   }
+  vec4_dup(r, temp);
+}
+#if defined(LINMATH_SIMD_AVX)
+/* Two columns of the result per register: each half of a column pair splats
+ * its own column of b, against a's column k repeated in both halves. mat4x4a
+ * is only 16 byte aligned, so both variants load unaligned */
+static inline void linmath_mat4x4_mul_avx(float *pM, const float *pA, const float *pB) {
+  __m256 a[4];
+  int k;
+  for (k = 0; k < 4; ++k) {
+    __m128 column = _mm_loadu_ps(pA + 4 * k);
+    a[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(column), column, 1);
+  }
+  __m256 b01 = _mm256_loadu_ps(pB);
+  __m256 b23 = _mm256_loadu_ps(pB + 8);
+  __m256 r01 = _mm256_mul_ps(a[0], _mm256_shuffle_ps(b01, b01, _MM_SHUFFLE(0, 0, 0, 0)));
+  __m256 r23 = _mm256_mul_ps(a[0], _mm256_shuffle_ps(b23, b23, _MM_SHUFFLE(0, 0, 0, 0)));
+#if defined(__FMA__)
+#define LINMATH_MADD256(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define LINMATH_MADD256(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+  r01 = LINMATH_MADD256(a[1], _mm256_shuffle_ps(b01, b01, _MM_SHUFFLE(1, 1, 1, 1)), r01);
+  r23 = LINMATH_MADD256(a[1], _mm256_shuffle_ps(b23, b23, _MM_SHUFFLE(1, 1, 1, 1)), r23);
+  r01 = LINMATH_MADD256(a[2], _mm256_shuffle_ps(b01, b01, _MM_SHUFFLE(2, 2, 2, 2)), r01);
+  r23 = LINMATH_MADD256(a[2], _mm256_shuffle_ps(b23, b23, _MM_SHUFFLE(2, 2, 2, 2)), r23);
+  r01 = LINMATH_MADD256(a[3], _mm256_shuffle_ps(b01, b01, _MM_SHUFFLE(3, 3, 3, 3)), r01);
+  r23 = LINMATH_MADD256(a[3], _mm256_shuffle_ps(b23, b23, _MM_SHUFFLE(3, 3, 3, 3)), r23);
+#undef LINMATH_MADD256
+  _mm256_storeu_ps(pM, r01);
+  _mm256_storeu_ps(pM + 8, r23);
+}
+static inline void mat4x4_mul(mat4x4 M, const mat4x4 a, const mat4x4 b) {
+  linmath_mat4x4_mul_avx(M[0], a[0], b[0]);
+}
+static inline void mat4x4a_mul(mat4x4a M, const mat4x4a a, const mat4x4a b) {
+  linmath_mat4x4_mul_avx(M[0], a[0], b[0]);
+}
+#elif defined(LINMATH_SIMD_SSE) || defined(LINMATH_SIMD_NEON)
+static inline void mat4x4_mul(mat4x4 M, const mat4x4 a, const mat4x4 b) {
+  linmath_v4 va[4] = {linmath_loadu(a[0]), linmath_loadu(a[1]), linmath_loadu(a[2]), linmath_loadu(a[3])};
+  linmath_v4 vb[4] = {linmath_loadu(b[0]), linmath_loadu(b[1]), linmath_loadu(b[2]), linmath_loadu(b[3])};
+  linmath_mat4x4_mul_v4(va, va, vb);
+  int i;
+  for (i = 0; i < 4; ++i) {
+    linmath_storeu(M[i], va[i]);
+  }
+}
+static inline void mat4x4a_mul(mat4x4a M, const mat4x4a a, const mat4x4a b) {
+  linmath_v4 va[4] = {linmath_load(a[0]), linmath_load(a[1]), linmath_load(a[2]), linmath_load(a[3])};
+  linmath_v4 vb[4] = {linmath_load(b[0]), linmath_load(b[1]), linmath_load(b[2]), linmath_load(b[3])};
+  linmath_mat4x4_mul_v4(va, va, vb);
+  int i;
+  for (i = 0; i < 4; ++i) {
+    linmath_store(M[i], va[i]);
+  }
+}
+#endif
+#if defined(LINMATH_SIMD_SSE) || defined(LINMATH_SIMD_NEON)
+static inline void mat4x4_mul_vec4(vec4 r, const mat4x4 M, const vec4 v) {
+  linmath_v4 vM[4] = {linmath_loadu(M[0]), linmath_loadu(M[1]), linmath_loadu(M[2]), linmath_loadu(M[3])};
+  linmath_storeu(r, linmath_mat4x4_mul_vec4_v4(vM, linmath_loadu(v)));
+}
+static inline void mat4x4a_mul_vec4a(vec4a r, const mat4x4a M, const vec4a v) {
+  linmath_v4 vM[4] = {linmath_load(M[0]), linmath_load(M[1]), linmath_load(M[2]), linmath_load(M[3])};
+  linmath_store(r, linmath_mat4x4_mul_vec4_v4(vM, linmath_load(v)));
 }
+#else
+static inline void mat4x4_mul(mat4x4 M, const mat4x4 a, const mat4x4 b) { mat4x4_mul_scalar(M, a, b); }
+static inline void mat4x4a_mul(mat4x4a M, const mat4x4a a, const mat4x4a b) { mat4x4_mul_scalar(M, a, b); }
+static inline void mat4x4_mul_vec4(vec4 r, const mat4x4 M, const vec4 v) { mat4x4_mul_vec4_scalar(r, M, v); }
+static inline void mat4x4a_mul_vec4a(vec4a r, const mat4x4a M, const vec4a v) {
+  mat4x4_mul_vec4_scalar(r, M, v);
+}
+#endif
 static inline void mat4x4_translate(mat4x4 T, float x, float y, float z) {
   mat4x4_identity(T);
   T[3][0] = x;
@@ -263,7 +515,7 @@ static inline void mat4x4_rotate_Z(mat4x4 Q, mat4x4 M, float angle) {
               {0.0f, 0.0f, 0.0f, 1.0f}};
   mat4x4_mul(Q, M, R);
 }
-static inline void mat4x4_invert(mat4x4 T, mat4x4 M) {
+static inline void mat4x4_invert_scalar(mat4x4 T, mat4x4 M) {
   float s[6];
   float c[6];
   s[0] = M[0][0] * M[1][1] - M[1][0] * M[0][1];
@@ -304,6 +556,32 @@ static inline void mat4x4_invert(mat4x4 T, mat4x4 M) {
   T[3][2] = (-M[3][0] * s[3] + M[3][1] * s[1] - M[3][2] * s[0]) * idet;
   T[3][3] = (M[2][0] * s[3] - M[2][1] * s[1] + M[2][2] * s[0]) * idet;
 }
+#if defined(LINMATH_SIMD_SHUFFLE)
+static inline void mat4x4_invert(mat4x4 T, mat4x4 M) {
+  linmath_v4 v[4] = {linmath_loadu(M[0]), linmath_loadu(M[1]), linmath_loadu(M[2]), linmath_loadu(M[3])};
+  linmath_mat4x4_invert_v4(v, v);
+  int i;
+  for (i = 0; i < 4; ++i) {
+    linmath_storeu(T[i], v[i]);
+  }
+}
+static inline void mat4x4a_invert(mat4x4a T, mat4x4a M) {
+  linmath_v4 v[4] = {linmath_load(M[0]), linmath_load(M[1]), linmath_load(M[2]), linmath_load(M[3])};
+  linmath_mat4x4_invert_v4(v, v);
+  int i;
+  for (i = 0; i < 4; ++i) {
+    linmath_store(T[i], v[i]);
+  }
+}
+#else
+/* the scalar version reads M after writing T, so go through a copy */
+static inline void mat4x4_invert(mat4x4 T, mat4x4 M) {
+  mat4x4 temp;
+  mat4x4_invert_scalar(temp, M);
+  mat4x4_dup(T, temp);
+}
+static inline void mat4x4a_invert(mat4x4a T, mat4x4a M) { mat4x4_invert(T, M); }
+#endif
 static inline void mat4x4_orthonormalize(mat4x4 R, mat4x4 M) {
   mat4x4_dup(R, M);
   float s = 1.;
@@ -443,15 +721,33 @@ static inline void quat_sub(quat r, quat a, quat b) {
     r[i] = a[i] - b[i];
   }
 }
-static inline void quat_mul(quat r, quat p, quat q) {
+static inline void quat_mul_scalar(quat r, quat p, quat q) {
+  quat temp;
   vec3 w;
-  vec3_mul_cross(r, p, q);
+  vec3_mul_cross(temp, p, q);
   vec3_scale(w, p, q[3]);
-  vec3_add(r, r, w);
+  vec3_add(temp, temp, w);
   vec3_scale(w, q, p[3]);
-  vec3_add(r, r, w);
-  r[3] = p[3] * q[3] - vec3_mul_inner(p, q);
+  vec3_add(temp, temp, w);
+  temp[3] = p[3] * q[3] - vec3_mul_inner(p, q);
+  vec4_dup(r, temp);
 }
+#if defined(LINMATH_SIMD_SHUFFLE)
+static inline void quat_mul(quat r, quat p, quat q) {
+  linmath_v4 vp = linmath_loadu(p);
+  linmath_v4 vq = linmath_loadu(q);
+  /* xyz: p.w q.xyz + q.w p.xyz + cross(p.xyz, q.xyz), with the cross product
+   * split over t2 and t3; w: p.w q.w - dot(p.xyz, q.xyz) */
+  linmath_v4 t0 = linmath_mul(linmath_splat(vp, 3), vq);
+  linmath_v4 t1 = linmath_mul(linmath_shuffle(vp, vp, 0, 1, 2, 0), linmath_shuffle(vq, vq, 3, 3, 3, 0));
+  linmath_v4 t2 = linmath_mul(linmath_shuffle(vp, vp, 1, 2, 0, 1), linmath_shuffle(vq, vq, 2, 0, 1, 1));
+  linmath_v4 t3 = linmath_mul(linmath_shuffle(vp, vp, 2, 0, 1, 2), linmath_shuffle(vq, vq, 1, 2, 0, 2));
+  linmath_v4 signs = linmath_setr(1.0f, 1.0f, 1.0f, -1.0f);
+  linmath_storeu(r, linmath_sub(linmath_add(t0, linmath_mul(linmath_add(t1, t2), signs)), t3));
+}
+#else
+static inline void quat_mul(quat r, quat p, quat q) { quat_mul_scalar(r, p, q); }
+#endif
 static inline void quat_scale(quat r, quat v, float s) {
   int i;
   for (i = 0; i < 4; ++i) {
@@ -570,4 +866,145 @@ static inline void quat_from_mat4x4(quat q, mat4x4 M) {
   q[3] = (M[p[2]][p[1]] - M[p[1]][p[2]]) / (2.0f * r);
 }
 
+
+/* Batched object transforms. Objects are given as structure of arrays and
+ * turned into model matrices, model = translate * rotate(q) * scale, and
+ * optionally into model view projection matrices. The outputs are strided by
+ * stride bytes so they can be written straight into an instance buffer */
+typedef struct {
+  const float *px, *py, *pz;
+  // unit quaternions
+  const float *qx, *qy, *qz, *qw;
+  const float *sx, *sy, *sz;
+} trs_soa;
+
+static inline float *linmath_strided(void *p, size_t stride, size_t i) {
+  return ((float *)((char *)p + i * stride));
+}
+static inline void mat4x4_from_trs(mat4x4 M, const trs_soa *src, size_t i) {
+  quat q = {src->qx[i], src->qy[i], src->qz[i], src->qw[i]};
+  mat4x4_from_quat(M, q);
+  vec4_scale(M[0], M[0], src->sx[i]);
+  vec4_scale(M[1], M[1], src->sy[i]);
+  vec4_scale(M[2], M[2], src->sz[i]);
+  M[3][0] = src->px[i];
+  M[3][1] = src->py[i];
+  M[3][2] = src->pz[i];
+}
+/* Writes objects [first, first + count) to pModels and pMvps at their index
+ * times stride; pMvps may be NULL, as may viewProjection then */
+static inline void mat4x4_batch_trs_scalar(void *pModels, void *pMvps, size_t stride,
+                                           const mat4x4 viewProjection, const trs_soa *src,
+                                           size_t first, size_t count) {
+  size_t i;
+  int c;
+  for (i = first; i < first + count; ++i) {
+    mat4x4 M;
+    mat4x4_from_trs(M, src, i);
+    float *pModel = linmath_strided(pModels, stride, i);
+    for (c = 0; c < 16; ++c) {
+      pModel[c] = M[c / 4][c % 4];
+    }
+    if (pMvps) {
+      mat4x4 MVP;
+      mat4x4_mul_scalar(MVP, viewProjection, M);
+      float *pMvp = linmath_strided(pMvps, stride, i);
+      for (c = 0; c < 16; ++c) {
+        pMvp[c] = MVP[c / 4][c % 4];
+      }
+    }
+  }
+}
+#if defined(LINMATH_SIMD_SSE) || defined(LINMATH_SIMD_NEON)
+/* Four objects per iteration with one object in each lane, transposed to
+ * per object columns on the way out */
+static inline void mat4x4_batch_trs(void *pModels, void *pMvps, size_t stride, const mat4x4 viewProjection,
+                                    const trs_soa *src, size_t first, size_t count) {
+  linmath_v4 vp[4][4];
+  int c, r, k;
+  if (pMvps) {
+    for (c = 0; c < 4; ++c) {
+      for (r = 0; r < 4; ++r) {
+        vp[c][r] = linmath_set1(viewProjection[c][r]);
+      }
+    }
+  }
+  const linmath_v4 zero = linmath_set1(0.0f);
+  const linmath_v4 one = linmath_set1(1.0f);
+  const linmath_v4 two = linmath_set1(2.0f);
+  size_t end = first + count;
+  size_t i = first;
+  for (; i + 4 <= end; i += 4) {
+    // same expansion as mat4x4_from_quat, with a = w, b = x, c = y, d = z
+    linmath_v4 qa = linmath_loadu(src->qw + i);
+    linmath_v4 qb = linmath_loadu(src->qx + i);
+    linmath_v4 qc = linmath_loadu(src->qy + i);
+    linmath_v4 qd = linmath_loadu(src->qz + i);
+    linmath_v4 a2 = linmath_mul(qa, qa);
+    linmath_v4 b2 = linmath_mul(qb, qb);
+    linmath_v4 c2 = linmath_mul(qc, qc);
+    linmath_v4 d2 = linmath_mul(qd, qd);
+    linmath_v4 ab = linmath_mul(qa, qb);
+    linmath_v4 ac = linmath_mul(qa, qc);
+    linmath_v4 ad = linmath_mul(qa, qd);
+    linmath_v4 bc = linmath_mul(qb, qc);
+    linmath_v4 bd = linmath_mul(qb, qd);
+    linmath_v4 cd = linmath_mul(qc, qd);
+    linmath_v4 sx = linmath_loadu(src->sx + i);
+    linmath_v4 sy = linmath_loadu(src->sy + i);
+    linmath_v4 sz = linmath_loadu(src->sz + i);
+
+    // M[c][r] holds entry (c, r) of all four models
+    linmath_v4 M[4][4];
+    M[0][0] = linmath_mul(linmath_sub(linmath_add(a2, b2), linmath_add(c2, d2)), sx);
+    M[0][1] = linmath_mul(linmath_mul(two, linmath_add(bc, ad)), sx);
+    M[0][2] = linmath_mul(linmath_mul(two, linmath_sub(bd, ac)), sx);
+    M[0][3] = zero;
+    M[1][0] = linmath_mul(linmath_mul(two, linmath_sub(bc, ad)), sy);
+    M[1][1] = linmath_mul(linmath_add(linmath_sub(a2, b2), linmath_sub(c2, d2)), sy);
+    M[1][2] = linmath_mul(linmath_mul(two, linmath_add(cd, ab)), sy);
+    M[1][3] = zero;
+    M[2][0] = linmath_mul(linmath_mul(two, linmath_add(bd, ac)), sz);
+    M[2][1] = linmath_mul(linmath_mul(two, linmath_sub(cd, ab)), sz);
+    M[2][2] = linmath_mul(linmath_add(linmath_sub(a2, b2), linmath_sub(d2, c2)), sz);
+    M[2][3] = zero;
+    M[3][0] = linmath_loadu(src->px + i);
+    M[3][1] = linmath_loadu(src->py + i);
+    M[3][2] = linmath_loadu(src->pz + i);
+    M[3][3] = one;
+
+    if (pMvps) {
+      // P = VP * M, using the fixed last row of M
+      linmath_v4 P[4][4];
+      for (c = 0; c < 4; ++c) {
+        for (r = 0; r < 4; ++r) {
+          P[c][r] = c == 3 ? vp[3][r] : zero;
+          for (k = 0; k < 3; ++k) {
+            P[c][r] = linmath_madd(vp[k][r], M[c][k], P[c][r]);
+          }
+        }
+      }
+      for (c = 0; c < 4; ++c) {
+        linmath_transpose(P[c][0], P[c][1], P[c][2], P[c][3]);
+        for (k = 0; k < 4; ++k) {
+          linmath_storeu(linmath_strided(pMvps, stride, i + k) + 4 * c, P[c][k]);
+        }
+      }
+    }
+    for (c = 0; c < 4; ++c) {
+      linmath_transpose(M[c][0], M[c][1], M[c][2], M[c][3]);
+      for (k = 0; k < 4; ++k) {
+        linmath_storeu(linmath_strided(pModels, stride, i + k) + 4 * c, M[c][k]);
+      }
+    }
+  }
+  mat4x4_batch_trs_scalar(pModels, pMvps, stride, viewProjection, src, i, end - i);
+}
+#else
+static inline void mat4x4_batch_trs(void *pModels, void *pMvps, size_t stride, const mat4x4 viewProjection,
+                                    const trs_soa *src, size_t first, size_t count) {
+  mat4x4_batch_trs_scalar(pModels, pMvps, stride, viewProjection, src, first, count);
+}
+#endif
+
 #endif
@@ -0,0 +1,147 @@
+/* Cross-checks the linmath SIMD kernels against their _scalar references.
+ *
+ * Each kernel runs on LINMATH_TEST_ROUNDS random inputs, through the
+ * unaligned and the aligned variants and with the output aliasing an input,
+ * and must agree with the scalar result to within a few ulps; FMA contraction
+ * is all that should tell them apart. Prints one line per kernel and exits
+ * non-zero if any disagrees. See linmath_test.sh for how it is built.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "linmath.hpp"
+
+#define LINMATH_TEST_ROUNDS 100000
+
+static float randomFloat() { return ((float)rand() / (float)RAND_MAX * 2.0f - 1.0f); }
+
+/* Well conditioned matrices: a random rotation, scale and translation */
+static void randomTransform(mat4x4 M) {
+  quat q = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+  quat_norm(q, q);
+  mat4x4_from_quat(M, q);
+  vec4_scale(M[0], M[0], 1.5f + randomFloat());
+  vec4_scale(M[1], M[1], 1.5f + randomFloat());
+  vec4_scale(M[2], M[2], 1.5f + randomFloat());
+  M[3][0] = 10.0f * randomFloat();
+  M[3][1] = 10.0f * randomFloat();
+  M[3][2] = 10.0f * randomFloat();
+}
+
+/* Any matrix, not just transforms, so every lane of the kernels is exercised */
+static void randomMatrix(mat4x4 M) {
+  for (int c = 0; c < 4; c++) {
+    for (int r = 0; r < 4; r++) {
+      M[c][r] = randomFloat() + (c == r ? 4.0f : 0.0f);
+    }
+  }
+}
+
+static float maxError(const float *pA, const float *pB, const int count) {
+  float error = 0.0f;
+  for (int i = 0; i < count; i++) {
+    // relative once the values get large
+    error = fmaxf(error, fabsf(pA[i] - pB[i]) / fmaxf(1.0f, fabsf(pB[i])));
+  }
+  return (error);
+}
+
+static bool check(const char *pName, const float error, const float tolerance) {
+  bool ok = error <= tolerance;
+  printf("%-16s max error %g%s\n", pName, error, ok ? "" : " FAILED");
+  return (ok);
+}
+
+static bool testMul() {
+  float error = 0.0f;
+  for (int round = 0; round < LINMATH_TEST_ROUNDS; round++) {
+    mat4x4 a, b, simd, scalar;
+    randomMatrix(a);
+    randomMatrix(b);
+    mat4x4_mul_scalar(scalar, a, b);
+    mat4x4_mul(simd, a, b);
+    error = fmaxf(error, maxError(&simd[0][0], &scalar[0][0], 16));
+
+    mat4x4a alignedA, alignedB, aligned;
+    mat4x4_dup(alignedA, a);
+    mat4x4_dup(alignedB, b);
+    mat4x4a_mul(aligned, alignedA, alignedB);
+    error = fmaxf(error, maxError(&aligned[0][0], &scalar[0][0], 16));
+
+    mat4x4_dup(simd, a);
+    mat4x4_mul(simd, simd, b);
+    error = fmaxf(error, maxError(&simd[0][0], &scalar[0][0], 16));
+    mat4x4_dup(simd, b);
+    mat4x4_mul(simd, a, simd);
+    error = fmaxf(error, maxError(&simd[0][0], &scalar[0][0], 16));
+  }
+  return (check("mat4x4_mul", error, 1e-5f));
+}
+
+static bool testMulVec4() {
+  float error = 0.0f;
+  for (int round = 0; round < LINMATH_TEST_ROUNDS; round++) {
+    mat4x4 M;
+    randomMatrix(M);
+    vec4 v = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+    vec4 simd, scalar;
+    mat4x4_mul_vec4_scalar(scalar, M, v);
+    mat4x4_mul_vec4(simd, M, v);
+    error = fmaxf(error, maxError(simd, scalar, 4));
+
+    mat4x4a alignedM;
+    mat4x4_dup(alignedM, M);
+    vec4a alignedV = {v[0], v[1], v[2], v[3]};
+    mat4x4a_mul_vec4a(alignedV, alignedM, alignedV);
+    error = fmaxf(error, maxError(alignedV, scalar, 4));
+  }
+  return (check("mat4x4_mul_vec4", error, 1e-5f));
+}
+
+static bool testInvert() {
+  float error = 0.0f;
+  for (int round = 0; round < LINMATH_TEST_ROUNDS; round++) {
+    mat4x4 M, simd, scalar;
+    if (round % 2) {
+      randomTransform(M);
+    } else {
+      randomMatrix(M);
+    }
+    mat4x4_invert_scalar(scalar, M);
+    mat4x4_invert(simd, M);
+    error = fmaxf(error, maxError(&simd[0][0], &scalar[0][0], 16));
+
+    mat4x4a aligned;
+    mat4x4_dup(aligned, M);
+    mat4x4a_invert(aligned, aligned);
+    error = fmaxf(error, maxError(&aligned[0][0], &scalar[0][0], 16));
+  }
+  return (check("mat4x4_invert", error, 1e-4f));
+}
+
+static bool testQuatMul() {
+  float error = 0.0f;
+  for (int round = 0; round < LINMATH_TEST_ROUNDS; round++) {
+    quat p = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+    quat q = {randomFloat(), randomFloat(), randomFloat(), randomFloat()};
+    quat simd, scalar;
+    quat_mul_scalar(scalar, p, q);
+    quat_mul(simd, p, q);
+    error = fmaxf(error, maxError(simd, scalar, 4));
+
+    quat_mul(p, p, q);
+    error = fmaxf(error, maxError(p, scalar, 4));
+  }
+  return (check("quat_mul", error, 1e-5f));
+}
+
+int main() {
+  srand(1);
+  bool ok = testMul();
+  ok = testMulVec4() && ok;
+  ok = testInvert() && ok;
+  ok = testQuatMul() && ok;
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,14 @@
+# Builds and runs the linmath SIMD cross-check from src/: once for the host
+# CPU (AVX on x86, NEON on AArch64), once with LINMATH_NO_SIMD for the scalar
+# build, and on x86-64 once more for baseline SSE. Extra flags come from
+# CXXFLAGS.
+run() {
+  g++ -std=c++17 -O2 "$@" $CXXFLAGS linmath_test.cpp -o linmath_test || exit 1
+  echo "$*:"
+  ./linmath_test || exit 1
+}
+run -march=native
+run -march=native -DLINMATH_NO_SIMD
+if [ "$(uname -m)" = "x86_64" ]; then
+  run -march=x86-64
+fi
@@ -3,11 +3,29 @@
 #include <cstdlib>
 #include <string>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <vulkan/vulkan.h>
 #include <GLFW/glfw3.h>
 #include "linmath.hpp"
 
-#define MAX_FRAMES_IN_FLIGHT 2
+/* Frames in flight are chosen at runtime, between 1 and MAX_FRAMES_IN_FLIGHT */
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define MAX_FRAMES_IN_FLIGHT 8
 #ifndef ERROR_MAX_PRINT_LENGTH
 #define ERROR_MAX_PRINT_LENGTH 4096
 #endif
@@ -254,41 +272,383 @@ uint64_t getLength(FILE *f) {
   return ((uint64_t)size);
 }
 
-/**
- * Mallocs
- */
-void readShaderFile(const char *filename, uint32_t *length, uint32_t **code) {
-  FILE *fp = fopen(filename, "rb");
-  if (!fp) {
-    LOG_ERROR(ERR_LEVEL_FATAL, "could not read file");
-    PANIC();
+/* Milliseconds from a monotonic clock, for timing */
+double getTimeMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1000000.0);
+}
+
+/* Nanoseconds from the same monotonic clock */
+uint64_t getTimeNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec);
+}
+
+/* Writes pString to fp as a quoted JSON string, escaping quotes, backslashes
+ * and control characters */
+void writeJsonString(FILE *fp, const char *pString) {
+  fputc('"', fp);
+  for (const char *c = pString; *c; c++) {
+    switch (*c) {
+    case '"':
+      fputs("\\\"", fp);
+      break;
+    case '\\':
+      fputs("\\\\", fp);
+      break;
+    case '\n':
+      fputs("\\n", fp);
+      break;
+    case '\t':
+      fputs("\\t", fp);
+      break;
+    default:
+      if ((unsigned char)*c < 0x20) {
+        fprintf(fp, "\\u%04x", (unsigned char)*c);
+      } else {
+        fputc(*c, fp);
+      }
+    }
   }
-  /* We can coerce to a 32 bit, because no realistic files will be
-   * greater than 2 GB */
-  uint32_t filesize = (uint32_t)getLength(fp);
-  // pad to a multiple of 4
-  uint32_t filesizepadded = (filesize + 3) & ~0x03u;
+  fputc('"', fp);
+}
 
-  char *str = (char *)malloc(filesizepadded);
-  if (!str) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "could not read shader file: %s",
-                   strerror(errno));
-    fclose(fp);
-    PANIC();
+/* Lightweight CPU tracing, written out as Chrome trace JSON (which Perfetto
+ * opens too). Each thread writes finished zones into its own single producer
+ * ring, so recording a zone never takes a lock; a background thread drains
+ * the rings into the file. When no tracer is running, zones cost one load. */
+#define TRACE_MAX_THREADS 64
+#define TRACE_BUFFER_EVENTS 16384
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+typedef struct {
+  const char *pName;
+  uint64_t beginNs;
+  uint64_t endNs;
+} TraceEvent;
+
+typedef struct {
+  uint32_t threadId;
+  char name[32];
+  // written only by the owning thread, read only by the flush thread
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> droppedCount;
+  TraceEvent pEvents[TRACE_BUFFER_EVENTS];
+} TraceThreadBuffer;
+
+typedef struct {
+  FILE *fp;
+  const char *pPath;
+  uint64_t startNs;
+  bool firstEvent;
+  std::atomic<uint32_t> threadCount;
+  std::atomic<TraceThreadBuffer *> pBuffers[TRACE_MAX_THREADS];
+  std::thread flushThread;
+  std::mutex flushMutex;
+  std::condition_variable flushWake;
+  bool stopping;
+} Tracer;
+
+typedef struct {
+  const char *pName;
+  uint64_t beginNs;
+} TraceZone;
+
+static Tracer *gpTracer = NULL;
+static thread_local TraceThreadBuffer *tlsTraceBuffer = NULL;
+
+/* Registers a new event ring under name; safe to call from any thread */
+static TraceThreadBuffer *new_TraceThreadBuffer(Tracer *pTracer, const char *pName) {
+  uint32_t index = pTracer->threadCount.fetch_add(1);
+  if (index >= TRACE_MAX_THREADS) {
+    return (NULL);
+  }
+  TraceThreadBuffer *pBuffer = new TraceThreadBuffer;
+  pBuffer->threadId = index + 1;
+  snprintf(pBuffer->name, sizeof(pBuffer->name), "%s", pName);
+  pBuffer->head = 0;
+  pBuffer->tail = 0;
+  pBuffer->droppedCount = 0;
+  pTracer->pBuffers[index].store(pBuffer, std::memory_order_release);
+  return (pBuffer);
+}
+
+static void pushTraceEvent(TraceThreadBuffer *pBuffer, const char *pName, const uint64_t beginNs,
+const uint64_t endNs) {
+  uint64_t head = pBuffer->head.load(std::memory_order_relaxed);
+  if (head - pBuffer->tail.load(std::memory_order_acquire) == TRACE_BUFFER_EVENTS) {
+    // the flush thread is behind; losing a zone beats stalling the caller
+    pBuffer->droppedCount.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  TraceEvent *pEvent = &pBuffer->pEvents[head % TRACE_BUFFER_EVENTS];
+  pEvent->pName = pName;
+  pEvent->beginNs = beginNs;
+  pEvent->endNs = endNs;
+  pBuffer->head.store(head + 1, std::memory_order_release);
+}
+
+/* Names the calling thread in the trace; threads that never call this show up
+ * as "thread N" */
+void setTraceThreadName(const char *pName) {
+  if (gpTracer && !tlsTraceBuffer) {
+    tlsTraceBuffer = new_TraceThreadBuffer(gpTracer, pName);
   }
+}
 
-  fread(str, filesize, sizeof(char), fp);
-  fclose(fp);
+TraceZone beginTraceZone(const char *pName) {
+  TraceZone zone;
+  zone.pName = pName;
+  zone.beginNs = gpTracer ? getTimeNs() : 0;
+  return (zone);
+}
+
+/* pName must be a string that outlives the tracer, a literal in practice */
+void endTraceZone(const TraceZone *pZone) {
+  if (!gpTracer) {
+    return;
+  }
+  if (!tlsTraceBuffer) {
+    char name[32];
+    snprintf(name, sizeof(name), "thread %u", gpTracer->threadCount.load() + 1);
+    setTraceThreadName(name);
+    if (!tlsTraceBuffer) {
+      return;
+    }
+  }
+  pushTraceEvent(tlsTraceBuffer, pZone->pName, pZone->beginNs, getTimeNs());
+}
+
+/* Records a zone measured elsewhere, e.g. on the GPU, onto pBuffer */
+void addTraceEvent(TraceThreadBuffer *pBuffer, const char *pName, const uint64_t beginNs, const uint64_t endNs) {
+  if (gpTracer && pBuffer) {
+    pushTraceEvent(pBuffer, pName, beginNs, endNs);
+  }
+}
+
+TraceThreadBuffer *new_TraceTrack(const char *pName) {
+  return (gpTracer ? new_TraceThreadBuffer(gpTracer, pName) : NULL);
+}
+
+static void drainTraceBuffers(Tracer *pTracer) {
+  uint32_t threadCount = pTracer->threadCount.load();
+  if (threadCount > TRACE_MAX_THREADS) {
+    threadCount = TRACE_MAX_THREADS;
+  }
+  for (uint32_t i = 0; i < threadCount; i++) {
+    TraceThreadBuffer *pBuffer = pTracer->pBuffers[i].load(std::memory_order_acquire);
+    if (!pBuffer) {
+      continue;
+    }
+    uint64_t tail = pBuffer->tail.load(std::memory_order_relaxed);
+    uint64_t head = pBuffer->head.load(std::memory_order_acquire);
+    for (; tail < head; tail++) {
+      const TraceEvent *pEvent = &pBuffer->pEvents[tail % TRACE_BUFFER_EVENTS];
+      // events from before the tracer started (calibrated gpu time) are clamped
+      uint64_t beginNs = pEvent->beginNs > pTracer->startNs ? pEvent->beginNs - pTracer->startNs : 0;
+      uint64_t endNs = pEvent->endNs > pTracer->startNs ? pEvent->endNs - pTracer->startNs : 0;
+      fprintf(pTracer->fp, "%s\n{\"name\":", pTracer->firstEvent ? "" : ",");
+      writeJsonString(pTracer->fp, pEvent->pName);
+      fprintf(pTracer->fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", pBuffer->threadId,
+              (double)beginNs / 1000.0, (double)(endNs > beginNs ? endNs - beginNs : 0) / 1000.0);
+      pTracer->firstEvent = false;
+    }
+    pBuffer->tail.store(tail, std::memory_order_release);
+  }
+}
+
+static void traceFlushThreadMain(Tracer *pTracer) {
+  std::unique_lock<std::mutex> lock(pTracer->flushMutex);
+  while (!pTracer->stopping) {
+    pTracer->flushWake.wait_for(lock, std::chrono::milliseconds(TRACE_FLUSH_INTERVAL_MS));
+    drainTraceBuffers(pTracer);
+  }
+}
+
+/* Starts tracing to pPath; the calling thread is named "main" */
+ErrVal new_Tracer(Tracer *pTracer, const char *pPath) {
+  pTracer->fp = fopen(pPath, "w");
+  if (!pTracer->fp) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to open trace file %s: %s", pPath, strerror(errno));
+    return (ERR_UNKNOWN);
+  }
+  pTracer->pPath = pPath;
+  pTracer->startNs = getTimeNs();
+  pTracer->firstEvent = true;
+  pTracer->threadCount = 0;
+  for (uint32_t i = 0; i < TRACE_MAX_THREADS; i++) {
+    pTracer->pBuffers[i] = NULL;
+  }
+  pTracer->stopping = false;
+  fprintf(pTracer->fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  gpTracer = pTracer;
+  setTraceThreadName("main");
+  pTracer->flushThread = std::thread(traceFlushThreadMain, pTracer);
+  return (ERR_OK);
+}
+
+/* Stops the flush thread, writes out what is left and names every track. No
+ * zone may be recorded once this has started */
+void delete_Tracer(Tracer *pTracer) {
+  {
+    std::lock_guard<std::mutex> lock(pTracer->flushMutex);
+    pTracer->stopping = true;
+  }
+  pTracer->flushWake.notify_one();
+  pTracer->flushThread.join();
+  gpTracer = NULL;
+  drainTraceBuffers(pTracer);
+
+  uint64_t droppedCount = 0;
+  uint32_t threadCount = pTracer->threadCount.load();
+  for (uint32_t i = 0; i < threadCount && i < TRACE_MAX_THREADS; i++) {
+    TraceThreadBuffer *pBuffer = pTracer->pBuffers[i].load();
+    if (!pBuffer) {
+      continue;
+    }
+    fprintf(pTracer->fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+            pTracer->firstEvent ? "" : ",", pBuffer->threadId);
+    writeJsonString(pTracer->fp, pBuffer->name);
+    fputs("}}", pTracer->fp);
+    pTracer->firstEvent = false;
+    droppedCount += pBuffer->droppedCount.load();
+    delete pBuffer;
+    pTracer->pBuffers[i] = NULL;
+  }
+  fprintf(pTracer->fp, "\n]}\n");
+  fclose(pTracer->fp);
+  pTracer->fp = NULL;
+  tlsTraceBuffer = NULL;
+  if (droppedCount > 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "trace dropped %llu zones", (unsigned long long)droppedCount);
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "wrote trace to %s", pTracer->pPath);
+}
+
+/* A fixed set of threads that run batches of independent tasks. The thread
+ * calling runWorkerTasks takes part as worker 0, so a pool of one thread runs
+ * everything inline. workerIndex is stable for the life of the pool, which
+ * lets tasks index per thread resources without locking. */
+typedef void (*WorkerTaskFn)(void *pData, uint32_t taskIndex, uint32_t workerIndex);
+
+typedef struct {
+  // including the calling thread
+  uint32_t workerCount;
+  std::thread *pThreads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint64_t generation;
+  bool quit;
+  WorkerTaskFn fn;
+  void *pData;
+  uint32_t taskCount;
+  std::atomic<uint32_t> nextTask;
+  uint32_t busyThreads;
+} WorkerPool;
+
+static void drainWorkerTasks(WorkerPool *pPool, const uint32_t workerIndex) {
+  for (;;) {
+    uint32_t taskIndex = pPool->nextTask.fetch_add(1);
+    if (taskIndex >= pPool->taskCount) {
+      return;
+    }
+    pPool->fn(pPool->pData, taskIndex, workerIndex);
+  }
+}
+
+static void workerThreadMain(WorkerPool *pPool, const uint32_t workerIndex) {
+  char traceName[32];
+  snprintf(traceName, sizeof(traceName), "worker %u", workerIndex);
+  setTraceThreadName(traceName);
+  uint64_t seenGeneration = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(pPool->mutex);
+      while (!pPool->quit && pPool->generation == seenGeneration) {
+        pPool->wake.wait(lock);
+      }
+      if (pPool->quit) {
+        return;
+      }
+      seenGeneration = pPool->generation;
+    }
+    drainWorkerTasks(pPool, workerIndex);
+    {
+      std::lock_guard<std::mutex> lock(pPool->mutex);
+      if (--pPool->busyThreads == 0) {
+        pPool->done.notify_one();
+      }
+    }
+  }
+}
+
+/* workerCount of 0 means one worker per hardware thread */
+ErrVal new_WorkerPool(WorkerPool *pPool, uint32_t workerCount) {
+  if (workerCount == 0) {
+    workerCount = std::thread::hardware_concurrency();
+  }
+  if (workerCount == 0) {
+    workerCount = 1;
+  }
+  pPool->workerCount = workerCount;
+  pPool->generation = 0;
+  pPool->quit = false;
+  pPool->taskCount = 0;
+  pPool->nextTask = 0;
+  pPool->busyThreads = 0;
+  pPool->pThreads = new std::thread[workerCount - 1];
+  for (uint32_t i = 1; i < workerCount; i++) {
+    pPool->pThreads[i - 1] = std::thread(workerThreadMain, pPool, i);
+  }
+  return (ERR_OK);
+}
+
+void delete_WorkerPool(WorkerPool *pPool) {
+  {
+    std::lock_guard<std::mutex> lock(pPool->mutex);
+    pPool->quit = true;
+  }
+  pPool->wake.notify_all();
+  for (uint32_t i = 1; i < pPool->workerCount; i++) {
+    pPool->pThreads[i - 1].join();
+  }
+  delete[] pPool->pThreads;
+  pPool->pThreads = NULL;
+  pPool->workerCount = 0;
+}
 
-  /*pad data*/
-  for (uint32_t i = filesize; i < filesizepadded; i++) {
-    str[i] = 0;
+/* Runs fn for every task index in [0, taskCount) and returns once all are done */
+void runWorkerTasks(WorkerPool *pPool, const uint32_t taskCount, WorkerTaskFn fn, void *pData) {
+  if (taskCount == 0) {
+    return;
+  }
+  if (pPool->workerCount == 1 || taskCount == 1) {
+    for (uint32_t i = 0; i < taskCount; i++) {
+      fn(pData, i, 0);
+    }
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pPool->mutex);
+    pPool->fn = fn;
+    pPool->pData = pData;
+    pPool->taskCount = taskCount;
+    pPool->nextTask = 0;
+    pPool->busyThreads = pPool->workerCount - 1;
+    pPool->generation++;
   }
+  pPool->wake.notify_all();
+  drainWorkerTasks(pPool, 0);
 
-  /*cast data t array of uints*/
-  *length = filesizepadded;
-  *code = (uint32_t *)((void *)str);
-  return;
+  std::unique_lock<std::mutex> lock(pPool->mutex);
+  while (pPool->busyThreads != 0) {
+    pPool->done.wait(lock);
+  }
 }
 
 
@@ -297,16 +657,193 @@ typedef struct {
   vec3 color;
 } Vertex;
 
-static uint32_t vertexCount = 6;
-static Vertex vertexData[] = {
-    (Vertex){.position = {1.0, 0.0, 0.0}, .color = {1.0, 0.0, 0.0}},
-    (Vertex){.position = {0.0, 1.0, 0.0}, .color = {0.0, 1.0, 0.0}},
-    (Vertex){.position = {0.0, 0.0, 1.0}, .color = {0.0, 0.0, 1.0}},
-    (Vertex){.position = {1.0, 0.0, 1.0}, .color = {1.0, 0.0, 0.0}},
-    (Vertex){.position = {0.0, 1.0, 0.0}, .color = {0.0, 1.0, 0.0}},
-    (Vertex){.position = {1.0, 0.0, 1.0}, .color = {0.0, 0.0, 1.0}},
+/* Per instance attributes, read from vertex binding 1. The transform's
+ * columns go to locations 2-5, the color (which tints the vertex color) to 6 */
+typedef struct {
+  mat4x4 transform;
+  vec4 color;
+} InstanceData;
+
+/* unit cube centered on the origin, one corner colour per vertex */
+static const uint32_t cubeVertexCount = 8;
+static const Vertex cubeVertices[] = {
+    (Vertex){.position = {-0.5, -0.5, -0.5}, .color = {0.0, 0.0, 0.0}},
+    (Vertex){.position = {0.5, -0.5, -0.5}, .color = {1.0, 0.0, 0.0}},
+    (Vertex){.position = {0.5, 0.5, -0.5}, .color = {1.0, 1.0, 0.0}},
+    (Vertex){.position = {-0.5, 0.5, -0.5}, .color = {0.0, 1.0, 0.0}},
+    (Vertex){.position = {-0.5, -0.5, 0.5}, .color = {0.0, 0.0, 1.0}},
+    (Vertex){.position = {0.5, -0.5, 0.5}, .color = {1.0, 0.0, 1.0}},
+    (Vertex){.position = {0.5, 0.5, 0.5}, .color = {1.0, 1.0, 1.0}},
+    (Vertex){.position = {-0.5, 0.5, 0.5}, .color = {0.0, 1.0, 1.0}},
+};
+
+static const uint32_t cubeIndexCount = 36;
+static const uint32_t cubeIndices[] = {
+    0, 2, 1, 0, 3, 2, // -z
+    4, 5, 6, 4, 6, 7, // +z
+    0, 1, 5, 0, 5, 4, // -y
+    3, 7, 6, 3, 6, 2, // +y
+    0, 4, 7, 0, 7, 3, // -x
+    1, 2, 6, 1, 6, 5, // +x
 };
 
+// bounding sphere radius of the unit cube, whichever way it is turned
+#define CUBE_RADIUS 0.8660254f
+
+/* UV sphere of radius SPHERE_RADIUS with segments slices and segments stacks,
+ * coloured by its normal. Wound like cubeIndices */
+#define SPHERE_RADIUS 0.5f
+#define MAX_MESH_SEGMENTS 256
+void buildSphereMesh(std::vector<Vertex> *pVertices, std::vector<uint32_t> *pIndices, const uint32_t segments) {
+  pVertices->resize((size_t)(segments + 1) * (segments + 1));
+  for (uint32_t stack = 0; stack <= segments; stack++) {
+    float phi = (float)M_PI * stack / segments;
+    for (uint32_t slice = 0; slice <= segments; slice++) {
+      float theta = 2.0f * (float)M_PI * slice / segments;
+      vec3 normal = {sinf(phi) * cosf(theta), cosf(phi), sinf(phi) * sinf(theta)};
+      Vertex *pVertex = &(*pVertices)[stack * (segments + 1) + slice];
+      for (int i = 0; i < 3; i++) {
+        pVertex->position[i] = normal[i] * SPHERE_RADIUS;
+        pVertex->color[i] = normal[i] * 0.5f + 0.5f;
+      }
+    }
+  }
+
+  pIndices->clear();
+  pIndices->reserve((size_t)segments * segments * 6);
+  for (uint32_t stack = 0; stack < segments; stack++) {
+    for (uint32_t slice = 0; slice < segments; slice++) {
+      uint32_t v00 = stack * (segments + 1) + slice;
+      uint32_t v01 = v00 + 1;
+      uint32_t v10 = v00 + segments + 1;
+      uint32_t v11 = v10 + 1;
+      pIndices->insert(pIndices->end(), {v00, v01, v10, v01, v11, v10});
+    }
+  }
+}
+
+/* the demo scene, a SCENE_GRID_SIZE square grid of cubes facing the camera.
+ * Scenes with more objects stack further grids behind it */
+#define SCENE_GRID_SIZE 32
+#define SCENE_GRID_SPACING 1.25f
+#define SCENE_GRID_DISTANCE 30.0f
+#define SCENE_LAYER_SPACING 2.5f
+
+/* Scene objects as structure of arrays, the input of mat4x4_batch_trs. Each
+ * object spins about its own axis by a fixed rotation per frame */
+#define SCENE_SPIN_SPEED 0.02f
+// objects per worker task when writing the instance stream
+#define SCENE_TRANSFORM_BATCH 256
+
+typedef struct {
+  uint32_t count;
+  // one allocation holding every array below
+  float *pData;
+  float *pPosition[3];
+  float *pRotation[4];
+  float *pScale[3];
+  // applied as rotation = spin * rotation every frame
+  float *pSpin[4];
+  trs_soa soa;
+} SceneTransforms;
+
+ErrVal new_SceneTransforms(SceneTransforms *pTransforms, const uint32_t count) {
+  pTransforms->count = count;
+  pTransforms->pData = (float *)malloc(14 * (size_t)count * sizeof(float));
+  if (!pTransforms->pData) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate scene transforms: %s", strerror(errno));
+    return (ERR_ALLOCFAIL);
+  }
+  float *pArray = pTransforms->pData;
+  for (int i = 0; i < 3; i++, pArray += count) {
+    pTransforms->pPosition[i] = pArray;
+  }
+  for (int i = 0; i < 4; i++, pArray += count) {
+    pTransforms->pRotation[i] = pArray;
+  }
+  for (int i = 0; i < 3; i++, pArray += count) {
+    pTransforms->pScale[i] = pArray;
+  }
+  for (int i = 0; i < 4; i++, pArray += count) {
+    pTransforms->pSpin[i] = pArray;
+  }
+  pTransforms->soa = (trs_soa){
+      .px = pTransforms->pPosition[0], .py = pTransforms->pPosition[1], .pz = pTransforms->pPosition[2],
+      .qx = pTransforms->pRotation[0], .qy = pTransforms->pRotation[1], .qz = pTransforms->pRotation[2],
+      .qw = pTransforms->pRotation[3],
+      .sx = pTransforms->pScale[0], .sy = pTransforms->pScale[1], .sz = pTransforms->pScale[2]};
+  return (ERR_OK);
+}
+
+void delete_SceneTransforms(SceneTransforms *pTransforms) {
+  free(pTransforms->pData);
+  pTransforms->pData = NULL;
+  pTransforms->count = 0;
+}
+
+/* Sets object i to a position, rotation, scale and per frame spin */
+void setSceneTransform(SceneTransforms *pTransforms, const uint32_t i, const vec3 position, const quat rotation,
+const vec3 scale, const quat spin) {
+  for (int j = 0; j < 3; j++) {
+    pTransforms->pPosition[j][i] = position[j];
+    pTransforms->pScale[j][i] = scale[j];
+  }
+  for (int j = 0; j < 4; j++) {
+    pTransforms->pRotation[j][i] = rotation[j];
+    pTransforms->pSpin[j][i] = spin[j];
+  }
+}
+
+typedef struct {
+  SceneTransforms *pTransforms;
+  InstanceData *pInstances;
+  bool advance;
+} SceneTransformJob;
+
+/* Spins and writes one SCENE_TRANSFORM_BATCH slice of the objects */
+static void writeSceneTransformBatch(void *pData, uint32_t taskIndex, uint32_t workerIndex) {
+  (void)workerIndex;
+  SceneTransformJob *pJob = (SceneTransformJob *)pData;
+  SceneTransforms *pTransforms = pJob->pTransforms;
+  uint32_t first = taskIndex * SCENE_TRANSFORM_BATCH;
+  uint32_t count = pTransforms->count - first < SCENE_TRANSFORM_BATCH ? pTransforms->count - first
+                                                                      : SCENE_TRANSFORM_BATCH;
+  if (pJob->advance) {
+    float *qx = pTransforms->pRotation[0], *qy = pTransforms->pRotation[1];
+    float *qz = pTransforms->pRotation[2], *qw = pTransforms->pRotation[3];
+    const float *sx = pTransforms->pSpin[0], *sy = pTransforms->pSpin[1];
+    const float *sz = pTransforms->pSpin[2], *sw = pTransforms->pSpin[3];
+    // quat_mul(spin, rotation) across the slice, renormalized so error never builds up
+    for (uint32_t i = first; i < first + count; i++) {
+      float x = sw[i] * qx[i] + sx[i] * qw[i] + sy[i] * qz[i] - sz[i] * qy[i];
+      float y = sw[i] * qy[i] + sy[i] * qw[i] + sz[i] * qx[i] - sx[i] * qz[i];
+      float z = sw[i] * qz[i] + sz[i] * qw[i] + sx[i] * qy[i] - sy[i] * qx[i];
+      float w = sw[i] * qw[i] - sx[i] * qx[i] - sy[i] * qy[i] - sz[i] * qz[i];
+      float invLength = 1.0f / sqrtf(x * x + y * y + z * z + w * w);
+      qx[i] = x * invLength;
+      qy[i] = y * invLength;
+      qz[i] = z * invLength;
+      qw[i] = w * invLength;
+    }
+  }
+  mat4x4_batch_trs((char *)pJob->pInstances + offsetof(InstanceData, transform), NULL, sizeof(InstanceData),
+                   NULL, &pTransforms->soa, first, count);
+}
+
+/* Writes every object's model matrix into pInstances, split across the
+ * worker pool; colors are left alone. advance steps the spin first */
+void writeSceneTransforms(WorkerPool *pWorkers, SceneTransforms *pTransforms, InstanceData *pInstances,
+const bool advance) {
+  TraceZone zone = beginTraceZone("writeSceneTransforms");
+  SceneTransformJob job;
+  job.pTransforms = pTransforms;
+  job.pInstances = pInstances;
+  job.advance = advance;
+  runWorkerTasks(pWorkers, (pTransforms->count + SCENE_TRANSFORM_BATCH - 1) / SCENE_TRANSFORM_BATCH,
+                 writeSceneTransformBatch, &job);
+  endTraceZone(&zone);
+}
+
 typedef struct {
   vec3 front;
   vec3 right;
@@ -443,34 +980,24 @@ void getMvpCamera(mat4x4 mvp, const Camera *camera) {
     mat4x4_mul(mvp, camera->projection, view);
 }
 
-struct VulkContext{
-
-    VkInstance instance;
-     VkDebugUtilsMessengerEXT callback;
-     VkPhysicalDevice physicalDevice;
-     GLFWwindow *pWindow;
-     VkSurfaceKHR surface;
-     VkExtent2D swapchainExtent;
-VkDevice device;
-     VkQueue graphicsQueue;
-      VkCommandPool commandPool;
-        VkSurfaceFormatKHR surfaceFormat;
-        VkSwapchainKHR swapchain;
-          VkDeviceMemory depthImageMemory;
-  VkImage depthImage;
-  //VkImageView depthImageView;
-  VkRenderPass renderPass;
-  VkPipelineLayout graphicsPipelineLayout;
-  VkPipeline graphicsPipeline;
-  VkBuffer vertexBuffer;
-  VkDeviceMemory vertexBufferMemory;
-  VkCommandBuffer pVertexDisplayCommandBuffers[MAX_FRAMES_IN_FLIGHT];
-  VkSemaphore pImageAvailableSemaphores[MAX_FRAMES_IN_FLIGHT];
-  VkSemaphore pRenderFinishedSemaphores[MAX_FRAMES_IN_FLIGHT];
-  VkFence pInFlightFences[MAX_FRAMES_IN_FLIGHT];
-};
-
-VulkContext context;
+/* Extracts the six clip planes of a view projection matrix (left, right,
+ * bottom, top, near, far), normalized and facing inwards, so that a sphere is
+ * outside when dot(plane.xyz, center) + plane.w < -radius for any plane */
+void getFrustumPlanes(vec4 pPlanes[6], const mat4x4 viewProjection) {
+  for (int i = 0; i < 6; i++) {
+    // linmath is column major, row r of the matrix is m[0..3][r]
+    int row = i / 2;
+    float sign = i % 2 == 0 ? 1.0f : -1.0f;
+    for (int j = 0; j < 4; j++) {
+      pPlanes[i][j] = viewProjection[j][3] + sign * viewProjection[j][row];
+    }
+    float length = sqrtf(pPlanes[i][0] * pPlanes[i][0] + pPlanes[i][1] * pPlanes[i][1] +
+                         pPlanes[i][2] * pPlanes[i][2]);
+    if (length > 0.0f) {
+      vec4_scale(pPlanes[i], pPlanes[i], 1.0f / length);
+    }
+  }
+}
 
 static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, 
 UNUSED VkDebugUtilsMessageTypeFlagsEXT messageType,const VkDebugUtilsMessengerCallbackDataEXT *pCallbackData,
@@ -606,6 +1133,11 @@ const char **ppAllExtensionNames = (const char **) malloc(allExtensionCount * si
   return (ERR_OK);
 };
 
+void delete_Instance(VkInstance *pInstance) {
+  vkDestroyInstance(*pInstance, NULL);
+  *pInstance = VK_NULL_HANDLE;
+}
+
 ErrVal new_DebugCallback(VkDebugUtilsMessengerEXT *pCallback,const VkInstance instance) {
   VkDebugUtilsMessengerCreateInfoEXT createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_DEBUG_UTILS_MESSENGER_CREATE_INFO_EXT;
@@ -634,6 +1166,15 @@ instance, "vkCreateDebugUtilsMessengerEXT");
   return (ERR_NOTSUPPORTED);
 };
 
+void delete_DebugCallback(VkDebugUtilsMessengerEXT *pCallback, const VkInstance instance) {
+  PFN_vkDestroyDebugUtilsMessengerEXT func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(
+      instance, "vkDestroyDebugUtilsMessengerEXT");
+  if (func) {
+    func(instance, *pCallback, NULL);
+  }
+  *pCallback = VK_NULL_HANDLE;
+}
+
 ErrVal getQueueFamilyIndexByCapability(uint32_t *pQueueFamilyIndex,const VkPhysicalDevice device,const VkQueueFlags bit) {
   uint32_t queueFamilyCount = 0;
   vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
@@ -651,7 +1192,7 @@ VkQueueFamilyProperties *pFamilyProperties = (VkQueueFamilyProperties *)malloc(q
   vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
                                            pFamilyProperties);
   for (uint32_t i = 0; i < queueFamilyCount; i++) {
-    if (pFamilyProperties[i].queueCount > 0 && (pFamilyProperties[0].queueFlags & bit)) {
+    if (pFamilyProperties[i].queueCount > 0 && (pFamilyProperties[i].queueFlags & bit)) {
       free(pFamilyProperties);
       *pQueueFamilyIndex = i;
       return (ERR_OK);
@@ -662,7 +1203,40 @@ VkQueueFamilyProperties *pFamilyProperties = (VkQueueFamilyProperties *)malloc(q
   return (ERR_NOTSUPPORTED);
 }
 
-ErrVal getPhysicalDevice(VkPhysicalDevice *pDevice, const VkInstance instance) {
+/* Like getQueueFamilyIndexByCapability, but only accepts a family that has none
+ * of avoidBits set, e.g. a transfer family that is not also the graphics family */
+ErrVal getDedicatedQueueFamilyIndex(uint32_t *pQueueFamilyIndex, const VkPhysicalDevice device,
+const VkQueueFlags bit, const VkQueueFlags avoidBits) {
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, NULL);
+  if (queueFamilyCount == 0) {
+    LOG_ERROR(ERR_LEVEL_WARN, "no device queues found");
+    return (ERR_NOTSUPPORTED);
+  }
+
+VkQueueFamilyProperties *pFamilyProperties = (VkQueueFamilyProperties *)malloc(queueFamilyCount * sizeof(VkQueueFamilyProperties));
+  if (!pFamilyProperties) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Failed to get device queue index: %s",
+                   strerror(errno));
+    PANIC();
+  }
+  vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount,
+                                           pFamilyProperties);
+  for (uint32_t i = 0; i < queueFamilyCount; i++) {
+    if (pFamilyProperties[i].queueCount > 0 && (pFamilyProperties[i].queueFlags & bit) &&
+        !(pFamilyProperties[i].queueFlags & avoidBits)) {
+      free(pFamilyProperties);
+      *pQueueFamilyIndex = i;
+      return (ERR_OK);
+    }
+  }
+  free(pFamilyProperties);
+  return (ERR_NOTSUPPORTED);
+}
+
+/* Picks the first device with a graphics and compute queue whose name
+ * contains pName, or the first such device at all when pName is NULL */
+ErrVal getPhysicalDevice(VkPhysicalDevice *pDevice, const VkInstance instance, const char *pName) {
   uint32_t deviceCount = 0;
   VkResult res = vkEnumeratePhysicalDevices(instance, &deviceCount, NULL);
   if (res != VK_SUCCESS || deviceCount == 0) {
@@ -682,6 +1256,9 @@ ErrVal getPhysicalDevice(VkPhysicalDevice *pDevice, const VkInstance instance) {
   for (uint32_t i = 0; i < deviceCount; i++) {
     /* TODO confirm it has required properties */
     vkGetPhysicalDeviceProperties(arr[i], &deviceProperties);
+    if (pName && !strstr(deviceProperties.deviceName, pName)) {
+      continue;
+    }
     uint32_t deviceQueueIndex;
 uint32_t ret = getQueueFamilyIndexByCapability(&deviceQueueIndex, arr[i], VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
     if (ret == VK_SUCCESS) { selectedDevice = arr[i]; break;}
@@ -691,6 +1268,7 @@ uint32_t ret = getQueueFamilyIndexByCapability(&deviceQueueIndex, arr[i], VK_QUE
     LOG_ERROR(ERR_LEVEL_WARN, "no suitable Vulkan device found");
     return (ERR_NOTSUPPORTED);
   } else {
+    LOG_ERROR_ARGS(ERR_LEVEL_INFO, "using %s", deviceProperties.deviceName);
     *pDevice = selectedDevice;
     return (ERR_OK);
   }
@@ -699,9 +1277,9 @@ uint32_t ret = getQueueFamilyIndexByCapability(&deviceQueueIndex, arr[i], VK_QUE
 void delete_Device(VkDevice *pDevice) { vkDestroyDevice(*pDevice, NULL); *pDevice = VK_NULL_HANDLE;};
 
 ErrVal new_GlfwWindow(GLFWwindow **ppGlfwWindow, const char *name, VkExtent2D dimensions) {
-  /* Not resizable */
+  /* Resizing only rebuilds the swapchain and what hangs off it, see recreateSwapchain */
   glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-  glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+  glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
   *ppGlfwWindow = glfwCreateWindow((int)dimensions.width, (int)dimensions.height, name, NULL, NULL);
   if (*ppGlfwWindow == NULL) {
     LOG_ERROR(ERR_LEVEL_ERROR, "failed to create GLFW window");
@@ -730,26 +1308,117 @@ ErrVal getExtentWindow(VkExtent2D *pExtent, GLFWwindow *pWindow) {
   return (ERR_OK);
 };
 
-ErrVal new_Device(VkDevice *pDevice, const VkPhysicalDevice physicalDevice, const uint32_t queueFamilyIndex,
-                  const uint32_t enabledExtensionCount, const char *const *ppEnabledExtensionNames) {
+static bool hasDeviceExtension(const VkPhysicalDevice physicalDevice, const char *pName) {
+  uint32_t extensionCount = 0;
+  vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, NULL);
+  std::vector<VkExtensionProperties> extensions(extensionCount);
+  vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, extensions.data());
+  for (uint32_t i = 0; i < extensionCount; i++) {
+    if (strcmp(extensions[i].extensionName, pName) == 0) {
+      return (true);
+    }
+  }
+  return (false);
+}
+
+/* Graphics pipeline libraries are only worth using where linking them is
+ * fast, otherwise a variant may as well be built whole */
+bool getPipelineLibrarySupport(const VkPhysicalDevice physicalDevice) {
+  if (!hasDeviceExtension(physicalDevice, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) ||
+      !hasDeviceExtension(physicalDevice, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)) {
+    return (false);
+  }
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures {};
+  libraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+  VkPhysicalDeviceFeatures2 features {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &libraryFeatures;
+  vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+
+  VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT libraryProperties {};
+  libraryProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT;
+  VkPhysicalDeviceProperties2 properties {};
+  properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties.pNext = &libraryProperties;
+  vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+  return (libraryFeatures.graphicsPipelineLibrary && libraryProperties.graphicsPipelineLibraryFastLinking);
+}
+
+/* Creates one queue on each distinct family in pQueueFamilyIndices. Timeline
+ * semaphores are required, the upload scheduler is built on them. With
+ * pipelineLibrary the graphics pipeline library extensions must be among
+ * ppEnabledExtensionNames */
+ErrVal new_Device(VkDevice *pDevice, const VkPhysicalDevice physicalDevice, const uint32_t queueFamilyIndexCount,
+                  const uint32_t *pQueueFamilyIndices, const uint32_t enabledExtensionCount,
+                  const char *const *ppEnabledExtensionNames, const bool pipelineLibrary) {
+  VkPhysicalDeviceVulkan12Features supportedFeatures12 {};
+  supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+  VkPhysicalDeviceFeatures2 supportedFeatures {};
+  supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  supportedFeatures.pNext = &supportedFeatures12;
+  vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+  if (!supportedFeatures12.timelineSemaphore) {
+    LOG_ERROR(ERR_LEVEL_FATAL, "Failed to create device: timeline semaphores are not supported");
+    PANIC();
+  }
+
+  VkPhysicalDeviceVulkan12Features deviceFeatures12 {};
+  deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+  deviceFeatures12.timelineSemaphore = VK_TRUE;
   VkPhysicalDeviceFeatures deviceFeatures {};
-  VkDeviceQueueCreateInfo queueCreateInfo {};
-  queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queueCreateInfo.queueFamilyIndex = queueFamilyIndex;
-  queueCreateInfo.queueCount = 1;
+  // optional, used by the gpu profiler when present
+  deviceFeatures.pipelineStatisticsQuery = supportedFeatures.features.pipelineStatisticsQuery;
+  // lets the statistics query stay active across the draws' secondaries
+  deviceFeatures.inheritedQueries = supportedFeatures.features.inheritedQueries;
+  // optional, the draw list picks the best indirect path it finds enabled
+  deviceFeatures.multiDrawIndirect = supportedFeatures.features.multiDrawIndirect;
+  deviceFeatures.drawIndirectFirstInstance = supportedFeatures.features.drawIndirectFirstInstance;
+  deviceFeatures12.drawIndirectCount = supportedFeatures12.drawIndirectCount;
+  VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures {};
+  libraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+  libraryFeatures.graphicsPipelineLibrary = VK_TRUE;
+  if (pipelineLibrary) {
+    deviceFeatures12.pNext = &libraryFeatures;
+  }
+
   float queuePriority = 1.0f;
-  queueCreateInfo.pQueuePriorities = &queuePriority;
+  uint32_t queueCreateInfoCount = 0;
+  VkDeviceQueueCreateInfo *pQueueCreateInfos =
+      (VkDeviceQueueCreateInfo *)malloc(queueFamilyIndexCount * sizeof(VkDeviceQueueCreateInfo));
+  if (!pQueueCreateInfos) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Failed to create device: %s", strerror(errno));
+    PANIC();
+  }
+  for (uint32_t i = 0; i < queueFamilyIndexCount; i++) {
+    bool duplicate = false;
+    for (uint32_t j = 0; j < queueCreateInfoCount; j++) {
+      if (pQueueCreateInfos[j].queueFamilyIndex == pQueueFamilyIndices[i]) {
+        duplicate = true;
+      }
+    }
+    if (duplicate) {
+      continue;
+    }
+    VkDeviceQueueCreateInfo queueCreateInfo {};
+    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = pQueueFamilyIndices[i];
+    queueCreateInfo.queueCount = 1;
+    queueCreateInfo.pQueuePriorities = &queuePriority;
+    pQueueCreateInfos[queueCreateInfoCount++] = queueCreateInfo;
+  }
 
   VkDeviceCreateInfo createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  createInfo.pQueueCreateInfos = &queueCreateInfo;
-  createInfo.queueCreateInfoCount = 1;
+  createInfo.pNext = &deviceFeatures12;
+  createInfo.pQueueCreateInfos = pQueueCreateInfos;
+  createInfo.queueCreateInfoCount = queueCreateInfoCount;
   createInfo.pEnabledFeatures = &deviceFeatures;
   createInfo.enabledExtensionCount = enabledExtensionCount;
   createInfo.ppEnabledExtensionNames = ppEnabledExtensionNames;
   createInfo.enabledLayerCount = 0;
 
   VkResult res = vkCreateDevice(physicalDevice, &createInfo, NULL, pDevice);
+  free(pQueueCreateInfos);
   if (res != VK_SUCCESS) {
     LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "Failed to create device, error code: %s",
                    vkstrerror(res));
@@ -821,9 +1490,73 @@ ErrVal getPreferredSurfaceFormat(VkSurfaceFormatKHR *pSurfaceFormat,const VkPhys
   return (ERR_OK);
 };
 
+/* Uses the requested present mode if the surface supports it, otherwise FIFO,
+ * which every surface is guaranteed to support */
+ErrVal getPresentMode(VkPresentModeKHR *pPresentMode, const VkPhysicalDevice physicalDevice,
+const VkSurfaceKHR surface, const VkPresentModeKHR requestedMode) {
+  *pPresentMode = VK_PRESENT_MODE_FIFO_KHR;
+  if (requestedMode == VK_PRESENT_MODE_FIFO_KHR) {
+    return (ERR_OK);
+  }
+
+  uint32_t modeCount = 0;
+  vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &modeCount, NULL);
+  VkPresentModeKHR *pModes = (VkPresentModeKHR *)malloc(modeCount * sizeof(VkPresentModeKHR));
+  if (!pModes) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "could not get present modes: %s", strerror(errno));
+    PANIC();
+  }
+  vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &modeCount, pModes);
+  for (uint32_t i = 0; i < modeCount; i++) {
+    if (pModes[i] == requestedMode) {
+      *pPresentMode = requestedMode;
+    }
+  }
+  free(pModes);
+
+  if (*pPresentMode != requestedMode) {
+    LOG_ERROR(ERR_LEVEL_WARN, "requested present mode is not supported, falling back to FIFO");
+    return (ERR_NOTSUPPORTED);
+  }
+  return (ERR_OK);
+}
+
+/* How many swapchain images a present mode needs to keep framesInFlight frames
+ * busy without acquire blocking:
+ *  - MAILBOX: one on screen, one queued, one being rendered
+ *  - IMMEDIATE: one on screen, one being rendered
+ *  - FIFO: one on screen plus one per frame in flight */
+static uint32_t getSwapchainImageCount(const VkSurfaceCapabilitiesKHR *pCapabilities,
+const VkPresentModeKHR presentMode, const uint32_t framesInFlight) {
+  uint32_t imageCount;
+  switch (presentMode) {
+  case VK_PRESENT_MODE_MAILBOX_KHR: {
+    imageCount = 3;
+    break;
+  }
+  case VK_PRESENT_MODE_IMMEDIATE_KHR: {
+    imageCount = 2;
+    break;
+  }
+  default: {
+    imageCount = framesInFlight + 1;
+    break;
+  }
+  }
+  if (imageCount < pCapabilities->minImageCount) {
+    imageCount = pCapabilities->minImageCount;
+  }
+  // a maxImageCount of 0 means there is no limit
+  if (pCapabilities->maxImageCount != 0 && imageCount > pCapabilities->maxImageCount) {
+    imageCount = pCapabilities->maxImageCount;
+  }
+  return (imageCount);
+}
+
 ErrVal new_Swapchain(VkSwapchainKHR *pSwapchain, uint32_t *pImageCount,  const VkSwapchainKHR oldSwapchain,
  const VkSurfaceFormatKHR surfaceFormat,  const VkPhysicalDevice physicalDevice,const VkDevice device, 
- const VkSurfaceKHR surface, const VkExtent2D extent, const uint32_t graphicsIndex,const uint32_t presentIndex) {
+ const VkSurfaceKHR surface, const VkExtent2D extent, const uint32_t graphicsIndex,const uint32_t presentIndex,
+ const VkPresentModeKHR presentMode, const uint32_t framesInFlight) {
   VkSurfaceCapabilitiesKHR capabilities;
   vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &capabilities);
 
@@ -832,7 +1565,7 @@ ErrVal new_Swapchain(VkSwapchainKHR *pSwapchain, uint32_t *pImageCount,  const V
   VkSwapchainCreateInfoKHR createInfo{};
   createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
   createInfo.surface = surface;
-  createInfo.minImageCount = capabilities.minImageCount + 1;
+  createInfo.minImageCount = getSwapchainImageCount(&capabilities, presentMode, framesInFlight);
   createInfo.imageFormat = surfaceFormat.format;
   createInfo.imageColorSpace = surfaceFormat.colorSpace;
   createInfo.imageExtent = extent;
@@ -852,8 +1585,8 @@ ErrVal new_Swapchain(VkSwapchainKHR *pSwapchain, uint32_t *pImageCount,  const V
 
   createInfo.preTransform = capabilities.currentTransform;
   createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-  /* guaranteed to be available */
-  createInfo.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  /* checked against the surface by getPresentMode */
+  createInfo.presentMode = presentMode;
   createInfo.clipped = VK_TRUE;
   createInfo.oldSwapchain = oldSwapchain;
   VkResult res = vkCreateSwapchainKHR(device, &createInfo, NULL, pSwapchain);
@@ -874,6 +1607,11 @@ ErrVal new_Swapchain(VkSwapchainKHR *pSwapchain, uint32_t *pImageCount,  const V
 
   return (ERR_OK);
 };
+void delete_Swapchain(VkSwapchainKHR *pSwapchain, const VkDevice device) {
+  vkDestroySwapchainKHR(device, *pSwapchain, NULL);
+  *pSwapchain = VK_NULL_HANDLE;
+}
+
 ErrVal getSwapchainImages(VkImage *pSwapchainImages, const uint32_t imageCount, const VkDevice device, 
 const VkSwapchainKHR swapchain) {
 
@@ -964,58 +1702,362 @@ const VkMemoryPropertyFlags memoryPropertyFlags,const VkPhysicalDevice physicalD
   return (ERR_MEMORY);
 }
 
-ErrVal new_Image(VkImage *pImage, VkDeviceMemory *pImageMemory, const VkExtent2D dimensions, const VkFormat format,                  
-const VkImageTiling tiling, const VkImageUsageFlags usage, const VkMemoryPropertyFlags properties, 
-const VkPhysicalDevice physicalDevice,  const VkDevice device) {
-  VkImageCreateInfo imageInfo {};
-  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-  imageInfo.imageType = VK_IMAGE_TYPE_2D;
-  imageInfo.extent.width = dimensions.width;
-  imageInfo.extent.height = dimensions.height;
-  imageInfo.extent.depth = 1;
-  imageInfo.mipLevels = 1;
-  imageInfo.arrayLayers = 1;
-  imageInfo.format = format;
-  imageInfo.tiling = tiling;
-  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  imageInfo.usage = usage;
-  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+/* Device memory is carved out of large blocks, with one pool of blocks per
+ * memory type, instead of calling vkAllocateMemory for every resource. Drivers
+ * cap the number of live allocations (maxMemoryAllocationCount, often 4096). */
+#define DEVICE_MEMORY_BLOCK_SIZE (64ull * 1024ull * 1024ull)
 
-  VkResult createImageResult = vkCreateImage(device, &imageInfo, NULL, pImage);
-  if (createImageResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create image: %s",
-                   vkstrerror(createImageResult));
-    return (ERR_UNKNOWN);
-  }
+typedef struct {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+} MemoryRange;
 
-  VkMemoryRequirements memRequirements;
-  vkGetImageMemoryRequirements(device, *pImage, &memRequirements);
+typedef struct {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  VkDeviceSize usedSize;
+  uint32_t allocationCount;
+  // blocks hold either buffers/linear images or optimal images, never both,
+  // so we never have to worry about bufferImageGranularity
+  bool linear;
+  // host visible blocks stay mapped for their whole lifetime
+  void *pMapped;
+  // free ranges, sorted by offset and never adjacent to one another
+  std::vector<MemoryRange> freeRanges;
+} MemoryBlock;
 
-  VkMemoryAllocateInfo allocInfo {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocInfo.allocationSize = memRequirements.size;
+typedef struct {
+  std::vector<MemoryBlock *> blocks;
+} MemoryPool;
 
-ErrVal memGetResult = getMemoryTypeIndex(&allocInfo.memoryTypeIndex,memRequirements.memoryTypeBits,
-properties, physicalDevice);
+typedef struct {
+  VkDevice device;
+  VkPhysicalDevice physicalDevice;
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  VkDeviceSize nonCoherentAtomSize;
+  uint32_t maxAllocationCount;
+  // number of live vkAllocateMemory allocations
+  uint32_t deviceAllocationCount;
+  MemoryPool pools[VK_MAX_MEMORY_TYPES];
+} DeviceAllocator;
 
-  if (memGetResult != ERR_OK) {
-    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create image: allocation failed");
-    return (ERR_MEMORY);
-  }
+typedef struct {
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  uint32_t memoryTypeIndex;
+  MemoryBlock *pBlock;
+  // NULL unless the memory is host visible
+  void *pMapped;
+} DeviceAllocation;
 
-  VkResult allocateResult =
-      vkAllocateMemory(device, &allocInfo, NULL, pImageMemory);
-  if (allocateResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create image: %s",
+typedef struct {
+  VkDeviceSize liveBytes;
+  VkDeviceSize reservedBytes;
+  VkDeviceSize freeBytes;
+  VkDeviceSize largestFreeRange;
+  uint32_t blockCount;
+  uint32_t allocationCount;
+  // 0 means all free space is contiguous, approaching 1 means it is scattered
+  // in many small ranges
+  float fragmentation;
+} DeviceAllocatorStats;
+
+static VkDeviceSize alignUp(const VkDeviceSize value, const VkDeviceSize alignment) {
+  return ((value + alignment - 1) / alignment) * alignment;
+}
+
+ErrVal new_DeviceAllocator(DeviceAllocator *pAllocator, const VkPhysicalDevice physicalDevice,
+const VkDevice device) {
+  pAllocator->device = device;
+  pAllocator->physicalDevice = physicalDevice;
+  pAllocator->deviceAllocationCount = 0;
+  vkGetPhysicalDeviceMemoryProperties(physicalDevice, &pAllocator->memoryProperties);
+
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+  pAllocator->nonCoherentAtomSize = deviceProperties.limits.nonCoherentAtomSize;
+  pAllocator->maxAllocationCount = deviceProperties.limits.maxMemoryAllocationCount;
+  return (ERR_OK);
+}
+
+static ErrVal new_MemoryBlock(MemoryBlock **ppBlock, DeviceAllocator *pAllocator, const VkDeviceSize size,
+const uint32_t memoryTypeIndex, const bool linear) {
+  if (pAllocator->deviceAllocationCount >= pAllocator->maxAllocationCount) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "device allocation limit of %u reached",
+                   pAllocator->maxAllocationCount);
+    return (ERR_MEMORY);
+  }
+
+  VkMemoryAllocateInfo allocateInfo {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocateInfo.allocationSize = size;
+  allocateInfo.memoryTypeIndex = memoryTypeIndex;
+
+  VkDeviceMemory memory;
+  VkResult allocateResult = vkAllocateMemory(pAllocator->device, &allocateInfo, NULL, &memory);
+  if (allocateResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate memory block: %s",
                    vkstrerror(allocateResult));
+    return (ERR_ALLOCFAIL);
+  }
+
+  void *pMapped = NULL;
+  if (pAllocator->memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags &
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    VkResult mapResult = vkMapMemory(pAllocator->device, memory, 0, VK_WHOLE_SIZE, 0, &pMapped);
+    if (mapResult != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to map memory block: %s",
+                     vkstrerror(mapResult));
+      vkFreeMemory(pAllocator->device, memory, NULL);
+      return (ERR_MEMORY);
+    }
+  }
+
+  MemoryBlock *pBlock = new MemoryBlock();
+  pBlock->memory = memory;
+  pBlock->size = size;
+  pBlock->usedSize = 0;
+  pBlock->allocationCount = 0;
+  pBlock->linear = linear;
+  pBlock->pMapped = pMapped;
+  pBlock->freeRanges.push_back((MemoryRange){.offset = 0, .size = size});
+
+  pAllocator->deviceAllocationCount++;
+  *ppBlock = pBlock;
+  return (ERR_OK);
+}
+
+static void delete_MemoryBlock(MemoryBlock **ppBlock, DeviceAllocator *pAllocator) {
+  // freeing memory implicitly unmaps it
+  vkFreeMemory(pAllocator->device, (*ppBlock)->memory, NULL);
+  pAllocator->deviceAllocationCount--;
+  delete *ppBlock;
+  *ppBlock = NULL;
+}
+
+/* First fit: takes the first free range that can hold the aligned request,
+ * leaving any alignment padding in front of it as a free range of its own */
+static bool suballocateMemoryBlock(VkDeviceSize *pOffset, MemoryBlock *pBlock, const VkDeviceSize size,
+const VkDeviceSize alignment) {
+  for (size_t i = 0; i < pBlock->freeRanges.size(); i++) {
+    MemoryRange range = pBlock->freeRanges[i];
+    VkDeviceSize alignedOffset = alignUp(range.offset, alignment);
+    VkDeviceSize rangeEnd = range.offset + range.size;
+    if (alignedOffset + size > rangeEnd) {
+      continue;
+    }
+
+    VkDeviceSize padding = alignedOffset - range.offset;
+    VkDeviceSize tail = rangeEnd - (alignedOffset + size);
+    if (padding > 0 && tail > 0) {
+      pBlock->freeRanges[i].size = padding;
+      pBlock->freeRanges.insert(pBlock->freeRanges.begin() + i + 1,
+                                (MemoryRange){.offset = alignedOffset + size, .size = tail});
+    } else if (padding > 0) {
+      pBlock->freeRanges[i].size = padding;
+    } else if (tail > 0) {
+      pBlock->freeRanges[i] = (MemoryRange){.offset = alignedOffset + size, .size = tail};
+    } else {
+      pBlock->freeRanges.erase(pBlock->freeRanges.begin() + i);
+    }
+
+    pBlock->usedSize += size;
+    pBlock->allocationCount++;
+    *pOffset = alignedOffset;
+    return (true);
+  }
+  return (false);
+}
+
+/* Returns a range to its block, merging it with its neighbours */
+static void releaseMemoryBlockRange(MemoryBlock *pBlock, const VkDeviceSize offset, const VkDeviceSize size) {
+  std::vector<MemoryRange> &ranges = pBlock->freeRanges;
+  size_t i = 0;
+  while (i < ranges.size() && ranges[i].offset < offset) {
+    i++;
+  }
+  ranges.insert(ranges.begin() + i, (MemoryRange){.offset = offset, .size = size});
+
+  if (i + 1 < ranges.size() && ranges[i].offset + ranges[i].size == ranges[i + 1].offset) {
+    ranges[i].size += ranges[i + 1].size;
+    ranges.erase(ranges.begin() + i + 1);
+  }
+  if (i > 0 && ranges[i - 1].offset + ranges[i - 1].size == ranges[i].offset) {
+    ranges[i - 1].size += ranges[i].size;
+    ranges.erase(ranges.begin() + i);
+  }
+
+  pBlock->usedSize -= size;
+  pBlock->allocationCount--;
+}
+
+/* linear should be true for buffers and linear tiled images, false for
+ * optimal tiled images */
+ErrVal allocateDeviceMemory(DeviceAllocation *pAllocation, DeviceAllocator *pAllocator,
+const VkMemoryRequirements memoryRequirements, const VkMemoryPropertyFlags properties, const bool linear) {
+  uint32_t memoryTypeIndex;
+  ErrVal memGetResult = getMemoryTypeIndex(&memoryTypeIndex, memoryRequirements.memoryTypeBits, properties,
+                                           pAllocator->physicalDevice);
+  if (memGetResult != ERR_OK) {
+    return (memGetResult);
+  }
+
+  MemoryPool *pPool = &pAllocator->pools[memoryTypeIndex];
+  VkDeviceSize offset = 0;
+  MemoryBlock *pBlock = NULL;
+  for (MemoryBlock *pCandidate : pPool->blocks) {
+    if (pCandidate->linear == linear &&
+        suballocateMemoryBlock(&offset, pCandidate, memoryRequirements.size, memoryRequirements.alignment)) {
+      pBlock = pCandidate;
+      break;
+    }
+  }
+
+  if (pBlock == NULL) {
+    // resources bigger than a block get a block of their own
+    VkDeviceSize blockSize = DEVICE_MEMORY_BLOCK_SIZE;
+    if (memoryRequirements.size > blockSize) {
+      blockSize = memoryRequirements.size;
+    }
+    ErrVal blockResult = new_MemoryBlock(&pBlock, pAllocator, blockSize, memoryTypeIndex, linear);
+    if (blockResult != ERR_OK) {
+      return (blockResult);
+    }
+    pPool->blocks.push_back(pBlock);
+    suballocateMemoryBlock(&offset, pBlock, memoryRequirements.size, memoryRequirements.alignment);
+  }
+
+  pAllocation->memory = pBlock->memory;
+  pAllocation->offset = offset;
+  pAllocation->size = memoryRequirements.size;
+  pAllocation->memoryTypeIndex = memoryTypeIndex;
+  pAllocation->pBlock = pBlock;
+  pAllocation->pMapped = pBlock->pMapped ? (char *)pBlock->pMapped + offset : NULL;
+  return (ERR_OK);
+}
+
+void freeDeviceMemory(DeviceAllocation *pAllocation, DeviceAllocator *pAllocator) {
+  MemoryBlock *pBlock = pAllocation->pBlock;
+  if (pBlock == NULL) {
+    return;
+  }
+  releaseMemoryBlockRange(pBlock, pAllocation->offset, pAllocation->size);
+
+  // give empty blocks back to the driver, but keep one around per pool so
+  // that alternating create/destroy does not thrash vkAllocateMemory
+  if (pBlock->allocationCount == 0) {
+    MemoryPool *pPool = &pAllocator->pools[pAllocation->memoryTypeIndex];
+    uint32_t emptyBlocks = 0;
+    for (MemoryBlock *pCandidate : pPool->blocks) {
+      if (pCandidate->allocationCount == 0) {
+        emptyBlocks++;
+      }
+    }
+    if (emptyBlocks > 1 || pBlock->size > DEVICE_MEMORY_BLOCK_SIZE) {
+      for (size_t i = 0; i < pPool->blocks.size(); i++) {
+        if (pPool->blocks[i] == pBlock) {
+          pPool->blocks.erase(pPool->blocks.begin() + i);
+          break;
+        }
+      }
+      delete_MemoryBlock(&pBlock, pAllocator);
+    }
+  }
+
+  pAllocation->memory = VK_NULL_HANDLE;
+  pAllocation->pBlock = NULL;
+  pAllocation->pMapped = NULL;
+}
+
+void delete_DeviceAllocator(DeviceAllocator *pAllocator) {
+  for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+    for (MemoryBlock *pBlock : pAllocator->pools[i].blocks) {
+      if (pBlock->allocationCount != 0) {
+        LOG_ERROR_ARGS(ERR_LEVEL_WARN, "freeing memory block with %u live allocations",
+                       pBlock->allocationCount);
+      }
+      delete_MemoryBlock(&pBlock, pAllocator);
+    }
+    pAllocator->pools[i].blocks.clear();
+  }
+}
+
+void getDeviceAllocatorStats(DeviceAllocatorStats *pStats, const DeviceAllocator *pAllocator) {
+  *pStats = (DeviceAllocatorStats){};
+  for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++) {
+    for (const MemoryBlock *pBlock : pAllocator->pools[i].blocks) {
+      pStats->blockCount++;
+      pStats->allocationCount += pBlock->allocationCount;
+      pStats->reservedBytes += pBlock->size;
+      pStats->liveBytes += pBlock->usedSize;
+      for (const MemoryRange &range : pBlock->freeRanges) {
+        pStats->freeBytes += range.size;
+        if (range.size > pStats->largestFreeRange) {
+          pStats->largestFreeRange = range.size;
+        }
+      }
+    }
+  }
+  if (pStats->freeBytes > 0) {
+    pStats->fragmentation = 1.0f - (float)pStats->largestFreeRange / (float)pStats->freeBytes;
+  }
+}
+
+void logDeviceAllocatorStats(const DeviceAllocator *pAllocator) {
+  DeviceAllocatorStats stats;
+  getDeviceAllocatorStats(&stats, pAllocator);
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO,
+                 "device memory: %llu bytes live in %u allocations, %llu bytes reserved in %u blocks, "
+                 "fragmentation %.2f",
+                 (unsigned long long)stats.liveBytes, stats.allocationCount,
+                 (unsigned long long)stats.reservedBytes, stats.blockCount, stats.fragmentation);
+}
+
+ErrVal new_Image(VkImage *pImage, DeviceAllocation *pImageMemory, const VkExtent2D dimensions, const VkFormat format,
+const VkImageTiling tiling, const VkImageUsageFlags usage, const VkMemoryPropertyFlags properties, 
+DeviceAllocator *pAllocator,  const VkDevice device) {
+  VkImageCreateInfo imageInfo {};
+  imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  imageInfo.imageType = VK_IMAGE_TYPE_2D;
+  imageInfo.extent.width = dimensions.width;
+  imageInfo.extent.height = dimensions.height;
+  imageInfo.extent.depth = 1;
+  imageInfo.mipLevels = 1;
+  imageInfo.arrayLayers = 1;
+  imageInfo.format = format;
+  imageInfo.tiling = tiling;
+  imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  imageInfo.usage = usage;
+  imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+  imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VkResult createImageResult = vkCreateImage(device, &imageInfo, NULL, pImage);
+  if (createImageResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create image: %s",
+                   vkstrerror(createImageResult));
+    return (ERR_UNKNOWN);
+  }
+
+  VkMemoryRequirements memRequirements;
+  vkGetImageMemoryRequirements(device, *pImage, &memRequirements);
+
+  ErrVal allocateResult = allocateDeviceMemory(pImageMemory, pAllocator, memRequirements, properties,
+                                               tiling == VK_IMAGE_TILING_LINEAR);
+  if (allocateResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create image: allocation failed");
+    vkDestroyImage(device, *pImage, NULL);
+    *pImage = VK_NULL_HANDLE;
     return (ERR_MEMORY);
   }
 
-  VkResult bindResult = vkBindImageMemory(device, *pImage, *pImageMemory, 0);
+  VkResult bindResult = vkBindImageMemory(device, *pImage, pImageMemory->memory, pImageMemory->offset);
   if (bindResult != VK_SUCCESS) {
     LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create image: %s",
                    vkstrerror(bindResult));
+    freeDeviceMemory(pImageMemory, pAllocator);
+    vkDestroyImage(device, *pImage, NULL);
+    *pImage = VK_NULL_HANDLE;
     return (ERR_UNKNOWN);
   }
   return (ERR_OK);
@@ -1023,17 +2065,193 @@ properties, physicalDevice);
 
 void delete_Image(VkImage *pImage, const VkDevice device) {vkDestroyImage(device, *pImage, NULL);}
 
+/* Deferred destruction. An object the GPU may still be using is retired to
+ * the queue instead of destroyed, tagged with the frame being recorded at the
+ * time, the last frame that can use it. The frame loop collects the queue
+ * right after each pInFlightFences wait: that wait means the frame
+ * framesInFlight back has completed, along with everything before it, so
+ * whatever was retired while recording those frames is freed. Replacing a
+ * resource never has to idle the device. The queue is locked, but objects
+ * should be retired from the frame loop, the one thread that knows which
+ * frame last recorded with them; collecting is the frame loop's too */
+typedef enum {
+  DEFERRED_IMAGE,
+  DEFERRED_IMAGE_VIEW,
+  DEFERRED_FRAMEBUFFER,
+  DEFERRED_PIPELINE,
+  DEFERRED_SWAPCHAIN,
+  DEFERRED_BUFFER,
+  DEFERRED_MEMORY,
+} DeferredDeletionType;
+
+typedef struct {
+  DeferredDeletionType type;
+  uint64_t retireFrame;
+  union {
+    VkImage image;
+    VkImageView imageView;
+    VkFramebuffer framebuffer;
+    VkPipeline pipeline;
+    VkSwapchainKHR swapchain;
+    VkBuffer buffer;
+    DeviceAllocation memory;
+  };
+} DeferredDeletion;
+
+typedef struct {
+  VkDevice device;
+  // device memory is given back to the allocator
+  DeviceAllocator *pAllocator;
+  uint32_t framesInFlight;
+  std::mutex mutex;
+  // the frame the frame loop is recording
+  uint64_t frameNumber;
+  // in the order they were retired, so a view goes before its image and an
+  // image or buffer before its memory
+  std::vector<DeferredDeletion> deletions;
+} DeletionQueue;
+
+ErrVal new_DeletionQueue(DeletionQueue *pQueue, const uint32_t framesInFlight, DeviceAllocator *pAllocator,
+const VkDevice device) {
+  pQueue->device = device;
+  pQueue->pAllocator = pAllocator;
+  pQueue->framesInFlight = framesInFlight;
+  pQueue->frameNumber = 0;
+  pQueue->deletions.clear();
+  return (ERR_OK);
+}
+
+static void destroyDeferredDeletion(DeferredDeletion *pDeletion, DeletionQueue *pQueue) {
+  switch (pDeletion->type) {
+  case DEFERRED_IMAGE:
+    vkDestroyImage(pQueue->device, pDeletion->image, NULL);
+    break;
+  case DEFERRED_IMAGE_VIEW:
+    vkDestroyImageView(pQueue->device, pDeletion->imageView, NULL);
+    break;
+  case DEFERRED_FRAMEBUFFER:
+    vkDestroyFramebuffer(pQueue->device, pDeletion->framebuffer, NULL);
+    break;
+  case DEFERRED_PIPELINE:
+    vkDestroyPipeline(pQueue->device, pDeletion->pipeline, NULL);
+    break;
+  case DEFERRED_SWAPCHAIN:
+    vkDestroySwapchainKHR(pQueue->device, pDeletion->swapchain, NULL);
+    break;
+  case DEFERRED_BUFFER:
+    vkDestroyBuffer(pQueue->device, pDeletion->buffer, NULL);
+    break;
+  case DEFERRED_MEMORY:
+    freeDeviceMemory(&pDeletion->memory, pQueue->pAllocator);
+    break;
+  }
+}
+
+/* The device must be idle, everything still queued is destroyed */
+void delete_DeletionQueue(DeletionQueue *pQueue) {
+  for (size_t i = 0; i < pQueue->deletions.size(); i++) {
+    destroyDeferredDeletion(&pQueue->deletions[i], pQueue);
+  }
+  pQueue->deletions.clear();
+}
+
+/* Call once per frame, right after waiting on the frame's pInFlightFences
+ * slot and before recording. frameNumber counts every frame, it never wraps
+ * at framesInFlight */
+void collectDeletionQueue(DeletionQueue *pQueue, const uint64_t frameNumber) {
+  std::lock_guard<std::mutex> lock(pQueue->mutex);
+  pQueue->frameNumber = frameNumber;
+  size_t keptCount = 0;
+  for (size_t i = 0; i < pQueue->deletions.size(); i++) {
+    if (pQueue->deletions[i].retireFrame + pQueue->framesInFlight <= frameNumber) {
+      destroyDeferredDeletion(&pQueue->deletions[i], pQueue);
+    } else {
+      pQueue->deletions[keptCount++] = pQueue->deletions[i];
+    }
+  }
+  pQueue->deletions.resize(keptCount);
+}
+
+static void retireObject(DeletionQueue *pQueue, DeferredDeletion deletion) {
+  std::lock_guard<std::mutex> lock(pQueue->mutex);
+  deletion.retireFrame = pQueue->frameNumber;
+  pQueue->deletions.push_back(deletion);
+}
+
+void retireImage(DeletionQueue *pQueue, VkImage *pImage) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_IMAGE;
+  deletion.image = *pImage;
+  retireObject(pQueue, deletion);
+  *pImage = VK_NULL_HANDLE;
+}
+
+void retireImageView(DeletionQueue *pQueue, VkImageView *pImageView) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_IMAGE_VIEW;
+  deletion.imageView = *pImageView;
+  retireObject(pQueue, deletion);
+  *pImageView = VK_NULL_HANDLE;
+}
+
+void retireFramebuffer(DeletionQueue *pQueue, VkFramebuffer *pFramebuffer) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_FRAMEBUFFER;
+  deletion.framebuffer = *pFramebuffer;
+  retireObject(pQueue, deletion);
+  *pFramebuffer = VK_NULL_HANDLE;
+}
+
+void retirePipeline(DeletionQueue *pQueue, VkPipeline *pPipeline) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_PIPELINE;
+  deletion.pipeline = *pPipeline;
+  retireObject(pQueue, deletion);
+  *pPipeline = VK_NULL_HANDLE;
+}
+
+void retireSwapchain(DeletionQueue *pQueue, VkSwapchainKHR *pSwapchain) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_SWAPCHAIN;
+  deletion.swapchain = *pSwapchain;
+  retireObject(pQueue, deletion);
+  *pSwapchain = VK_NULL_HANDLE;
+}
+
+/* A streamed or resized buffer; retire its DeviceAllocation right after */
+void retireBuffer(DeletionQueue *pQueue, VkBuffer *pBuffer) {
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_BUFFER;
+  deletion.buffer = *pBuffer;
+  retireObject(pQueue, deletion);
+  *pBuffer = VK_NULL_HANDLE;
+}
+
+/* Memory from the DeviceAllocator, handed back to it once collected */
+void retireDeviceMemory(DeletionQueue *pQueue, DeviceAllocation *pAllocation) {
+  if (pAllocation->pBlock == NULL) {
+    return;
+  }
+  DeferredDeletion deletion;
+  deletion.type = DEFERRED_MEMORY;
+  deletion.memory = *pAllocation;
+  retireObject(pQueue, deletion);
+  pAllocation->memory = VK_NULL_HANDLE;
+  pAllocation->pBlock = NULL;
+  pAllocation->pMapped = NULL;
+}
+
 /* Gets image format of depth *//* TODO we might want to redo this so that there are more compatible images */
 void getDepthFormat(VkFormat *pFormat) {*pFormat = VK_FORMAT_D32_SFLOAT;}
 
-ErrVal new_DepthImage(VkImage *pImage, VkDeviceMemory *pImageMemory,const VkExtent2D swapchainExtent,
-                      const VkPhysicalDevice physicalDevice,const VkDevice device) {
+ErrVal new_DepthImage(VkImage *pImage, DeviceAllocation *pImageMemory,const VkExtent2D swapchainExtent,
+                      DeviceAllocator *pAllocator,const VkDevice device) {
   VkFormat depthFormat {};
   getDepthFormat(&depthFormat);
   ErrVal retVal = new_Image(
       pImage, pImageMemory, swapchainExtent, depthFormat,
       VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, physicalDevice, device);
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, pAllocator, device);
   if (retVal != ERR_OK) {
     LOG_ERROR(ERR_LEVEL_ERROR, "failed to create depth image");
     return (retVal);
@@ -1067,719 +2285,4449 @@ const uint32_t codeSize, const uint32_t *pCode) {
   return (ERR_OK);
 };
 
-ErrVal new_VertexDisplayRenderPass(VkRenderPass *pRenderPass,const VkDevice device,
-const VkFormat swapchainImageFormat) {
-  VkAttachmentDescription colorAttachment {};
-  colorAttachment.format = swapchainImageFormat;
-  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-
-  VkAttachmentDescription depthAttachment {};
-  getDepthFormat(&depthAttachment.format);
-  depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  depthAttachment.finalLayout =
-      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-
-  VkAttachmentDescription pAttachments[2];
-  pAttachments[0] = colorAttachment;
-  pAttachments[1] = depthAttachment;
-
-  VkAttachmentReference colorAttachmentRef {};
-  colorAttachmentRef.attachment = 0;
-  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-  VkAttachmentReference depthAttachmentRef {};
-  depthAttachmentRef.attachment = 1;
-  depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+void delete_ShaderModule(VkShaderModule *pShaderModule, const VkDevice device) {
+  vkDestroyShaderModule(device, *pShaderModule, NULL);
+  *pShaderModule = VK_NULL_HANDLE;
+}
 
-  VkSubpassDescription subpass {};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.colorAttachmentCount = 1;
-  subpass.pColorAttachments = &colorAttachmentRef;
-  subpass.pDepthStencilAttachment = &depthAttachmentRef;
+/* Shader SPIR-V is named relative to the asset root, e.g.
+ * "shaders/shader.vert.spv". Builds with EMBED_SHADERS, which release builds
+ * get by default, compile the code into the binary (assets/shaders/compile.sh
+ * generates embedded_shaders.hpp) and do no shader file I/O. Other builds map
+ * the .spv files, so a recompiled shader is picked up without a rebuild */
+#ifndef DEFAULT_ASSET_ROOT
+#define DEFAULT_ASSET_ROOT "../assets"
+#endif
 
-  VkRenderPassCreateInfo renderPassInfo {};
-  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  renderPassInfo.attachmentCount = 2;
-  renderPassInfo.pAttachments = pAttachments;
-  renderPassInfo.subpassCount = 1;
-  renderPassInfo.pSubpasses = &subpass;
+#if defined(NDEBUG) && !defined(NO_EMBED_SHADERS) && !defined(EMBED_SHADERS)
+#define EMBED_SHADERS
+#endif
 
-  VkSubpassDependency dependency {};
-  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-  dependency.dstSubpass = 0;
-  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.srcAccessMask = 0;
-  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-                             VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+#ifdef EMBED_SHADERS
+typedef struct {
+  const char *pName;
+  const uint32_t *pCode;
+  size_t size;
+} EmbeddedShader;
 
-  renderPassInfo.dependencyCount = 1;
-  renderPassInfo.pDependencies = &dependency;
+#if !__has_include("../assets/shaders/embedded_shaders.hpp")
+#error "embedded_shaders.hpp is generated, run assets/shaders/compile.sh first"
+#endif
+#include "../assets/shaders/embedded_shaders.hpp"
+#endif
 
-  VkResult res = vkCreateRenderPass(device, &renderPassInfo, NULL, pRenderPass);
-  if (res != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Could not create render pass, error: %s",
-                   vkstrerror(res));
-    PANIC();
+/* SPIR-V to create a shader module from, either embedded or a read only file
+ * mapping. Nothing is copied */
+typedef struct {
+  const uint32_t *pCode;
+  size_t size;
+  // NULL for embedded code
+  void *pMapping;
+} ShaderBlob;
+
+ErrVal new_ShaderBlobFromFile(ShaderBlob *pBlob, const char *pPath) {
+  int fd = open(pPath, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not open shader %s: %s", pPath, strerror(errno));
+    return (ERR_BADARGS);
+  }
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not stat shader %s: %s", pPath, strerror(errno));
+    close(fd);
+    return (ERR_UNKNOWN);
   }
-  return (ERR_OK);
-};
-
-ErrVal new_VertexDisplayPipelineLayout(VkPipelineLayout *pPipelineLayout,const VkDevice device) {
-  VkPushConstantRange pushConstantRange {};
-  pushConstantRange.offset = 0;
-  pushConstantRange.size = sizeof(mat4x4);
-  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-
-  VkPipelineLayoutCreateInfo pipelineLayoutInfo {};
-  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  pipelineLayoutInfo.setLayoutCount = 0;
-  pipelineLayoutInfo.pushConstantRangeCount = 1;
-  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
-  VkResult res = vkCreatePipelineLayout(device, &pipelineLayoutInfo, NULL,
-                                        pPipelineLayout);
-  if (res != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL,
-                   "failed to create pipeline layout with error: %s",
-                   vkstrerror(res));
-    PANIC();
+  // SPIR-V is a stream of 32 bit words
+  size_t size = (size_t)fileStat.st_size;
+  if (size == 0 || size % sizeof(uint32_t) != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "%s is not SPIR-V, its size is %zu bytes", pPath, size);
+    close(fd);
+    return (ERR_BADARGS);
+  }
+  void *pMapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (pMapping == MAP_FAILED) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not map shader %s: %s", pPath, strerror(errno));
+    return (ERR_MEMORY);
   }
+  pBlob->pCode = (const uint32_t *)pMapping;
+  pBlob->size = size;
+  pBlob->pMapping = pMapping;
   return (ERR_OK);
 }
 
-void delete_PipelineLayout(VkPipelineLayout *pPipelineLayout,const VkDevice device) {
-  vkDestroyPipelineLayout(device, *pPipelineLayout, NULL);
-  *pPipelineLayout = VK_NULL_HANDLE;
+ErrVal new_ShaderBlob(ShaderBlob *pBlob, const char *pAssetRoot, const char *pName) {
+#ifdef EMBED_SHADERS
+  for (size_t i = 0; i < sizeof(embeddedShaders) / sizeof(embeddedShaders[0]); i++) {
+    if (strcmp(embeddedShaders[i].pName, pName) == 0) {
+      pBlob->pCode = embeddedShaders[i].pCode;
+      pBlob->size = embeddedShaders[i].size;
+      pBlob->pMapping = NULL;
+      return (ERR_OK);
+    }
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_WARN, "shader %s is not embedded, loading it from %s", pName, pAssetRoot);
+#endif
+  std::string path = std::string(pAssetRoot) + "/" + pName;
+  return (new_ShaderBlobFromFile(pBlob, path.c_str()));
 }
 
-ErrVal new_VertexDisplayPipeline(VkPipeline *pGraphicsPipeline, const VkDevice device,
-const VkShaderModule vertShaderModule, const VkShaderModule fragShaderModule,const VkExtent2D extent,
-const VkRenderPass renderPass,const VkPipelineLayout pipelineLayout) {
-  VkPipelineShaderStageCreateInfo vertShaderStageInfo {};
-  vertShaderStageInfo.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vertShaderStageInfo.module = vertShaderModule;
-  vertShaderStageInfo.pName = "main";
+void delete_ShaderBlob(ShaderBlob *pBlob) {
+  if (pBlob->pMapping) {
+    munmap(pBlob->pMapping, pBlob->size);
+  }
+  pBlob->pCode = NULL;
+  pBlob->size = 0;
+  pBlob->pMapping = NULL;
+}
 
-  VkPipelineShaderStageCreateInfo fragShaderStageInfo {};
-  fragShaderStageInfo.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  fragShaderStageInfo.module = fragShaderModule;
-  fragShaderStageInfo.pName = "main";
+/* SPIR-V reflection. Only what the layout cache and the pipeline checks need
+ * is pulled out of a module: its descriptor bindings, the size of its push
+ * constant block, its vertex inputs and its compute local size. Opcodes and
+ * enumerants are from section 3 of the SPIR-V specification. Only the first
+ * entry point is looked at, which is all glslangValidator emits */
+#define SPIRV_MAGIC 0x07230203
+#define SPIRV_HEADER_WORDS 5
+
+#define SPIRV_OP_ENTRY_POINT 15
+#define SPIRV_OP_EXECUTION_MODE 16
+#define SPIRV_OP_TYPE_INT 21
+#define SPIRV_OP_TYPE_FLOAT 22
+#define SPIRV_OP_TYPE_VECTOR 23
+#define SPIRV_OP_TYPE_MATRIX 24
+#define SPIRV_OP_TYPE_IMAGE 25
+#define SPIRV_OP_TYPE_SAMPLER 26
+#define SPIRV_OP_TYPE_SAMPLED_IMAGE 27
+#define SPIRV_OP_TYPE_ARRAY 28
+#define SPIRV_OP_TYPE_RUNTIME_ARRAY 29
+#define SPIRV_OP_TYPE_STRUCT 30
+#define SPIRV_OP_TYPE_POINTER 32
+#define SPIRV_OP_CONSTANT 43
+#define SPIRV_OP_VARIABLE 59
+#define SPIRV_OP_DECORATE 71
+#define SPIRV_OP_MEMBER_DECORATE 72
+
+#define SPIRV_EXECUTION_MODEL_VERTEX 0
+#define SPIRV_EXECUTION_MODEL_GEOMETRY 3
+#define SPIRV_EXECUTION_MODEL_FRAGMENT 4
+#define SPIRV_EXECUTION_MODEL_GLCOMPUTE 5
+#define SPIRV_EXECUTION_MODE_LOCAL_SIZE 17
+
+#define SPIRV_DECORATION_BLOCK 2
+#define SPIRV_DECORATION_BUFFER_BLOCK 3
+#define SPIRV_DECORATION_ARRAY_STRIDE 6
+#define SPIRV_DECORATION_BUILTIN 11
+#define SPIRV_DECORATION_LOCATION 30
+#define SPIRV_DECORATION_BINDING 33
+#define SPIRV_DECORATION_DESCRIPTOR_SET 34
+#define SPIRV_DECORATION_OFFSET 35
+
+#define SPIRV_STORAGE_UNIFORM_CONSTANT 0
+#define SPIRV_STORAGE_INPUT 1
+#define SPIRV_STORAGE_UNIFORM 2
+#define SPIRV_STORAGE_PUSH_CONSTANT 9
+#define SPIRV_STORAGE_STORAGE_BUFFER 12
+
+#define SPIRV_DIM_BUFFER 5
+#define SPIRV_DIM_SUBPASS_DATA 6
+// the Sampled operand of an image that is only read and written, not sampled
+#define SPIRV_IMAGE_STORAGE 2
+
+// types nest this deep at most before a module is taken as malformed
+#define SPIRV_MAX_TYPE_DEPTH 16
+
+#define MAX_REFLECTED_SETS 4
+#define MAX_REFLECTED_BINDINGS 16
+#define MAX_REFLECTED_INPUTS 16
 
-  VkPipelineShaderStageCreateInfo shaderStages[2] = {vertShaderStageInfo,fragShaderStageInfo};
+typedef struct {
+  uint32_t set;
+  uint32_t binding;
+  VkDescriptorType type;
+  // elements of a descriptor array, 1 otherwise
+  uint32_t count;
+} ReflectedBinding;
 
-  VkVertexInputBindingDescription bindingDescription {};
-  bindingDescription.binding = 0;
-  bindingDescription.stride = sizeof(Vertex);
-  bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+typedef struct {
+  uint32_t location;
+  // VK_FORMAT_UNDEFINED for types no vertex attribute can feed
+  VkFormat format;
+} ReflectedInput;
 
-  VkVertexInputAttributeDescription attributeDescriptions[2];
+typedef struct {
+  VkShaderStageFlagBits stage;
+  uint32_t bindingCount;
+  ReflectedBinding pBindings[MAX_REFLECTED_BINDINGS];
+  // 0 without a push constant block
+  uint32_t pushConstantSize;
+  // vertex shaders only, one per location so a matrix takes one per column
+  uint32_t inputCount;
+  ReflectedInput pInputs[MAX_REFLECTED_INPUTS];
+  // compute shaders only
+  uint32_t pLocalSize[3];
+} ShaderReflection;
+
+#define SPIRV_ID_SET 0x1
+#define SPIRV_ID_BINDING 0x2
+#define SPIRV_ID_LOCATION 0x4
+#define SPIRV_ID_BUILTIN 0x8
+#define SPIRV_ID_BUFFER_BLOCK 0x10
+
+/* What is known about one result id. pWords holds the operands that matter
+ * for its opcode:
+ *   int {width, signedness}, float {width}, vector {component type, count},
+ *   matrix {column type, column count}, image {dim, sampled},
+ *   sampled image {image type}, array {element type, length id},
+ *   runtime array {element type}, pointer {storage class, type},
+ *   constant {value}, variable {pointer type, storage class} */
+typedef struct {
+  uint32_t opcode;
+  uint32_t pWords[2];
+  uint32_t flags;
+  uint32_t set;
+  uint32_t binding;
+  uint32_t location;
+  uint32_t arrayStride;
+  // struct member types are pMemberTypes[firstMember] on
+  uint32_t firstMember;
+  uint32_t memberCount;
+} SpirvId;
 
-  attributeDescriptions[0].binding = 0;
-  attributeDescriptions[0].location = 0;
-  attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
-  attributeDescriptions[0].offset = offsetof(Vertex, position);
+typedef struct {
+  uint32_t structId;
+  uint32_t member;
+  uint32_t offset;
+} SpirvMemberOffset;
 
-  attributeDescriptions[1].binding = 0;
-  attributeDescriptions[1].location = 1;
-  attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-  attributeDescriptions[1].offset = offsetof(Vertex, color);
+typedef struct {
+  std::vector<SpirvId> ids;
+  std::vector<uint32_t> memberTypes;
+  // decorations come before the types they decorate, so offsets are kept
+  // aside until the struct is seen
+  std::vector<SpirvMemberOffset> memberOffsets;
+} SpirvModule;
+
+static const SpirvId *getSpirvId(const SpirvModule *pModule, const uint32_t id) {
+  return (id < pModule->ids.size() ? &pModule->ids[id] : NULL);
+}
 
-  VkPipelineVertexInputStateCreateInfo vertexInputInfo {};
-  vertexInputInfo.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputInfo.vertexBindingDescriptionCount = 1;
-  vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-  vertexInputInfo.vertexAttributeDescriptionCount = 2;
-  vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
+/* Size in bytes of a type in a block, 0 for types that have none */
+static uint32_t getSpirvTypeSize(const SpirvModule *pModule, const uint32_t typeId, const uint32_t depth) {
+  const SpirvId *pType = getSpirvId(pModule, typeId);
+  if (!pType || depth > SPIRV_MAX_TYPE_DEPTH) {
+    return (0);
+  }
+  switch (pType->opcode) {
+  case SPIRV_OP_TYPE_INT:
+  case SPIRV_OP_TYPE_FLOAT:
+    return (pType->pWords[0] / 8);
+  case SPIRV_OP_TYPE_VECTOR:
+    return (pType->pWords[1] * getSpirvTypeSize(pModule, pType->pWords[0], depth + 1));
+  case SPIRV_OP_TYPE_MATRIX: {
+    // 3 component columns are padded out to 4
+    const SpirvId *pColumn = getSpirvId(pModule, pType->pWords[0]);
+    uint32_t columnSize = getSpirvTypeSize(pModule, pType->pWords[0], depth + 1);
+    if (pColumn && pColumn->opcode == SPIRV_OP_TYPE_VECTOR && pColumn->pWords[1] == 3) {
+      columnSize = columnSize / 3 * 4;
+    }
+    return (pType->pWords[1] * columnSize);
+  }
+  case SPIRV_OP_TYPE_ARRAY: {
+    const SpirvId *pLength = getSpirvId(pModule, pType->pWords[1]);
+    uint32_t stride = pType->arrayStride ? pType->arrayStride
+                                         : getSpirvTypeSize(pModule, pType->pWords[0], depth + 1);
+    return (pLength && pLength->opcode == SPIRV_OP_CONSTANT ? pLength->pWords[0] * stride : 0);
+  }
+  case SPIRV_OP_TYPE_STRUCT: {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < pType->memberCount; i++) {
+      uint32_t offset = 0;
+      for (size_t j = 0; j < pModule->memberOffsets.size(); j++) {
+        if (pModule->memberOffsets[j].structId == (uint32_t)(pType - pModule->ids.data()) &&
+            pModule->memberOffsets[j].member == i) {
+          offset = pModule->memberOffsets[j].offset;
+        }
+      }
+      uint32_t end = offset + getSpirvTypeSize(pModule, pModule->memberTypes[pType->firstMember + i], depth + 1);
+      size = end > size ? end : size;
+    }
+    return (size);
+  }
+  default:
+    return (0);
+  }
+}
 
-  VkPipelineInputAssemblyStateCreateInfo inputAssembly {};
-  inputAssembly.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-  inputAssembly.primitiveRestartEnable = VK_FALSE;
+static ErrVal getSpirvDescriptorType(VkDescriptorType *pDescriptorType, uint32_t *pCount, const SpirvModule *pModule,
+const SpirvId *pVariable) {
+  const SpirvId *pPointer = getSpirvId(pModule, pVariable->pWords[0]);
+  if (!pPointer || pPointer->opcode != SPIRV_OP_TYPE_POINTER) {
+    return (ERR_BADARGS);
+  }
+  const SpirvId *pType = getSpirvId(pModule, pPointer->pWords[1]);
+  *pCount = 1;
+  // a runtime sized array is taken as a single descriptor
+  for (uint32_t depth = 0;
+       pType && (pType->opcode == SPIRV_OP_TYPE_ARRAY || pType->opcode == SPIRV_OP_TYPE_RUNTIME_ARRAY) &&
+       depth < SPIRV_MAX_TYPE_DEPTH;
+       depth++) {
+    if (pType->opcode == SPIRV_OP_TYPE_ARRAY) {
+      const SpirvId *pLength = getSpirvId(pModule, pType->pWords[1]);
+      if (!pLength || pLength->opcode != SPIRV_OP_CONSTANT) {
+        return (ERR_NOTSUPPORTED);
+      }
+      *pCount *= pLength->pWords[0];
+    }
+    pType = getSpirvId(pModule, pType->pWords[0]);
+  }
+  if (!pType) {
+    return (ERR_BADARGS);
+  }
 
-  VkViewport viewport {};
-  viewport.x = 0.0f;
-  viewport.y = 0.0f;
-  viewport.width = (float)extent.width;
-  viewport.height = (float)extent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
+  switch (pVariable->pWords[1]) {
+  case SPIRV_STORAGE_STORAGE_BUFFER:
+    *pDescriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    return (ERR_OK);
+  case SPIRV_STORAGE_UNIFORM:
+    // storage buffers from before SPV_KHR_storage_buffer_class
+    *pDescriptorType = (pType->flags & SPIRV_ID_BUFFER_BLOCK) ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+                                                              : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    return (ERR_OK);
+  case SPIRV_STORAGE_UNIFORM_CONSTANT:
+    switch (pType->opcode) {
+    case SPIRV_OP_TYPE_SAMPLER:
+      *pDescriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+      return (ERR_OK);
+    case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+      *pDescriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+      return (ERR_OK);
+    case SPIRV_OP_TYPE_IMAGE:
+      if (pType->pWords[0] == SPIRV_DIM_SUBPASS_DATA) {
+        *pDescriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+      } else if (pType->pWords[0] == SPIRV_DIM_BUFFER) {
+        *pDescriptorType = pType->pWords[1] == SPIRV_IMAGE_STORAGE ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+                                                                   : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+      } else {
+        *pDescriptorType = pType->pWords[1] == SPIRV_IMAGE_STORAGE ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+                                                                   : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+      }
+      return (ERR_OK);
+    default:
+      return (ERR_NOTSUPPORTED);
+    }
+  default:
+    return (ERR_NOTSUPPORTED);
+  }
+}
+
+/* The attribute format that feeds a scalar or vector input */
+static VkFormat getSpirvInputFormat(const SpirvModule *pModule, const uint32_t typeId) {
+  static const VkFormat ppFormats[3][4] = {
+      {VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT},
+      {VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT},
+      {VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT}};
+  const SpirvId *pType = getSpirvId(pModule, typeId);
+  uint32_t componentCount = 1;
+  if (pType && pType->opcode == SPIRV_OP_TYPE_VECTOR) {
+    componentCount = pType->pWords[1];
+    pType = getSpirvId(pModule, pType->pWords[0]);
+  }
+  if (!pType || pType->pWords[0] != 32 || componentCount < 1 || componentCount > 4) {
+    return (VK_FORMAT_UNDEFINED);
+  }
+  if (pType->opcode == SPIRV_OP_TYPE_FLOAT) {
+    return (ppFormats[0][componentCount - 1]);
+  }
+  if (pType->opcode == SPIRV_OP_TYPE_INT) {
+    return (ppFormats[pType->pWords[1] ? 1 : 2][componentCount - 1]);
+  }
+  return (VK_FORMAT_UNDEFINED);
+}
+
+static ErrVal addReflectedInput(ShaderReflection *pReflection, const uint32_t location, const VkFormat format) {
+  if (pReflection->inputCount == MAX_REFLECTED_INPUTS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "shader has more than %d vertex inputs", MAX_REFLECTED_INPUTS);
+    return (ERR_NOTSUPPORTED);
+  }
+  pReflection->pInputs[pReflection->inputCount].location = location;
+  pReflection->pInputs[pReflection->inputCount].format = format;
+  pReflection->inputCount++;
+  return (ERR_OK);
+}
+
+/* Fills pReflection from the words of a SPIR-V module. Only reads pCode */
+ErrVal reflectShader(ShaderReflection *pReflection, const uint32_t *pCode, const size_t size) {
+  memset(pReflection, 0, sizeof(*pReflection));
+  size_t wordCount = size / sizeof(uint32_t);
+  if (wordCount < SPIRV_HEADER_WORDS || pCode[0] != SPIRV_MAGIC) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "shader is not SPIR-V");
+    return (ERR_BADARGS);
+  }
+
+  SpirvModule module;
+  // the id bound is in the header
+  module.ids.assign(pCode[3], SpirvId {});
+  bool hasEntryPoint = false;
+  uint32_t executionModel = 0;
+  uint32_t entryPointId = 0;
+  for (size_t i = SPIRV_HEADER_WORDS; i < wordCount;) {
+    uint32_t opcode = pCode[i] & 0xFFFF;
+    uint32_t length = pCode[i] >> 16;
+    if (length == 0 || i + length > wordCount) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "malformed SPIR-V instruction at word %zu", i);
+      return (ERR_BADARGS);
+    }
+    const uint32_t *pWords = pCode + i;
+    i += length;
+
+    // the result id of the instructions that declare one we care about
+    uint32_t resultWord = 0;
+    switch (opcode) {
+    case SPIRV_OP_ENTRY_POINT:
+      if (!hasEntryPoint && length >= 3) {
+        hasEntryPoint = true;
+        executionModel = pWords[1];
+        entryPointId = pWords[2];
+      }
+      continue;
+    case SPIRV_OP_EXECUTION_MODE:
+      if (length >= 6 && pWords[1] == entryPointId && pWords[2] == SPIRV_EXECUTION_MODE_LOCAL_SIZE) {
+        memcpy(pReflection->pLocalSize, pWords + 3, sizeof(pReflection->pLocalSize));
+      }
+      continue;
+    case SPIRV_OP_DECORATE: {
+      SpirvId *pTarget = length >= 3 && pWords[1] < module.ids.size() ? &module.ids[pWords[1]] : NULL;
+      if (!pTarget) {
+        continue;
+      }
+      uint32_t literal = length >= 4 ? pWords[3] : 0;
+      switch (pWords[2]) {
+      case SPIRV_DECORATION_DESCRIPTOR_SET:
+        pTarget->flags |= SPIRV_ID_SET;
+        pTarget->set = literal;
+        break;
+      case SPIRV_DECORATION_BINDING:
+        pTarget->flags |= SPIRV_ID_BINDING;
+        pTarget->binding = literal;
+        break;
+      case SPIRV_DECORATION_LOCATION:
+        pTarget->flags |= SPIRV_ID_LOCATION;
+        pTarget->location = literal;
+        break;
+      case SPIRV_DECORATION_BUILTIN:
+        pTarget->flags |= SPIRV_ID_BUILTIN;
+        break;
+      case SPIRV_DECORATION_BUFFER_BLOCK:
+        pTarget->flags |= SPIRV_ID_BUFFER_BLOCK;
+        break;
+      case SPIRV_DECORATION_ARRAY_STRIDE:
+        pTarget->arrayStride = literal;
+        break;
+      }
+      continue;
+    }
+    case SPIRV_OP_MEMBER_DECORATE:
+      if (length >= 5 && pWords[3] == SPIRV_DECORATION_OFFSET) {
+        module.memberOffsets.push_back({pWords[1], pWords[2], pWords[4]});
+      }
+      continue;
+    case SPIRV_OP_TYPE_INT:
+    case SPIRV_OP_TYPE_FLOAT:
+    case SPIRV_OP_TYPE_VECTOR:
+    case SPIRV_OP_TYPE_MATRIX:
+    case SPIRV_OP_TYPE_SAMPLER:
+    case SPIRV_OP_TYPE_SAMPLED_IMAGE:
+    case SPIRV_OP_TYPE_ARRAY:
+    case SPIRV_OP_TYPE_RUNTIME_ARRAY:
+    case SPIRV_OP_TYPE_POINTER:
+    case SPIRV_OP_TYPE_STRUCT:
+    case SPIRV_OP_TYPE_IMAGE:
+      resultWord = 1;
+      break;
+    case SPIRV_OP_CONSTANT:
+    case SPIRV_OP_VARIABLE:
+      resultWord = 2;
+      break;
+    default:
+      continue;
+    }
+
+    if (length <= resultWord || pWords[resultWord] >= module.ids.size()) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "malformed SPIR-V, opcode %u has a bad result id", opcode);
+      return (ERR_BADARGS);
+    }
+    SpirvId *pId = &module.ids[pWords[resultWord]];
+    pId->opcode = opcode;
+    if (opcode == SPIRV_OP_TYPE_STRUCT) {
+      pId->firstMember = (uint32_t)module.memberTypes.size();
+      pId->memberCount = length - 2;
+      module.memberTypes.insert(module.memberTypes.end(), pWords + 2, pWords + length);
+    } else if (opcode == SPIRV_OP_TYPE_IMAGE) {
+      // dim and sampled
+      pId->pWords[0] = length > 3 ? pWords[3] : 0;
+      pId->pWords[1] = length > 7 ? pWords[7] : 0;
+    } else if (opcode == SPIRV_OP_VARIABLE) {
+      pId->pWords[0] = pWords[1];
+      pId->pWords[1] = length > 3 ? pWords[3] : 0;
+    } else {
+      for (uint32_t j = 0; j < 2 && resultWord + 1 + j < length; j++) {
+        pId->pWords[j] = pWords[resultWord + 1 + j];
+      }
+    }
+  }
+
+  switch (executionModel) {
+  case SPIRV_EXECUTION_MODEL_VERTEX:
+    pReflection->stage = VK_SHADER_STAGE_VERTEX_BIT;
+    break;
+  case SPIRV_EXECUTION_MODEL_GEOMETRY:
+    pReflection->stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+    break;
+  case SPIRV_EXECUTION_MODEL_FRAGMENT:
+    pReflection->stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    break;
+  case SPIRV_EXECUTION_MODEL_GLCOMPUTE:
+    pReflection->stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    break;
+  default:
+    hasEntryPoint = false;
+  }
+  if (!hasEntryPoint) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "shader has no supported entry point, execution model %u", executionModel);
+    return (ERR_NOTSUPPORTED);
+  }
+
+  for (size_t id = 0; id < module.ids.size(); id++) {
+    const SpirvId *pVariable = &module.ids[id];
+    if (pVariable->opcode != SPIRV_OP_VARIABLE) {
+      continue;
+    }
+    const SpirvId *pPointer = getSpirvId(&module, pVariable->pWords[0]);
+    if (!pPointer || pPointer->opcode != SPIRV_OP_TYPE_POINTER) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "malformed SPIR-V, variable %zu is not a pointer", id);
+      return (ERR_BADARGS);
+    }
+    uint32_t typeId = pPointer->pWords[1];
+
+    if (pVariable->pWords[1] == SPIRV_STORAGE_PUSH_CONSTANT) {
+      pReflection->pushConstantSize = getSpirvTypeSize(&module, typeId, 0);
+    } else if (pVariable->pWords[1] == SPIRV_STORAGE_INPUT) {
+      if (pReflection->stage != VK_SHADER_STAGE_VERTEX_BIT || (pVariable->flags & SPIRV_ID_BUILTIN) ||
+          !(pVariable->flags & SPIRV_ID_LOCATION)) {
+        continue;
+      }
+      const SpirvId *pType = getSpirvId(&module, typeId);
+      ErrVal retVal = ERR_OK;
+      if (pType && pType->opcode == SPIRV_OP_TYPE_MATRIX) {
+        // one location per column
+        for (uint32_t column = 0; column < pType->pWords[1] && retVal == ERR_OK; column++) {
+          retVal = addReflectedInput(pReflection, pVariable->location + column,
+                                     getSpirvInputFormat(&module, pType->pWords[0]));
+        }
+      } else {
+        retVal = addReflectedInput(pReflection, pVariable->location, getSpirvInputFormat(&module, typeId));
+      }
+      if (retVal != ERR_OK) {
+        return (retVal);
+      }
+    } else if ((pVariable->flags & SPIRV_ID_BINDING) && (pVariable->pWords[1] == SPIRV_STORAGE_UNIFORM_CONSTANT ||
+                                                           pVariable->pWords[1] == SPIRV_STORAGE_UNIFORM ||
+                                                           pVariable->pWords[1] == SPIRV_STORAGE_STORAGE_BUFFER)) {
+      if (pReflection->bindingCount == MAX_REFLECTED_BINDINGS) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "shader has more than %d descriptor bindings", MAX_REFLECTED_BINDINGS);
+        return (ERR_NOTSUPPORTED);
+      }
+      ReflectedBinding *pBinding = &pReflection->pBindings[pReflection->bindingCount];
+      pBinding->set = pVariable->set;
+      pBinding->binding = pVariable->binding;
+      if (getSpirvDescriptorType(&pBinding->type, &pBinding->count, &module, pVariable) != ERR_OK) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "unsupported descriptor at set %u binding %u", pBinding->set,
+                       pBinding->binding);
+        return (ERR_NOTSUPPORTED);
+      }
+      pReflection->bindingCount++;
+    }
+  }
+  return (ERR_OK);
+}
+
+/* Descriptor set and pipeline layouts built from shader reflection, shared
+ * between every pipeline whose shaders declare the same interface. The cache
+ * owns them, callers never destroy the layouts it hands out. Lookups are a
+ * linear search, there are only ever a handful of layouts. Safe to use from
+ * several threads */
+typedef struct {
+  uint32_t bindingCount;
+  // sorted by binding
+  VkDescriptorSetLayoutBinding pBindings[MAX_REFLECTED_BINDINGS];
+  VkDescriptorSetLayout layout;
+} CachedSetLayout;
+
+typedef struct {
+  uint32_t setCount;
+  VkDescriptorSetLayout pSetLayouts[MAX_REFLECTED_SETS];
+  // size 0 without push constants
+  VkPushConstantRange pushConstantRange;
+  VkPipelineLayout layout;
+} CachedPipelineLayout;
+
+typedef struct {
+  VkDevice device;
+  std::mutex mutex;
+  std::vector<CachedSetLayout> setLayouts;
+  std::vector<CachedPipelineLayout> pipelineLayouts;
+} LayoutCache;
+
+ErrVal new_LayoutCache(LayoutCache *pCache, const VkDevice device) {
+  pCache->device = device;
+  pCache->setLayouts.clear();
+  pCache->pipelineLayouts.clear();
+  return (ERR_OK);
+}
+
+void delete_LayoutCache(LayoutCache *pCache) {
+  for (size_t i = 0; i < pCache->pipelineLayouts.size(); i++) {
+    vkDestroyPipelineLayout(pCache->device, pCache->pipelineLayouts[i].layout, NULL);
+  }
+  for (size_t i = 0; i < pCache->setLayouts.size(); i++) {
+    vkDestroyDescriptorSetLayout(pCache->device, pCache->setLayouts[i].layout, NULL);
+  }
+  pCache->pipelineLayouts.clear();
+  pCache->setLayouts.clear();
+}
+
+/* The cache's mutex must be held */
+static ErrVal getCachedSetLayout(VkDescriptorSetLayout *pSetLayout, LayoutCache *pCache,
+const VkDescriptorSetLayoutBinding *pBindings, const uint32_t bindingCount) {
+  for (size_t i = 0; i < pCache->setLayouts.size(); i++) {
+    const CachedSetLayout *pCached = &pCache->setLayouts[i];
+    bool match = pCached->bindingCount == bindingCount;
+    for (uint32_t j = 0; match && j < bindingCount; j++) {
+      match = pCached->pBindings[j].binding == pBindings[j].binding &&
+              pCached->pBindings[j].descriptorType == pBindings[j].descriptorType &&
+              pCached->pBindings[j].descriptorCount == pBindings[j].descriptorCount &&
+              pCached->pBindings[j].stageFlags == pBindings[j].stageFlags;
+    }
+    if (match) {
+      *pSetLayout = pCached->layout;
+      return (ERR_OK);
+    }
+  }
+
+  CachedSetLayout cached {};
+  cached.bindingCount = bindingCount;
+  memcpy(cached.pBindings, pBindings, bindingCount * sizeof(VkDescriptorSetLayoutBinding));
+  VkDescriptorSetLayoutCreateInfo layoutInfo {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = bindingCount;
+  layoutInfo.pBindings = cached.pBindings;
+  VkResult ret = vkCreateDescriptorSetLayout(pCache->device, &layoutInfo, NULL, &cached.layout);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create descriptor set layout: %s", vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  pCache->setLayouts.push_back(cached);
+  *pSetLayout = cached.layout;
+  return (ERR_OK);
+}
+
+/* The pipeline layout for the stages in pReflections, merging bindings the
+ * stages share. The push constants of all stages become one range visible to
+ * each stage that declares a block, so they have to be pushed with all of
+ * those stage flags. pSetLayouts is NULL, or receives MAX_REFLECTED_SETS
+ * set layouts; sets no stage uses are empty */
+ErrVal getReflectedPipelineLayout(VkPipelineLayout *pPipelineLayout, VkDescriptorSetLayout *pSetLayouts,
+LayoutCache *pCache, const ShaderReflection *pReflections, const uint32_t reflectionCount) {
+  VkDescriptorSetLayoutBinding ppBindings[MAX_REFLECTED_SETS][MAX_REFLECTED_BINDINGS] {};
+  uint32_t pBindingCounts[MAX_REFLECTED_SETS] = {};
+  uint32_t setCount = 0;
+  VkPushConstantRange pushConstantRange {};
+  for (uint32_t i = 0; i < reflectionCount; i++) {
+    const ShaderReflection *pReflection = &pReflections[i];
+    for (uint32_t j = 0; j < pReflection->bindingCount; j++) {
+      const ReflectedBinding *pBinding = &pReflection->pBindings[j];
+      if (pBinding->set >= MAX_REFLECTED_SETS) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "descriptor set %u is past the %d supported", pBinding->set,
+                       MAX_REFLECTED_SETS);
+        return (ERR_NOTSUPPORTED);
+      }
+      VkDescriptorSetLayoutBinding *pSetBindings = ppBindings[pBinding->set];
+      uint32_t *pCount = &pBindingCounts[pBinding->set];
+      uint32_t k = 0;
+      while (k < *pCount && pSetBindings[k].binding < pBinding->binding) {
+        k++;
+      }
+      if (k < *pCount && pSetBindings[k].binding == pBinding->binding) {
+        if (pSetBindings[k].descriptorType != pBinding->type || pSetBindings[k].descriptorCount != pBinding->count) {
+          LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "stages disagree on set %u binding %u", pBinding->set, pBinding->binding);
+          return (ERR_BADARGS);
+        }
+        pSetBindings[k].stageFlags |= pReflection->stage;
+        continue;
+      }
+      if (*pCount == MAX_REFLECTED_BINDINGS) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "set %u has more than %d bindings", pBinding->set, MAX_REFLECTED_BINDINGS);
+        return (ERR_NOTSUPPORTED);
+      }
+      memmove(&pSetBindings[k + 1], &pSetBindings[k], (*pCount - k) * sizeof(VkDescriptorSetLayoutBinding));
+      pSetBindings[k] = {};
+      pSetBindings[k].binding = pBinding->binding;
+      pSetBindings[k].descriptorType = pBinding->type;
+      pSetBindings[k].descriptorCount = pBinding->count;
+      pSetBindings[k].stageFlags = pReflection->stage;
+      (*pCount)++;
+      setCount = pBinding->set + 1 > setCount ? pBinding->set + 1 : setCount;
+    }
+    if (pReflection->pushConstantSize > 0) {
+      pushConstantRange.stageFlags |= pReflection->stage;
+      if (pReflection->pushConstantSize > pushConstantRange.size) {
+        pushConstantRange.size = pReflection->pushConstantSize;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(pCache->mutex);
+  VkDescriptorSetLayout pLayouts[MAX_REFLECTED_SETS];
+  for (uint32_t i = 0; i < MAX_REFLECTED_SETS; i++) {
+    // the empty layout is only made when a set is skipped or asked for
+    if (i < setCount || pSetLayouts) {
+      ErrVal retVal = getCachedSetLayout(&pLayouts[i], pCache, ppBindings[i], pBindingCounts[i]);
+      if (retVal != ERR_OK) {
+        return (retVal);
+      }
+    }
+  }
+  if (pSetLayouts) {
+    memcpy(pSetLayouts, pLayouts, sizeof(pLayouts));
+  }
+
+  for (size_t i = 0; i < pCache->pipelineLayouts.size(); i++) {
+    const CachedPipelineLayout *pCached = &pCache->pipelineLayouts[i];
+    if (pCached->setCount == setCount &&
+        memcmp(pCached->pSetLayouts, pLayouts, setCount * sizeof(VkDescriptorSetLayout)) == 0 &&
+        pCached->pushConstantRange.stageFlags == pushConstantRange.stageFlags &&
+        pCached->pushConstantRange.size == pushConstantRange.size) {
+      *pPipelineLayout = pCached->layout;
+      return (ERR_OK);
+    }
+  }
+
+  CachedPipelineLayout cached {};
+  cached.setCount = setCount;
+  memcpy(cached.pSetLayouts, pLayouts, setCount * sizeof(VkDescriptorSetLayout));
+  cached.pushConstantRange = pushConstantRange;
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount = setCount;
+  pipelineLayoutInfo.pSetLayouts = cached.pSetLayouts;
+  pipelineLayoutInfo.pushConstantRangeCount = pushConstantRange.size > 0 ? 1 : 0;
+  pipelineLayoutInfo.pPushConstantRanges = &cached.pushConstantRange;
+  VkResult ret = vkCreatePipelineLayout(pCache->device, &pipelineLayoutInfo, NULL, &cached.layout);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create pipeline layout: %s", vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  pCache->pipelineLayouts.push_back(cached);
+  *pPipelineLayout = cached.layout;
+  return (ERR_OK);
+}
+
+/* Creates the module and, when pReflection isn't NULL, reflects it. The driver
+ * copies the code, so the blob is released straight away */
+static ErrVal new_ShaderModuleFromBlob(VkShaderModule *pShaderModule, ShaderBlob *pBlob,
+ShaderReflection *pReflection, const VkDevice device) {
+  ErrVal retVal = pReflection ? reflectShader(pReflection, pBlob->pCode, pBlob->size) : ERR_OK;
+  if (retVal == ERR_OK) {
+    retVal = new_ShaderModule(pShaderModule, device, (uint32_t)pBlob->size, pBlob->pCode);
+  }
+  delete_ShaderBlob(pBlob);
+  return (retVal);
+}
+
+/* pReflection is NULL when the interface isn't needed */
+ErrVal loadShaderModule(VkShaderModule *pShaderModule, ShaderReflection *pReflection, const char *pAssetRoot,
+const char *pName, const VkDevice device) {
+  ShaderBlob blob;
+  ErrVal retVal = new_ShaderBlob(&blob, pAssetRoot, pName);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  return (new_ShaderModuleFromBlob(pShaderModule, &blob, pReflection, device));
+}
+
+/* finalLayout is PRESENT_SRC for swapchain images, or TRANSFER_SRC_OPTIMAL when
+ * the color attachment is copied out afterwards */
+ErrVal new_VertexDisplayRenderPass(VkRenderPass *pRenderPass,const VkDevice device,
+const VkFormat swapchainImageFormat, const VkImageLayout finalLayout) {
+  VkAttachmentDescription colorAttachment {};
+  colorAttachment.format = swapchainImageFormat;
+  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  colorAttachment.finalLayout = finalLayout;
+
+  VkAttachmentDescription depthAttachment {};
+  getDepthFormat(&depthAttachment.format);
+  depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+  depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+  depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+  depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  depthAttachment.finalLayout =
+      VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentDescription pAttachments[2];
+  pAttachments[0] = colorAttachment;
+  pAttachments[1] = depthAttachment;
+
+  VkAttachmentReference colorAttachmentRef {};
+  colorAttachmentRef.attachment = 0;
+  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+  VkAttachmentReference depthAttachmentRef {};
+  depthAttachmentRef.attachment = 1;
+  depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+  VkSubpassDescription subpass {};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = 1;
+  subpass.pColorAttachments = &colorAttachmentRef;
+  subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+  VkRenderPassCreateInfo renderPassInfo {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassInfo.attachmentCount = 2;
+  renderPassInfo.pAttachments = pAttachments;
+  renderPassInfo.subpassCount = 1;
+  renderPassInfo.pSubpasses = &subpass;
+
+  // the depth image is shared by every frame in flight, so the previous
+  // frame's depth writes have to finish before this one clears it
+  VkSubpassDependency pDependencies[2] {};
+  pDependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+  pDependencies[0].dstSubpass = 0;
+  pDependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                  VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+  pDependencies[0].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+  pDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+                                  VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+  pDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+                                   VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                   VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+  // copies out of the color attachment wait for the pass to finish writing it
+  pDependencies[1].srcSubpass = 0;
+  pDependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+  pDependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  pDependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  pDependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+  pDependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+  renderPassInfo.dependencyCount = finalLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL ? 2 : 1;
+  renderPassInfo.pDependencies = pDependencies;
+
+  VkResult res = vkCreateRenderPass(device, &renderPassInfo, NULL, pRenderPass);
+  if (res != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Could not create render pass, error: %s",
+                   vkstrerror(res));
+    PANIC();
+  }
+  return (ERR_OK);
+};
+
+void delete_RenderPass(VkRenderPass *pRenderPass, const VkDevice device) {
+  vkDestroyRenderPass(device, *pRenderPass, NULL);
+  *pRenderPass = VK_NULL_HANDLE;
+}
+
+/* Pipelines are compiled through one VkPipelineCache that is loaded from disk
+ * at startup and written back at shutdown. The driver rejects foreign data on
+ * its own, but we check the header first so a cache from another GPU or
+ * driver is dropped with a clear message instead of silently ignored. */
+#define PIPELINE_CACHE_PATH "pipeline_cache.bin"
+// headerSize, headerVersion, vendorID, deviceID, pipelineCacheUUID
+#define PIPELINE_CACHE_HEADER_SIZE (4 * sizeof(uint32_t) + VK_UUID_SIZE)
+
+typedef struct {
+  VkPipelineCache cache;
+  VkDevice device;
+  const char *pPath;
+  bool warm;
+  size_t loadedSize;
+  double loadMs;
+  // the driver reports hits through VK_EXT_pipeline_creation_feedback, without
+  // it every creation counts as a miss
+  bool feedback;
+  // pipelines may be created from several threads at once
+  std::mutex statsMutex;
+  uint32_t hitCount;
+  uint32_t missCount;
+  double hitMs;
+  double missMs;
+} PipelineCache;
+
+/* Brackets one pipeline creation so the cache can tell hits from misses */
+typedef struct {
+  double startMs;
+  VkPipelineCreationFeedbackEXT creationFeedback;
+  VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo;
+} PipelineCacheTimer;
+
+static bool validatePipelineCacheHeader(const uint8_t *pData, const size_t size,
+const VkPhysicalDeviceProperties *pProperties) {
+  if (size < PIPELINE_CACHE_HEADER_SIZE) {
+    return (false);
+  }
+  uint32_t pHeader[4];
+  memcpy(pHeader, pData, sizeof(pHeader));
+  return (pHeader[0] >= PIPELINE_CACHE_HEADER_SIZE && pHeader[0] <= size &&
+          pHeader[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE && pHeader[2] == pProperties->vendorID &&
+          pHeader[3] == pProperties->deviceID &&
+          memcmp(pData + sizeof(pHeader), pProperties->pipelineCacheUUID, VK_UUID_SIZE) == 0);
+}
+
+/* With feedback VK_EXT_pipeline_creation_feedback must be enabled on device */
+ErrVal new_PipelineCache(PipelineCache *pCache, const char *pPath, const VkPhysicalDevice physicalDevice,
+const bool feedback, const VkDevice device) {
+  double startMs = getTimeMs();
+  pCache->device = device;
+  pCache->pPath = pPath;
+  pCache->warm = false;
+  pCache->loadedSize = 0;
+  pCache->feedback = feedback;
+  pCache->hitCount = 0;
+  pCache->missCount = 0;
+  pCache->hitMs = 0;
+  pCache->missMs = 0;
+
+  uint8_t *pData = NULL;
+  size_t dataSize = 0;
+  FILE *fp = fopen(pPath, "rb");
+  if (fp) {
+    dataSize = (size_t)getLength(fp);
+    pData = (uint8_t *)malloc(dataSize > 0 ? dataSize : 1);
+    if (!pData) {
+      LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "could not read pipeline cache: %s", strerror(errno));
+      fclose(fp);
+      PANIC();
+    }
+    if (fread(pData, 1, dataSize, fp) != dataSize) {
+      dataSize = 0;
+    }
+    fclose(fp);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    if (!validatePipelineCacheHeader(pData, dataSize, &properties)) {
+      LOG_ERROR_ARGS(ERR_LEVEL_WARN, "pipeline cache %s was made for another device or driver, starting cold",
+                     pPath);
+      dataSize = 0;
+    }
+  }
+
+  VkPipelineCacheCreateInfo createInfo {};
+  createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  createInfo.initialDataSize = dataSize;
+  createInfo.pInitialData = dataSize > 0 ? pData : NULL;
+  VkResult ret = vkCreatePipelineCache(device, &createInfo, NULL, &pCache->cache);
+  free(pData);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create pipeline cache: %s", vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  pCache->warm = dataSize > 0;
+  pCache->loadedSize = dataSize;
+  pCache->loadMs = getTimeMs() - startMs;
+  return (ERR_OK);
+}
+
+/* Returns the pNext chain for the pipeline's create info: pNext with the
+ * creation feedback in front of it when the driver reports it. The timer must
+ * outlive the creation */
+const void *startPipelineCacheTimer(PipelineCacheTimer *pTimer, const PipelineCache *pCache, const void *pNext) {
+  pTimer->creationFeedback = {};
+  pTimer->feedbackInfo = {};
+  pTimer->startMs = getTimeMs();
+  if (!pCache || !pCache->feedback) {
+    return (pNext);
+  }
+  pTimer->feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+  pTimer->feedbackInfo.pNext = pNext;
+  pTimer->feedbackInfo.pPipelineCreationFeedback = &pTimer->creationFeedback;
+  return (&pTimer->feedbackInfo);
+}
+
+/* Each pipeline's own feedback says whether the cache served it, whatever
+ * other threads add to the cache meanwhile */
+void stopPipelineCacheTimer(const PipelineCacheTimer *pTimer, PipelineCache *pCache, const char *pName) {
+  double elapsedMs = getTimeMs() - pTimer->startMs;
+  if (!pCache) {
+    return;
+  }
+  VkPipelineCreationFeedbackFlagsEXT flags = pTimer->creationFeedback.flags;
+  bool hit = (flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) &&
+             (flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT);
+  std::lock_guard<std::mutex> lock(pCache->statsMutex);
+  if (hit) {
+    pCache->hitCount++;
+    pCache->hitMs += elapsedMs;
+  } else {
+    pCache->missCount++;
+    pCache->missMs += elapsedMs;
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_DEBUG, "pipeline %s: cache %s, %.3f ms", pName, hit ? "hit" : "miss", elapsedMs);
+}
+
+void logPipelineCacheStats(const PipelineCache *pCache) {
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO,
+                 "pipeline cache (%s): loaded %zu bytes in %.3f ms, %u hits in %.3f ms, %u misses in %.3f ms%s",
+                 pCache->warm ? "warm" : "cold", pCache->loadedSize, pCache->loadMs, pCache->hitCount,
+                 pCache->hitMs, pCache->missCount, pCache->missMs,
+                 pCache->feedback ? "" : " (no creation feedback, hits are not reported)");
+}
+
+/* Writes the cache to a temporary file and renames it over the old one, so a
+ * crash mid write never leaves a truncated cache behind */
+ErrVal savePipelineCache(const PipelineCache *pCache) {
+  double startMs = getTimeMs();
+  size_t dataSize = 0;
+  VkResult sizeRet = vkGetPipelineCacheData(pCache->device, pCache->cache, &dataSize, NULL);
+  if (sizeRet != VK_SUCCESS || dataSize == 0) {
+    LOG_ERROR(ERR_LEVEL_WARN, "failed to save pipeline cache: no data");
+    return (ERR_UNKNOWN);
+  }
+  void *pData = malloc(dataSize);
+  if (!pData) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to save pipeline cache: %s", strerror(errno));
+    PANIC();
+  }
+  VkResult dataRet = vkGetPipelineCacheData(pCache->device, pCache->cache, &dataSize, pData);
+  if (dataRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to save pipeline cache: %s", vkstrerror(dataRet));
+    free(pData);
+    return (ERR_UNKNOWN);
+  }
+
+  std::string tmpPath = std::string(pCache->pPath) + ".tmp";
+  FILE *fp = fopen(tmpPath.c_str(), "wb");
+  if (!fp) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to save pipeline cache: %s", strerror(errno));
+    free(pData);
+    return (ERR_UNKNOWN);
+  }
+  bool written = fwrite(pData, 1, dataSize, fp) == dataSize && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  written = (fclose(fp) == 0) && written;
+  free(pData);
+  if (!written || rename(tmpPath.c_str(), pCache->pPath) != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to save pipeline cache: %s", strerror(errno));
+    remove(tmpPath.c_str());
+    return (ERR_UNKNOWN);
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "saved %zu byte pipeline cache in %.3f ms", dataSize, getTimeMs() - startMs);
+  return (ERR_OK);
+}
+
+void delete_PipelineCache(PipelineCache *pCache) {
+  vkDestroyPipelineCache(pCache->device, pCache->cache, NULL);
+  pCache->cache = VK_NULL_HANDLE;
+}
+
+/* Every input the vertex shader reads has to be fed by an attribute of its
+ * format, otherwise the pipeline would read garbage */
+static ErrVal checkVertexInputs(const ShaderReflection *pReflection,
+const VkVertexInputAttributeDescription *pAttributes, const uint32_t attributeCount) {
+  for (uint32_t i = 0; i < pReflection->inputCount; i++) {
+    const ReflectedInput *pInput = &pReflection->pInputs[i];
+    uint32_t j = 0;
+    while (j < attributeCount && pAttributes[j].location != pInput->location) {
+      j++;
+    }
+    if (j == attributeCount || pAttributes[j].format != pInput->format) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "vertex shader input at location %u does not match the vertex layout",
+                     pInput->location);
+      return (ERR_BADARGS);
+    }
+  }
+  return (ERR_OK);
+}
+
+/* Permutations of the vertex display pipeline. Each feature is a
+ * specialization constant of the scene shaders whose constant_id is its index
+ * here, so the shaders' branches on it are folded when the pipeline is
+ * compiled rather than taken per vertex or fragment. Keep in step with
+ * assets/shaders/shader.vert and shader.frag */
+typedef enum {
+  PIPELINE_FEATURE_VERTEX_COLORS,
+  PIPELINE_FEATURE_INSTANCED,
+  PIPELINE_FEATURE_LIGHT_COUNT,
+  PIPELINE_FEATURE_COUNT
+} PipelineFeature;
+
+#define MAX_SCENE_LIGHTS 4
+// every combination of the features
+#define PIPELINE_VARIANT_COUNT (2 * 2 * (MAX_SCENE_LIGHTS + 1))
+
+// the specialization data itself, every constant is a VkBool32 or a uint32_t
+typedef struct {
+  uint32_t pValues[PIPELINE_FEATURE_COUNT];
+} PipelineKey;
+
+constexpr PipelineKey makePipelineKey(const bool vertexColors, const bool instanced, const uint32_t lightCount) {
+  return (PipelineKey {{vertexColors, instanced, lightCount}});
+}
+
+/* For keys known at compile time, which are checked at compile time too */
+template <bool VertexColors, bool Instanced, uint32_t LightCount> constexpr PipelineKey pipelineKey() {
+  static_assert(LightCount <= MAX_SCENE_LIGHTS, "the scene shaders have at most MAX_SCENE_LIGHTS lights");
+  return (makePipelineKey(VertexColors, Instanced, LightCount));
+}
+
+// FNV-1a over the specialization data
+constexpr uint64_t hashPipelineKey(const PipelineKey &key) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (uint32_t i = 0; i < PIPELINE_FEATURE_COUNT; i++) {
+    for (uint32_t byte = 0; byte < sizeof(uint32_t); byte++) {
+      hash = (hash ^ ((key.pValues[i] >> (byte * 8)) & 0xFF)) * 0x100000001b3ull;
+    }
+  }
+  return (hash);
+}
+
+constexpr bool equalPipelineKeys(const PipelineKey &a, const PipelineKey &b) {
+  for (uint32_t i = 0; i < PIPELINE_FEATURE_COUNT; i++) {
+    if (a.pValues[i] != b.pValues[i]) {
+      return (false);
+    }
+  }
+  return (true);
+}
+
+// what the scene shaders do without specialization
+static constexpr PipelineKey DEFAULT_PIPELINE_KEY = pipelineKey<true, true, 0>();
+
+/* The n'th of the PIPELINE_VARIANT_COUNT combinations */
+static PipelineKey getPipelineVariantKey(const uint32_t n) {
+  return (makePipelineKey(n & 1, (n >> 1) & 1, (n >> 2) % (MAX_SCENE_LIGHTS + 1)));
+}
+
+typedef struct {
+  VkSpecializationMapEntry pEntries[PIPELINE_FEATURE_COUNT];
+  VkSpecializationInfo info;
+} PipelineSpecialization;
+
+/* pKey is the data, so it has to outlive the pipeline's creation */
+static void getPipelineSpecialization(PipelineSpecialization *pSpecialization, const PipelineKey *pKey) {
+  for (uint32_t i = 0; i < PIPELINE_FEATURE_COUNT; i++) {
+    pSpecialization->pEntries[i].constantID = i;
+    pSpecialization->pEntries[i].offset = i * sizeof(uint32_t);
+    pSpecialization->pEntries[i].size = sizeof(uint32_t);
+  }
+  pSpecialization->info.mapEntryCount = PIPELINE_FEATURE_COUNT;
+  pSpecialization->info.pMapEntries = pSpecialization->pEntries;
+  pSpecialization->info.dataSize = sizeof(pKey->pValues);
+  pSpecialization->info.pData = pKey->pValues;
+}
+
+/* Everything that describes the vertex display pipeline. It points into
+ * itself, so it is filled in place and never copied */
+typedef struct {
+  PipelineSpecialization specialization;
+  VkPipelineShaderStageCreateInfo shaderStages[2];
+  VkVertexInputBindingDescription bindingDescriptions[2];
+  VkVertexInputAttributeDescription attributeDescriptions[7];
+  VkPipelineVertexInputStateCreateInfo vertexInputInfo;
+  VkPipelineInputAssemblyStateCreateInfo inputAssembly;
+  VkDynamicState dynamicStates[2];
+  VkPipelineDynamicStateCreateInfo dynamicState;
+  VkPipelineDepthStencilStateCreateInfo depthStencil;
+  VkPipelineViewportStateCreateInfo viewportState;
+  VkPipelineRasterizationStateCreateInfo rasterizer;
+  VkPipelineMultisampleStateCreateInfo multisampling;
+  VkPipelineColorBlendAttachmentState colorBlendAttachment;
+  VkPipelineColorBlendStateCreateInfo colorBlending;
+  VkGraphicsPipelineCreateInfo pipelineInfo;
+} VertexDisplayPipelineInfo;
+
+/* pVertexReflection is NULL to skip checking the vertex inputs. Both stages
+ * get every feature of pKey, a stage ignores the constants it doesn't declare */
+static ErrVal getVertexDisplayPipelineInfo(VertexDisplayPipelineInfo *pInfo, const VkShaderModule vertShaderModule,
+const VkShaderModule fragShaderModule, const ShaderReflection *pVertexReflection, const PipelineKey *pKey,
+const VkRenderPass renderPass, const VkPipelineLayout pipelineLayout) {
+  getPipelineSpecialization(&pInfo->specialization, pKey);
+
+  VkPipelineShaderStageCreateInfo vertShaderStageInfo {};
+  vertShaderStageInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+  vertShaderStageInfo.module = vertShaderModule;
+  vertShaderStageInfo.pName = "main";
+  vertShaderStageInfo.pSpecializationInfo = &pInfo->specialization.info;
+
+  VkPipelineShaderStageCreateInfo fragShaderStageInfo {};
+  fragShaderStageInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  fragShaderStageInfo.module = fragShaderModule;
+  fragShaderStageInfo.pName = "main";
+  fragShaderStageInfo.pSpecializationInfo = &pInfo->specialization.info;
+
+  pInfo->shaderStages[0] = vertShaderStageInfo;
+  pInfo->shaderStages[1] = fragShaderStageInfo;
+
+  memset(pInfo->bindingDescriptions, 0, sizeof(pInfo->bindingDescriptions));
+  pInfo->bindingDescriptions[0].binding = 0;
+  pInfo->bindingDescriptions[0].stride = sizeof(Vertex);
+  pInfo->bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+  pInfo->bindingDescriptions[1].binding = 1;
+  pInfo->bindingDescriptions[1].stride = sizeof(InstanceData);
+  pInfo->bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+  pInfo->attributeDescriptions[0].binding = 0;
+  pInfo->attributeDescriptions[0].location = 0;
+  pInfo->attributeDescriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
+  pInfo->attributeDescriptions[0].offset = offsetof(Vertex, position);
+
+  pInfo->attributeDescriptions[1].binding = 0;
+  pInfo->attributeDescriptions[1].location = 1;
+  pInfo->attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+  pInfo->attributeDescriptions[1].offset = offsetof(Vertex, color);
+
+  // a mat4 attribute takes one location per column
+  for (uint32_t i = 0; i < 4; i++) {
+    pInfo->attributeDescriptions[2 + i].binding = 1;
+    pInfo->attributeDescriptions[2 + i].location = 2 + i;
+    pInfo->attributeDescriptions[2 + i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    pInfo->attributeDescriptions[2 + i].offset = offsetof(InstanceData, transform) + i * sizeof(vec4);
+  }
+
+  pInfo->attributeDescriptions[6].binding = 1;
+  pInfo->attributeDescriptions[6].location = 6;
+  pInfo->attributeDescriptions[6].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+  pInfo->attributeDescriptions[6].offset = offsetof(InstanceData, color);
+
+  if (pVertexReflection && checkVertexInputs(pVertexReflection, pInfo->attributeDescriptions, 7) != ERR_OK) {
+    return (ERR_BADARGS);
+  }
+
+  pInfo->vertexInputInfo = (VkPipelineVertexInputStateCreateInfo){};
+  pInfo->vertexInputInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  pInfo->vertexInputInfo.vertexBindingDescriptionCount = 2;
+  pInfo->vertexInputInfo.pVertexBindingDescriptions = pInfo->bindingDescriptions;
+  pInfo->vertexInputInfo.vertexAttributeDescriptionCount = 7;
+  pInfo->vertexInputInfo.pVertexAttributeDescriptions = pInfo->attributeDescriptions;
+
+  pInfo->inputAssembly = (VkPipelineInputAssemblyStateCreateInfo){};
+  pInfo->inputAssembly.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  pInfo->inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  pInfo->inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+  /* Viewport and scissor are set while recording, so a resize never has to
+   * rebuild the pipeline */
+  pInfo->dynamicStates[0] = VK_DYNAMIC_STATE_VIEWPORT;
+  pInfo->dynamicStates[1] = VK_DYNAMIC_STATE_SCISSOR;
+  pInfo->dynamicState = (VkPipelineDynamicStateCreateInfo){};
+  pInfo->dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  pInfo->dynamicState.dynamicStateCount = 2;
+  pInfo->dynamicState.pDynamicStates = pInfo->dynamicStates;
+
+  pInfo->depthStencil = (VkPipelineDepthStencilStateCreateInfo){};
+  pInfo->depthStencil.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  pInfo->depthStencil.depthTestEnable = VK_TRUE;
+  pInfo->depthStencil.depthWriteEnable = VK_TRUE;
+  pInfo->depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+  pInfo->depthStencil.depthBoundsTestEnable = VK_FALSE;
+  pInfo->depthStencil.stencilTestEnable = VK_FALSE;
+
+  pInfo->viewportState = (VkPipelineViewportStateCreateInfo){};
+  pInfo->viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  pInfo->viewportState.viewportCount = 1;
+  pInfo->viewportState.pViewports = NULL;
+  pInfo->viewportState.scissorCount = 1;
+  pInfo->viewportState.pScissors = NULL;
+
+  pInfo->rasterizer = (VkPipelineRasterizationStateCreateInfo){};
+  pInfo->rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  pInfo->rasterizer.depthClampEnable = VK_FALSE;
+  pInfo->rasterizer.rasterizerDiscardEnable = VK_FALSE;
+  pInfo->rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+  pInfo->rasterizer.lineWidth = 1.0f;
+  pInfo->rasterizer.cullMode = VK_CULL_MODE_NONE; /* VK_CULL_MODE_BACK_BIT; */
+  pInfo->rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  pInfo->rasterizer.depthBiasEnable = VK_FALSE;
+
+  pInfo->multisampling = (VkPipelineMultisampleStateCreateInfo){};
+  pInfo->multisampling.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  pInfo->multisampling.sampleShadingEnable = VK_FALSE;
+  pInfo->multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  pInfo->colorBlendAttachment = (VkPipelineColorBlendAttachmentState){};
+  pInfo->colorBlendAttachment.colorWriteMask =
+      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  pInfo->colorBlendAttachment.blendEnable = VK_FALSE;
+
+  pInfo->colorBlending = (VkPipelineColorBlendStateCreateInfo){};
+  pInfo->colorBlending.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  pInfo->colorBlending.logicOpEnable = VK_FALSE;
+  pInfo->colorBlending.logicOp = VK_LOGIC_OP_COPY;
+  pInfo->colorBlending.attachmentCount = 1;
+  pInfo->colorBlending.pAttachments = &pInfo->colorBlendAttachment;
+  pInfo->colorBlending.blendConstants[0] = 0.0f;
+  pInfo->colorBlending.blendConstants[1] = 0.0f;
+  pInfo->colorBlending.blendConstants[2] = 0.0f;
+  pInfo->colorBlending.blendConstants[3] = 0.0f;
+
+  pInfo->pipelineInfo = (VkGraphicsPipelineCreateInfo){};
+  pInfo->pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pInfo->pipelineInfo.stageCount = 2;
+  pInfo->pipelineInfo.pStages = pInfo->shaderStages;
+  pInfo->pipelineInfo.pVertexInputState = &pInfo->vertexInputInfo;
+  pInfo->pipelineInfo.pInputAssemblyState = &pInfo->inputAssembly;
+  pInfo->pipelineInfo.pViewportState = &pInfo->viewportState;
+  pInfo->pipelineInfo.pRasterizationState = &pInfo->rasterizer;
+  pInfo->pipelineInfo.pMultisampleState = &pInfo->multisampling;
+  pInfo->pipelineInfo.pColorBlendState = &pInfo->colorBlending;
+  pInfo->pipelineInfo.pDepthStencilState = &pInfo->depthStencil;
+  pInfo->pipelineInfo.pDynamicState = &pInfo->dynamicState;
+  pInfo->pipelineInfo.layout = pipelineLayout;
+  pInfo->pipelineInfo.renderPass = renderPass;
+  pInfo->pipelineInfo.subpass = 0;
+  pInfo->pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+
+  return (ERR_OK);
+}
+
+/* pVertexReflection is NULL to skip checking the vertex inputs */
+ErrVal new_VertexDisplayPipeline(VkPipeline *pGraphicsPipeline, const VkDevice device,
+const VkShaderModule vertShaderModule, const VkShaderModule fragShaderModule,
+const ShaderReflection *pVertexReflection, const PipelineKey *pKey, const VkRenderPass renderPass,
+const VkPipelineLayout pipelineLayout, PipelineCache *pPipelineCache) {
+  VertexDisplayPipelineInfo info;
+  ErrVal retVal = getVertexDisplayPipelineInfo(&info, vertShaderModule, fragShaderModule, pVertexReflection, pKey,
+                                               renderPass, pipelineLayout);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+
+  PipelineCacheTimer timer;
+  info.pipelineInfo.pNext = startPipelineCacheTimer(&timer, pPipelineCache, info.pipelineInfo.pNext);
+  if (vkCreateGraphicsPipelines(device, pPipelineCache ? pPipelineCache->cache : VK_NULL_HANDLE, 1, &info.pipelineInfo,
+                                NULL, pGraphicsPipeline) != VK_SUCCESS) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create graphics pipeline!");
+    return (ERR_UNKNOWN);
+  }
+  stopPipelineCacheTimer(&timer, pPipelineCache, "vertex display");
+  return (ERR_OK);
+}
+
+/* One part of the vertex display pipeline as a graphics pipeline library
+ * (VK_EXT_graphics_pipeline_library). part is a single
+ * VkGraphicsPipelineLibraryFlagBitsEXT; the state the part doesn't cover is
+ * ignored. Link time optimization info is kept, so the parts can be linked
+ * into an optimized pipeline later */
+static ErrVal new_VertexDisplayPipelineLibrary(VkPipeline *pLibrary, const VkDevice device,
+const VkGraphicsPipelineLibraryFlagsEXT part, const VkShaderModule vertShaderModule,
+const VkShaderModule fragShaderModule, const ShaderReflection *pVertexReflection, const PipelineKey *pKey,
+const VkRenderPass renderPass, const VkPipelineLayout pipelineLayout, PipelineCache *pPipelineCache) {
+  VertexDisplayPipelineInfo info;
+  ErrVal retVal = getVertexDisplayPipelineInfo(&info, vertShaderModule, fragShaderModule, pVertexReflection, pKey,
+                                               renderPass, pipelineLayout);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+
+  VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo {};
+  libraryInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+  libraryInfo.flags = part;
+  info.pipelineInfo.pNext = &libraryInfo;
+  info.pipelineInfo.flags =
+      VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+  // only the shader parts have a stage, each its own
+  if (part == VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT) {
+    info.pipelineInfo.stageCount = 1;
+    info.pipelineInfo.pStages = &info.shaderStages[0];
+  } else if (part == VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT) {
+    info.pipelineInfo.stageCount = 1;
+    info.pipelineInfo.pStages = &info.shaderStages[1];
+  } else {
+    info.pipelineInfo.stageCount = 0;
+    info.pipelineInfo.pStages = NULL;
+  }
+
+  PipelineCacheTimer timer;
+  info.pipelineInfo.pNext = startPipelineCacheTimer(&timer, pPipelineCache, info.pipelineInfo.pNext);
+  VkResult ret = vkCreateGraphicsPipelines(device, pPipelineCache ? pPipelineCache->cache : VK_NULL_HANDLE, 1,
+                                           &info.pipelineInfo, NULL, pLibrary);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create pipeline library: %s", vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  stopPipelineCacheTimer(&timer, pPipelineCache, "pipeline library");
+  return (ERR_OK);
+}
+
+/* Links libraryCount pipeline libraries, which together cover every part, into
+ * a pipeline. Without optimize this is the fast link, which only stitches the
+ * compiled parts together; with it the driver optimizes across them, which
+ * takes about as long as building the pipeline outright */
+static ErrVal new_LinkedPipeline(VkPipeline *pPipeline, const VkDevice device, const VkPipeline *pLibraries,
+const uint32_t libraryCount, const VkPipelineLayout pipelineLayout, const bool optimize,
+PipelineCache *pPipelineCache) {
+  VkPipelineLibraryCreateInfoKHR libraryInfo {};
+  libraryInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+  libraryInfo.libraryCount = libraryCount;
+  libraryInfo.pLibraries = pLibraries;
+
+  VkGraphicsPipelineCreateInfo pipelineInfo {};
+  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineInfo.pNext = &libraryInfo;
+  pipelineInfo.flags = optimize ? VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0;
+  pipelineInfo.layout = pipelineLayout;
+  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+
+  PipelineCacheTimer timer;
+  pipelineInfo.pNext = startPipelineCacheTimer(&timer, pPipelineCache, pipelineInfo.pNext);
+  VkResult ret = vkCreateGraphicsPipelines(device, pPipelineCache ? pPipelineCache->cache : VK_NULL_HANDLE, 1,
+                                           &pipelineInfo, NULL, pPipeline);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to link pipeline libraries: %s", vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  stopPipelineCacheTimer(&timer, pPipelineCache, optimize ? "optimized link" : "fast link");
+  return (ERR_OK);
+}
+
+void delete_Pipeline(VkPipeline *pPipeline, const VkDevice device) {vkDestroyPipeline(device, *pPipeline, NULL);}
+
+/* Every variant of the vertex display pipeline built so far, by key. Variants
+ * are built on demand by getPipelineVariant, or ahead of time by a
+ * PipelineBuilder, all through the shared pipeline cache. The
+ * set owns the shader modules and the pipelines. Safe to use from several
+ * threads.
+ *
+ * Where the device has graphics pipeline libraries, each variant is first a
+ * fast link of four separately compiled parts: the vertex input and fragment
+ * output interfaces, shared by every variant, and the vertex and fragment
+ * shader parts, shared by the variants whose constants for that stage match.
+ * A new variant then usually costs a link rather than a compile.
+ * optimizePipelineVariant replaces the fast link with an optimized one */
+typedef struct {
+  PipelineKey key;
+  uint64_t hash;
+  VkPipeline pipeline;
+  // false while pipeline is a fast link
+  bool optimized;
+} PipelineVariant;
+
+typedef struct {
+  VkGraphicsPipelineLibraryFlagsEXT part;
+  // only the features the part's stage reads
+  PipelineKey key;
+  uint64_t hash;
+  VkPipeline library;
+} PipelineLibrary;
+
+typedef struct {
+  VkDevice device;
+  VkShaderModule vertShaderModule;
+  VkShaderModule fragShaderModule;
+  ShaderReflection vertexReflection;
+  VkRenderPass renderPass;
+  VkPipelineLayout pipelineLayout;
+  PipelineCache *pPipelineCache;
+  std::mutex mutex;
+  std::vector<PipelineVariant> variants;
+  bool useLibraries;
+  VkPipeline vertexInputLibrary;
+  VkPipeline fragmentOutputLibrary;
+  // the shader parts
+  std::vector<PipelineLibrary> libraries;
+  // fast links an optimized link replaced, frames in flight may still draw
+  // with them. Only the frame loop knows when it stops recording with one,
+  // so retireReplacedPipelineVariants retires them to pDeletions
+  std::vector<VkPipeline> replaced;
+  DeletionQueue *pDeletions;
+  // bumped whenever a variant's pipeline is replaced
+  std::atomic<uint32_t> generation;
+} PipelineVariants;
+
+/* Takes ownership of the shader modules. useLibraries needs
+ * VK_EXT_graphics_pipeline_library enabled on the device; if the key
+ * independent parts can't be built the set falls back to whole pipelines */
+ErrVal new_PipelineVariants(PipelineVariants *pVariants, const VkShaderModule vertShaderModule,
+const VkShaderModule fragShaderModule, const ShaderReflection *pVertexReflection, const VkRenderPass renderPass,
+const VkPipelineLayout pipelineLayout, PipelineCache *pPipelineCache, const bool useLibraries,
+DeletionQueue *pDeletions, const VkDevice device) {
+  pVariants->device = device;
+  pVariants->vertShaderModule = vertShaderModule;
+  pVariants->fragShaderModule = fragShaderModule;
+  pVariants->vertexReflection = *pVertexReflection;
+  pVariants->renderPass = renderPass;
+  pVariants->pipelineLayout = pipelineLayout;
+  pVariants->pPipelineCache = pPipelineCache;
+  pVariants->variants.clear();
+  pVariants->useLibraries = false;
+  pVariants->vertexInputLibrary = VK_NULL_HANDLE;
+  pVariants->fragmentOutputLibrary = VK_NULL_HANDLE;
+  pVariants->libraries.clear();
+  pVariants->replaced.clear();
+  pVariants->pDeletions = pDeletions;
+  pVariants->generation = 0;
+  if (!useLibraries) {
+    return (ERR_OK);
+  }
+
+  if (new_VertexDisplayPipelineLibrary(&pVariants->vertexInputLibrary, device,
+                                       VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT, vertShaderModule,
+                                       fragShaderModule, pVertexReflection, &DEFAULT_PIPELINE_KEY, renderPass,
+                                       pipelineLayout, pPipelineCache) != ERR_OK) {
+    pVariants->vertexInputLibrary = VK_NULL_HANDLE;
+  } else if (new_VertexDisplayPipelineLibrary(&pVariants->fragmentOutputLibrary, device,
+                                              VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT,
+                                              vertShaderModule, fragShaderModule, pVertexReflection,
+                                              &DEFAULT_PIPELINE_KEY, renderPass, pipelineLayout,
+                                              pPipelineCache) != ERR_OK) {
+    delete_Pipeline(&pVariants->vertexInputLibrary, device);
+    pVariants->vertexInputLibrary = VK_NULL_HANDLE;
+    pVariants->fragmentOutputLibrary = VK_NULL_HANDLE;
+  } else {
+    pVariants->useLibraries = true;
+  }
+  if (!pVariants->useLibraries) {
+    LOG_ERROR(ERR_LEVEL_WARN, "could not build the pipeline interface libraries, building whole pipelines");
+  }
+  return (ERR_OK);
+}
+
+/* The device must be idle */
+void delete_PipelineVariants(PipelineVariants *pVariants) {
+  for (size_t i = 0; i < pVariants->variants.size(); i++) {
+    delete_Pipeline(&pVariants->variants[i].pipeline, pVariants->device);
+  }
+  pVariants->variants.clear();
+  for (size_t i = 0; i < pVariants->libraries.size(); i++) {
+    delete_Pipeline(&pVariants->libraries[i].library, pVariants->device);
+  }
+  pVariants->libraries.clear();
+  for (size_t i = 0; i < pVariants->replaced.size(); i++) {
+    delete_Pipeline(&pVariants->replaced[i], pVariants->device);
+  }
+  pVariants->replaced.clear();
+  if (pVariants->useLibraries) {
+    delete_Pipeline(&pVariants->vertexInputLibrary, pVariants->device);
+    delete_Pipeline(&pVariants->fragmentOutputLibrary, pVariants->device);
+  }
+  delete_ShaderModule(&pVariants->vertShaderModule, pVariants->device);
+  delete_ShaderModule(&pVariants->fragShaderModule, pVariants->device);
+}
+
+/* The mutex must be held. NULL if there is no variant for pKey yet */
+static PipelineVariant *findPipelineVariant(PipelineVariants *pVariants, const PipelineKey *pKey,
+const uint64_t hash) {
+  for (size_t i = 0; i < pVariants->variants.size(); i++) {
+    if (pVariants->variants[i].hash == hash && equalPipelineKeys(pVariants->variants[i].key, *pKey)) {
+      return (&pVariants->variants[i]);
+    }
+  }
+  return (NULL);
+}
+
+/* shader.vert reads the vertex colors and instancing constants, shader.frag
+ * the light count, so a shader part only has to differ by those */
+static PipelineKey getPipelineLibraryKey(const PipelineKey *pKey, const VkGraphicsPipelineLibraryFlagsEXT part) {
+  PipelineKey key = *pKey;
+  if (part == VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT) {
+    key.pValues[PIPELINE_FEATURE_LIGHT_COUNT] = 0;
+  } else {
+    key.pValues[PIPELINE_FEATURE_VERTEX_COLORS] = VK_FALSE;
+    key.pValues[PIPELINE_FEATURE_INSTANCED] = VK_FALSE;
+  }
+  return (key);
+}
+
+/* The mutex must be held */
+static VkPipeline findPipelineLibrary(const PipelineVariants *pVariants,
+const VkGraphicsPipelineLibraryFlagsEXT part, const PipelineKey *pKey, const uint64_t hash) {
+  for (size_t i = 0; i < pVariants->libraries.size(); i++) {
+    const PipelineLibrary *pLibrary = &pVariants->libraries[i];
+    if (pLibrary->part == part && pLibrary->hash == hash && equalPipelineKeys(pLibrary->key, *pKey)) {
+      return (pLibrary->library);
+    }
+  }
+  return (VK_NULL_HANDLE);
+}
+
+/* The shader part for pKey, built now if it hasn't been. Like the variants,
+ * racing builds of the same part keep the first */
+static ErrVal getPipelineLibrary(VkPipeline *pLibrary, PipelineVariants *pVariants,
+const VkGraphicsPipelineLibraryFlagsEXT part, const PipelineKey *pVariantKey) {
+  PipelineKey key = getPipelineLibraryKey(pVariantKey, part);
+  uint64_t hash = hashPipelineKey(key);
+  {
+    std::lock_guard<std::mutex> lock(pVariants->mutex);
+    *pLibrary = findPipelineLibrary(pVariants, part, &key, hash);
+    if (*pLibrary != VK_NULL_HANDLE) {
+      return (ERR_OK);
+    }
+  }
+
+  VkPipeline library;
+  ErrVal retVal = new_VertexDisplayPipelineLibrary(&library, pVariants->device, part, pVariants->vertShaderModule,
+                                                   pVariants->fragShaderModule, NULL, &key, pVariants->renderPass,
+                                                   pVariants->pipelineLayout, pVariants->pPipelineCache);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  std::lock_guard<std::mutex> lock(pVariants->mutex);
+  *pLibrary = findPipelineLibrary(pVariants, part, &key, hash);
+  if (*pLibrary != VK_NULL_HANDLE) {
+    delete_Pipeline(&library, pVariants->device);
+    return (ERR_OK);
+  }
+  pVariants->libraries.push_back((PipelineLibrary){.part = part, .key = key, .hash = hash, .library = library});
+  *pLibrary = library;
+  return (ERR_OK);
+}
+
+/* All four parts of the variant for pKey, in pipeline order */
+static ErrVal getPipelineLibraries(VkPipeline *pLibraries, PipelineVariants *pVariants, const PipelineKey *pKey) {
+  pLibraries[0] = pVariants->vertexInputLibrary;
+  pLibraries[3] = pVariants->fragmentOutputLibrary;
+  ErrVal retVal = getPipelineLibrary(&pLibraries[1], pVariants,
+                                     VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT, pKey);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  return (getPipelineLibrary(&pLibraries[2], pVariants, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+                             pKey));
+}
+
+/* The variant for pKey, built now if it hasn't been. The lock isn't held while
+ * building, so two threads asking for the same new variant both build it and
+ * the loser's copy is thrown away */
+ErrVal getPipelineVariant(VkPipeline *pPipeline, PipelineVariants *pVariants, const PipelineKey *pKey) {
+  uint64_t hash = hashPipelineKey(*pKey);
+  {
+    std::lock_guard<std::mutex> lock(pVariants->mutex);
+    PipelineVariant *pVariant = findPipelineVariant(pVariants, pKey, hash);
+    if (pVariant) {
+      *pPipeline = pVariant->pipeline;
+      return (ERR_OK);
+    }
+  }
+
+  VkPipeline pipeline;
+  ErrVal retVal;
+  if (pVariants->useLibraries) {
+    VkPipeline pLibraries[4];
+    retVal = getPipelineLibraries(pLibraries, pVariants, pKey);
+    if (retVal == ERR_OK) {
+      retVal = new_LinkedPipeline(&pipeline, pVariants->device, pLibraries, 4, pVariants->pipelineLayout, false,
+                                  pVariants->pPipelineCache);
+    }
+  } else {
+    retVal = new_VertexDisplayPipeline(&pipeline, pVariants->device, pVariants->vertShaderModule,
+                                       pVariants->fragShaderModule, &pVariants->vertexReflection, pKey,
+                                       pVariants->renderPass, pVariants->pipelineLayout, pVariants->pPipelineCache);
+  }
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  std::lock_guard<std::mutex> lock(pVariants->mutex);
+  PipelineVariant *pVariant = findPipelineVariant(pVariants, pKey, hash);
+  if (pVariant) {
+    delete_Pipeline(&pipeline, pVariants->device);
+    *pPipeline = pVariant->pipeline;
+    return (ERR_OK);
+  }
+  pVariants->variants.push_back(
+      (PipelineVariant){.key = *pKey, .hash = hash, .pipeline = pipeline, .optimized = !pVariants->useLibraries});
+  *pPipeline = pipeline;
+  return (ERR_OK);
+}
+
+/* Relinks the variant for pKey with link time optimization and swaps it in
+ * for the fast link. Does nothing if the variant doesn't exist or is already
+ * optimized. The fast link is kept until retireReplacedPipelineVariants
+ * retires it, since the frame loop may still record with it */
+ErrVal optimizePipelineVariant(PipelineVariants *pVariants, const PipelineKey *pKey) {
+  uint64_t hash = hashPipelineKey(*pKey);
+  {
+    std::lock_guard<std::mutex> lock(pVariants->mutex);
+    PipelineVariant *pVariant = findPipelineVariant(pVariants, pKey, hash);
+    if (!pVariant || pVariant->optimized) {
+      return (ERR_OK);
+    }
+  }
+
+  VkPipeline pLibraries[4];
+  ErrVal retVal = getPipelineLibraries(pLibraries, pVariants, pKey);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  VkPipeline pipeline;
+  retVal = new_LinkedPipeline(&pipeline, pVariants->device, pLibraries, 4, pVariants->pipelineLayout, true,
+                              pVariants->pPipelineCache);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  std::lock_guard<std::mutex> lock(pVariants->mutex);
+  PipelineVariant *pVariant = findPipelineVariant(pVariants, pKey, hash);
+  if (pVariant->optimized) {
+    delete_Pipeline(&pipeline, pVariants->device);
+    return (ERR_OK);
+  }
+  pVariants->replaced.push_back(pVariant->pipeline);
+  pVariant->pipeline = pipeline;
+  pVariant->optimized = true;
+  pVariants->generation++;
+  return (ERR_OK);
+}
+
+/* Call every frame from the frame loop, after collectDeletionQueue and before
+ * recording, whichever pipeline the frame draws with. Retires the fast links
+ * optimized ones replaced, tagged with the frame about to be recorded; that
+ * frame draws with the replacement once refreshPipelineVariant has run, so
+ * the last frame that used them is no newer than their tag */
+void retireReplacedPipelineVariants(PipelineVariants *pVariants) {
+  std::lock_guard<std::mutex> lock(pVariants->mutex);
+  for (size_t i = 0; i < pVariants->replaced.size(); i++) {
+    retirePipeline(pVariants->pDeletions, &pVariants->replaced[i]);
+  }
+  pVariants->replaced.clear();
+}
+
+/* Call once per frame from the frame loop, before recording, with a
+ * generation count the caller keeps (starting at 0). Points *pPipeline at the
+ * variant for pKey again once any variant was replaced, so an optimized link
+ * is picked up at a frame boundary */
+void refreshPipelineVariant(VkPipeline *pPipeline, uint32_t *pGeneration, PipelineVariants *pVariants,
+const PipelineKey *pKey) {
+  uint32_t generation = pVariants->generation.load();
+  if (generation == *pGeneration) {
+    return;
+  }
+  *pGeneration = generation;
+  std::lock_guard<std::mutex> lock(pVariants->mutex);
+  PipelineVariant *pVariant = findPipelineVariant(pVariants, pKey, hashPipelineKey(*pKey));
+  if (pVariant) {
+    *pPipeline = pVariant->pipeline;
+  }
+}
+
+/* Shader hot reload for the windowed loop. A watcher thread waits on inotify
+ * for the vertex display pipeline's GLSL sources to be written, recompiles
+ * them with glslangValidator and builds a new pipeline from the result, all
+ * off the render thread. The frame loop picks it up at a frame boundary with
+ * a non-blocking exchange, and retires the pipeline it replaced to the
+ * deletion queue. A shader that fails to compile
+ * leaves the running pipeline alone */
+// editors write a file in several steps, wait for them to settle
+#define SHADER_RELOAD_DEBOUNCE_MS 50
+
+static const char *ppShaderReloadSources[] = {"shader.vert", "shader.frag"};
+#define SHADER_RELOAD_SOURCE_COUNT (sizeof(ppShaderReloadSources) / sizeof(ppShaderReloadSources[0]))
+
+typedef struct {
+  VkDevice device;
+  VkRenderPass renderPass;
+  // reloaded shaders have to keep to the running pipeline's layout
+  LayoutCache *pLayouts;
+  VkPipelineLayout pipelineLayout;
+  // the variant the frame loop draws with
+  PipelineKey key;
+  std::string shaderDirectory;
+  int inotifyFd;
+  // written to once to stop the watcher
+  int pStopPipe[2];
+  std::thread watcher;
+  // a rebuilt pipeline the frame loop has not picked up yet
+  std::atomic<VkPipeline> pending;
+  // the last pipeline handed to the frame loop, VK_NULL_HANDLE while it
+  // still draws with the startup one, which the pipeline variants own
+  VkPipeline current;
+  // where the pipelines current replaces go
+  DeletionQueue *pDeletions;
+} ShaderReloader;
+
+extern char **environ;
+
+static ErrVal compileShaderSource(const char *pSourcePath, const char *pSpirvPath) {
+  const char *ppArgs[] = {"glslangValidator", "-V", "-o", pSpirvPath, pSourcePath, NULL};
+  pid_t pid;
+  int ret = posix_spawnp(&pid, ppArgs[0], NULL, NULL, (char *const *)ppArgs, environ);
+  if (ret != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not run glslangValidator: %s", strerror(ret));
+    return (ERR_NOTSUPPORTED);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not wait for glslangValidator: %s", strerror(errno));
+      return (ERR_UNKNOWN);
+    }
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "%s failed to compile, keeping the running shaders", pSourcePath);
+    return (ERR_BADARGS);
+  }
+  return (ERR_OK);
+}
+
+static ErrVal loadShaderModuleFile(VkShaderModule *pShaderModule, ShaderReflection *pReflection,
+const std::string &path, const VkDevice device) {
+  ShaderBlob blob;
+  ErrVal retVal = new_ShaderBlobFromFile(&blob, path.c_str());
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  return (new_ShaderModuleFromBlob(pShaderModule, &blob, pReflection, device));
+}
+
+/* The frame loop keeps binding and pushing through the running layout, so
+ * shaders that declare a different interface can't be swapped in */
+static ErrVal checkReloadedLayout(const ShaderReloader *pReloader, const ShaderReflection *pReflections,
+const uint32_t reflectionCount) {
+  VkPipelineLayout pipelineLayout;
+  ErrVal retVal = getReflectedPipelineLayout(&pipelineLayout, NULL, pReloader->pLayouts, pReflections,
+                                             reflectionCount);
+  if (retVal == ERR_OK && pipelineLayout != pReloader->pipelineLayout) {
+    LOG_ERROR(ERR_LEVEL_WARN, "reloaded shaders changed their descriptors or push constants, restart to pick them up");
+    return (ERR_NOTSUPPORTED);
+  }
+  return (retVal);
+}
+
+/* Recompiles the changed sources, then builds the pipeline from both stages.
+ * Reloaded pipelines skip the pipeline cache, they are throwaway and the
+ * cache's statistics belong to the render thread */
+static void reloadShaderPipeline(ShaderReloader *pReloader, const bool *pChanged) {
+  double startMs = getTimeMs();
+  for (uint32_t i = 0; i < SHADER_RELOAD_SOURCE_COUNT; i++) {
+    std::string sourcePath = pReloader->shaderDirectory + "/" + ppShaderReloadSources[i];
+    if (pChanged[i] && compileShaderSource(sourcePath.c_str(), (sourcePath + ".spv").c_str()) != ERR_OK) {
+      return;
+    }
+  }
+
+  VkShaderModule vertShaderModule = VK_NULL_HANDLE;
+  VkShaderModule fragShaderModule = VK_NULL_HANDLE;
+  VkPipeline pipeline = VK_NULL_HANDLE;
+  // vertex then fragment
+  ShaderReflection pReflections[2];
+  if (loadShaderModuleFile(&vertShaderModule, &pReflections[0], pReloader->shaderDirectory + "/shader.vert.spv",
+                           pReloader->device) == ERR_OK &&
+      loadShaderModuleFile(&fragShaderModule, &pReflections[1], pReloader->shaderDirectory + "/shader.frag.spv",
+                           pReloader->device) == ERR_OK &&
+      checkReloadedLayout(pReloader, pReflections, 2) == ERR_OK &&
+      new_VertexDisplayPipeline(&pipeline, pReloader->device, vertShaderModule, fragShaderModule, &pReflections[0],
+                                &pReloader->key, pReloader->renderPass, pReloader->pipelineLayout, NULL) == ERR_OK) {
+    // one the frame loop never picked up was never used
+    VkPipeline unused = pReloader->pending.exchange(pipeline);
+    if (unused != VK_NULL_HANDLE) {
+      delete_Pipeline(&unused, pReloader->device);
+    }
+    LOG_ERROR_ARGS(ERR_LEVEL_INFO, "reloaded shaders in %.1f ms", getTimeMs() - startMs);
+  }
+  delete_ShaderModule(&vertShaderModule, pReloader->device);
+  delete_ShaderModule(&fragShaderModule, pReloader->device);
+}
+
+static void shaderReloaderMain(ShaderReloader *pReloader) {
+  alignas(struct inotify_event) char pEvents[4096];
+  bool pChanged[SHADER_RELOAD_SOURCE_COUNT] = {};
+  bool anyChanged = false;
+  while (true) {
+    struct pollfd pFds[2] = {{pReloader->inotifyFd, POLLIN, 0}, {pReloader->pStopPipe[0], POLLIN, 0}};
+    int ready = poll(pFds, 2, anyChanged ? SHADER_RELOAD_DEBOUNCE_MS : -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "shader watcher stopped: %s", strerror(errno));
+      return;
+    }
+    if (pFds[1].revents) {
+      return;
+    }
+    // quiet for the debounce interval
+    if (ready == 0) {
+      reloadShaderPipeline(pReloader, pChanged);
+      memset(pChanged, 0, sizeof(pChanged));
+      anyChanged = false;
+      continue;
+    }
+
+    ssize_t length = read(pReloader->inotifyFd, pEvents, sizeof(pEvents));
+    for (ssize_t offset = 0; offset < length;) {
+      const struct inotify_event *pEvent = (const struct inotify_event *)(pEvents + offset);
+      for (uint32_t i = 0; pEvent->len > 0 && i < SHADER_RELOAD_SOURCE_COUNT; i++) {
+        if (strcmp(pEvent->name, ppShaderReloadSources[i]) == 0) {
+          pChanged[i] = true;
+          anyChanged = true;
+        }
+      }
+      offset += sizeof(struct inotify_event) + pEvent->len;
+    }
+  }
+}
+
+ErrVal new_ShaderReloader(ShaderReloader *pReloader, const char *pAssetRoot, const VkRenderPass renderPass,
+LayoutCache *pLayouts, const VkPipelineLayout pipelineLayout, const PipelineKey *pKey, DeletionQueue *pDeletions,
+const VkDevice device) {
+  pReloader->device = device;
+  pReloader->renderPass = renderPass;
+  pReloader->pLayouts = pLayouts;
+  pReloader->pipelineLayout = pipelineLayout;
+  pReloader->key = *pKey;
+  pReloader->shaderDirectory = std::string(pAssetRoot) + "/shaders";
+  pReloader->pending = VK_NULL_HANDLE;
+  pReloader->current = VK_NULL_HANDLE;
+  pReloader->pDeletions = pDeletions;
+
+  pReloader->inotifyFd = inotify_init1(IN_CLOEXEC);
+  if (pReloader->inotifyFd < 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to watch shaders: %s", strerror(errno));
+    return (ERR_NOTSUPPORTED);
+  }
+  // editors that save by renaming a new file over the old one show up as moves
+  if (inotify_add_watch(pReloader->inotifyFd, pReloader->shaderDirectory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to watch %s: %s", pReloader->shaderDirectory.c_str(), strerror(errno));
+    close(pReloader->inotifyFd);
+    return (ERR_BADARGS);
+  }
+  if (pipe(pReloader->pStopPipe) != 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to watch shaders: %s", strerror(errno));
+    close(pReloader->inotifyFd);
+    return (ERR_UNKNOWN);
+  }
+  pReloader->watcher = std::thread(shaderReloaderMain, pReloader);
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "watching %s for shader changes", pReloader->shaderDirectory.c_str());
+  return (ERR_OK);
+}
+
+/* Call once per frame, at a frame boundary. Returns the pipeline to draw
+ * with, which is a freshly reloaded one when there is one */
+VkPipeline swapReloadedPipeline(ShaderReloader *pReloader, const VkPipeline current) {
+  VkPipeline reloaded = pReloader->pending.exchange(VK_NULL_HANDLE);
+  if (reloaded == VK_NULL_HANDLE) {
+    return (current);
+  }
+  if (pReloader->current != VK_NULL_HANDLE) {
+    retirePipeline(pReloader->pDeletions, &pReloader->current);
+  }
+  pReloader->current = reloaded;
+  return (reloaded);
+}
+
+/* The device must be idle, the last reloaded pipeline is destroyed; the ones
+ * before it are left to the deletion queue */
+void delete_ShaderReloader(ShaderReloader *pReloader) {
+  char stop = 1;
+  if (write(pReloader->pStopPipe[1], &stop, 1) != 1) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to stop the shader watcher: %s", strerror(errno));
+  }
+  pReloader->watcher.join();
+  close(pReloader->pStopPipe[0]);
+  close(pReloader->pStopPipe[1]);
+  close(pReloader->inotifyFd);
+  if (pReloader->current != VK_NULL_HANDLE) {
+    delete_Pipeline(&pReloader->current, pReloader->device);
+  }
+  VkPipeline unused = pReloader->pending.exchange(VK_NULL_HANDLE);
+  if (unused != VK_NULL_HANDLE) {
+    delete_Pipeline(&unused, pReloader->device);
+  }
+}
+
+ErrVal new_Framebuffer(VkFramebuffer *pFramebuffer, const VkDevice device, const VkRenderPass renderPass,
+const VkImageView imageView, const VkImageView depthImageView,const VkExtent2D swapchainExtent) {
+  VkFramebufferCreateInfo framebufferInfo {};
+  framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+  framebufferInfo.renderPass = renderPass;
+  framebufferInfo.attachmentCount = 2;
+  VkImageView view[] = {imageView, depthImageView};
+  framebufferInfo.pAttachments = view;
+  framebufferInfo.width = swapchainExtent.width;
+  framebufferInfo.height = swapchainExtent.height;
+  framebufferInfo.layers = 1;
+  VkResult res = vkCreateFramebuffer(device, &framebufferInfo, NULL, pFramebuffer);
+  if (res == VK_SUCCESS) {
+    return (ERR_OK);
+  } else {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to create framebuffers: %s",
+                   vkstrerror(res));
+    return (ERR_UNKNOWN);
+  }
+}
+
+void delete_Framebuffer(VkFramebuffer *pFramebuffer, VkDevice device) {
+  vkDestroyFramebuffer(device, *pFramebuffer, NULL);
+  *pFramebuffer = VK_NULL_HANDLE;
+}
+
+void delete_SwapchainFramebuffers(VkFramebuffer *pFramebuffers,
+                                  const uint32_t imageCount,
+                                  const VkDevice device) {
+  for (uint32_t i = 0; i < imageCount; i++) {
+    delete_Framebuffer(&pFramebuffers[i], device);
+  }
+}
+
+ErrVal new_SwapchainFramebuffers(VkFramebuffer *pFramebuffers, const VkDevice device,const VkRenderPass renderPass,
+const VkExtent2D swapchainExtent, const uint32_t imageCount, const VkImageView depthImageView,
+const VkImageView *pSwapchainImageViews) {
+  for (uint32_t i = 0; i < imageCount; i++) {
+    ErrVal retVal = new_Framebuffer(&pFramebuffers[i], device, renderPass,
+                                    pSwapchainImageViews[i], depthImageView,
+                                    swapchainExtent);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_ERROR, "could not create framebuffers");
+      delete_SwapchainFramebuffers(pFramebuffers, i, device);
+      return (retVal);
+    }
+  }
+  return (ERR_OK);
+}
+
+void delete_CommandPool(VkCommandPool *pCommandPool, const VkDevice device) {
+  vkDestroyCommandPool(device, *pCommandPool, NULL);
+  *pCommandPool = VK_NULL_HANDLE;
+}
+
+ErrVal new_Semaphore(VkSemaphore *pSemaphore, const VkDevice device) {
+  VkSemaphoreCreateInfo semaphoreInfo {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  VkResult ret = vkCreateSemaphore(device, &semaphoreInfo, NULL, pSemaphore);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create semaphore: %s",
+                   vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  return (ERR_OK);
+}
+
+void delete_Semaphore(VkSemaphore *pSemaphore, const VkDevice device) {
+  vkDestroySemaphore(device, *pSemaphore, NULL);
+  *pSemaphore = VK_NULL_HANDLE;
+}
+
+void delete_Semaphores(VkSemaphore *pSemaphores, const uint32_t semaphoreCount,const VkDevice device) {
+  for (uint32_t i = 0; i < semaphoreCount; i++) {
+    delete_Semaphore(&pSemaphores[i], device);
+  }
+}
+
+ErrVal new_Semaphores(VkSemaphore *pSemaphores, const uint32_t semaphoreCount,const VkDevice device) {
+  for (uint32_t i = 0; i < semaphoreCount; i++) {
+    ErrVal retVal = new_Semaphore(&pSemaphores[i], device);
+    if (retVal != ERR_OK) {
+      delete_Semaphores(pSemaphores, i, device);
+      return (retVal);
+    }
+  }
+  return (ERR_OK);
+}
+
+/* A timeline semaphore carries a 64 bit counter instead of a binary state, so
+ * one semaphore can track any number of submissions */
+ErrVal new_TimelineSemaphore(VkSemaphore *pSemaphore, const uint64_t initialValue, const VkDevice device) {
+  VkSemaphoreTypeCreateInfo typeInfo {};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeInfo.initialValue = initialValue;
+
+  VkSemaphoreCreateInfo semaphoreInfo {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+  VkResult ret = vkCreateSemaphore(device, &semaphoreInfo, NULL, pSemaphore);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create timeline semaphore: %s",
+                   vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  }
+  return (ERR_OK);
+}
+
+// Note we're creating the fence already signaled!
+ErrVal new_Fence(VkFence *pFence, const VkDevice device, const bool signaled) {
+  VkFenceCreateInfo fenceInfo {};
+  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  if (signaled) {
+    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+  }
+  VkResult ret = vkCreateFence(device, &fenceInfo, NULL, pFence);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create fence: %s",
+                   vkstrerror(ret));
+    PANIC();
+  }
+  return (ERR_OK);
+}
+
+void delete_Fence(VkFence *pFence, const VkDevice device) {
+  vkDestroyFence(device, *pFence, NULL);
+  *pFence = VK_NULL_HANDLE;
+};
+
+void delete_Fences(VkFence *pFences, const uint32_t fenceCount, const VkDevice device) {
+  for (uint32_t i = 0; i < fenceCount; i++) {
+    delete_Fence(&pFences[i], device);
+  }
+}
+
+ErrVal new_Fences( //
+    VkFence *pFences,  //
+    const uint32_t fenceCount, //
+    const VkDevice device, //
+    const bool allSignaled //
+) {
+  for (uint32_t i = 0; i < fenceCount; i++) {
+    ErrVal retVal = new_Fence(&pFences[i], device, allSignaled);
+    if (retVal != ERR_OK) {
+      /* Clean up memory */
+     delete_Fences(pFences, i, device);
+      return (retVal);
+    }
+  }
+  return (ERR_OK);
+}
+
+ErrVal waitAndResetFence(VkFence fence, const VkDevice device) {
+  // Wait for the current frame to finish processing
+  VkResult waitRet = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+  if (waitRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to wait for fence: %s",
+                   vkstrerror(waitRet));
+    PANIC();
+  }
+
+  // reset the fence
+  VkResult resetRet = vkResetFences(device, 1, &fence);
+  if (resetRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to reset fence: %s",
+                   vkstrerror(resetRet));
+    PANIC();
+  }
+
+  return (ERR_OK);
+}
+
+ErrVal getNextSwapchainImage(uint32_t *pImageIndex, const VkSwapchainKHR swapchain, const VkDevice device,              
+VkSemaphore imageAvailableSemaphore ) {
+  // get the next image from the swapchain
+  VkResult nextImageResult = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageAvailableSemaphore, 
+  VK_NULL_HANDLE,pImageIndex);
+  if (nextImageResult == VK_ERROR_OUT_OF_DATE_KHR) {
+    // If the window has been resized, the result will be an out of date error,
+    // meaning that the swap chain must be resized
+    return (ERR_OUTOFDATE);
+  } else if (nextImageResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to get next frame: %s",
+                   vkstrerror(nextImageResult));
+    PANIC();
+  }
+
+  return (ERR_OK);
+}
+
+// Draws a frame to the surface provided, and sets things up for the next frame
+/* Submits a frame's command buffer. imageAvailableSemaphore and
+ * renderFinishedSemaphore may be VK_NULL_HANDLE when nothing is presented */
+ErrVal submitFrame(VkCommandBuffer commandBuffer, VkSemaphore imageAvailableSemaphore,
+VkSemaphore renderFinishedSemaphore, VkFence inFlightFence, const VkQueue graphicsQueue,
+const VkSemaphore uploadSemaphore, const uint64_t uploadWaitValue) {
+  VkSemaphore waitSemaphores[2];
+  VkPipelineStageFlags waitStages[2];
+  // the binary semaphore's value is ignored
+  uint64_t waitValues[2];
+  uint32_t waitCount = 0;
+  if (imageAvailableSemaphore != VK_NULL_HANDLE) {
+    waitSemaphores[waitCount] = imageAvailableSemaphore;
+    waitStages[waitCount] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    waitValues[waitCount] = 0;
+    waitCount++;
+  }
+  // only wait on uploads when this frame consumes one that is still in flight
+  if (uploadWaitValue > 0) {
+    waitSemaphores[waitCount] = uploadSemaphore;
+    waitStages[waitCount] = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                            VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT |
+                            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    waitValues[waitCount] = uploadWaitValue;
+    waitCount++;
+  }
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount = waitCount;
+  timelineInfo.pWaitSemaphoreValues = waitValues;
+
+  VkSubmitInfo submitInfo {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount = waitCount;
+  submitInfo.pWaitSemaphores = waitSemaphores;
+  submitInfo.pWaitDstStageMask = waitStages;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &commandBuffer;
+
+  if (renderFinishedSemaphore != VK_NULL_HANDLE) {
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &renderFinishedSemaphore;
+  }
+
+  VkResult queueSubmitResult =
+      vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence);
+  if (queueSubmitResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to submit queue: %s",
+                   vkstrerror(queueSubmitResult));
+    PANIC();
+  }
+  return (ERR_OK);
+}
+
+ErrVal drawFrame( VkCommandBuffer commandBuffer, VkSwapchainKHR swapchain, const uint32_t swapchainImageIndex,  
+VkSemaphore imageAvailableSemaphore, VkSemaphore renderFinishedSemaphore, VkFence inFlightFence, 
+const VkQueue graphicsQueue, const VkQueue presentQueue, const VkSemaphore uploadSemaphore,
+const uint64_t uploadWaitValue) {
+  submitFrame(commandBuffer, imageAvailableSemaphore, renderFinishedSemaphore, inFlightFence, graphicsQueue,
+              uploadSemaphore, uploadWaitValue);
+
+  // Present frame to screen
+  VkPresentInfoKHR presentInfo {};
+  presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+  presentInfo.waitSemaphoreCount = 1;
+  presentInfo.pWaitSemaphores = &renderFinishedSemaphore;
+  presentInfo.swapchainCount = 1;
+  presentInfo.pSwapchains = &swapchain;
+  presentInfo.pImageIndices = &swapchainImageIndex;
+  VkResult presentResult = vkQueuePresentKHR(presentQueue, &presentInfo);
+  if (presentResult == VK_ERROR_OUT_OF_DATE_KHR || presentResult == VK_SUBOPTIMAL_KHR) {
+    // the frame still went through, but the swapchain no longer matches the window
+    return (ERR_OUTOFDATE);
+  } else if (presentResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to present frame: %s",
+                   vkstrerror(presentResult));
+    PANIC();
+  }
+
+  return (ERR_OK);
+}
+
+// Deletes a VkSurfaceKHR
+void delete_Surface(VkSurfaceKHR *pSurface, const VkInstance instance) {
+  vkDestroySurfaceKHR(instance, *pSurface, NULL);
+  *pSurface = VK_NULL_HANDLE;
+}
+
+ErrVal new_CommandBuffers( VkCommandBuffer *pCommandBuffer, const uint32_t commandBufferCount, 
+const VkCommandPool commandPool, const VkDevice device) {
+  VkCommandBufferAllocateInfo allocateInfo {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocateInfo.commandPool = commandPool;
+  allocateInfo.commandBufferCount = commandBufferCount;
+
+  VkResult allocateResult =vkAllocateCommandBuffers(device, &allocateInfo, pCommandBuffer);
+  if (allocateResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to allocate command buffers: %s",
+                   vkstrerror(allocateResult));
+    PANIC();
+  }
+
+  return (ERR_OK);
+}
+
+ErrVal new_Buffer_DeviceMemory(VkBuffer *pBuffer, DeviceAllocation *pBufferMemory,const VkDeviceSize size,
+DeviceAllocator *pAllocator,const VkDevice device,const VkBufferUsageFlags usage,
+const VkMemoryPropertyFlags properties) {
+
+  VkBufferCreateInfo bufferInfo {};
+  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferInfo.size = size;
+  bufferInfo.usage = usage;
+  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  /* Create buffer */
+  VkResult bufferCreateResult =vkCreateBuffer(device, &bufferInfo, NULL, pBuffer);
+  if (bufferCreateResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create buffer: %s",
+                   vkstrerror(bufferCreateResult));
+    return (ERR_UNKNOWN);
+  }
+  /* Allocate memory for buffer */
+  VkMemoryRequirements memoryRequirements;
+  vkGetBufferMemoryRequirements(device, *pBuffer, &memoryRequirements);
+
+  /* Suballocate memory, handle errors */
+  ErrVal memoryAllocateResult = allocateDeviceMemory(pBufferMemory, pAllocator, memoryRequirements, properties, true);
+  if (memoryAllocateResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to allocate memory for buffer");
+    vkDestroyBuffer(device, *pBuffer, NULL);
+    *pBuffer = VK_NULL_HANDLE;
+    return (memoryAllocateResult);
+  }
+  VkResult bindResult = vkBindBufferMemory(device, *pBuffer, pBufferMemory->memory, pBufferMemory->offset);
+  if (bindResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to bind buffer memory: %s",
+                   vkstrerror(bindResult));
+    freeDeviceMemory(pBufferMemory, pAllocator);
+    vkDestroyBuffer(device, *pBuffer, NULL);
+    *pBuffer = VK_NULL_HANDLE;
+    return (ERR_UNKNOWN);
+  }
+  return (ERR_OK);
+}
+
+void delete_Buffer(VkBuffer *pBuffer, const VkDevice device) {
+  vkDestroyBuffer(device, *pBuffer, NULL);
+  *pBuffer = VK_NULL_HANDLE;}
+
+void delete_DeviceMemory(VkDeviceMemory *pDeviceMemory, const VkDevice device) {
+vkFreeMemory(device, *pDeviceMemory, NULL);
+*pDeviceMemory = VK_NULL_HANDLE;}
+
+ErrVal copyToDeviceMemory(const DeviceAllocation *pDeviceMemory,const VkDeviceSize deviceSize, const void *source,
+const DeviceAllocator *pAllocator) {
+  /* Host visible blocks are persistently mapped by the allocator */
+  if (pDeviceMemory->pMapped == NULL) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to copy to device memory: memory is not host visible");
+    return (ERR_MEMORY);
+  }
+  memcpy(pDeviceMemory->pMapped, source, (size_t)deviceSize);
+
+  /* Non coherent memory has to be flushed, in multiples of nonCoherentAtomSize */
+  if (!(pAllocator->memoryProperties.memoryTypes[pDeviceMemory->memoryTypeIndex].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+    VkDeviceSize atom = pAllocator->nonCoherentAtomSize;
+    VkDeviceSize start = (pDeviceMemory->offset / atom) * atom;
+    VkDeviceSize end = alignUp(pDeviceMemory->offset + deviceSize, atom);
+    if (end > pDeviceMemory->pBlock->size) {
+      end = pDeviceMemory->pBlock->size;
+    }
+    VkMappedMemoryRange range {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = pDeviceMemory->memory;
+    range.offset = start;
+    range.size = end - start;
+    vkFlushMappedMemoryRanges(pAllocator->device, 1, &range);
+  }
+  return (ERR_OK);
+}
+
+/* Every upload goes through one persistently mapped, host coherent ring buffer
+ * that lives for the whole session. Each submitted upload batch remembers how
+ * far into the ring it reaches, and that space is handed back once the batch's
+ * timeline value has been reached. */
+#define STAGING_RING_SIZE (32ull * 1024ull * 1024ull)
+#define STAGING_RING_ALIGNMENT 16ull
+
+typedef struct {
+  uint64_t timelineValue;
+  VkDeviceSize head;
+} StagingRetirement;
+
+typedef struct {
+  VkBuffer buffer;
+  DeviceAllocation memory;
+  VkDeviceSize size;
+  // head and tail only ever grow; ring offsets are taken modulo size
+  VkDeviceSize head;
+  VkDeviceSize tail;
+  // ring heads of submitted batches, oldest first
+  std::deque<StagingRetirement> retirements;
+} StagingRing;
+
+ErrVal new_StagingRing(StagingRing *pRing, const VkDeviceSize size, DeviceAllocator *pAllocator,
+const VkDevice device) {
+  ErrVal bufferResult = new_Buffer_DeviceMemory(&pRing->buffer, &pRing->memory, size, pAllocator, device,
+                                                VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+  if (bufferResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create staging ring");
+    return (bufferResult);
+  }
+
+  pRing->size = size;
+  pRing->head = 0;
+  pRing->tail = 0;
+  pRing->retirements.clear();
+  return (ERR_OK);
+}
+
+void delete_StagingRing(StagingRing *pRing, DeviceAllocator *pAllocator, const VkDevice device) {
+  delete_Buffer(&pRing->buffer, device);
+  freeDeviceMemory(&pRing->memory, pAllocator);
+  pRing->retirements.clear();
+}
+
+/* Reserves size bytes of ring space, returning ERR_MEMORY when the ring is
+ * full of data that uploads still in flight have yet to consume */
+ErrVal reserveStagingRing(VkDeviceSize *pOffset, void **ppMapped, StagingRing *pRing, const VkDeviceSize size) {
+  VkDeviceSize start = alignUp(pRing->head, STAGING_RING_ALIGNMENT);
+  // an upload never wraps around the end of the ring
+  if (start % pRing->size + size > pRing->size) {
+    start = alignUp(start, pRing->size);
+  }
+  if (start + size - pRing->tail > pRing->size) {
+    return (ERR_MEMORY);
+  }
+
+  pRing->head = start + size;
+  *pOffset = start % pRing->size;
+  *ppMapped = (char *)pRing->memory.pMapped + *pOffset;
+  return (ERR_OK);
+}
+
+/* Everything reserved so far is read by the batch that signals timelineValue */
+void markStagingRing(StagingRing *pRing, const uint64_t timelineValue) {
+  pRing->retirements.push_back((StagingRetirement){.timelineValue = timelineValue, .head = pRing->head});
+}
+
+/* Hands back the ring space of every batch up to and including completedValue */
+void retireStagingRing(StagingRing *pRing, const uint64_t completedValue) {
+  while (!pRing->retirements.empty() && pRing->retirements.front().timelineValue <= completedValue) {
+    pRing->tail = pRing->retirements.front().head;
+    pRing->retirements.pop_front();
+  }
+}
+
+/* The upload scheduler collects buffer and image copies out of the staging ring
+ * and records each batch into a single command buffer. Batches go to a
+ * dedicated transfer queue when the device has one, and signal successive
+ * values of one timeline semaphore, so callers never wait on a fence. When the
+ * transfer family differs from the graphics family, each batch releases its
+ * resources and the next graphics frame records the matching acquires. */
+#define UPLOAD_BATCH_COUNT 4
+
+typedef enum {
+  UPLOAD_KIND_BUFFER,
+  UPLOAD_KIND_IMAGE,
+} UploadKind;
+
+typedef struct {
+  UploadKind kind;
+  VkBuffer dstBuffer;
+  VkBufferCopy bufferRegion;
+  VkImage dstImage;
+  VkBufferImageCopy imageRegion;
+  VkImageSubresourceRange imageRange;
+  VkImageLayout finalLayout;
+} UploadRequest;
+
+typedef struct {
+  VkCommandBuffer commandBuffer;
+  // the value this batch last signaled, 0 if it was never submitted
+  uint64_t timelineValue;
+} UploadBatch;
+
+typedef struct {
+  VkDevice device;
+  VkQueue queue;
+  uint32_t queueFamilyIndex;
+  uint32_t graphicsQueueFamilyIndex;
+  VkCommandPool commandPool;
+  StagingRing stagingRing;
+  VkSemaphore timeline;
+  // the value the batch currently being collected will signal
+  uint64_t nextValue;
+  // the newest value seen complete by pollUploads
+  uint64_t completedValue;
+  uint32_t nextBatch;
+  UploadBatch pBatches[UPLOAD_BATCH_COUNT];
+  std::vector<UploadRequest> pendingRequests;
+  // acquires the graphics queue has yet to record, and the value they wait on
+  std::vector<VkBufferMemoryBarrier> pendingBufferAcquires;
+  std::vector<VkImageMemoryBarrier> pendingImageAcquires;
+  uint64_t acquireValue;
+} UploadScheduler;
+
+ErrVal new_UploadScheduler(UploadScheduler *pScheduler, const VkDeviceSize stagingSize, const VkQueue queue,
+const uint32_t queueFamilyIndex, const uint32_t graphicsQueueFamilyIndex, DeviceAllocator *pAllocator,
+const VkDevice device) {
+  pScheduler->device = device;
+  pScheduler->queue = queue;
+  pScheduler->queueFamilyIndex = queueFamilyIndex;
+  pScheduler->graphicsQueueFamilyIndex = graphicsQueueFamilyIndex;
+  pScheduler->nextValue = 1;
+  pScheduler->completedValue = 0;
+  pScheduler->nextBatch = 0;
+  pScheduler->acquireValue = 0;
+  pScheduler->pendingRequests.clear();
+  pScheduler->pendingBufferAcquires.clear();
+  pScheduler->pendingImageAcquires.clear();
+
+  ErrVal ringResult = new_StagingRing(&pScheduler->stagingRing, stagingSize, pAllocator, device);
+  if (ringResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create upload scheduler");
+    return (ringResult);
+  }
+
+  ErrVal semaphoreResult = new_TimelineSemaphore(&pScheduler->timeline, 0, device);
+  if (semaphoreResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create upload scheduler");
+    delete_StagingRing(&pScheduler->stagingRing, pAllocator, device);
+    return (semaphoreResult);
+  }
+
+  new_CommandPool(&pScheduler->commandPool, device, queueFamilyIndex);
+  VkCommandBuffer pCommandBuffers[UPLOAD_BATCH_COUNT];
+  new_CommandBuffers(pCommandBuffers, UPLOAD_BATCH_COUNT, pScheduler->commandPool, device);
+  for (uint32_t i = 0; i < UPLOAD_BATCH_COUNT; i++) {
+    pScheduler->pBatches[i].commandBuffer = pCommandBuffers[i];
+    pScheduler->pBatches[i].timelineValue = 0;
+  }
+  return (ERR_OK);
+}
+
+/* Blocks until timelineValue has been reached */
+ErrVal waitUploads(UploadScheduler *pScheduler, const uint64_t timelineValue) {
+  if (timelineValue <= pScheduler->completedValue) {
+    return (ERR_OK);
+  }
+  VkSemaphoreWaitInfo waitInfo {};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &pScheduler->timeline;
+  waitInfo.pValues = &timelineValue;
+  VkResult waitRet = vkWaitSemaphores(pScheduler->device, &waitInfo, UINT64_MAX);
+  if (waitRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to wait for uploads: %s", vkstrerror(waitRet));
+    PANIC();
+  }
+  pScheduler->completedValue = timelineValue;
+  retireStagingRing(&pScheduler->stagingRing, timelineValue);
+  return (ERR_OK);
+}
+
+/* Non blocking: picks up finished batches and frees their ring space */
+void pollUploads(UploadScheduler *pScheduler) {
+  uint64_t value;
+  VkResult ret = vkGetSemaphoreCounterValue(pScheduler->device, pScheduler->timeline, &value);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to poll uploads: %s", vkstrerror(ret));
+    PANIC();
+  }
+  pScheduler->completedValue = value;
+  retireStagingRing(&pScheduler->stagingRing, value);
+}
+
+bool isUploadComplete(const UploadScheduler *pScheduler, const uint64_t timelineValue) {
+  return (timelineValue <= pScheduler->completedValue);
+}
+
+void delete_UploadScheduler(UploadScheduler *pScheduler, DeviceAllocator *pAllocator) {
+  waitUploads(pScheduler, pScheduler->nextValue - 1);
+  VkCommandBuffer pCommandBuffers[UPLOAD_BATCH_COUNT];
+  for (uint32_t i = 0; i < UPLOAD_BATCH_COUNT; i++) {
+    pCommandBuffers[i] = pScheduler->pBatches[i].commandBuffer;
+  }
+  vkFreeCommandBuffers(pScheduler->device, pScheduler->commandPool, UPLOAD_BATCH_COUNT, pCommandBuffers);
+  vkDestroyCommandPool(pScheduler->device, pScheduler->commandPool, NULL);
+  pScheduler->commandPool = VK_NULL_HANDLE;
+  delete_Semaphore(&pScheduler->timeline, pScheduler->device);
+  delete_StagingRing(&pScheduler->stagingRing, pAllocator, pScheduler->device);
+  pScheduler->pendingRequests.clear();
+  pScheduler->pendingBufferAcquires.clear();
+  pScheduler->pendingImageAcquires.clear();
+}
+
+/* Copies size bytes into the staging ring, retrying once after reclaiming
+ * finished batches */
+static ErrVal stageUploadData(VkDeviceSize *pSrcOffset, UploadScheduler *pScheduler, const void *pData,
+const VkDeviceSize size) {
+  void *pMapped;
+  ErrVal reserveResult = reserveStagingRing(pSrcOffset, &pMapped, &pScheduler->stagingRing, size);
+  if (reserveResult == ERR_MEMORY) {
+    pollUploads(pScheduler);
+    reserveResult = reserveStagingRing(pSrcOffset, &pMapped, &pScheduler->stagingRing, size);
+  }
+  if (reserveResult != ERR_OK) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "staging ring full, could not stage %llu bytes",
+                   (unsigned long long)size);
+    return (reserveResult);
+  }
+  memcpy(pMapped, pData, (size_t)size);
+  return (ERR_OK);
+}
+
+/* Queues a copy of pData into dstBuffer. *pTimelineValue is set to the value
+ * the upload scheduler's timeline reaches once the copy has landed */
+ErrVal uploadBuffer(uint64_t *pTimelineValue, UploadScheduler *pScheduler, const VkBuffer dstBuffer,
+const VkDeviceSize dstOffset, const void *pData, const VkDeviceSize size) {
+  VkDeviceSize srcOffset;
+  ErrVal stageResult = stageUploadData(&srcOffset, pScheduler, pData, size);
+  if (stageResult != ERR_OK) {
+    return (stageResult);
+  }
+
+  UploadRequest request {};
+  request.kind = UPLOAD_KIND_BUFFER;
+  request.dstBuffer = dstBuffer;
+  request.bufferRegion = (VkBufferCopy){.srcOffset = srcOffset, .dstOffset = dstOffset, .size = size};
+  pScheduler->pendingRequests.push_back(request);
+  *pTimelineValue = pScheduler->nextValue;
+  return (ERR_OK);
+}
+
+/* Queues a copy of tightly packed texels into mip 0 of dstImage, leaving the
+ * image in finalLayout */
+ErrVal uploadImage(uint64_t *pTimelineValue, UploadScheduler *pScheduler, const VkImage dstImage,
+const VkExtent3D extent, const VkImageAspectFlags aspectMask, const VkImageLayout finalLayout,
+const void *pData, const VkDeviceSize size) {
+  VkDeviceSize srcOffset;
+  ErrVal stageResult = stageUploadData(&srcOffset, pScheduler, pData, size);
+  if (stageResult != ERR_OK) {
+    return (stageResult);
+  }
+
+  UploadRequest request {};
+  request.kind = UPLOAD_KIND_IMAGE;
+  request.dstImage = dstImage;
+  request.imageRegion.bufferOffset = srcOffset;
+  request.imageRegion.imageSubresource.aspectMask = aspectMask;
+  request.imageRegion.imageSubresource.layerCount = 1;
+  request.imageRegion.imageExtent = extent;
+  request.imageRange.aspectMask = aspectMask;
+  request.imageRange.levelCount = 1;
+  request.imageRange.layerCount = 1;
+  request.finalLayout = finalLayout;
+  pScheduler->pendingRequests.push_back(request);
+  *pTimelineValue = pScheduler->nextValue;
+  return (ERR_OK);
+}
+
+/* Records every pending request into one command buffer and submits it.
+ * *pTimelineValue is set to the value the batch signals, or the last submitted
+ * value when nothing was pending */
+ErrVal submitUploads(uint64_t *pTimelineValue, UploadScheduler *pScheduler) {
+  if (pScheduler->pendingRequests.empty()) {
+    *pTimelineValue = pScheduler->nextValue - 1;
+    return (ERR_OK);
+  }
+
+  // only stalls when UPLOAD_BATCH_COUNT batches are already in flight
+  UploadBatch *pBatch = &pScheduler->pBatches[pScheduler->nextBatch];
+  waitUploads(pScheduler, pBatch->timelineValue);
+
+  VkCommandBufferBeginInfo beginInfo {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  VkResult beginRet = vkBeginCommandBuffer(pBatch->commandBuffer, &beginInfo);
+  if (beginRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Failed to begin upload command buffer: %s",
+                   vkstrerror(beginRet));
+    PANIC();
+  }
+
+  const bool transferOwnership = pScheduler->queueFamilyIndex != pScheduler->graphicsQueueFamilyIndex;
+  const uint32_t srcFamily = transferOwnership ? pScheduler->queueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+  const uint32_t dstFamily = transferOwnership ? pScheduler->graphicsQueueFamilyIndex : VK_QUEUE_FAMILY_IGNORED;
+  std::vector<VkImageMemoryBarrier> imageBarriers;
+  std::vector<VkBufferMemoryBarrier> bufferBarriers;
+
+  // images have to be in TRANSFER_DST_OPTIMAL before anything is copied into them
+  for (size_t i = 0; i < pScheduler->pendingRequests.size(); i++) {
+    const UploadRequest *pRequest = &pScheduler->pendingRequests[i];
+    if (pRequest->kind != UPLOAD_KIND_IMAGE) {
+      continue;
+    }
+    VkImageMemoryBarrier barrier {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = pRequest->dstImage;
+    barrier.subresourceRange = pRequest->imageRange;
+    imageBarriers.push_back(barrier);
+  }
+  if (!imageBarriers.empty()) {
+    vkCmdPipelineBarrier(pBatch->commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL,
+                         (uint32_t)imageBarriers.size(), imageBarriers.data());
+    imageBarriers.clear();
+  }
+
+  // batch runs of buffer copies into the same destination into one command
+  std::vector<VkBufferCopy> regions;
+  VkBuffer runBuffer = VK_NULL_HANDLE;
+  for (size_t i = 0; i <= pScheduler->pendingRequests.size(); i++) {
+    const UploadRequest *pRequest = i < pScheduler->pendingRequests.size() ? &pScheduler->pendingRequests[i] : NULL;
+    if (!regions.empty() && (!pRequest || pRequest->kind != UPLOAD_KIND_BUFFER || pRequest->dstBuffer != runBuffer)) {
+      vkCmdCopyBuffer(pBatch->commandBuffer, pScheduler->stagingRing.buffer, runBuffer,
+                      (uint32_t)regions.size(), regions.data());
+      regions.clear();
+    }
+    if (!pRequest) {
+      break;
+    }
+
+    if (pRequest->kind == UPLOAD_KIND_BUFFER) {
+      runBuffer = pRequest->dstBuffer;
+      regions.push_back(pRequest->bufferRegion);
+      if (transferOwnership) {
+        VkBufferMemoryBarrier barrier {};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        barrier.srcQueueFamilyIndex = srcFamily;
+        barrier.dstQueueFamilyIndex = dstFamily;
+        barrier.buffer = pRequest->dstBuffer;
+        barrier.offset = pRequest->bufferRegion.dstOffset;
+        barrier.size = pRequest->bufferRegion.size;
+        bufferBarriers.push_back(barrier);
+
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT |
+                                VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+        pScheduler->pendingBufferAcquires.push_back(barrier);
+      }
+    } else {
+      vkCmdCopyBufferToImage(pBatch->commandBuffer, pScheduler->stagingRing.buffer, pRequest->dstImage,
+                             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &pRequest->imageRegion);
+
+      // the release and the acquire must describe the same layout transition
+      VkImageMemoryBarrier barrier {};
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = 0;
+      barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barrier.newLayout = pRequest->finalLayout;
+      barrier.srcQueueFamilyIndex = srcFamily;
+      barrier.dstQueueFamilyIndex = dstFamily;
+      barrier.image = pRequest->dstImage;
+      barrier.subresourceRange = pRequest->imageRange;
+      imageBarriers.push_back(barrier);
+
+      if (transferOwnership) {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        pScheduler->pendingImageAcquires.push_back(barrier);
+      }
+    }
+  }
+
+  /* Release ownership and finish layout transitions. The timeline signal makes
+   * the writes available; the frame that waits on it makes them visible */
+  if (!bufferBarriers.empty() || !imageBarriers.empty()) {
+    vkCmdPipelineBarrier(pBatch->commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL,
+                         (uint32_t)bufferBarriers.size(), bufferBarriers.data(),
+                         (uint32_t)imageBarriers.size(), imageBarriers.data());
+  }
+
+  VkResult endRet = vkEndCommandBuffer(pBatch->commandBuffer);
+  if (endRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to end upload command buffer: %s",
+                   vkstrerror(endRet));
+    PANIC();
+  }
+
+  const uint64_t signalValue = pScheduler->nextValue;
+  VkTimelineSemaphoreSubmitInfo timelineInfo {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.signalSemaphoreValueCount = 1;
+  timelineInfo.pSignalSemaphoreValues = &signalValue;
+
+  VkSubmitInfo submitInfo {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &pBatch->commandBuffer;
+  submitInfo.signalSemaphoreCount = 1;
+  submitInfo.pSignalSemaphores = &pScheduler->timeline;
+
+  VkResult queueSubmitResult = vkQueueSubmit(pScheduler->queue, 1, &submitInfo, VK_NULL_HANDLE);
+  if (queueSubmitResult != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to submit uploads: %s",
+                   vkstrerror(queueSubmitResult));
+    PANIC();
+  }
+
+  markStagingRing(&pScheduler->stagingRing, signalValue);
+  pBatch->timelineValue = signalValue;
+  pScheduler->acquireValue = signalValue;
+  pScheduler->pendingRequests.clear();
+  pScheduler->nextValue++;
+  pScheduler->nextBatch = (pScheduler->nextBatch + 1) % UPLOAD_BATCH_COUNT;
+  *pTimelineValue = signalValue;
+  return (ERR_OK);
+}
+
+/* Records the ownership acquires for every submitted batch into a graphics
+ * command buffer, outside a render pass. *pWaitValue is the value that
+ * command buffer's submission has to wait on, or 0 when it needs nothing */
+void recordUploadAcquires(uint64_t *pWaitValue, UploadScheduler *pScheduler, const VkCommandBuffer commandBuffer) {
+  // a frame only waits on batches submitted since the previous frame was recorded
+  *pWaitValue = pScheduler->acquireValue;
+  pScheduler->acquireValue = 0;
+  if (pScheduler->pendingBufferAcquires.empty() && pScheduler->pendingImageAcquires.empty()) {
+    return;
+  }
+
+  // the frame's timeline wait blocks the transfer stage, which chains into this barrier
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT |
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       0, 0, NULL, (uint32_t)pScheduler->pendingBufferAcquires.size(),
+                       pScheduler->pendingBufferAcquires.data(),
+                       (uint32_t)pScheduler->pendingImageAcquires.size(),
+                       pScheduler->pendingImageAcquires.data());
+  pScheduler->pendingBufferAcquires.clear();
+  pScheduler->pendingImageAcquires.clear();
+}
+
+/* Creates a device local buffer and queues pData for upload into it; the
+ * upload lands once the timeline reaches *pUploadValue */
+ErrVal new_UploadedBuffer(VkBuffer *pBuffer, DeviceAllocation *pBufferMemory, uint64_t *pUploadValue,
+const void *pData, const VkDeviceSize size, const VkBufferUsageFlags usage, const VkDevice device,
+DeviceAllocator *pAllocator, UploadScheduler *pUploads) {
+  ErrVal bufferCreateResult = new_Buffer_DeviceMemory(
+      pBuffer, pBufferMemory, size, pAllocator, device,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage,
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+  /* Handle errors */
+  if (bufferCreateResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create buffer");
+    return (bufferCreateResult);
+  }
+
+  /* The copy itself goes out with the next upload batch */
+  ErrVal stageResult = uploadBuffer(pUploadValue, pUploads, *pBuffer, 0, pData, size);
+  if (stageResult != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create buffer: could not stage its contents");
+    delete_Buffer(pBuffer, device);
+    freeDeviceMemory(pBufferMemory, pAllocator);
+    return (stageResult);
+  }
+
+  return (ERR_OK);
+}
+
+/* Indexed geometry. Several meshes can share one Mesh's buffers, each draw
+ * then selects its own range through firstIndex and vertexOffset */
+typedef struct {
+  VkBuffer vertexBuffer;
+  DeviceAllocation vertexMemory;
+  VkBuffer indexBuffer;
+  DeviceAllocation indexMemory;
+  VkIndexType indexType;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+} Mesh;
+
+/* Indices are stored as 16 bit whenever every vertex is addressable with them,
+ * which halves the index fetch bandwidth for all but very large meshes */
+ErrVal new_Mesh(Mesh *pMesh, uint64_t *pUploadValue, const Vertex *pVertices, const uint32_t vertexCount,
+const uint32_t *pIndices, const uint32_t indexCount, const VkDevice device, DeviceAllocator *pAllocator,
+UploadScheduler *pUploads) {
+  pMesh->vertexCount = vertexCount;
+  pMesh->indexCount = indexCount;
+  pMesh->indexType = vertexCount <= UINT16_MAX + 1 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+  uint64_t vertexUploadValue;
+  ErrVal retVal = new_UploadedBuffer(&pMesh->vertexBuffer, &pMesh->vertexMemory, &vertexUploadValue, pVertices,
+                                     sizeof(Vertex) * vertexCount, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, device,
+                                     pAllocator, pUploads);
+  if (retVal != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create mesh vertex buffer");
+    return (retVal);
+  }
+
+  std::vector<uint16_t> shortIndices;
+  const void *pIndexData = pIndices;
+  VkDeviceSize indexSize = sizeof(uint32_t) * indexCount;
+  if (pMesh->indexType == VK_INDEX_TYPE_UINT16) {
+    shortIndices.resize(indexCount);
+    for (uint32_t i = 0; i < indexCount; i++) {
+      shortIndices[i] = (uint16_t)pIndices[i];
+    }
+    pIndexData = shortIndices.data();
+    indexSize = sizeof(uint16_t) * indexCount;
+  }
+  retVal = new_UploadedBuffer(&pMesh->indexBuffer, &pMesh->indexMemory, pUploadValue, pIndexData, indexSize,
+                              VK_BUFFER_USAGE_INDEX_BUFFER_BIT, device, pAllocator, pUploads);
+  if (retVal != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create mesh index buffer");
+    delete_Buffer(&pMesh->vertexBuffer, device);
+    freeDeviceMemory(&pMesh->vertexMemory, pAllocator);
+    return (retVal);
+  }
+  // both go out in the same batch, but never rely on that
+  if (vertexUploadValue > *pUploadValue) {
+    *pUploadValue = vertexUploadValue;
+  }
+  return (ERR_OK);
+}
 
-  VkRect2D scissor {};
-  scissor.offset.x = 0;
-  scissor.offset.y = 0;
-  scissor.extent = extent;
+void delete_Mesh(Mesh *pMesh, DeviceAllocator *pAllocator, const VkDevice device) {
+  delete_Buffer(&pMesh->vertexBuffer, device);
+  freeDeviceMemory(&pMesh->vertexMemory, pAllocator);
+  delete_Buffer(&pMesh->indexBuffer, device);
+  freeDeviceMemory(&pMesh->indexMemory, pAllocator);
+}
 
-  VkPipelineDepthStencilStateCreateInfo depthStencil {};
-  depthStencil.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-  depthStencil.depthTestEnable = VK_TRUE;
-  depthStencil.depthWriteEnable = VK_TRUE;
-  depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-  depthStencil.depthBoundsTestEnable = VK_FALSE;
-  depthStencil.stencilTestEnable = VK_FALSE;
-
-  VkPipelineViewportStateCreateInfo viewportState {};
-  viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportState.viewportCount = 1;
-  viewportState.pViewports = &viewport;
-  viewportState.scissorCount = 1;
-  viewportState.pScissors = &scissor;
-
-  VkPipelineRasterizationStateCreateInfo rasterizer {};
-  rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizer.depthClampEnable = VK_FALSE;
-  rasterizer.rasterizerDiscardEnable = VK_FALSE;
-  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizer.lineWidth = 1.0f;
-  rasterizer.cullMode = VK_CULL_MODE_NONE; /* VK_CULL_MODE_BACK_BIT; */
-  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-  rasterizer.depthBiasEnable = VK_FALSE;
-
-  VkPipelineMultisampleStateCreateInfo multisampling {};
-  multisampling.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampling.sampleShadingEnable = VK_FALSE;
-  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+/* GPU profiler: recorded regions are wrapped in named scopes that write a
+ * timestamp at each end and, optionally, collect pipeline statistics. Every
+ * frame in flight owns its own slice of the query pools, and a slice is read
+ * back only after that frame's fence has signaled, so reading results never
+ * waits on the GPU. */
+#define GPU_PROFILER_MAX_SCOPES 32
+// main logs one profiled frame out of every GPU_PROFILER_LOG_INTERVAL
+#define GPU_PROFILER_LOG_INTERVAL 256
+#define GPU_PROFILER_STATISTICS                                                                              \
+  (VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT | \
+   VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT)
 
-  VkPipelineColorBlendAttachmentState colorBlendAttachment {};
-  colorBlendAttachment.colorWriteMask =
-      VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachment.blendEnable = VK_FALSE;
+typedef struct {
+  const char *pName;
+  // relative to the first scope of the frame, in nanoseconds
+  uint64_t beginNs;
+  uint64_t durationNs;
+  bool hasStatistics;
+  uint64_t vertexInvocations;
+  uint64_t clippingPrimitives;
+  uint64_t fragmentInvocations;
+} GpuProfileScope;
 
-  VkPipelineColorBlendStateCreateInfo colorBlending {};
-  colorBlending.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  colorBlending.logicOpEnable = VK_FALSE;
-  colorBlending.logicOp = VK_LOGIC_OP_COPY;
-  colorBlending.attachmentCount = 1;
-  colorBlending.pAttachments = &colorBlendAttachment;
-  colorBlending.blendConstants[0] = 0.0f;
-  colorBlending.blendConstants[1] = 0.0f;
-  colorBlending.blendConstants[2] = 0.0f;
-  colorBlending.blendConstants[3] = 0.0f;
+typedef struct {
+  // false until a frame has been read back
+  bool valid;
+  uint64_t frameNumber;
+  // raw device timestamp of the frame's first scope, converted to nanoseconds
+  uint64_t gpuStartNs;
+  uint32_t scopeCount;
+  GpuProfileScope pScopes[GPU_PROFILER_MAX_SCOPES];
+} GpuFrameProfile;
 
-  VkGraphicsPipelineCreateInfo pipelineInfo {};
-  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineInfo.stageCount = 2;
-  pipelineInfo.pStages = shaderStages;
-  pipelineInfo.pVertexInputState = &vertexInputInfo;
-  pipelineInfo.pInputAssemblyState = &inputAssembly;
-  pipelineInfo.pViewportState = &viewportState;
-  pipelineInfo.pRasterizationState = &rasterizer;
-  pipelineInfo.pMultisampleState = &multisampling;
-  pipelineInfo.pColorBlendState = &colorBlending;
-  pipelineInfo.pDepthStencilState = &depthStencil;
-  pipelineInfo.layout = pipelineLayout;
-  pipelineInfo.renderPass = renderPass;
-  pipelineInfo.subpass = 0;
-  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+typedef struct {
+  VkDevice device;
+  uint32_t frameCount;
+  // nanoseconds per timestamp tick
+  double timestampPeriod;
+  uint64_t timestampMask;
+  bool statisticsEnabled;
+  // whether secondaries may run inside a statistics scope
+  bool inheritedQueries;
+  // two timestamps per scope, GPU_PROFILER_MAX_SCOPES scopes per frame slot
+  VkQueryPool timestampPool;
+  // one query per scope, GPU_PROFILER_MAX_SCOPES per frame slot
+  VkQueryPool statisticsPool;
+  uint64_t frameNumber;
+  // what each frame slot recorded, frameCount entries
+  GpuFrameProfile *pSlots;
+  GpuFrameProfile latest;
+  // getTimeNs() minus device time, valid once calibrated
+  bool calibrated;
+  int64_t cpuOffsetNs;
+} GpuProfiler;
+
+ErrVal new_GpuProfiler(GpuProfiler *pProfiler, const uint32_t frameCount, const bool collectStatistics,
+const uint32_t queueFamilyIndex, const VkPhysicalDevice physicalDevice, const VkDevice device) {
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, NULL);
+  VkQueueFamilyProperties *pFamilyProperties =
+      (VkQueueFamilyProperties *)malloc(queueFamilyCount * sizeof(VkQueueFamilyProperties));
+  if (!pFamilyProperties) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create gpu profiler: %s", strerror(errno));
+    PANIC();
+  }
+  vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, pFamilyProperties);
+  uint32_t validBits = queueFamilyIndex < queueFamilyCount ? pFamilyProperties[queueFamilyIndex].timestampValidBits : 0;
+  free(pFamilyProperties);
+  if (validBits == 0) {
+    LOG_ERROR(ERR_LEVEL_WARN, "failed to create gpu profiler: the queue does not support timestamps");
+    return (ERR_NOTSUPPORTED);
+  }
 
-  if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
-                                pGraphicsPipeline) != VK_SUCCESS) {
-    LOG_ERROR(ERR_LEVEL_FATAL, "failed to create graphics pipeline!");
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+  VkPhysicalDeviceFeatures features;
+  vkGetPhysicalDeviceFeatures(physicalDevice, &features);
+
+  pProfiler->device = device;
+  pProfiler->frameCount = frameCount;
+  pProfiler->timestampPeriod = (double)properties.limits.timestampPeriod;
+  pProfiler->timestampMask = validBits >= 64 ? UINT64_MAX : ((1ull << validBits) - 1);
+  pProfiler->statisticsEnabled = collectStatistics && features.pipelineStatisticsQuery;
+  pProfiler->inheritedQueries = features.inheritedQueries;
+  pProfiler->statisticsPool = VK_NULL_HANDLE;
+  pProfiler->frameNumber = 0;
+  pProfiler->latest.valid = false;
+  pProfiler->latest.scopeCount = 0;
+  pProfiler->calibrated = false;
+  pProfiler->cpuOffsetNs = 0;
+  if (collectStatistics && !pProfiler->statisticsEnabled) {
+    LOG_ERROR(ERR_LEVEL_WARN, "pipeline statistics queries are not supported, profiling timestamps only");
+  }
+
+  pProfiler->pSlots = (GpuFrameProfile *)calloc(frameCount, sizeof(GpuFrameProfile));
+  if (!pProfiler->pSlots) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create gpu profiler: %s", strerror(errno));
     PANIC();
   }
+
+  VkQueryPoolCreateInfo poolInfo {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  poolInfo.queryCount = frameCount * GPU_PROFILER_MAX_SCOPES * 2;
+  VkResult ret = vkCreateQueryPool(device, &poolInfo, NULL, &pProfiler->timestampPool);
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create timestamp query pool: %s", vkstrerror(ret));
+    free(pProfiler->pSlots);
+    return (ERR_UNKNOWN);
+  }
+
+  if (pProfiler->statisticsEnabled) {
+    poolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    poolInfo.queryCount = frameCount * GPU_PROFILER_MAX_SCOPES;
+    poolInfo.pipelineStatistics = GPU_PROFILER_STATISTICS;
+    ret = vkCreateQueryPool(device, &poolInfo, NULL, &pProfiler->statisticsPool);
+    if (ret != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to create pipeline statistics query pool: %s", vkstrerror(ret));
+      pProfiler->statisticsEnabled = false;
+    }
+  }
   return (ERR_OK);
 }
 
-void delete_Pipeline(VkPipeline *pPipeline, const VkDevice device) {vkDestroyPipeline(device, *pPipeline, NULL);}
+void delete_GpuProfiler(GpuProfiler *pProfiler) {
+  vkDestroyQueryPool(pProfiler->device, pProfiler->timestampPool, NULL);
+  if (pProfiler->statisticsPool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(pProfiler->device, pProfiler->statisticsPool, NULL);
+  }
+  free(pProfiler->pSlots);
+  pProfiler->pSlots = NULL;
+}
 
-ErrVal new_Framebuffer(VkFramebuffer *pFramebuffer, const VkDevice device, const VkRenderPass renderPass,
-const VkImageView imageView, const VkImageView depthImageView,const VkExtent2D swapchainExtent) {
-  VkFramebufferCreateInfo framebufferInfo {};
-  framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-  framebufferInfo.renderPass = renderPass;
-  framebufferInfo.attachmentCount = 2;
-  VkImageView view[] = {imageView, depthImageView};
-  framebufferInfo.pAttachments = view;
-  framebufferInfo.width = swapchainExtent.width;
-  framebufferInfo.height = swapchainExtent.height;
-  framebufferInfo.layers = 1;
-  VkResult res = vkCreateFramebuffer(device, &framebufferInfo, NULL, pFramebuffer);
-  if (res == VK_SUCCESS) {
-    return (ERR_OK);
-  } else {
-    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to create framebuffers: %s",
-                   vkstrerror(res));
+/* Call once frameIndex's fence has signaled. Whatever the slot recorded last
+ * time round becomes the latest profile, and true is returned; nothing here
+ * waits on the GPU */
+bool readGpuProfilerFrame(GpuProfiler *pProfiler, const uint32_t frameIndex) {
+  GpuFrameProfile *pSlot = &pProfiler->pSlots[frameIndex];
+  if (pSlot->scopeCount == 0) {
+    return (false);
+  }
+
+  // each query is followed by its availability word
+  uint64_t pTimestamps[GPU_PROFILER_MAX_SCOPES * 2][2];
+  VkResult ret = vkGetQueryPoolResults(pProfiler->device, pProfiler->timestampPool,
+                                       frameIndex * GPU_PROFILER_MAX_SCOPES * 2, pSlot->scopeCount * 2,
+                                       sizeof(pTimestamps), pTimestamps, sizeof(pTimestamps[0]),
+                                       VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  if (ret != VK_SUCCESS && ret != VK_NOT_READY) {
+    LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to read gpu timestamps: %s", vkstrerror(ret));
+    pSlot->scopeCount = 0;
+    return (false);
+  }
+
+  uint64_t pStatistics[GPU_PROFILER_MAX_SCOPES][4] = {};
+  if (pProfiler->statisticsEnabled) {
+    vkGetQueryPoolResults(pProfiler->device, pProfiler->statisticsPool, frameIndex * GPU_PROFILER_MAX_SCOPES,
+                          pSlot->scopeCount, sizeof(pStatistics), pStatistics, sizeof(pStatistics[0]),
+                          VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+  }
+
+  uint64_t frameStart = pTimestamps[0][0] & pProfiler->timestampMask;
+  for (uint32_t i = 0; i < pSlot->scopeCount; i++) {
+    GpuProfileScope *pScope = &pSlot->pScopes[i];
+    if (!pTimestamps[i * 2][1] || !pTimestamps[i * 2 + 1][1]) {
+      // unavailable, e.g. a scope whose queries were never written
+      pScope->beginNs = 0;
+      pScope->durationNs = 0;
+      continue;
+    }
+    uint64_t begin = pTimestamps[i * 2][0] & pProfiler->timestampMask;
+    uint64_t end = pTimestamps[i * 2 + 1][0] & pProfiler->timestampMask;
+    pScope->beginNs = (uint64_t)((double)((begin - frameStart) & pProfiler->timestampMask) * pProfiler->timestampPeriod);
+    pScope->durationNs = (uint64_t)((double)((end - begin) & pProfiler->timestampMask) * pProfiler->timestampPeriod);
+    if (pScope->hasStatistics) {
+      // results come back in bit order: vertex, clipping, fragment
+      pScope->hasStatistics = pStatistics[i][3] != 0;
+      pScope->vertexInvocations = pStatistics[i][0];
+      pScope->clippingPrimitives = pStatistics[i][1];
+      pScope->fragmentInvocations = pStatistics[i][2];
+    }
+  }
+  pSlot->gpuStartNs = (uint64_t)((double)frameStart * pProfiler->timestampPeriod);
+  pSlot->valid = true;
+  pProfiler->latest = *pSlot;
+  pSlot->scopeCount = 0;
+  return (true);
+}
+
+/* Records the reset of frameIndex's queries; must be outside a render pass and
+ * before any scope of that frame */
+void resetGpuProfilerFrame(GpuProfiler *pProfiler, const VkCommandBuffer commandBuffer, const uint32_t frameIndex) {
+  GpuFrameProfile *pSlot = &pProfiler->pSlots[frameIndex];
+  pSlot->valid = false;
+  pSlot->scopeCount = 0;
+  pSlot->frameNumber = pProfiler->frameNumber++;
+  vkCmdResetQueryPool(commandBuffer, pProfiler->timestampPool, frameIndex * GPU_PROFILER_MAX_SCOPES * 2,
+                      GPU_PROFILER_MAX_SCOPES * 2);
+  if (pProfiler->statisticsEnabled) {
+    vkCmdResetQueryPool(commandBuffer, pProfiler->statisticsPool, frameIndex * GPU_PROFILER_MAX_SCOPES,
+                        GPU_PROFILER_MAX_SCOPES);
+  }
+}
+
+/* Opens a named scope and returns its index for endGpuScope, or UINT32_MAX if
+ * the frame is out of scopes. pName must outlive the readback */
+uint32_t beginGpuScope(GpuProfiler *pProfiler, const VkCommandBuffer commandBuffer, const uint32_t frameIndex,
+const char *pName, const bool withStatistics) {
+  GpuFrameProfile *pSlot = &pProfiler->pSlots[frameIndex];
+  if (pSlot->scopeCount == GPU_PROFILER_MAX_SCOPES) {
+    return (UINT32_MAX);
+  }
+  uint32_t scopeIndex = pSlot->scopeCount++;
+  GpuProfileScope *pScope = &pSlot->pScopes[scopeIndex];
+  pScope->pName = pName;
+  pScope->hasStatistics = withStatistics && pProfiler->statisticsEnabled;
+
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pProfiler->timestampPool,
+                      (frameIndex * GPU_PROFILER_MAX_SCOPES + scopeIndex) * 2);
+  if (pScope->hasStatistics) {
+    vkCmdBeginQuery(commandBuffer, pProfiler->statisticsPool, frameIndex * GPU_PROFILER_MAX_SCOPES + scopeIndex, 0);
+  }
+  return (scopeIndex);
+}
+
+void endGpuScope(GpuProfiler *pProfiler, const VkCommandBuffer commandBuffer, const uint32_t frameIndex,
+const uint32_t scopeIndex) {
+  if (scopeIndex == UINT32_MAX) {
+    return;
+  }
+  if (pProfiler->pSlots[frameIndex].pScopes[scopeIndex].hasStatistics) {
+    vkCmdEndQuery(commandBuffer, pProfiler->statisticsPool, frameIndex * GPU_PROFILER_MAX_SCOPES + scopeIndex);
+  }
+  vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pProfiler->timestampPool,
+                      (frameIndex * GPU_PROFILER_MAX_SCOPES + scopeIndex) * 2 + 1);
+}
+
+/* The newest frame read back, which is framesInFlight frames behind the CPU */
+const GpuFrameProfile *getGpuFrameProfile(const GpuProfiler *pProfiler) {
+  return (&pProfiler->latest);
+}
+
+void logGpuFrameProfile(const GpuFrameProfile *pProfile) {
+  if (!pProfile->valid) {
+    return;
+  }
+  for (uint32_t i = 0; i < pProfile->scopeCount; i++) {
+    const GpuProfileScope *pScope = &pProfile->pScopes[i];
+    if (pScope->hasStatistics) {
+      LOG_ERROR_ARGS(ERR_LEVEL_INFO,
+                     "gpu frame %llu: %s %.3f ms, %llu vertex invocations, %llu clipping primitives, "
+                     "%llu fragment invocations",
+                     (unsigned long long)pProfile->frameNumber, pScope->pName, (double)pScope->durationNs / 1e6,
+                     (unsigned long long)pScope->vertexInvocations, (unsigned long long)pScope->clippingPrimitives,
+                     (unsigned long long)pScope->fragmentInvocations);
+    } else {
+      LOG_ERROR_ARGS(ERR_LEVEL_INFO, "gpu frame %llu: %s %.3f ms", (unsigned long long)pProfile->frameNumber,
+                     pScope->pName, (double)pScope->durationNs / 1e6);
+    }
+  }
+}
+
+/* Measures the offset between the device timestamp clock and getTimeNs by
+ * timestamping an otherwise empty submit. The GPU write lands somewhere between
+ * the submit and the fence wait returning, so the tightest of a few rounds is
+ * kept and its midpoint taken. Must run before the first frame is recorded */
+#define GPU_PROFILER_CALIBRATION_ROUNDS 8
+
+ErrVal calibrateGpuProfiler(GpuProfiler *pProfiler, const VkCommandPool commandPool, const VkQueue queue) {
+  VkCommandBuffer commandBuffer;
+  new_CommandBuffers(&commandBuffer, 1, commandPool, pProfiler->device);
+  VkFence fence;
+  new_Fence(&fence, pProfiler->device, false);
+
+  uint64_t bestWindowNs = UINT64_MAX;
+  for (uint32_t round = 0; round < GPU_PROFILER_CALIBRATION_ROUNDS; round++) {
+    VkCommandBufferBeginInfo beginInfo {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    vkCmdResetQueryPool(commandBuffer, pProfiler->timestampPool, 0, 1);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pProfiler->timestampPool, 0);
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    uint64_t submitNs = getTimeNs();
+    VkResult ret = vkQueueSubmit(queue, 1, &submitInfo, fence);
+    if (ret != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to calibrate gpu clock: %s", vkstrerror(ret));
+      break;
+    }
+    waitAndResetFence(fence, pProfiler->device);
+    uint64_t doneNs = getTimeNs();
+
+    uint64_t timestamp;
+    ret = vkGetQueryPoolResults(pProfiler->device, pProfiler->timestampPool, 0, 1, sizeof(timestamp), &timestamp,
+                                sizeof(timestamp), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+    if (ret != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_WARN, "failed to calibrate gpu clock: %s", vkstrerror(ret));
+      break;
+    }
+    if (doneNs - submitNs < bestWindowNs) {
+      bestWindowNs = doneNs - submitNs;
+      uint64_t gpuNs = (uint64_t)((double)(timestamp & pProfiler->timestampMask) * pProfiler->timestampPeriod);
+      pProfiler->cpuOffsetNs = (int64_t)(submitNs + (doneNs - submitNs) / 2) - (int64_t)gpuNs;
+      pProfiler->calibrated = true;
+    }
+  }
+
+  delete_Fence(&fence, pProfiler->device);
+  vkFreeCommandBuffers(pProfiler->device, commandPool, 1, &commandBuffer);
+  if (!pProfiler->calibrated) {
     return (ERR_UNKNOWN);
   }
+  LOG_ERROR_ARGS(ERR_LEVEL_DEBUG, "gpu clock calibrated to within %.3f ms", (double)bestWindowNs / 2e6);
+  return (ERR_OK);
 }
 
-void delete_Framebuffer(VkFramebuffer *pFramebuffer, VkDevice device) {
-  vkDestroyFramebuffer(device, *pFramebuffer, NULL);
-  *pFramebuffer = VK_NULL_HANDLE;
+/* Copies a frame's scopes onto a trace track in getTimeNs time. Does nothing
+ * until the profiler has been calibrated */
+void traceGpuFrameProfile(TraceThreadBuffer *pTrack, const GpuProfiler *pProfiler, const GpuFrameProfile *pProfile) {
+  if (!pTrack || !pProfiler->calibrated || !pProfile->valid) {
+    return;
+  }
+  for (uint32_t i = 0; i < pProfile->scopeCount; i++) {
+    const GpuProfileScope *pScope = &pProfile->pScopes[i];
+    if (pScope->durationNs == 0) {
+      continue;
+    }
+    uint64_t beginNs = (uint64_t)((int64_t)(pProfile->gpuStartNs + pScope->beginNs) + pProfiler->cpuOffsetNs);
+    addTraceEvent(pTrack, pScope->pName, beginNs, beginNs + pScope->durationNs);
+  }
 }
 
-ErrVal new_SwapchainFramebuffers(VkFramebuffer *pFramebuffers, const VkDevice device,const VkRenderPass renderPass,
-const VkExtent2D swapchainExtent, const uint32_t imageCount, const VkImageView depthImageView,
-const VkImageView *pSwapchainImageViews) {
-  for (uint32_t i = 0; i < imageCount; i++) {
-    ErrVal retVal = new_Framebuffer(&pFramebuffers[i], device, renderPass,
-                                    pSwapchainImageViews[i], depthImageView,
-                                    swapchainExtent);
-    if (retVal != ERR_OK) {
-      LOG_ERROR(ERR_LEVEL_ERROR, "could not create framebuffers");
-     // delete_SwapchainFramebuffers(pFramebuffers, i, device);
-      return (retVal);
+/* Secondary command buffers are recorded from one VkCommandPool per frame in
+ * flight per worker thread. A pool is only ever touched by its own worker, and
+ * is reset as a whole once its frame's fence has signaled, which is much
+ * cheaper than resetting its command buffers one at a time. */
+#define DRAWS_PER_SECONDARY 1024
+
+typedef struct {
+  VkCommandPool commandPool;
+  std::vector<VkCommandBuffer> commandBuffers;
+  // command buffers handed out since the last reset
+  uint32_t usedCount;
+} ThreadCommandPool;
+
+typedef struct {
+  uint32_t frameCount;
+  uint32_t workerCount;
+  // frameCount * workerCount pools, indexed [frame * workerCount + worker]
+  ThreadCommandPool *pPools;
+} SecondaryCommandPools;
+
+ErrVal new_SecondaryCommandPools(SecondaryCommandPools *pPools, const uint32_t frameCount,
+const uint32_t workerCount, const uint32_t queueFamilyIndex, const VkDevice device) {
+  pPools->frameCount = frameCount;
+  pPools->workerCount = workerCount;
+  pPools->pPools = new ThreadCommandPool[frameCount * workerCount];
+
+  VkCommandPoolCreateInfo poolInfo {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = queueFamilyIndex;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  for (uint32_t i = 0; i < frameCount * workerCount; i++) {
+    pPools->pPools[i].usedCount = 0;
+    VkResult ret = vkCreateCommandPool(device, &poolInfo, NULL, &pPools->pPools[i].commandPool);
+    if (ret != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create secondary command pool: %s", vkstrerror(ret));
+      PANIC();
     }
   }
   return (ERR_OK);
 }
 
-/*void delete_SwapchainFramebuffers(VkFramebuffer *pFramebuffers,
-                                  const uint32_t imageCount,
-                                  const VkDevice device) {
-  for (uint32_t i = 0; i < imageCount; i++) {
-    //delete_Framebuffer(&pFramebuffers[i], device);
+void delete_SecondaryCommandPools(SecondaryCommandPools *pPools, const VkDevice device) {
+  for (uint32_t i = 0; i < pPools->frameCount * pPools->workerCount; i++) {
+    // destroying a pool frees every command buffer allocated from it
+    vkDestroyCommandPool(device, pPools->pPools[i].commandPool, NULL);
   }
-}*/
+  delete[] pPools->pPools;
+  pPools->pPools = NULL;
+}
 
-/*void delete_CommandPool(VkCommandPool *pCommandPool, const VkDevice device) {
-  vkDestroyCommandPool(device, *pCommandPool, NULL);
+/* Call once frameIndex's fence has signaled */
+void resetSecondaryCommandPools(SecondaryCommandPools *pPools, const uint32_t frameIndex, const VkDevice device) {
+  for (uint32_t i = 0; i < pPools->workerCount; i++) {
+    ThreadCommandPool *pPool = &pPools->pPools[frameIndex * pPools->workerCount + i];
+    if (pPool->usedCount == 0) {
+      continue;
+    }
+    vkResetCommandPool(device, pPool->commandPool, 0);
+    pPool->usedCount = 0;
+  }
 }
-*/
-ErrVal recordVertexDisplayCommandBuffer( VkCommandBuffer commandBuffer, const VkFramebuffer swapchainFramebuffer,           
-const VkBuffer vertexBuffer, const uint32_t vertexCount, const VkRenderPass renderPass,
-const VkPipelineLayout vertexDisplayPipelineLayout, const VkPipeline vertexDisplayPipeline, 
-const VkExtent2D swapchainExtent, const mat4x4 cameraTransform, const VkClearColorValue clearColor) {
+
+/* Hands out a secondary command buffer from workerIndex's pool, allocating a
+ * new one the first time the pool needs more than it has */
+VkCommandBuffer getSecondaryCommandBuffer(SecondaryCommandPools *pPools, const uint32_t frameIndex,
+const uint32_t workerIndex, const VkDevice device) {
+  ThreadCommandPool *pPool = &pPools->pPools[frameIndex * pPools->workerCount + workerIndex];
+  if (pPool->usedCount == pPool->commandBuffers.size()) {
+    VkCommandBufferAllocateInfo allocateInfo {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocateInfo.commandPool = pPool->commandPool;
+    allocateInfo.commandBufferCount = 1;
+    VkCommandBuffer commandBuffer;
+    VkResult allocateResult = vkAllocateCommandBuffers(device, &allocateInfo, &commandBuffer);
+    if (allocateResult != VK_SUCCESS) {
+      LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to allocate secondary command buffer: %s",
+                     vkstrerror(allocateResult));
+      PANIC();
+    }
+    pPool->commandBuffers.push_back(commandBuffer);
+  }
+  return (pPool->commandBuffers[pPool->usedCount++]);
+}
+
+/* Everything a worker needs to record one slice of the vertex display draws */
+typedef struct {
+  SecondaryCommandPools *pPools;
+  uint32_t frameIndex;
+  VkDevice device;
+  VkRenderPass renderPass;
+  VkFramebuffer framebuffer;
+  VkPipelineLayout pipelineLayout;
+  VkPipeline pipeline;
+  const Mesh *pMesh;
+  VkBuffer instanceBuffer;
+  VkExtent2D extent;
+  // statistics the primary has active around these secondaries
+  VkQueryPipelineStatisticFlags pipelineStatistics;
+  const vec4 *pCameraTransform;
+  const VkDrawIndexedIndirectCommand *pDraws;
+  uint32_t drawCount;
+  // one per task, in draw order
+  VkCommandBuffer *pSecondaries;
+} VertexDisplayRecordJob;
+
+/* Command buffers inherit no state from one another, so everything that
+ * records draws binds this first */
+static void bindVertexDisplayState(const VkCommandBuffer commandBuffer, const VertexDisplayRecordJob *pJob) {
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pJob->pipeline);
+  VkViewport viewport {};
+  viewport.width = (float)pJob->extent.width;
+  viewport.height = (float)pJob->extent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+  VkRect2D scissor {};
+  scissor.extent = pJob->extent;
+  vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+  vkCmdPushConstants(commandBuffer, pJob->pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat4x4),
+                     pJob->pCameraTransform);
+  VkBuffer pVertexBuffers[2] = {pJob->pMesh->vertexBuffer, pJob->instanceBuffer};
+  VkDeviceSize pOffsets[2] = {0, 0};
+  vkCmdBindVertexBuffers(commandBuffer, 0, 2, pVertexBuffers, pOffsets);
+  vkCmdBindIndexBuffer(commandBuffer, pJob->pMesh->indexBuffer, 0, pJob->pMesh->indexType);
+}
+
+static void recordVertexDisplaySecondary(void *pData, uint32_t taskIndex, uint32_t workerIndex) {
+  VertexDisplayRecordJob *pJob = (VertexDisplayRecordJob *)pData;
+  TraceZone zone = beginTraceZone("record secondary");
+  VkCommandBuffer commandBuffer = getSecondaryCommandBuffer(pJob->pPools, pJob->frameIndex, workerIndex,
+                                                            pJob->device);
+
+  VkCommandBufferInheritanceInfo inheritanceInfo {};
+  inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritanceInfo.renderPass = pJob->renderPass;
+  inheritanceInfo.subpass = 0;
+  inheritanceInfo.framebuffer = pJob->framebuffer;
+  inheritanceInfo.pipelineStatistics = pJob->pipelineStatistics;
+
   VkCommandBufferBeginInfo beginInfo {};
   beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  beginInfo.pInheritanceInfo = &inheritanceInfo;
   VkResult beginRet = vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-  if (beginRet != VK_SUCCESS) {LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to record into graphics command buffer: %s",
-    vkstrerror(beginRet));
+  if (beginRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to record into secondary command buffer: %s",
+                   vkstrerror(beginRet));
     PANIC();
   }
 
-  VkRenderPassBeginInfo renderPassInfo {};
-  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  renderPassInfo.renderPass = renderPass;
-  renderPassInfo.framebuffer = swapchainFramebuffer;
-  renderPassInfo.renderArea.offset = (VkOffset2D){0, 0};
-  renderPassInfo.renderArea.extent = swapchainExtent;
+  // secondaries inherit no state, every slice binds its own
+  bindVertexDisplayState(commandBuffer, pJob);
 
-  VkClearValue pClearColors[2];
-  pClearColors[0].color = clearColor;
-  pClearColors[1].depthStencil.depth = 1.0f;
-  pClearColors[1].depthStencil.stencil = 0;
+  uint32_t firstDraw = taskIndex * DRAWS_PER_SECONDARY;
+  uint32_t lastDraw = firstDraw + DRAWS_PER_SECONDARY;
+  if (lastDraw > pJob->drawCount) {
+    lastDraw = pJob->drawCount;
+  }
+  for (uint32_t i = firstDraw; i < lastDraw; i++) {
+    const VkDrawIndexedIndirectCommand *pDraw = &pJob->pDraws[i];
+    vkCmdDrawIndexed(commandBuffer, pDraw->indexCount, pDraw->instanceCount, pDraw->firstIndex, pDraw->vertexOffset,
+                     pDraw->firstInstance);
+  }
 
-  renderPassInfo.clearValueCount = 2;
-  renderPassInfo.pClearValues = pClearColors;
+  VkResult endRet = vkEndCommandBuffer(commandBuffer);
+  if (endRet != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Failed to record secondary command buffer, error code: %s",
+                   vkstrerror(endRet));
+    PANIC();
+  }
+  pJob->pSecondaries[taskIndex] = commandBuffer;
+  endTraceZone(&zone);
+}
 
-  vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
-                       VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                    vertexDisplayPipeline);
-  vkCmdPushConstants(commandBuffer, vertexDisplayPipelineLayout,
-                     VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(mat4x4),
-                     cameraTransform);
+/* Headless rendering draws into offscreen color images instead of swapchain
+ * images, one per frame in flight, and copies each into a host visible
+ * readback buffer of the same frame slot. The pixels are only read once that
+ * slot's fence comes round again, framesInFlight frames later, so the CPU
+ * never waits on a copy it has just submitted. */
+#define OFFSCREEN_COLOR_FORMAT VK_FORMAT_R8G8B8A8_UNORM
+#define OFFSCREEN_BYTES_PER_PIXEL 4
 
-  VkBuffer vertexBuffers[] = {vertexBuffer};
-  VkDeviceSize offsets[] = {0};
-  vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+#define DEFAULT_BENCH_WARMUP_FRAMES 60
 
-  vkCmdDraw(commandBuffer, vertexCount, 1, 0, 0);
-  vkCmdEndRenderPass(commandBuffer);
+typedef struct {
+  VkExtent2D extent;
+  uint32_t frameCount;
+  // frameCount entries each
+  VkImage *pColorImages;
+  DeviceAllocation *pColorImageMemory;
+  VkImageView *pColorImageViews;
+  VkFramebuffer *pFramebuffers;
+  // NULL when frames are not read back
+  VkBuffer *pReadbackBuffers;
+  DeviceAllocation *pReadbackMemory;
+  // frame number copied into each readback buffer, UINT64_MAX when empty
+  uint64_t *pReadbackFrames;
+  uint64_t frameNumber;
+} OffscreenTarget;
+
+static bool hasMemoryType(const DeviceAllocator *pAllocator, const VkMemoryPropertyFlags properties) {
+  for (uint32_t i = 0; i < pAllocator->memoryProperties.memoryTypeCount; i++) {
+    if ((pAllocator->memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+      return (true);
+    }
+  }
+  return (false);
+}
 
-  VkResult endCommandBufferRetVal = vkEndCommandBuffer(commandBuffer);
-  if (endCommandBufferRetVal != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL,
-                   "Failed to record command buffer, error code: %s",
-                   vkstrerror(endCommandBufferRetVal));
+/* depthImageView is shared with the frames, as with the swapchain path.
+ * renderPass must have been created with a TRANSFER_SRC_OPTIMAL final layout */
+ErrVal new_OffscreenTarget(OffscreenTarget *pTarget, const VkExtent2D extent, const uint32_t frameCount,
+const bool readback, const VkRenderPass renderPass, const VkImageView depthImageView, DeviceAllocator *pAllocator,
+const VkDevice device) {
+  pTarget->extent = extent;
+  pTarget->frameCount = frameCount;
+  pTarget->frameNumber = 0;
+  pTarget->pColorImages = (VkImage *)malloc(frameCount * sizeof(VkImage));
+  pTarget->pColorImageMemory = (DeviceAllocation *)malloc(frameCount * sizeof(DeviceAllocation));
+  pTarget->pColorImageViews = (VkImageView *)malloc(frameCount * sizeof(VkImageView));
+  pTarget->pFramebuffers = (VkFramebuffer *)malloc(frameCount * sizeof(VkFramebuffer));
+  pTarget->pReadbackBuffers = NULL;
+  pTarget->pReadbackMemory = NULL;
+  pTarget->pReadbackFrames = NULL;
+  if (!pTarget->pColorImages || !pTarget->pColorImageMemory || !pTarget->pColorImageViews ||
+      !pTarget->pFramebuffers) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create offscreen target: %s", strerror(errno));
+    PANIC();
+  }
+
+  for (uint32_t i = 0; i < frameCount; i++) {
+    ErrVal retVal = new_Image(&pTarget->pColorImages[i], &pTarget->pColorImageMemory[i], extent,
+                              OFFSCREEN_COLOR_FORMAT, VK_IMAGE_TILING_OPTIMAL,
+                              VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, pAllocator, device);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_FATAL, "failed to create offscreen color image");
+      PANIC();
+    }
+    new_ImageView(&pTarget->pColorImageViews[i], device, pTarget->pColorImages[i], OFFSCREEN_COLOR_FORMAT,
+                  VK_IMAGE_ASPECT_COLOR_BIT);
+  }
+  new_SwapchainFramebuffers(pTarget->pFramebuffers, device, renderPass, extent, frameCount, depthImageView,
+                            pTarget->pColorImageViews);
+
+  if (!readback) {
+    return (ERR_OK);
+  }
+  pTarget->pReadbackBuffers = (VkBuffer *)malloc(frameCount * sizeof(VkBuffer));
+  pTarget->pReadbackMemory = (DeviceAllocation *)malloc(frameCount * sizeof(DeviceAllocation));
+  pTarget->pReadbackFrames = (uint64_t *)malloc(frameCount * sizeof(uint64_t));
+  if (!pTarget->pReadbackBuffers || !pTarget->pReadbackMemory || !pTarget->pReadbackFrames) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create offscreen target: %s", strerror(errno));
     PANIC();
   }
+  // uncached reads from device memory are painfully slow, so prefer cached
+  // memory where there is any (which is everywhere but some integrated parts)
+  VkMemoryPropertyFlags readbackProperties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  if (hasMemoryType(pAllocator, readbackProperties | VK_MEMORY_PROPERTY_HOST_CACHED_BIT)) {
+    readbackProperties |= VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  }
+  VkDeviceSize frameSize = (VkDeviceSize)extent.width * extent.height * OFFSCREEN_BYTES_PER_PIXEL;
+  for (uint32_t i = 0; i < frameCount; i++) {
+    ErrVal retVal = new_Buffer_DeviceMemory(&pTarget->pReadbackBuffers[i], &pTarget->pReadbackMemory[i], frameSize,
+                                            pAllocator, device, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                            readbackProperties);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_FATAL, "failed to create readback buffer");
+      PANIC();
+    }
+    pTarget->pReadbackFrames[i] = UINT64_MAX;
+  }
   return (ERR_OK);
 }
 
-ErrVal new_Semaphore(VkSemaphore *pSemaphore, const VkDevice device) {
-  VkSemaphoreCreateInfo semaphoreInfo {};
-  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  VkResult ret = vkCreateSemaphore(device, &semaphoreInfo, NULL, pSemaphore);
-  if (ret != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create semaphore: %s",
-                   vkstrerror(ret));
-    return (ERR_UNKNOWN);
+void delete_OffscreenTarget(OffscreenTarget *pTarget, DeviceAllocator *pAllocator, const VkDevice device) {
+  delete_SwapchainFramebuffers(pTarget->pFramebuffers, pTarget->frameCount, device);
+  for (uint32_t i = 0; i < pTarget->frameCount; i++) {
+    delete_ImageView(&pTarget->pColorImageViews[i], device);
+    delete_Image(&pTarget->pColorImages[i], device);
+    freeDeviceMemory(&pTarget->pColorImageMemory[i], pAllocator);
+    if (pTarget->pReadbackBuffers) {
+      delete_Buffer(&pTarget->pReadbackBuffers[i], device);
+      freeDeviceMemory(&pTarget->pReadbackMemory[i], pAllocator);
+    }
   }
-  return (ERR_OK);
+  free(pTarget->pColorImages);
+  free(pTarget->pColorImageMemory);
+  free(pTarget->pColorImageViews);
+  free(pTarget->pFramebuffers);
+  free(pTarget->pReadbackBuffers);
+  free(pTarget->pReadbackMemory);
+  free(pTarget->pReadbackFrames);
 }
 
-void delete_Semaphore(VkSemaphore *pSemaphore, const VkDevice device) {
-  vkDestroySemaphore(device, *pSemaphore, NULL);
-  *pSemaphore = VK_NULL_HANDLE;
+/* Records the copy of frameIndex's color image into its readback buffer; goes
+ * after the render pass, which leaves the image in TRANSFER_SRC_OPTIMAL */
+void recordOffscreenReadback(OffscreenTarget *pTarget, const VkCommandBuffer commandBuffer,
+const uint32_t frameIndex) {
+  uint64_t frameNumber = pTarget->frameNumber++;
+  if (!pTarget->pReadbackBuffers) {
+    return;
+  }
+  VkBufferImageCopy region {};
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.layerCount = 1;
+  region.imageExtent = (VkExtent3D){pTarget->extent.width, pTarget->extent.height, 1};
+  vkCmdCopyImageToBuffer(commandBuffer, pTarget->pColorImages[frameIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                         pTarget->pReadbackBuffers[frameIndex], 1, &region);
+
+  // the fence alone does not make the copy visible to the host
+  VkBufferMemoryBarrier barrier {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = pTarget->pReadbackBuffers[frameIndex];
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, NULL, 1,
+                       &barrier, 0, NULL);
+  pTarget->pReadbackFrames[frameIndex] = frameNumber;
 }
 
-void delete_Semaphores(VkSemaphore *pSemaphores, const uint32_t semaphoreCount,const VkDevice device) {
-  for (uint32_t i = 0; i < semaphoreCount; i++) {
-    delete_Semaphore(&pSemaphores[i], device);
+#define OFFSCREEN_FRAME_TOKEN "{frame}"
+
+/* Copies pPattern to pPath with each OFFSCREEN_FRAME_TOKEN replaced by the
+ * frame number, zero padded to five digits. The pattern is user input, so it
+ * is never used as a format string. false if the path does not fit */
+static bool getOffscreenFramePath(char *pPath, const size_t pathSize, const char *pPattern,
+const uint64_t frameNumber) {
+  char number[24];
+  int numberLength = snprintf(number, sizeof(number), "%05llu", (unsigned long long)frameNumber);
+  size_t tokenLength = strlen(OFFSCREEN_FRAME_TOKEN);
+  size_t length = 0;
+  while (*pPattern) {
+    const char *pPiece = pPattern;
+    size_t pieceLength = 1;
+    if (strncmp(pPattern, OFFSCREEN_FRAME_TOKEN, tokenLength) == 0) {
+      pPiece = number;
+      pieceLength = (size_t)numberLength;
+      pPattern += tokenLength;
+    } else {
+      pPattern++;
+    }
+    if (length + pieceLength >= pathSize) {
+      return (false);
+    }
+    memcpy(pPath + length, pPiece, pieceLength);
+    length += pieceLength;
   }
+  pPath[length] = '\0';
+  return (true);
 }
 
-ErrVal new_Semaphores(VkSemaphore *pSemaphores, const uint32_t semaphoreCount,const VkDevice device) {
-  for (uint32_t i = 0; i < semaphoreCount; i++) {
-    ErrVal retVal = new_Semaphore(&pSemaphores[i], device);
-    if (retVal != ERR_OK) {
-      delete_Semaphores(pSemaphores, i, device);
-      return (retVal);
+/* Writes whatever frameIndex's readback buffer holds to pPathPattern, where
+ * OFFSCREEN_FRAME_TOKEN stands for the frame number. Paths ending in .ppm get
+ * a binary PPM, any other path the raw RGBA8 rows. Call once frameIndex's
+ * fence has signaled */
+ErrVal writeOffscreenFrame(OffscreenTarget *pTarget, const uint32_t frameIndex, const char *pPathPattern) {
+  if (!pTarget->pReadbackFrames || pTarget->pReadbackFrames[frameIndex] == UINT64_MAX) {
+    return (ERR_OK);
+  }
+  char path[4096];
+  bool pathFits = getOffscreenFramePath(path, sizeof(path), pPathPattern, pTarget->pReadbackFrames[frameIndex]);
+  pTarget->pReadbackFrames[frameIndex] = UINT64_MAX;
+  if (!pathFits) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to write frame: path too long for %s", pPathPattern);
+    return (ERR_BADARGS);
+  }
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to write frame %s: %s", path, strerror(errno));
+    return (ERR_UNKNOWN);
+  }
+  const uint8_t *pPixels = (const uint8_t *)pTarget->pReadbackMemory[frameIndex].pMapped;
+  size_t pixelCount = (size_t)pTarget->extent.width * pTarget->extent.height;
+  size_t pathLength = strlen(path);
+  bool ok;
+  if (pathLength >= 4 && strcmp(path + pathLength - 4, ".ppm") == 0) {
+    fprintf(fp, "P6\n%u %u\n255\n", pTarget->extent.width, pTarget->extent.height);
+    // PPM has no alpha, drop it a row at a time
+    std::vector<uint8_t> row(pTarget->extent.width * 3);
+    ok = true;
+    for (uint32_t y = 0; y < pTarget->extent.height && ok; y++) {
+      const uint8_t *pRow = pPixels + (size_t)y * pTarget->extent.width * OFFSCREEN_BYTES_PER_PIXEL;
+      for (uint32_t x = 0; x < pTarget->extent.width; x++) {
+        row[x * 3 + 0] = pRow[x * 4 + 0];
+        row[x * 3 + 1] = pRow[x * 4 + 1];
+        row[x * 3 + 2] = pRow[x * 4 + 2];
+      }
+      ok = fwrite(row.data(), 1, row.size(), fp) == row.size();
     }
+  } else {
+    ok = fwrite(pPixels, OFFSCREEN_BYTES_PER_PIXEL, pixelCount, fp) == pixelCount;
+  }
+  if (fclose(fp) != 0 || !ok) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to write frame %s: %s", path, strerror(errno));
+    return (ERR_UNKNOWN);
   }
   return (ERR_OK);
 }
 
-// Note we're creating the fence already signaled!
-ErrVal new_Fence(VkFence *pFence, const VkDevice device, const bool signaled) {
-  VkFenceCreateInfo fenceInfo {};
-  fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  if (signaled) {
-    fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-  }
-  VkResult ret = vkCreateFence(device, &fenceInfo, NULL, pFence);
+ErrVal new_ComputePipeline(VkPipeline *pPipeline,const VkPipelineLayout pipelineLayout,
+const VkShaderModule shaderModule,const VkDevice device, PipelineCache *pPipelineCache) {
+
+  VkPipelineShaderStageCreateInfo shaderStageCreateInfo {};
+  shaderStageCreateInfo.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStageCreateInfo.module = shaderModule;
+  shaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  shaderStageCreateInfo.pName = "main";
+
+  VkComputePipelineCreateInfo computePipelineCreateInfo {};
+  computePipelineCreateInfo.sType =
+      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  computePipelineCreateInfo.layout = pipelineLayout;
+  computePipelineCreateInfo.stage = shaderStageCreateInfo;
+
+  PipelineCacheTimer timer;
+  computePipelineCreateInfo.pNext =
+      startPipelineCacheTimer(&timer, pPipelineCache, computePipelineCreateInfo.pNext);
+  VkResult ret = vkCreateComputePipelines(
+      device, pPipelineCache ? pPipelineCache->cache : VK_NULL_HANDLE, 1, &computePipelineCreateInfo, NULL,
+      pPipeline);
   if (ret != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create fence: %s",
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create compute pipelines %s",
                    vkstrerror(ret));
-    PANIC();
+    return (ERR_UNKNOWN);
   }
+  stopPipelineCacheTimer(&timer, pPipelineCache, "compute");
   return (ERR_OK);
 }
 
-void delete_Fence(VkFence *pFence, const VkDevice device) {
-  vkDestroyFence(device, *pFence, NULL);
-  *pFence = VK_NULL_HANDLE;
-};
+/* Ahead of time pipeline compilation. Pipeline descriptions are queued on a
+ * builder that compiles them on its own threads through the shared pipeline
+ * cache, while the main thread gets on with the rest of startup. Each build is
+ * only waited for where its pipeline is first needed. Builds start in the
+ * order they were queued, so the pipelines the first frame draws with go
+ * first and speculative ones after. A variant that was fast linked from
+ * pipeline libraries queues its own optimized link behind everything else */
+typedef enum {
+  // a variant of the vertex display pipeline, owned by pVariants
+  PIPELINE_BUILD_VARIANT,
+  // the optimized link of a fast linked variant; waiting on it gives no
+  // pipeline, the frame loop picks it up with refreshPipelineVariant
+  PIPELINE_BUILD_OPTIMIZE_VARIANT,
+  // a compute pipeline, owned by whoever waits for it
+  PIPELINE_BUILD_COMPUTE,
+} PipelineBuildType;
 
-void delete_Fences(VkFence *pFences, const uint32_t fenceCount, const VkDevice device) {
-  for (uint32_t i = 0; i < fenceCount; i++) {
-    delete_Fence(&pFences[i], device);
+typedef struct {
+  PipelineBuildType type;
+  // PIPELINE_BUILD_VARIANT and PIPELINE_BUILD_OPTIMIZE_VARIANT
+  PipelineVariants *pVariants;
+  PipelineKey key;
+  // PIPELINE_BUILD_COMPUTE, the module has to outlive the build
+  VkShaderModule shaderModule;
+  VkPipelineLayout pipelineLayout;
+} PipelineDesc;
+
+typedef struct {
+  PipelineDesc desc;
+  bool done;
+  // a compute pipeline nobody waited for is destroyed with the builder
+  bool claimed;
+  ErrVal result;
+  VkPipeline pipeline;
+} PipelineBuild;
+
+// a build's index in the order they were queued
+typedef uint32_t PipelineTicket;
+
+typedef struct {
+  VkDevice device;
+  PipelineCache *pPipelineCache;
+  uint32_t threadCount;
+  std::thread *pThreads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  bool quit;
+  // a deque so builds don't move as more are queued
+  std::deque<PipelineBuild> builds;
+  // the first build no thread has started
+  size_t nextBuild;
+} PipelineBuilder;
+
+/* Queues descCount builds. pTickets is NULL, or receives a ticket for each to
+ * wait on */
+void queuePipelineBuilds(PipelineBuilder *pBuilder, const PipelineDesc *pDescs, const uint32_t descCount,
+PipelineTicket *pTickets) {
+  {
+    std::lock_guard<std::mutex> lock(pBuilder->mutex);
+    for (uint32_t i = 0; i < descCount; i++) {
+      if (pTickets) {
+        pTickets[i] = (PipelineTicket)pBuilder->builds.size();
+      }
+      pBuilder->builds.push_back((PipelineBuild){.desc = pDescs[i], .done = false, .claimed = false,
+                                                 .result = ERR_OK, .pipeline = VK_NULL_HANDLE});
+    }
   }
+  pBuilder->wake.notify_all();
 }
 
-ErrVal new_Fences( //
-    VkFence *pFences,  //
-    const uint32_t fenceCount, //
-    const VkDevice device, //
-    const bool allSignaled //
-) {
-  for (uint32_t i = 0; i < fenceCount; i++) {
-    ErrVal retVal = new_Fence(&pFences[i], device, allSignaled);
-    if (retVal != ERR_OK) {
-      /* Clean up memory */
-     delete_Fences(pFences, i, device);
-      return (retVal);
+static ErrVal runPipelineBuild(VkPipeline *pPipeline, PipelineBuilder *pBuilder, const PipelineDesc *pDesc) {
+  TraceZone zone = beginTraceZone("buildPipeline");
+  ErrVal retVal;
+  if (pDesc->type == PIPELINE_BUILD_VARIANT) {
+    retVal = getPipelineVariant(pPipeline, pDesc->pVariants, &pDesc->key);
+    if (retVal == ERR_OK && pDesc->pVariants->useLibraries) {
+      PipelineDesc optimizeDesc = *pDesc;
+      optimizeDesc.type = PIPELINE_BUILD_OPTIMIZE_VARIANT;
+      queuePipelineBuilds(pBuilder, &optimizeDesc, 1, NULL);
     }
+  } else if (pDesc->type == PIPELINE_BUILD_OPTIMIZE_VARIANT) {
+    retVal = optimizePipelineVariant(pDesc->pVariants, &pDesc->key);
+  } else {
+    retVal = new_ComputePipeline(pPipeline, pDesc->pipelineLayout, pDesc->shaderModule, pBuilder->device,
+                                 pBuilder->pPipelineCache);
   }
-  return (ERR_OK);
+  endTraceZone(&zone);
+  return (retVal);
 }
 
-ErrVal waitAndResetFence(VkFence fence, const VkDevice device) {
-  // Wait for the current frame to finish processing
-  VkResult waitRet = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
-  if (waitRet != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to wait for fence: %s",
-                   vkstrerror(waitRet));
-    PANIC();
+static void pipelineBuilderMain(PipelineBuilder *pBuilder, const uint32_t threadIndex) {
+  char traceName[32];
+  snprintf(traceName, sizeof(traceName), "pipeline builder %u", threadIndex);
+  setTraceThreadName(traceName);
+  std::unique_lock<std::mutex> lock(pBuilder->mutex);
+  for (;;) {
+    while (!pBuilder->quit && pBuilder->nextBuild == pBuilder->builds.size()) {
+      pBuilder->wake.wait(lock);
+    }
+    if (pBuilder->quit) {
+      return;
+    }
+    PipelineBuild *pBuild = &pBuilder->builds[pBuilder->nextBuild++];
+    lock.unlock();
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    ErrVal result = runPipelineBuild(&pipeline, pBuilder, &pBuild->desc);
+    lock.lock();
+    pBuild->pipeline = pipeline;
+    pBuild->result = result;
+    pBuild->done = true;
+    pBuilder->done.notify_all();
   }
+}
 
-  // reset the fence
-  VkResult resetRet = vkResetFences(device, 1, &fence);
-  if (resetRet != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to reset fence: %s",
-                   vkstrerror(resetRet));
-    PANIC();
+/* threadCount of 0 means one thread per hardware thread */
+ErrVal new_PipelineBuilder(PipelineBuilder *pBuilder, uint32_t threadCount, PipelineCache *pPipelineCache,
+const VkDevice device) {
+  if (threadCount == 0) {
+    threadCount = std::thread::hardware_concurrency();
+  }
+  if (threadCount == 0) {
+    threadCount = 1;
+  }
+  pBuilder->device = device;
+  pBuilder->pPipelineCache = pPipelineCache;
+  pBuilder->threadCount = threadCount;
+  pBuilder->quit = false;
+  pBuilder->builds.clear();
+  pBuilder->nextBuild = 0;
+  pBuilder->pThreads = new std::thread[threadCount];
+  for (uint32_t i = 0; i < threadCount; i++) {
+    pBuilder->pThreads[i] = std::thread(pipelineBuilderMain, pBuilder, i);
   }
-
   return (ERR_OK);
 }
 
-ErrVal getNextSwapchainImage(uint32_t *pImageIndex, const VkSwapchainKHR swapchain, const VkDevice device,              
-VkSemaphore imageAvailableSemaphore ) {
-  // get the next image from the swapchain
-  VkResult nextImageResult = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, imageAvailableSemaphore, 
-  VK_NULL_HANDLE,pImageIndex);
-  if (nextImageResult == VK_ERROR_OUT_OF_DATE_KHR) {
-    // If the window has been resized, the result will be an out of date error,
-    // meaning that the swap chain must be resized
-    return (ERR_OUTOFDATE);
-  } else if (nextImageResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to get next frame: %s",
-                   vkstrerror(nextImageResult));
-    PANIC();
+/* Builds that haven't started are dropped, the ones in progress are finished.
+ * Variants stay with their PipelineVariants, a dropped optimized link leaves
+ * the fast link in place */
+void delete_PipelineBuilder(PipelineBuilder *pBuilder) {
+  {
+    std::lock_guard<std::mutex> lock(pBuilder->mutex);
+    pBuilder->quit = true;
+  }
+  pBuilder->wake.notify_all();
+  for (uint32_t i = 0; i < pBuilder->threadCount; i++) {
+    pBuilder->pThreads[i].join();
+  }
+  delete[] pBuilder->pThreads;
+  pBuilder->pThreads = NULL;
+  for (size_t i = 0; i < pBuilder->builds.size(); i++) {
+    PipelineBuild *pBuild = &pBuilder->builds[i];
+    if (pBuild->done && !pBuild->claimed && pBuild->desc.type == PIPELINE_BUILD_COMPUTE &&
+        pBuild->pipeline != VK_NULL_HANDLE) {
+      delete_Pipeline(&pBuild->pipeline, pBuilder->device);
+    }
   }
+  pBuilder->builds.clear();
+}
 
-  return (ERR_OK);
+/* Blocks until the build of ticket is done. A compute pipeline is the
+ * caller's from then on */
+ErrVal waitPipelineBuild(VkPipeline *pPipeline, PipelineBuilder *pBuilder, const PipelineTicket ticket) {
+  double startMs = getTimeMs();
+  std::unique_lock<std::mutex> lock(pBuilder->mutex);
+  PipelineBuild *pBuild = &pBuilder->builds[ticket];
+  while (!pBuild->done) {
+    pBuilder->done.wait(lock);
+  }
+  pBuild->claimed = true;
+  *pPipeline = pBuild->pipeline;
+  LOG_ERROR_ARGS(ERR_LEVEL_DEBUG, "waited %.3f ms for pipeline build %u", getTimeMs() - startMs, ticket);
+  return (pBuild->result);
 }
 
-// Draws a frame to the surface provided, and sets things up for the next frame
-ErrVal drawFrame( VkCommandBuffer commandBuffer, VkSwapchainKHR swapchain, const uint32_t swapchainImageIndex,  
-VkSemaphore imageAvailableSemaphore, VkSemaphore renderFinishedSemaphore, VkFence inFlightFence, 
-const VkQueue graphicsQueue, const VkQueue presentQueue) {
+#define MAX_COMPUTE_STORAGE_BINDINGS 8
 
-  // Sets up for next frame
-  VkPipelineStageFlags waitStages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+void delete_DescriptorSetLayout(VkDescriptorSetLayout *pDescriptorSetLayout,const VkDevice device) {
+vkDestroyDescriptorSetLayout(device, *pDescriptorSetLayout, NULL);
+*pDescriptorSetLayout = VK_NULL_HANDLE;
+}
 
-  VkSubmitInfo submitInfo {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = &imageAvailableSemaphore;
-  submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
+ErrVal new_DescriptorPool(VkDescriptorPool *pDescriptorPool,const VkDescriptorType descriptorType,
+const uint32_t maxAllocFrom, const VkDevice device) {
+  VkDescriptorPoolSize descriptorPoolSize;
+  descriptorPoolSize.type = descriptorType;
+  descriptorPoolSize.descriptorCount = maxAllocFrom;
 
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = &renderFinishedSemaphore;
+  VkDescriptorPoolCreateInfo poolInfo {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = 1;
+  poolInfo.pPoolSizes = &descriptorPoolSize;
+  poolInfo.maxSets = maxAllocFrom;
 
-  VkResult queueSubmitResult =
-      vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFence);
-  if (queueSubmitResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to submit queue: %s",
-                   vkstrerror(queueSubmitResult));
-    PANIC();
+  /* Actually create descriptor pool */
+  VkResult ret =
+      vkCreateDescriptorPool(device, &poolInfo, NULL, pDescriptorPool);
+
+  if (ret != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create descriptor pool; %s",
+                   vkstrerror(ret));
+    return (ERR_UNKNOWN);
+  } else {
+    return (ERR_OK);
   }
+}
 
-  // Present frame to screen
-  VkPresentInfoKHR presentInfo {};
-  presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-  presentInfo.waitSemaphoreCount = 1;
-  presentInfo.pWaitSemaphores = &renderFinishedSemaphore;
-  presentInfo.swapchainCount = 1;
-  presentInfo.pSwapchains = &swapchain;
-  presentInfo.pImageIndices = &swapchainImageIndex;
-  vkQueuePresentKHR(presentQueue, &presentInfo);
+void delete_DescriptorPool(VkDescriptorPool *pDescriptorPool,const VkDevice device){
+vkDestroyDescriptorPool(device, *pDescriptorPool, NULL); *pDescriptorPool = VK_NULL_HANDLE;};
+
+/* Binds pBuffers[i] to binding i, for a layout of bufferCount storage
+ * buffers at bindings 0 to bufferCount - 1 */
+ErrVal new_ComputeBufferDescriptorSet(VkDescriptorSet *pDescriptorSet, const uint32_t bufferCount,
+const VkBuffer *pBuffers, const VkDeviceSize *pBufferSizes, const VkDescriptorSetLayout descriptorSetLayout,
+const VkDescriptorPool descriptorPool, const VkDevice device) {
+
+  VkDescriptorSetAllocateInfo allocateInfo {};
+  allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocateInfo.descriptorPool = descriptorPool;
+  allocateInfo.descriptorSetCount = 1;
+  allocateInfo.pSetLayouts = &descriptorSetLayout;
+  VkResult allocateDescriptorSetRetVal =
+      vkAllocateDescriptorSets(device, &allocateInfo, pDescriptorSet);
+  if (allocateDescriptorSetRetVal != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate descriptor sets: %s",
+                   vkstrerror(allocateDescriptorSetRetVal));
+    return (ERR_MEMORY);
+  }
 
+  VkDescriptorBufferInfo pBufferInfos[MAX_COMPUTE_STORAGE_BINDINGS] {};
+  VkWriteDescriptorSet pDescriptorWrites[MAX_COMPUTE_STORAGE_BINDINGS] {};
+  for (uint32_t i = 0; i < bufferCount && i < MAX_COMPUTE_STORAGE_BINDINGS; i++) {
+    pBufferInfos[i].buffer = pBuffers[i];
+    pBufferInfos[i].range = pBufferSizes[i];
+    pBufferInfos[i].offset = 0;
+
+    pDescriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    pDescriptorWrites[i].dstSet = *pDescriptorSet;
+    pDescriptorWrites[i].dstBinding = i;
+    pDescriptorWrites[i].dstArrayElement = 0;
+    pDescriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pDescriptorWrites[i].descriptorCount = 1;
+    pDescriptorWrites[i].pBufferInfo = &pBufferInfos[i];
+    pDescriptorWrites[i].pImageInfo = NULL;
+    pDescriptorWrites[i].pTexelBufferView = NULL;
+  }
+  vkUpdateDescriptorSets(device, bufferCount < MAX_COMPUTE_STORAGE_BINDINGS ? bufferCount : MAX_COMPUTE_STORAGE_BINDINGS,
+                         pDescriptorWrites, 0, NULL);
   return (ERR_OK);
 }
 
-// Deletes a VkSurfaceKHR
-/*void delete_Surface(VkSurfaceKHR *pSurface, const VkInstance instance) {
-  vkDestroySurfaceKHR(instance, *pSurface, NULL);
-  *pSurface = VK_NULL_HANDLE;
+void delete_DescriptorSets(VkDescriptorSet **ppDescriptorSets) {
+  free(*ppDescriptorSets);
+  *ppDescriptorSets = NULL;
 }
-*/
 
-ErrVal new_CommandBuffers( VkCommandBuffer *pCommandBuffer, const uint32_t commandBufferCount, 
-const VkCommandPool commandPool, const VkDevice device) {
-  VkCommandBufferAllocateInfo allocateInfo {};
-  allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocateInfo.commandPool = commandPool;
-  allocateInfo.commandBufferCount = commandBufferCount;
+/* GPU driven submission. Each frame's draws are written as
+ * VkDrawIndexedIndirectCommand records into that frame slot's buffer and issued
+ * by a single vkCmdDrawIndexedIndirectCount (or vkCmdDrawIndexedIndirect), so
+ * recording costs the same however many draws there are. Per object data
+ * stays in the instance stream: each draw's firstInstance points at its
+ * objects, which the vertex shader then fetches by gl_InstanceIndex. */
+typedef struct {
+  VkDevice device;
+  uint32_t frameCount;
+  uint32_t maxDrawCount;
+  // false means one vkCmdDrawIndexedIndirect per draw
+  bool multiDraw;
+  bool drawCount;
+  // commands first, then the uint32_t draw count at countOffset
+  VkDeviceSize countOffset;
+  // frameCount entries each
+  VkBuffer *pBuffers;
+  DeviceAllocation *pMemory;
+  uint32_t *pDrawCounts;
+} DrawList;
+
+/* Fails with ERR_NOTSUPPORTED when the device cannot start an indirect draw
+ * at a non-zero instance, the direct path has to be used then */
+ErrVal new_DrawList(DrawList *pList, const uint32_t maxDrawCount, const uint32_t frameCount,
+const VkPhysicalDevice physicalDevice, DeviceAllocator *pAllocator, const VkDevice device) {
+  VkPhysicalDeviceVulkan12Features features12 {};
+  features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES;
+  VkPhysicalDeviceFeatures2 features {};
+  features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features.pNext = &features12;
+  vkGetPhysicalDeviceFeatures2(physicalDevice, &features);
+  if (!features.features.drawIndirectFirstInstance) {
+    LOG_ERROR(ERR_LEVEL_WARN, "indirect draws cannot offset instances, using direct draws");
+    return (ERR_NOTSUPPORTED);
+  }
 
-  VkResult allocateResult =vkAllocateCommandBuffers(device, &allocateInfo, pCommandBuffer);
-  if (allocateResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to allocate command buffers: %s",
-                   vkstrerror(allocateResult));
+  pList->device = device;
+  pList->frameCount = frameCount;
+  pList->maxDrawCount = maxDrawCount;
+  pList->multiDraw = features.features.multiDrawIndirect;
+  pList->drawCount = pList->multiDraw && features12.drawIndirectCount;
+  pList->countOffset = alignUp(maxDrawCount * sizeof(VkDrawIndexedIndirectCommand), sizeof(uint32_t));
+  pList->pBuffers = (VkBuffer *)malloc(frameCount * sizeof(VkBuffer));
+  pList->pMemory = (DeviceAllocation *)malloc(frameCount * sizeof(DeviceAllocation));
+  pList->pDrawCounts = (uint32_t *)calloc(frameCount, sizeof(uint32_t));
+  if (!pList->pBuffers || !pList->pMemory || !pList->pDrawCounts) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create draw list: %s", strerror(errno));
     PANIC();
   }
 
+  // written every frame and read once by the command processor, so device
+  // local is only worth it when the CPU can write it directly
+  VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  if (hasMemoryType(pAllocator, properties | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+    properties |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  }
+  for (uint32_t i = 0; i < frameCount; i++) {
+    ErrVal retVal = new_Buffer_DeviceMemory(&pList->pBuffers[i], &pList->pMemory[i],
+                                            pList->countOffset + sizeof(uint32_t), pAllocator, device,
+                                            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                            properties);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_FATAL, "failed to create draw list buffer");
+      PANIC();
+    }
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "draw list: %u draws, %s", maxDrawCount,
+                 pList->drawCount ? "indirect count" : pList->multiDraw ? "multi draw indirect" : "draw indirect");
   return (ERR_OK);
 }
 
-ErrVal new_Buffer_DeviceMemory(VkBuffer *pBuffer, VkDeviceMemory *pBufferMemory,const VkDeviceSize size,
-const VkPhysicalDevice physicalDevice,const VkDevice device,const VkBufferUsageFlags usage,
-const VkMemoryPropertyFlags properties) {
+void delete_DrawList(DrawList *pList, DeviceAllocator *pAllocator) {
+  for (uint32_t i = 0; i < pList->frameCount; i++) {
+    delete_Buffer(&pList->pBuffers[i], pList->device);
+    freeDeviceMemory(&pList->pMemory[i], pAllocator);
+  }
+  free(pList->pBuffers);
+  free(pList->pMemory);
+  free(pList->pDrawCounts);
+}
 
-  VkBufferCreateInfo bufferInfo {};
-  bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  bufferInfo.size = size;
-  bufferInfo.usage = usage;
-  bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  /* Create buffer */
-  VkResult bufferCreateResult =vkCreateBuffer(device, &bufferInfo, NULL, pBuffer);
-  if (bufferCreateResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create buffer: %s",
-                   vkstrerror(bufferCreateResult));
-    return (ERR_UNKNOWN);
+/* Fills frameIndex's slot; only call once that frame's fence has signaled.
+ * resetInstanceCounts writes every instanceCount as 0 for the GPU culler to
+ * count up from, firstInstance then marks the start of each draw's range */
+ErrVal writeDrawList(DrawList *pList, const uint32_t frameIndex, const VkDrawIndexedIndirectCommand *pDraws,
+const uint32_t drawCount, const bool resetInstanceCounts) {
+  if (drawCount > pList->maxDrawCount) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "draw list holds %u draws, not %u", pList->maxDrawCount, drawCount);
+    return (ERR_BADARGS);
+  }
+  char *pMapped = (char *)pList->pMemory[frameIndex].pMapped;
+  memcpy(pMapped, pDraws, drawCount * sizeof(VkDrawIndexedIndirectCommand));
+  if (resetInstanceCounts) {
+    VkDrawIndexedIndirectCommand *pCommands = (VkDrawIndexedIndirectCommand *)pMapped;
+    for (uint32_t i = 0; i < drawCount; i++) {
+      pCommands[i].instanceCount = 0;
+    }
   }
-  /* Allocate memory for buffer */
-  VkMemoryRequirements memoryRequirements;
-  vkGetBufferMemoryRequirements(device, *pBuffer, &memoryRequirements);
+  memcpy(pMapped + pList->countOffset, &drawCount, sizeof(uint32_t));
+  pList->pDrawCounts[frameIndex] = drawCount;
+  return (ERR_OK);
+}
 
-  VkMemoryAllocateInfo allocateInfo {};
-  allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocateInfo.allocationSize = memoryRequirements.size;
-  /* Get the type of memory required, handle errors */
-  ErrVal getMemoryTypeRetVal = getMemoryTypeIndex( &allocateInfo.memoryTypeIndex, memoryRequirements.memoryTypeBits,
-      properties, physicalDevice);
-  if (getMemoryTypeRetVal != ERR_OK) {
-    LOG_ERROR(ERR_LEVEL_ERROR, "failed to get type of memory to allocate");
-    return (ERR_MEMORY);
+/* Records frameIndex's draws; the pipeline and buffers must already be bound */
+void recordDrawList(const DrawList *pList, const VkCommandBuffer commandBuffer, const uint32_t frameIndex) {
+  VkBuffer buffer = pList->pBuffers[frameIndex];
+  uint32_t drawCount = pList->pDrawCounts[frameIndex];
+  uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+  if (pList->drawCount) {
+    vkCmdDrawIndexedIndirectCount(commandBuffer, buffer, 0, buffer, pList->countOffset, pList->maxDrawCount, stride);
+  } else if (pList->multiDraw) {
+    if (drawCount > 0) {
+      vkCmdDrawIndexedIndirect(commandBuffer, buffer, 0, drawCount, stride);
+    }
+  } else {
+    for (uint32_t i = 0; i < drawCount; i++) {
+      vkCmdDrawIndexedIndirect(commandBuffer, buffer, i * stride, 1, stride);
+    }
   }
+}
 
-  /* Actually allocate memory */
-  VkResult memoryAllocateResult =vkAllocateMemory(device, &allocateInfo, NULL, pBufferMemory);
-  if (memoryAllocateResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate memory for buffer: %s",
-                   vkstrerror(memoryAllocateResult));
-    return (ERR_ALLOCFAIL);
+/* Instance data the CPU rewrites every frame, one persistently mapped buffer
+ * per frame in flight so a frame never writes what the GPU is still reading */
+typedef struct {
+  VkDevice device;
+  uint32_t frameCount;
+  uint32_t instanceCount;
+  VkBuffer *pBuffers;
+  DeviceAllocation *pMemory;
+} InstanceStream;
+
+/* Every frame's buffer starts out as a copy of pInstances */
+ErrVal new_InstanceStream(InstanceStream *pStream, const InstanceData *pInstances, const uint32_t instanceCount,
+const uint32_t frameCount, DeviceAllocator *pAllocator, const VkDevice device) {
+  pStream->device = device;
+  pStream->frameCount = frameCount;
+  pStream->instanceCount = instanceCount;
+  pStream->pBuffers = (VkBuffer *)malloc(frameCount * sizeof(VkBuffer));
+  pStream->pMemory = (DeviceAllocation *)malloc(frameCount * sizeof(DeviceAllocation));
+  if (!pStream->pBuffers || !pStream->pMemory) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create instance stream: %s", strerror(errno));
+    PANIC();
+  }
+
+  // like the draw list, device local only when the CPU can write it directly
+  VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  if (hasMemoryType(pAllocator, properties | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+    properties |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  }
+  VkDeviceSize size = (VkDeviceSize)instanceCount * sizeof(InstanceData);
+  for (uint32_t i = 0; i < frameCount; i++) {
+    ErrVal retVal = new_Buffer_DeviceMemory(&pStream->pBuffers[i], &pStream->pMemory[i], size, pAllocator, device,
+                                            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                            properties);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_FATAL, "failed to create instance stream buffer");
+      PANIC();
+    }
+    memcpy(pStream->pMemory[i].pMapped, pInstances, size);
   }
-  vkBindBufferMemory(device, *pBuffer, *pBufferMemory, 0);
   return (ERR_OK);
 }
 
-// submits a copy to the queue, you'll later need to wait for idle
-ErrVal copyBuffer(VkBuffer destinationBuffer, const VkBuffer sourceBuffer,const VkDeviceSize size, 
-const VkCommandPool commandPool, const VkQueue queue, const VkDevice device) {
-  VkCommandBuffer copyCommandBuffer;
-  ErrVal createResult =new_CommandBuffers(&copyCommandBuffer, 1, commandPool, device);
-  if (createResult != ERR_OK) {
+void delete_InstanceStream(InstanceStream *pStream, DeviceAllocator *pAllocator) {
+  for (uint32_t i = 0; i < pStream->frameCount; i++) {
+    delete_Buffer(&pStream->pBuffers[i], pStream->device);
+    freeDeviceMemory(&pStream->pMemory[i], pAllocator);
   }
+  free(pStream->pBuffers);
+  free(pStream->pMemory);
+}
 
-  VkCommandBufferBeginInfo beginInfo {};
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+/* frameIndex's instances; only write them once that frame's fence has signaled */
+InstanceData *getInstanceStreamFrame(const InstanceStream *pStream, const uint32_t frameIndex) {
+  return ((InstanceData *)pStream->pMemory[frameIndex].pMapped);
+}
 
-  VkResult beginRet = vkBeginCommandBuffer(copyCommandBuffer, &beginInfo);
-  if (beginRet != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "Failed to begin copy command buffer: %s",
-                   vkstrerror(beginRet));
-    PANIC();
-  }
+/* GPU frustum culling, run as a compute pass ahead of the render pass. Each
+ * object's bounding sphere is tested against the frustum planes, and the
+ * instance data of survivors is copied from the frame's instance stream into
+ * their draw's instance range in a per frame visible instance stream, with
+ * the draw's instanceCount as the atomic counter. Nothing about
+ * culling touches the CPU beyond the push constants, and culled objects cost
+ * no vertex work. The layouts and group size come from reflecting
+ * assets/shaders/cull.comp, which is checked against the buffers bound here. */
+#define GPU_CULL_BINDING_COUNT 4
+#define GPU_CULL_MAX_GROUPS_X 65535
 
-VkBufferCopy copyRegion = { .srcOffset = 0, .dstOffset = 0, .size = size};
+typedef struct {
+  // world space center in xyz, radius in w
+  vec4 sphere;
+  // the draw this object is an instance of
+  uint32_t drawIndex;
+  uint32_t pad[3];
+} CullObject;
 
-  vkCmdCopyBuffer(copyCommandBuffer, sourceBuffer, destinationBuffer, 1,&copyRegion);
+typedef struct {
+  vec4 planes[6];
+  uint32_t objectCount;
+} CullConstants;
 
-  // End buffer
-  VkResult bufferEndResult = vkEndCommandBuffer(copyCommandBuffer);
-  if (bufferEndResult != VK_SUCCESS) {
-    /* Clean up resources */
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to end command buffer: %s",
-                   vkstrerror(bufferEndResult));
-    PANIC();
+typedef struct {
+  VkDevice device;
+  uint32_t frameCount;
+  uint32_t objectCount;
+  // the shader's local size x
+  uint32_t groupSize;
+  // both owned by the layout cache
+  VkDescriptorSetLayout descriptorSetLayout;
+  VkPipelineLayout pipelineLayout;
+  VkPipeline pipeline;
+  VkDescriptorPool descriptorPool;
+  VkBuffer objectBuffer;
+  DeviceAllocation objectMemory;
+  // frameCount entries each, bound to the draw list slot of the same frame
+  VkDescriptorSet *pDescriptorSets;
+  VkBuffer *pVisibleBuffers;
+  DeviceAllocation *pVisibleMemory;
+} GpuCuller;
+
+/* The cull shader has to read the buffers bound below, as storage buffers at
+ * set 0 bindings 0 to GPU_CULL_BINDING_COUNT - 1, take CullConstants as its
+ * push constants and run one dimensional groups */
+static ErrVal checkCullShader(const ShaderReflection *pReflection) {
+  bool match = pReflection->stage == VK_SHADER_STAGE_COMPUTE_BIT &&
+               pReflection->bindingCount == GPU_CULL_BINDING_COUNT &&
+               pReflection->pushConstantSize == sizeof(CullConstants) && pReflection->pLocalSize[0] > 0 &&
+               pReflection->pLocalSize[1] == 1 && pReflection->pLocalSize[2] == 1;
+  for (uint32_t i = 0; match && i < pReflection->bindingCount; i++) {
+    const ReflectedBinding *pBinding = &pReflection->pBindings[i];
+    match = pBinding->set == 0 && pBinding->binding < GPU_CULL_BINDING_COUNT &&
+            pBinding->type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER && pBinding->count == 1;
+  }
+  if (!match) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "cull shader does not match the culler's buffers and constants");
+    return (ERR_BADARGS);
   }
+  return (ERR_OK);
+}
 
-  // wait for completion with a fence
-  VkFence fence;
-  if (new_Fence(&fence, device, false) != ERR_OK) {
-    LOG_ERROR(ERR_LEVEL_FATAL, "Failed to make copy fence");
-    PANIC();
+/* The layouts of the cull shader, which can be had before the culler to
+ * build its pipeline ahead of time. Both are owned by pLayouts */
+ErrVal getGpuCullerLayouts(VkPipelineLayout *pPipelineLayout, VkDescriptorSetLayout *pSetLayout,
+const ShaderReflection *pReflection, LayoutCache *pLayouts) {
+  ErrVal retVal = checkCullShader(pReflection);
+  if (retVal != ERR_OK) {
+    return (retVal);
   }
+  VkDescriptorSetLayout pSetLayouts[MAX_REFLECTED_SETS];
+  retVal = getReflectedPipelineLayout(pPipelineLayout, pSetLayouts, pLayouts, pReflection, 1);
+  *pSetLayout = pSetLayouts[0];
+  return (retVal);
+}
 
-  VkSubmitInfo submitInfo {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &copyCommandBuffer;
+/* Object i's instance is entry i of pInstances, which has one buffer per
+ * frame like pDrawList. Each draw in pDrawList has to own the instance range
+ * starting at its firstInstance, big enough for all of its objects. pipeline
+ * is the cull shader's, with the layout from getGpuCullerLayouts, and belongs
+ * to the culler once it has been created */
+ErrVal new_GpuCuller(GpuCuller *pCuller, uint64_t *pUploadValue, const CullObject *pObjects,
+const uint32_t objectCount, const InstanceStream *pInstances, const DrawList *pDrawList,
+const VkPipeline pipeline, const ShaderReflection *pReflection, LayoutCache *pLayouts,
+DeviceAllocator *pAllocator, UploadScheduler *pUploads, const VkDevice device) {
+  pCuller->device = device;
+  pCuller->frameCount = pDrawList->frameCount;
+  pCuller->objectCount = objectCount;
+
+  if (pInstances->instanceCount != objectCount || pInstances->frameCount != pDrawList->frameCount) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "cull objects do not match the instance stream");
+    return (ERR_BADARGS);
+  }
+  ErrVal retVal = getGpuCullerLayouts(&pCuller->pipelineLayout, &pCuller->descriptorSetLayout, pReflection,
+                                      pLayouts);
+  if (retVal != ERR_OK) {
+    return (retVal);
+  }
+  pCuller->groupSize = pReflection->pLocalSize[0];
+  pCuller->pipeline = pipeline;
 
-  VkResult queueSubmitResult = vkQueueSubmit(queue, 1, &submitInfo, fence);
-  if (queueSubmitResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL,
-                   "failed to submit command buffer to queue: %s",
-                   vkstrerror(queueSubmitResult));
-    PANIC();
+  /* The object buffer's contents are staged last, once nothing else can fail,
+   * so every error path below can free what it made right away */
+  VkDeviceSize objectSize = (VkDeviceSize)objectCount * sizeof(CullObject);
+  retVal = new_Buffer_DeviceMemory(&pCuller->objectBuffer, &pCuller->objectMemory, objectSize, pAllocator, device,
+                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  if (retVal != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create cull object buffer");
+    return (retVal);
   }
 
-  VkResult waitRet = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
-  if (waitRet != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to wait for fence: %s",
-                   vkstrerror(waitRet));
+  retVal = new_DescriptorPool(&pCuller->descriptorPool, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                              pCuller->frameCount * GPU_CULL_BINDING_COUNT, device);
+  if (retVal != ERR_OK) {
+    delete_Buffer(&pCuller->objectBuffer, device);
+    freeDeviceMemory(&pCuller->objectMemory, pAllocator);
+    return (retVal);
+  }
+  pCuller->pDescriptorSets = (VkDescriptorSet *)malloc(pCuller->frameCount * sizeof(VkDescriptorSet));
+  pCuller->pVisibleBuffers = (VkBuffer *)malloc(pCuller->frameCount * sizeof(VkBuffer));
+  pCuller->pVisibleMemory = (DeviceAllocation *)malloc(pCuller->frameCount * sizeof(DeviceAllocation));
+  if (!pCuller->pDescriptorSets || !pCuller->pVisibleBuffers || !pCuller->pVisibleMemory) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to create gpu culler: %s", strerror(errno));
     PANIC();
   }
-
-  delete_Fence(&fence, device);
-
+  VkDeviceSize visibleSize = (VkDeviceSize)objectCount * sizeof(InstanceData);
+  uint32_t visibleCount = 0;
+  for (; visibleCount < pCuller->frameCount; visibleCount++) {
+    uint32_t i = visibleCount;
+    retVal = new_Buffer_DeviceMemory(&pCuller->pVisibleBuffers[i], &pCuller->pVisibleMemory[i], visibleSize,
+                                     pAllocator, device,
+                                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_ERROR, "failed to create visible instance buffer");
+      break;
+    }
+    VkBuffer pBuffers[GPU_CULL_BINDING_COUNT] = {pCuller->objectBuffer, pDrawList->pBuffers[i],
+                                                 pCuller->pVisibleBuffers[i], pInstances->pBuffers[i]};
+    VkDeviceSize pSizes[GPU_CULL_BINDING_COUNT] = {objectSize, pDrawList->countOffset, visibleSize, visibleSize};
+    retVal = new_ComputeBufferDescriptorSet(&pCuller->pDescriptorSets[i], GPU_CULL_BINDING_COUNT, pBuffers, pSizes,
+                                            pCuller->descriptorSetLayout, pCuller->descriptorPool, device);
+    if (retVal != ERR_OK) {
+      // this frame's buffer was made, count it for the cleanup
+      visibleCount++;
+      break;
+    }
+  }
+  if (retVal == ERR_OK) {
+    retVal = uploadBuffer(pUploadValue, pUploads, pCuller->objectBuffer, 0, pObjects, objectSize);
+    if (retVal != ERR_OK) {
+      LOG_ERROR(ERR_LEVEL_ERROR, "failed to create gpu culler: could not stage the cull objects");
+    }
+  }
+  if (retVal != ERR_OK) {
+    for (uint32_t i = 0; i < visibleCount; i++) {
+      delete_Buffer(&pCuller->pVisibleBuffers[i], device);
+      freeDeviceMemory(&pCuller->pVisibleMemory[i], pAllocator);
+    }
+    // the descriptor sets go with their pool
+    delete_DescriptorPool(&pCuller->descriptorPool, device);
+    delete_Buffer(&pCuller->objectBuffer, device);
+    freeDeviceMemory(&pCuller->objectMemory, pAllocator);
+    free(pCuller->pDescriptorSets);
+    free(pCuller->pVisibleBuffers);
+    free(pCuller->pVisibleMemory);
+    return (retVal);
+  }
   return (ERR_OK);
-};
+}
 
-void delete_Buffer(VkBuffer *pBuffer, const VkDevice device) {
-  vkDestroyBuffer(device, *pBuffer, NULL);
-  *pBuffer = VK_NULL_HANDLE;}
+void delete_GpuCuller(GpuCuller *pCuller, DeviceAllocator *pAllocator) {
+  for (uint32_t i = 0; i < pCuller->frameCount; i++) {
+    delete_Buffer(&pCuller->pVisibleBuffers[i], pCuller->device);
+    freeDeviceMemory(&pCuller->pVisibleMemory[i], pAllocator);
+  }
+  delete_Buffer(&pCuller->objectBuffer, pCuller->device);
+  freeDeviceMemory(&pCuller->objectMemory, pAllocator);
+  delete_DescriptorPool(&pCuller->descriptorPool, pCuller->device);
+  vkDestroyPipeline(pCuller->device, pCuller->pipeline, NULL);
+  free(pCuller->pDescriptorSets);
+  free(pCuller->pVisibleBuffers);
+  free(pCuller->pVisibleMemory);
+}
 
-void delete_DeviceMemory(VkDeviceMemory *pDeviceMemory, const VkDevice device) {
-vkFreeMemory(device, *pDeviceMemory, NULL);
-*pDeviceMemory = VK_NULL_HANDLE;}
+/* Records the cull of frameIndex against the frustum of viewProjection, and the
+ * barrier that makes its results visible to the draws. Goes outside the render
+ * pass, after the draw list slot has been written with reset instance counts */
+void recordGpuCull(const GpuCuller *pCuller, const VkCommandBuffer commandBuffer, const uint32_t frameIndex,
+const mat4x4 viewProjection) {
+  CullConstants constants {};
+  getFrustumPlanes(constants.planes, viewProjection);
+  constants.objectCount = pCuller->objectCount;
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pCuller->pipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pCuller->pipelineLayout, 0, 1,
+                          &pCuller->pDescriptorSets[frameIndex], 0, NULL);
+  vkCmdPushConstants(commandBuffer, pCuller->pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants),
+                     &constants);
+  uint32_t groupCount = (pCuller->objectCount + pCuller->groupSize - 1) / pCuller->groupSize;
+  uint32_t groupCountX = groupCount < GPU_CULL_MAX_GROUPS_X ? groupCount : GPU_CULL_MAX_GROUPS_X;
+  uint32_t groupCountY = (groupCount + GPU_CULL_MAX_GROUPS_X - 1) / GPU_CULL_MAX_GROUPS_X;
+  if (groupCount > 0) {
+    vkCmdDispatch(commandBuffer, groupCountX, groupCountY, 1);
+  }
+
+  VkMemoryBarrier barrier {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+  vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                       VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0,
+                       NULL, 0, NULL);
+}
 
-ErrVal copyToDeviceMemory(VkDeviceMemory *pDeviceMemory,const VkDeviceSize deviceSize, const void *source,
+/* With a draw list, the draws are written into it and issued indirectly from
+ * the primary buffer. Without one they are recorded in slices of
+ * DRAWS_PER_SECONDARY on the worker pool, and the primary buffer only begins
+ * the render pass and executes the slices in order. With a culler as well, the
+ * draw list's instance counts are filled on the GPU and the draws read their
+ * instances from the culler's visible stream instead of instanceBuffer.
+ * pOffscreen is NULL when rendering to the swapchain, otherwise the frame is
+ * copied out after the pass */
+ErrVal recordVertexDisplayCommandBuffer( VkCommandBuffer commandBuffer, const uint32_t frameIndex,
+uint64_t *pUploadWaitValue, UploadScheduler *pUploads, WorkerPool *pWorkers, GpuProfiler *pProfiler,
+SecondaryCommandPools *pSecondaryPools, DrawList *pDrawList, const GpuCuller *pCuller,
+OffscreenTarget *pOffscreen, const VkFramebuffer swapchainFramebuffer,
+const Mesh *pMesh, const VkBuffer instanceBuffer,
+const VkDrawIndexedIndirectCommand *pDraws, const uint32_t drawCount, const VkRenderPass renderPass,
+const VkPipelineLayout vertexDisplayPipelineLayout, const VkPipeline vertexDisplayPipeline, 
+const VkExtent2D swapchainExtent, const mat4x4 cameraTransform, const VkClearColorValue clearColor,
 const VkDevice device) {
-  void *data;
-  VkResult mapMemoryResult =
-      vkMapMemory(device, *pDeviceMemory, 0, deviceSize, 0, &data);
+  uint32_t secondaryCount = pDrawList ? 0 : (drawCount + DRAWS_PER_SECONDARY - 1) / DRAWS_PER_SECONDARY;
+  std::vector<VkCommandBuffer> secondaries(secondaryCount);
+
+  VertexDisplayRecordJob job;
+  job.pPools = pSecondaryPools;
+  job.frameIndex = frameIndex;
+  job.device = device;
+  job.renderPass = renderPass;
+  job.framebuffer = swapchainFramebuffer;
+  job.pipelineLayout = vertexDisplayPipelineLayout;
+  job.pipeline = vertexDisplayPipeline;
+  job.pMesh = pMesh;
+  job.instanceBuffer = pCuller ? pCuller->pVisibleBuffers[frameIndex] : instanceBuffer;
+  job.extent = swapchainExtent;
+  // secondaries can only be counted with inherited queries, without them no
+  // query may be active around vkCmdExecuteCommands
+  bool secondaryStatistics = pProfiler && pProfiler->statisticsEnabled && pProfiler->inheritedQueries;
+  job.pipelineStatistics = secondaryStatistics ? GPU_PROFILER_STATISTICS : 0;
+  job.pCameraTransform = cameraTransform;
+  job.pDraws = pDraws;
+  job.drawCount = drawCount;
+  job.pSecondaries = secondaries.data();
+  if (pDrawList) {
+    writeDrawList(pDrawList, frameIndex, pDraws, drawCount, pCuller != NULL);
+  } else {
+    runWorkerTasks(pWorkers, secondaryCount, recordVertexDisplaySecondary, &job);
+  }
+
+  VkCommandBufferBeginInfo beginInfo {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  VkResult beginRet = vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+  if (beginRet != VK_SUCCESS) {LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to record into graphics command buffer: %s",
+    vkstrerror(beginRet));
+    PANIC();
+  }
 
-  /* On failure */
-  if (mapMemoryResult != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR,
-                   "failed to copy to device memory: failed to map memory: %s",
-                   vkstrerror(mapMemoryResult));
-    return (ERR_MEMORY);
+  if (pProfiler) {
+    resetGpuProfilerFrame(pProfiler, commandBuffer, frameIndex);
   }
 
-  /* If it was successful, go on and actually copy it, making sure to unmap once
-   * done */
-  memcpy(data, source, (size_t)deviceSize);
-  vkUnmapMemory(device, *pDeviceMemory);
-  return (ERR_OK);
-}
-
-ErrVal new_VertexBuffer(VkBuffer *pBuffer, VkDeviceMemory *pBufferMemory,const Vertex *pVertices, 
-const uint32_t vertexCount,const VkDevice device,const VkPhysicalDevice physicalDevice,
-const VkCommandPool commandPool, const VkQueue queue) {
-  /* Construct staging buffers */
-  VkDeviceSize bufferSize = sizeof(Vertex) * vertexCount;
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  ErrVal stagingBufferCreateResult = new_Buffer_DeviceMemory(
-      &stagingBuffer, &stagingBufferMemory, bufferSize, physicalDevice, device,
-      VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-  if (stagingBufferCreateResult != ERR_OK) {
-    LOG_ERROR(
-        ERR_LEVEL_ERROR,
-        "failed to create vertex buffer: failed to create staging buffer");
-    return (stagingBufferCreateResult);
-  }
-
-  /* Copy data to staging buffer, making sure to clean up leaks */
-  ErrVal copyResult =
-      copyToDeviceMemory(&stagingBufferMemory, bufferSize, pVertices, device);
-  if (copyResult != ERR_OK) {
-    LOG_ERROR(ERR_LEVEL_ERROR,
-              "failed to create vertex buffer: could not map memory");
-    delete_Buffer(&stagingBuffer, device);
-    delete_DeviceMemory(&stagingBufferMemory, device);
-    return (copyResult);
-  }
-
-  /* Create vertex buffer and allocate memory for it */
-  ErrVal vertexBufferCreateResult = new_Buffer_DeviceMemory(
-      pBuffer, pBufferMemory, bufferSize, physicalDevice, device,
-      VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+  /* Take ownership of anything the transfer queue uploaded since the last frame */
+  recordUploadAcquires(pUploadWaitValue, pUploads, commandBuffer);
 
-  /* Handle errors */
-  if (vertexBufferCreateResult != ERR_OK) {
-    /* Delete the temporary staging buffers */
-    LOG_ERROR(ERR_LEVEL_ERROR, "failed to create vertex buffer");
-    delete_Buffer(&stagingBuffer, device);
-    delete_DeviceMemory(&stagingBufferMemory, device);
-    return (vertexBufferCreateResult);
+  if (pCuller) {
+    uint32_t cullScope = 0;
+    if (pProfiler) {
+      cullScope = beginGpuScope(pProfiler, commandBuffer, frameIndex, "cull", false);
+    }
+    recordGpuCull(pCuller, commandBuffer, frameIndex, cameraTransform);
+    if (pProfiler) {
+      endGpuScope(pProfiler, commandBuffer, frameIndex, cullScope);
+    }
   }
 
-  /* Copy the data over from the staging buffer to the vertex buffer */
-  copyBuffer(*pBuffer, stagingBuffer, bufferSize, commandPool, queue, device);
+  VkRenderPassBeginInfo renderPassInfo {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = renderPass;
+  renderPassInfo.framebuffer = swapchainFramebuffer;
+  renderPassInfo.renderArea.offset = (VkOffset2D){0, 0};
+  renderPassInfo.renderArea.extent = swapchainExtent;
+
+  VkClearValue pClearColors[2];
+  pClearColors[0].color = clearColor;
+  pClearColors[1].depthStencil.depth = 1.0f;
+  pClearColors[1].depthStencil.stencil = 0;
+
+  renderPassInfo.clearValueCount = 2;
+  renderPassInfo.pClearValues = pClearColors;
 
-  /* Delete the temporary staging buffers */
-  delete_Buffer(&stagingBuffer, device);
-  delete_DeviceMemory(&stagingBufferMemory, device);
+  uint32_t renderPassScope = 0;
+  if (pProfiler) {
+    renderPassScope = beginGpuScope(pProfiler, commandBuffer, frameIndex, "vertex display",
+                                    pDrawList != NULL || secondaryStatistics);
+  }
+  if (pDrawList) {
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    bindVertexDisplayState(commandBuffer, &job);
+    recordDrawList(pDrawList, commandBuffer, frameIndex);
+  } else {
+    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                         VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    if (secondaryCount > 0) {
+      vkCmdExecuteCommands(commandBuffer, secondaryCount, secondaries.data());
+    }
+  }
+  vkCmdEndRenderPass(commandBuffer);
+  if (pProfiler) {
+    endGpuScope(pProfiler, commandBuffer, frameIndex, renderPassScope);
+  }
+  if (pOffscreen) {
+    recordOffscreenReadback(pOffscreen, commandBuffer, frameIndex);
+  }
 
+  VkResult endCommandBufferRetVal = vkEndCommandBuffer(commandBuffer);
+  if (endCommandBufferRetVal != VK_SUCCESS) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL,
+                   "Failed to record command buffer, error code: %s",
+                   vkstrerror(endCommandBufferRetVal));
+    PANIC();
+  }
   return (ERR_OK);
 }
 
@@ -1792,250 +6740,1074 @@ const VkCommandPool commandPool, const VkDevice device) {
   }
 }
 
-ErrVal new_ComputePipeline(VkPipeline *pPipeline,const VkPipelineLayout pipelineLayout,
-const VkShaderModule shaderModule,const VkDevice device) {
 
-  VkPipelineShaderStageCreateInfo shaderStageCreateInfo {};
-  shaderStageCreateInfo.sType =
-      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageCreateInfo.module = shaderModule;
-  shaderStageCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
-  shaderStageCreateInfo.pName = "main";
 
-  VkComputePipelineCreateInfo computePipelineCreateInfo {};
-  computePipelineCreateInfo.sType =
-      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-  computePipelineCreateInfo.layout = pipelineLayout;
-  computePipelineCreateInfo.stage = shaderStageCreateInfo;
+/* Settings that trade latency against throughput, picked per deployment on
+ * the command line */
+typedef struct {
+  VkPresentModeKHR presentMode;
+  uint32_t framesInFlight;
+  bool profileGpu;
+  bool pipelineStatistics;
+  // NULL unless a trace was asked for
+  const char *pTracePath;
+  // render frameCount frames offscreen without a window, then exit
+  bool headless;
+  uint32_t headlessFrameCount;
+  // printf format for the frames read back in headless mode, NULL for none
+  const char *pOutputPath;
+  VkExtent2D extent;
+  bool validation;
+  // record every draw on the CPU instead of through the draw list
+  bool directDraws;
+  // draw every instance instead of frustum culling them on the GPU
+  bool noCull;
+  // time benchFrameCount headless frames after benchWarmupFrames untimed ones,
+  // 0 outside a benchmark run; pBenchPath is the JSON report, NULL for none
+  uint32_t benchFrameCount;
+  uint32_t benchWarmupFrames;
+  const char *pBenchPath;
+  // the synthetic scene: objects split evenly over drawCount draws, each a
+  // cube, or a sphere of meshSegments segments when that is not 0
+  uint32_t objectCount;
+  uint32_t drawCount;
+  uint32_t meshSegments;
+  // NULL for the first suitable device, else part of the device's name
+  const char *pDeviceName;
+  // the directory shaders are loaded from when they are not embedded
+  const char *pAssetRoot;
+  // recompile and swap in the scene shaders when their sources change
+  bool hotReload;
+  // the scene pipeline variant to draw with
+  PipelineKey pipelineKey;
+  // build every variant at startup, not just pipelineKey's
+  bool prebuildVariants;
+  // build whole pipelines even where graphics pipeline libraries are supported
+  bool noPipelineLibrary;
+} AppConfig;
+
+static void printUsage(const char *pProgramName) {
+  printf("usage: %s [options]\n"
+         "  --present-mode <fifo|fifo-relaxed|mailbox|immediate>  default fifo\n"
+         "  --frames-in-flight <1-%d>                             default %d\n"
+         "  --profile-gpu                                         log gpu scope timings\n"
+         "  --pipeline-statistics                                 also collect pipeline statistics\n"
+         "  --trace <file>                                        write a cpu and gpu trace (chrome json)\n"
+         "  --headless <frames>                                   render offscreen without a window\n"
+         "  --output <pattern>                                    headless frame files, e.g. frame_{frame}.ppm\n"
+         "                                                        (.ppm for PPM, anything else raw RGBA8)\n"
+         "  --size <width>x<height>                               default 800x600\n"
+         "  --no-validation                                       skip the validation layer\n"
+         "  --direct-draws                                        record draws on the cpu, not indirectly\n"
+         "  --no-cull                                             skip gpu frustum culling\n"
+         "  --device <name>                                       use the device whose name contains this,\n"
+         "                                                        e.g. llvmpipe\n"
+         "  --objects <n>                                         scene objects, default %d\n"
+         "  --draws <n>                                           draws the objects are split over, default 1\n"
+         "  --mesh-segments <n>                                   spheres of n segments instead of cubes\n"
+         "  --bench <frames>                                      headless benchmark: time this many frames\n"
+         "  --warmup <frames>                                     untimed frames first, default %d\n"
+         "  --bench-json <file>                                   write the benchmark results as json\n"
+         "  --assets <dir>                                        asset directory, default %s\n"
+         "  --hot-reload                                          rebuild the scene pipeline when its shader\n"
+         "                                                        sources change, needs glslangValidator\n"
+         "  --flat-color                                          ignore the vertex colors\n"
+         "  --lights <0-%d>                                        directional lights, default 0 (unlit)\n"
+         "  --prebuild-variants                                   build every scene pipeline variant at startup\n"
+         "  --no-pipeline-library                                 don't link variants from pipeline libraries\n",
+         pProgramName, MAX_FRAMES_IN_FLIGHT, DEFAULT_FRAMES_IN_FLIGHT, SCENE_GRID_SIZE * SCENE_GRID_SIZE,
+         DEFAULT_BENCH_WARMUP_FRAMES, DEFAULT_ASSET_ROOT, MAX_SCENE_LIGHTS);
+}
 
-  VkResult ret = vkCreateComputePipelines(
-      device, VK_NULL_HANDLE, 1, &computePipelineCreateInfo, NULL, pPipeline);
-  if (ret != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create compute pipelines %s",
-                   vkstrerror(ret));
-    return (ERR_UNKNOWN);
+ErrVal parseAppConfig(AppConfig *pConfig, const int argc, char **argv) {
+  pConfig->presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  pConfig->framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+  pConfig->profileGpu = false;
+  pConfig->pipelineStatistics = false;
+  pConfig->pTracePath = NULL;
+  pConfig->headless = false;
+  pConfig->headlessFrameCount = 0;
+  pConfig->pOutputPath = NULL;
+  pConfig->extent = (VkExtent2D){.width = 800, .height = 600};
+  pConfig->validation = true;
+  pConfig->directDraws = false;
+  pConfig->noCull = false;
+  pConfig->benchFrameCount = 0;
+  pConfig->benchWarmupFrames = DEFAULT_BENCH_WARMUP_FRAMES;
+  pConfig->pBenchPath = NULL;
+  pConfig->objectCount = SCENE_GRID_SIZE * SCENE_GRID_SIZE;
+  pConfig->drawCount = 1;
+  pConfig->meshSegments = 0;
+  pConfig->pDeviceName = NULL;
+  pConfig->pAssetRoot = DEFAULT_ASSET_ROOT;
+  pConfig->hotReload = false;
+  pConfig->pipelineKey = DEFAULT_PIPELINE_KEY;
+  pConfig->prebuildVariants = false;
+  pConfig->noPipelineLibrary = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char *pArg = argv[i];
+    const char *pValue = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(pArg, "--present-mode") == 0 && pValue) {
+      if (strcmp(pValue, "fifo") == 0) {
+        pConfig->presentMode = VK_PRESENT_MODE_FIFO_KHR;
+      } else if (strcmp(pValue, "fifo-relaxed") == 0) {
+        pConfig->presentMode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+      } else if (strcmp(pValue, "mailbox") == 0) {
+        pConfig->presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+      } else if (strcmp(pValue, "immediate") == 0) {
+        pConfig->presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+      } else {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "unknown present mode: %s", pValue);
+        return (ERR_BADARGS);
+      }
+      i++;
+    } else if (strcmp(pArg, "--frames-in-flight") == 0 && pValue) {
+      long frames = strtol(pValue, NULL, 10);
+      if (frames < 1 || frames > MAX_FRAMES_IN_FLIGHT) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "frames in flight must be between 1 and %d", MAX_FRAMES_IN_FLIGHT);
+        return (ERR_BADARGS);
+      }
+      pConfig->framesInFlight = (uint32_t)frames;
+      i++;
+    } else if (strcmp(pArg, "--profile-gpu") == 0) {
+      pConfig->profileGpu = true;
+    } else if (strcmp(pArg, "--pipeline-statistics") == 0) {
+      pConfig->profileGpu = true;
+      pConfig->pipelineStatistics = true;
+    } else if (strcmp(pArg, "--trace") == 0 && pValue) {
+      // the gpu track comes from the profiler's timestamps
+      pConfig->profileGpu = true;
+      pConfig->pTracePath = pValue;
+      i++;
+    } else if (strcmp(pArg, "--headless") == 0 && pValue) {
+      long frames = strtol(pValue, NULL, 10);
+      if (frames < 1) {
+        LOG_ERROR(ERR_LEVEL_ERROR, "headless frame count must be at least 1");
+        return (ERR_BADARGS);
+      }
+      pConfig->headless = true;
+      pConfig->headlessFrameCount = (uint32_t)frames;
+      i++;
+    } else if (strcmp(pArg, "--output") == 0 && pValue) {
+      pConfig->pOutputPath = pValue;
+      i++;
+    } else if (strcmp(pArg, "--size") == 0 && pValue) {
+      unsigned width;
+      unsigned height;
+      if (sscanf(pValue, "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "bad size: %s", pValue);
+        return (ERR_BADARGS);
+      }
+      pConfig->extent = (VkExtent2D){.width = width, .height = height};
+      i++;
+    } else if (strcmp(pArg, "--no-validation") == 0) {
+      pConfig->validation = false;
+    } else if (strcmp(pArg, "--direct-draws") == 0) {
+      pConfig->directDraws = true;
+    } else if (strcmp(pArg, "--no-cull") == 0) {
+      pConfig->noCull = true;
+    } else if (strcmp(pArg, "--device") == 0 && pValue) {
+      pConfig->pDeviceName = pValue;
+      i++;
+    } else if (strcmp(pArg, "--objects") == 0 && pValue) {
+      long objects = strtol(pValue, NULL, 10);
+      if (objects < 1) {
+        LOG_ERROR(ERR_LEVEL_ERROR, "object count must be at least 1");
+        return (ERR_BADARGS);
+      }
+      pConfig->objectCount = (uint32_t)objects;
+      i++;
+    } else if (strcmp(pArg, "--draws") == 0 && pValue) {
+      long draws = strtol(pValue, NULL, 10);
+      if (draws < 1) {
+        LOG_ERROR(ERR_LEVEL_ERROR, "draw count must be at least 1");
+        return (ERR_BADARGS);
+      }
+      pConfig->drawCount = (uint32_t)draws;
+      i++;
+    } else if (strcmp(pArg, "--mesh-segments") == 0 && pValue) {
+      long segments = strtol(pValue, NULL, 10);
+      if (segments < 3 || segments > MAX_MESH_SEGMENTS) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "mesh segments must be between 3 and %d", MAX_MESH_SEGMENTS);
+        return (ERR_BADARGS);
+      }
+      pConfig->meshSegments = (uint32_t)segments;
+      i++;
+    } else if (strcmp(pArg, "--bench") == 0 && pValue) {
+      long frames = strtol(pValue, NULL, 10);
+      if (frames < 1) {
+        LOG_ERROR(ERR_LEVEL_ERROR, "bench frame count must be at least 1");
+        return (ERR_BADARGS);
+      }
+      pConfig->benchFrameCount = (uint32_t)frames;
+      i++;
+    } else if (strcmp(pArg, "--warmup") == 0 && pValue) {
+      long frames = strtol(pValue, NULL, 10);
+      if (frames < 0) {
+        LOG_ERROR(ERR_LEVEL_ERROR, "warmup frame count cannot be negative");
+        return (ERR_BADARGS);
+      }
+      pConfig->benchWarmupFrames = (uint32_t)frames;
+      i++;
+    } else if (strcmp(pArg, "--bench-json") == 0 && pValue) {
+      pConfig->pBenchPath = pValue;
+      i++;
+    } else if (strcmp(pArg, "--assets") == 0 && pValue) {
+      pConfig->pAssetRoot = pValue;
+      i++;
+    } else if (strcmp(pArg, "--hot-reload") == 0) {
+      pConfig->hotReload = true;
+    } else if (strcmp(pArg, "--flat-color") == 0) {
+      pConfig->pipelineKey.pValues[PIPELINE_FEATURE_VERTEX_COLORS] = VK_FALSE;
+    } else if (strcmp(pArg, "--lights") == 0 && pValue) {
+      long lights = strtol(pValue, NULL, 10);
+      if (lights < 0 || lights > MAX_SCENE_LIGHTS) {
+        LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "light count must be between 0 and %d", MAX_SCENE_LIGHTS);
+        return (ERR_BADARGS);
+      }
+      pConfig->pipelineKey.pValues[PIPELINE_FEATURE_LIGHT_COUNT] = (uint32_t)lights;
+      i++;
+    } else if (strcmp(pArg, "--prebuild-variants") == 0) {
+      pConfig->prebuildVariants = true;
+    } else if (strcmp(pArg, "--no-pipeline-library") == 0) {
+      pConfig->noPipelineLibrary = true;
+    } else {
+      LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "unknown argument: %s", pArg);
+      return (ERR_BADARGS);
+    }
+  }
+  if (pConfig->pOutputPath && !pConfig->headless) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "--output needs --headless");
+    return (ERR_BADARGS);
+  }
+  // otherwise every frame would overwrite the last
+  if (pConfig->pOutputPath && !strstr(pConfig->pOutputPath, OFFSCREEN_FRAME_TOKEN)) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "--output needs " OFFSCREEN_FRAME_TOKEN " where the frame number goes");
+    return (ERR_BADARGS);
+  }
+  if (pConfig->hotReload && pConfig->headless) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "--hot-reload needs a window");
+    return (ERR_BADARGS);
+  }
+  if (pConfig->drawCount > pConfig->objectCount) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "cannot split the objects over more draws than there are objects");
+    return (ERR_BADARGS);
+  }
+  /* A benchmark is a headless run with the gpu profiler on for gpu times and
+   * the validation layer off, which would otherwise dominate the cpu times */
+  if (pConfig->benchFrameCount > 0) {
+    if (pConfig->pOutputPath) {
+      LOG_ERROR(ERR_LEVEL_ERROR, "--output cannot be combined with --bench");
+      return (ERR_BADARGS);
+    }
+    pConfig->headless = true;
+    pConfig->headlessFrameCount = pConfig->benchWarmupFrames + pConfig->benchFrameCount;
+    pConfig->profileGpu = true;
+    pConfig->validation = false;
+  } else if (pConfig->pBenchPath) {
+    LOG_ERROR(ERR_LEVEL_ERROR, "--bench-json needs --bench");
+    return (ERR_BADARGS);
   }
   return (ERR_OK);
 }
 
-ErrVal new_ComputeStorageDescriptorSetLayout(VkDescriptorSetLayout *pDescriptorSetLayout, const VkDevice device) {
-  VkDescriptorSetLayoutBinding storageLayoutBinding {};
-  storageLayoutBinding.binding = 0;
-  storageLayoutBinding.descriptorCount = 1;
-  storageLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  storageLayoutBinding.pImmutableSamplers = NULL;
-  storageLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-  VkDescriptorSetLayoutCreateInfo layoutInfo {};
-  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  layoutInfo.bindingCount = 1;
-  layoutInfo.pBindings = &storageLayoutBinding;
-  VkResult retVal = vkCreateDescriptorSetLayout(device, &layoutInfo, NULL,
-                                                pDescriptorSetLayout);
-  if (retVal != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR,
-                   "failed to create descriptor set layout: %s",
-                   vkstrerror(retVal));
-    return (ERR_UNKNOWN);
+struct VulkContext{
+
+    VkInstance instance;
+     VkDebugUtilsMessengerEXT callback;
+     VkPhysicalDevice physicalDevice;
+     GLFWwindow *pWindow;
+     VkSurfaceKHR surface;
+     VkExtent2D swapchainExtent;
+VkDevice device;
+     VkQueue graphicsQueue;
+     VkQueue transferQueue;
+      VkCommandPool commandPool;
+        VkSurfaceFormatKHR surfaceFormat;
+        VkSwapchainKHR swapchain;
+  uint32_t graphicsQueueFamilyIndex;
+  uint32_t presentQueueFamilyIndex;
+  uint32_t swapchainImageCount;
+  VkImage *pSwapchainImages;
+  VkImageView *pSwapchainImageViews;
+  VkFramebuffer *pSwapchainFramebuffers;
+  DeviceAllocator allocator;
+  // objects frames in flight may still use wait here to be destroyed
+  DeletionQueue deletions;
+  DeviceAllocation depthImageMemory;
+  VkImage depthImage;
+  VkImageView depthImageView;
+  VkRenderPass renderPass;
+  // owned by layouts
+  VkPipelineLayout graphicsPipelineLayout;
+  // owned by pipelineVariants, or by the shader reloader once it has swapped
+  VkPipeline graphicsPipeline;
+  // pipelineVariants' generation graphicsPipeline was last looked up at
+  uint32_t pipelineGeneration;
+  LayoutCache layouts;
+  PipelineVariants pipelineVariants;
+  PipelineBuilder pipelineBuilder;
+  PipelineCache pipelineCache;
+  Mesh mesh;
+  SceneTransforms sceneTransforms;
+  InstanceStream instances;
+  UploadScheduler uploads;
+  WorkerPool workers;
+  SecondaryCommandPools secondaryCommandPools;
+  // NULL when draws are recorded directly
+  DrawList *pDrawList;
+  DrawList drawList;
+  // NULL without a draw list or when culling is turned off
+  GpuCuller *pCuller;
+  GpuCuller culler;
+  // NULL unless gpu profiling was asked for
+  GpuProfiler *pGpuProfiler;
+  GpuProfiler gpuProfiler;
+  // NULL unless shader hot reload was asked for
+  ShaderReloader *pShaderReloader;
+  ShaderReloader shaderReloader;
+  // NULL unless a trace was asked for, as is the gpu track
+  Tracer *pTracer;
+  Tracer tracer;
+  TraceThreadBuffer *pGpuTrack;
+  VkPresentModeKHR presentMode;
+  // headless runs have no window, surface or swapchain and render into offscreen
+  bool headless;
+  OffscreenTarget offscreen;
+  // every per frame array below holds framesInFlight entries
+  uint32_t framesInFlight;
+  VkCommandBuffer *pVertexDisplayCommandBuffers;
+  VkSemaphore *pImageAvailableSemaphores;
+  VkSemaphore *pRenderFinishedSemaphores;
+  VkFence *pInFlightFences;
+};
+
+VulkContext context;
+
+/* Rebuilds everything sized by the window: the swapchain, its image views, the
+ * depth buffer and the framebuffers. The render pass and pipeline survive,
+ * since viewport and scissor are dynamic state. The old swapchain is handed to
+ * the new one so the presentation engine can reuse its resources. Frames in
+ * flight still use the old objects, so they are retired rather than
+ * destroyed and the device keeps running */
+ErrVal recreateSwapchain(VulkContext *pContext) {
+  VkExtent2D extent;
+  getExtentWindow(&extent, pContext->pWindow);
+  // a minimized window has nothing to render to, so sleep until it comes back
+  while (extent.width == 0 || extent.height == 0) {
+    glfwWaitEvents();
+    getExtentWindow(&extent, pContext->pWindow);
+  }
+  double startMs = getTimeMs();
+
+  for (uint32_t i = 0; i < pContext->swapchainImageCount; i++) {
+    retireFramebuffer(&pContext->deletions, &pContext->pSwapchainFramebuffers[i]);
+    retireImageView(&pContext->deletions, &pContext->pSwapchainImageViews[i]);
+  }
+  free(pContext->pSwapchainFramebuffers);
+  free(pContext->pSwapchainImageViews);
+  free(pContext->pSwapchainImages);
+  retireImageView(&pContext->deletions, &pContext->depthImageView);
+  retireImage(&pContext->deletions, &pContext->depthImage);
+  retireDeviceMemory(&pContext->deletions, &pContext->depthImageMemory);
+
+  pContext->swapchainExtent = extent;
+  VkSwapchainKHR oldSwapchain = pContext->swapchain;
+  new_Swapchain(&pContext->swapchain, &pContext->swapchainImageCount, oldSwapchain, pContext->surfaceFormat,
+                pContext->physicalDevice, pContext->device, pContext->surface, pContext->swapchainExtent,
+                pContext->graphicsQueueFamilyIndex, pContext->presentQueueFamilyIndex, pContext->presentMode,
+                pContext->framesInFlight);
+  retireSwapchain(&pContext->deletions, &oldSwapchain);
+
+  pContext->pSwapchainImages = (VkImage *)malloc(pContext->swapchainImageCount * sizeof(VkImage));
+  pContext->pSwapchainImageViews = (VkImageView *)malloc(pContext->swapchainImageCount * sizeof(VkImageView));
+  pContext->pSwapchainFramebuffers = (VkFramebuffer *)malloc(pContext->swapchainImageCount * sizeof(VkFramebuffer));
+  if (!pContext->pSwapchainImages || !pContext->pSwapchainImageViews || !pContext->pSwapchainFramebuffers) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to recreate swapchain: %s", strerror(errno));
+    PANIC();
   }
+  getSwapchainImages(pContext->pSwapchainImages, pContext->swapchainImageCount, pContext->device,
+                     pContext->swapchain);
+  new_SwapchainImageViews(pContext->pSwapchainImageViews, pContext->pSwapchainImages, pContext->swapchainImageCount,
+                          pContext->device, pContext->surfaceFormat.format);
+
+  new_DepthImage(&pContext->depthImage, &pContext->depthImageMemory, pContext->swapchainExtent,
+                 &pContext->allocator, pContext->device);
+  new_DepthImageView(&pContext->depthImageView, pContext->device, pContext->depthImage);
+
+  new_SwapchainFramebuffers(pContext->pSwapchainFramebuffers, pContext->device, pContext->renderPass,
+                            pContext->swapchainExtent, pContext->swapchainImageCount, pContext->depthImageView,
+                            pContext->pSwapchainImageViews);
+
+  LOG_ERROR_ARGS(ERR_LEVEL_DEBUG, "recreated %ux%u swapchain in %.3f ms", extent.width, extent.height,
+                 getTimeMs() - startMs);
   return (ERR_OK);
 }
 
-void delete_DescriptorSetLayout(VkDescriptorSetLayout *pDescriptorSetLayout,const VkDevice device) {
-vkDestroyDescriptorSetLayout(device, *pDescriptorSetLayout, NULL);
-*pDescriptorSetLayout = VK_NULL_HANDLE;
+/* Per frame timings collected by a benchmark run (--bench), reduced to
+ * percentiles at the end. CPU time is the whole frame iteration on the host,
+ * GPU time the span of the frame's profiler scopes */
+typedef struct {
+  uint32_t capacity;
+  uint32_t cpuCount;
+  uint32_t gpuCount;
+  double *pCpuMs;
+  double *pGpuMs;
+} FrameStats;
+
+ErrVal new_FrameStats(FrameStats *pStats, const uint32_t capacity) {
+  pStats->capacity = capacity;
+  pStats->cpuCount = 0;
+  pStats->gpuCount = 0;
+  pStats->pCpuMs = (double *)malloc(capacity * sizeof(double));
+  pStats->pGpuMs = (double *)malloc(capacity * sizeof(double));
+  if (!pStats->pCpuMs || !pStats->pGpuMs) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate frame stats: %s", strerror(errno));
+    free(pStats->pCpuMs);
+    free(pStats->pGpuMs);
+    return (ERR_ALLOCFAIL);
+  }
+  return (ERR_OK);
 }
 
-ErrVal new_DescriptorPool(VkDescriptorPool *pDescriptorPool,const VkDescriptorType descriptorType,
-const uint32_t maxAllocFrom, const VkDevice device) {
-  VkDescriptorPoolSize descriptorPoolSize;
-  descriptorPoolSize.type = descriptorType;
-  descriptorPoolSize.descriptorCount = maxAllocFrom;
+void delete_FrameStats(FrameStats *pStats) {
+  free(pStats->pCpuMs);
+  free(pStats->pGpuMs);
+  pStats->pCpuMs = NULL;
+  pStats->pGpuMs = NULL;
+}
 
-  VkDescriptorPoolCreateInfo poolInfo {};
-  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  poolInfo.poolSizeCount = 1;
-  poolInfo.pPoolSizes = &descriptorPoolSize;
-  poolInfo.maxSets = maxAllocFrom;
+void addCpuFrameTime(FrameStats *pStats, const double ms) {
+  if (pStats->cpuCount < pStats->capacity) {
+    pStats->pCpuMs[pStats->cpuCount++] = ms;
+  }
+}
 
-  /* Actually create descriptor pool */
-  VkResult ret =
-      vkCreateDescriptorPool(device, &poolInfo, NULL, pDescriptorPool);
+void addGpuFrameTime(FrameStats *pStats, const GpuFrameProfile *pProfile) {
+  uint64_t endNs = 0;
+  for (uint32_t i = 0; i < pProfile->scopeCount; i++) {
+    const GpuProfileScope *pScope = &pProfile->pScopes[i];
+    if (pScope->beginNs + pScope->durationNs > endNs) {
+      endNs = pScope->beginNs + pScope->durationNs;
+    }
+  }
+  if (pStats->gpuCount < pStats->capacity) {
+    pStats->pGpuMs[pStats->gpuCount++] = (double)endNs / 1e6;
+  }
+}
 
-  if (ret != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to create descriptor pool; %s",
-                   vkstrerror(ret));
-    return (ERR_UNKNOWN);
-  } else {
+static int compareDoubles(const void *pA, const void *pB) {
+  double a = *(const double *)pA;
+  double b = *(const double *)pB;
+  return (a < b ? -1 : a > b ? 1 : 0);
+}
+
+typedef struct {
+  uint32_t count;
+  double meanMs;
+  double p50Ms;
+  double p90Ms;
+  double p99Ms;
+  double maxMs;
+} FrameTimeSummary;
+
+/* Sorts pMs in place; nearest rank percentiles */
+static FrameTimeSummary summarizeFrameTimes(double *pMs, const uint32_t count) {
+  FrameTimeSummary summary {};
+  summary.count = count;
+  if (count == 0) {
+    return (summary);
+  }
+  qsort(pMs, count, sizeof(double), compareDoubles);
+  double totalMs = 0.0;
+  for (uint32_t i = 0; i < count; i++) {
+    totalMs += pMs[i];
+  }
+  summary.meanMs = totalMs / count;
+  summary.p50Ms = pMs[(count - 1) * 50 / 100];
+  summary.p90Ms = pMs[(count - 1) * 90 / 100];
+  summary.p99Ms = pMs[(count - 1) * 99 / 100];
+  summary.maxMs = pMs[count - 1];
+  return (summary);
+}
+
+static void writeFrameTimeSummaryJson(FILE *fp, const char *pName, const FrameTimeSummary *pSummary) {
+  fprintf(fp,
+          "  \"%s\": {\"frames\": %u, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, "
+          "\"max_ms\": %.4f},\n",
+          pName, pSummary->count, pSummary->meanMs, pSummary->p50Ms, pSummary->p90Ms, pSummary->p99Ms,
+          pSummary->maxMs);
+}
+
+/* Logs the benchmark results and writes them as JSON to pPath unless it is
+ * NULL. Triangles are the ones submitted, before GPU culling */
+ErrVal reportBenchmark(FrameStats *pStats, const AppConfig *pConfig, const char *pDeviceName, const bool indirect,
+const bool culling, const uint32_t drawsPerFrame, const uint64_t trianglesPerFrame, const double measuredMs,
+const char *pPath) {
+  FrameTimeSummary cpu = summarizeFrameTimes(pStats->pCpuMs, pStats->cpuCount);
+  FrameTimeSummary gpu = summarizeFrameTimes(pStats->pGpuMs, pStats->gpuCount);
+  double framesPerSecond = measuredMs > 0.0 ? cpu.count * 1000.0 / measuredMs : 0.0;
+  double drawsPerSecond = framesPerSecond * drawsPerFrame;
+  double trianglesPerSecond = framesPerSecond * (double)trianglesPerFrame;
+
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "bench: %u objects in %u draws, %llu triangles, %ux%u on %s",
+                 pConfig->objectCount, drawsPerFrame, (unsigned long long)trianglesPerFrame,
+                 pConfig->extent.width, pConfig->extent.height, pDeviceName);
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "bench: cpu frame ms p50 %.3f p90 %.3f p99 %.3f max %.3f", cpu.p50Ms, cpu.p90Ms,
+                 cpu.p99Ms, cpu.maxMs);
+  if (gpu.count > 0) {
+    LOG_ERROR_ARGS(ERR_LEVEL_INFO, "bench: gpu frame ms p50 %.3f p90 %.3f p99 %.3f max %.3f", gpu.p50Ms,
+                   gpu.p90Ms, gpu.p99Ms, gpu.maxMs);
+  }
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "bench: %.1f fps, %.0f draws/s, %.0f triangles/s", framesPerSecond,
+                 drawsPerSecond, trianglesPerSecond);
+
+  if (!pPath) {
     return (ERR_OK);
   }
+  FILE *fp = fopen(pPath, "w");
+  if (!fp) {
+    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "could not open %s: %s", pPath, strerror(errno));
+    return (ERR_UNKNOWN);
+  }
+  fputs("{\n  \"device\": ", fp);
+  writeJsonString(fp, pDeviceName);
+  fputs(",\n", fp);
+  fprintf(fp,
+          "  \"scene\": {\"objects\": %u, \"draws\": %u, \"mesh_segments\": %u, \"triangles\": %llu, "
+          "\"width\": %u, \"height\": %u, \"culling\": %s, \"indirect\": %s},\n",
+          pConfig->objectCount, drawsPerFrame, pConfig->meshSegments, (unsigned long long)trianglesPerFrame,
+          pConfig->extent.width, pConfig->extent.height, culling ? "true" : "false", indirect ? "true" : "false");
+  fprintf(fp, "  \"warmup_frames\": %u,\n  \"frames_in_flight\": %u,\n", pConfig->benchWarmupFrames,
+          pConfig->framesInFlight);
+  writeFrameTimeSummaryJson(fp, "cpu", &cpu);
+  writeFrameTimeSummaryJson(fp, "gpu", &gpu);
+  fprintf(fp, "  \"fps\": %.2f,\n  \"draws_per_second\": %.1f,\n  \"triangles_per_second\": %.1f\n}\n",
+          framesPerSecond, drawsPerSecond, trianglesPerSecond);
+  fclose(fp);
+  return (ERR_OK);
 }
 
-void delete_DescriptorPool(VkDescriptorPool *pDescriptorPool,const VkDevice device){
-vkDestroyDescriptorPool(device, *pDescriptorPool, NULL); *pDescriptorPool = VK_NULL_HANDLE;};
-
-ErrVal new_ComputeBufferDescriptorSet(VkDescriptorSet *pDescriptorSet, const VkBuffer computeBufferDescriptorSet,
-const VkDeviceSize computeBufferSize,const VkDescriptorSetLayout descriptorSetLayout,
-const VkDescriptorPool descriptorPool, const VkDevice device) {
+/* Renders the configured number of frames offscreen from a fixed camera. A
+ * frame's pixels are written out when its slot comes round again, so the
+ * writes overlap the frames still in flight; the last few are written once the
+ * device has drained. In a benchmark run the frames after the warmup ones are
+ * timed and reported */
+ErrVal renderHeadless(VulkContext *pContext, const AppConfig *pConfig, const Camera *pCamera,
+const VkDrawIndexedIndirectCommand *pDraws, const uint32_t drawCount) {
+  double startMs = getTimeMs();
+  mat4x4 mvp;
+  getMvpCamera(mvp, pCamera);
 
-  VkDescriptorSetAllocateInfo allocateInfo {};
-  allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  allocateInfo.descriptorPool = descriptorPool;
-  allocateInfo.descriptorSetCount = 1;
-  allocateInfo.pSetLayouts = &descriptorSetLayout;
-  VkResult allocateDescriptorSetRetVal =
-      vkAllocateDescriptorSets(device, &allocateInfo, pDescriptorSet);
-  if (allocateDescriptorSetRetVal != VK_SUCCESS) {
-    LOG_ERROR_ARGS(ERR_LEVEL_ERROR, "failed to allocate descriptor sets: %s",
-                   vkstrerror(allocateDescriptorSetRetVal));
-    return (ERR_MEMORY);
+  FrameStats stats;
+  FrameStats *pStats = NULL;
+  if (pConfig->benchFrameCount > 0 && new_FrameStats(&stats, pConfig->benchFrameCount) == ERR_OK) {
+    pStats = &stats;
   }
+  double measureStartMs = startMs;
+
+  uint32_t currentFrame = 0;
+  for (uint32_t frame = 0; frame < pConfig->headlessFrameCount; frame++) {
+    uint64_t frameStartNs = getTimeNs();
+    if (frame == pConfig->benchWarmupFrames) {
+      measureStartMs = getTimeMs();
+    }
+    TraceZone frameZone = beginTraceZone("frame");
+    TraceZone zone = beginTraceZone("waitAndResetFence");
+    waitAndResetFence(pContext->pInFlightFences[currentFrame], pContext->device);
+    endTraceZone(&zone);
+    collectDeletionQueue(&pContext->deletions, frame);
+    retireReplacedPipelineVariants(&pContext->pipelineVariants);
+    refreshPipelineVariant(&pContext->graphicsPipeline, &pContext->pipelineGeneration, &pContext->pipelineVariants,
+                           &pConfig->pipelineKey);
+    pollUploads(&pContext->uploads);
+    resetSecondaryCommandPools(&pContext->secondaryCommandPools, currentFrame, pContext->device);
+    if (pContext->pGpuProfiler && readGpuProfilerFrame(pContext->pGpuProfiler, currentFrame)) {
+      const GpuFrameProfile *pProfile = getGpuFrameProfile(pContext->pGpuProfiler);
+      traceGpuFrameProfile(pContext->pGpuTrack, pContext->pGpuProfiler, pProfile);
+      if (pStats && pProfile->frameNumber >= pConfig->benchWarmupFrames) {
+        addGpuFrameTime(pStats, pProfile);
+      } else if (pProfile->frameNumber % GPU_PROFILER_LOG_INTERVAL == 0) {
+        logGpuFrameProfile(pProfile);
+      }
+    }
+    if (pConfig->pOutputPath) {
+      zone = beginTraceZone("writeOffscreenFrame");
+      writeOffscreenFrame(&pContext->offscreen, currentFrame, pConfig->pOutputPath);
+      endTraceZone(&zone);
+    }
 
-  VkDescriptorBufferInfo bufferInfo {};
-  bufferInfo.buffer = computeBufferDescriptorSet;
-  bufferInfo.range = computeBufferSize;
-  bufferInfo.offset = 0;
+    uint64_t submittedUploadValue;
+    submitUploads(&submittedUploadValue, &pContext->uploads);
+
+    writeSceneTransforms(&pContext->workers, &pContext->sceneTransforms,
+                         getInstanceStreamFrame(&pContext->instances, currentFrame), true);
+
+    uint64_t uploadWaitValue;
+    zone = beginTraceZone("recordVertexDisplayCommandBuffer");
+    recordVertexDisplayCommandBuffer(pContext->pVertexDisplayCommandBuffers[currentFrame], currentFrame,
+                                     &uploadWaitValue, &pContext->uploads, &pContext->workers,
+                                     pContext->pGpuProfiler, &pContext->secondaryCommandPools, pContext->pDrawList,
+                                     pContext->pCuller, &pContext->offscreen,
+                                     pContext->offscreen.pFramebuffers[currentFrame], &pContext->mesh,
+                                     pContext->instances.pBuffers[currentFrame], pDraws, drawCount, pContext->renderPass,
+                                     pContext->graphicsPipelineLayout,
+                                     pContext->graphicsPipeline, pContext->swapchainExtent, mvp,
+                                     (VkClearColorValue){.float32 = {0, 0, 0, 0}}, pContext->device);
+    endTraceZone(&zone);
+
+    zone = beginTraceZone("submitFrame");
+    submitFrame(pContext->pVertexDisplayCommandBuffers[currentFrame], VK_NULL_HANDLE, VK_NULL_HANDLE,
+                pContext->pInFlightFences[currentFrame], pContext->graphicsQueue, pContext->uploads.timeline,
+                uploadWaitValue);
+    endTraceZone(&zone);
+
+    currentFrame = (currentFrame + 1) % pContext->framesInFlight;
+    endTraceZone(&frameZone);
+    if (pStats && frame >= pConfig->benchWarmupFrames) {
+      addCpuFrameTime(pStats, (double)(getTimeNs() - frameStartNs) / 1e6);
+    }
+  }
 
-  VkWriteDescriptorSet descriptorWrites {};
-  descriptorWrites.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  descriptorWrites.dstSet = *pDescriptorSet;
-  descriptorWrites.dstBinding = 0;
-  descriptorWrites.dstArrayElement = 0;
-  descriptorWrites.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-  descriptorWrites.descriptorCount = 1;
-  descriptorWrites.pBufferInfo = &bufferInfo;
-  descriptorWrites.pImageInfo = NULL;
-  descriptorWrites.pTexelBufferView = NULL;
-  vkUpdateDescriptorSets(device, 1, &descriptorWrites, 0, NULL);
+  vkDeviceWaitIdle(pContext->device);
+  if (pStats) {
+    double measuredMs = getTimeMs() - measureStartMs;
+    uint64_t trianglesPerFrame = 0;
+    for (uint32_t i = 0; i < drawCount; i++) {
+      trianglesPerFrame += (uint64_t)pDraws[i].instanceCount * (pDraws[i].indexCount / 3);
+    }
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(pContext->physicalDevice, &properties);
+    reportBenchmark(pStats, pConfig, properties.deviceName, pContext->pDrawList != NULL,
+                    pContext->pCuller != NULL, drawCount, trianglesPerFrame, measuredMs, pConfig->pBenchPath);
+    delete_FrameStats(pStats);
+  }
+  if (pConfig->pOutputPath) {
+    // oldest first
+    for (uint32_t i = 0; i < pContext->framesInFlight; i++) {
+      writeOffscreenFrame(&pContext->offscreen, (currentFrame + i) % pContext->framesInFlight, pConfig->pOutputPath);
+    }
+  }
+  double elapsedMs = getTimeMs() - startMs;
+  LOG_ERROR_ARGS(ERR_LEVEL_INFO, "rendered %u headless frames in %.3f ms (%.1f fps)", pConfig->headlessFrameCount,
+                 elapsedMs, pConfig->headlessFrameCount * 1000.0 / elapsedMs);
   return (ERR_OK);
 }
 
-void delete_DescriptorSets(VkDescriptorSet **ppDescriptorSets) {
-  free(*ppDescriptorSets);
-  *ppDescriptorSets = NULL;
-}
+int main(int argc, char **argv){
+  AppConfig config;
+  if (parseAppConfig(&config, argc, argv) != ERR_OK) {
+    printUsage(argv[0]);
+    return (EXIT_FAILURE);
+  }
+
+  // started first so the worker threads register as they come up
+  context.pTracer = NULL;
+  context.pGpuTrack = NULL;
+  if (config.pTracePath && new_Tracer(&context.tracer, config.pTracePath) == ERR_OK) {
+    context.pTracer = &context.tracer;
+  }
 
-int main(){
+  // headless runs never touch glfw, so they work without a display server
+  // and on software drivers such as lavapipe
+  context.headless = config.headless;
+  if (!context.headless) {
 glfwInit();
+  }
 
-  const uint32_t validationLayerCount = 1;
+  const uint32_t validationLayerCount = config.validation ? 1 : 0;
   const char *ppValidationLayerNames[1] = {"VK_LAYER_KHRONOS_validation"};
 
-  new_Instance(&context.instance, validationLayerCount, ppValidationLayerNames, 0, NULL,true, true, "herro");
+  new_Instance(&context.instance, validationLayerCount, ppValidationLayerNames, 0, NULL, !context.headless,
+               config.validation, "herro");
  
+  if (config.validation) {
   new_DebugCallback(&context.callback, context.instance);
+  }
 
-  getPhysicalDevice(&context.physicalDevice, context.instance);
+  if (getPhysicalDevice(&context.physicalDevice, context.instance, config.pDeviceName) != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_FATAL, "no usable Vulkan device");
+    PANIC();
+  }
 
-  new_GlfwWindow(&context.pWindow, "HellYeah", (VkExtent2D){.width = 800, .height = 600});
+  if (!context.headless) {
+  new_GlfwWindow(&context.pWindow, "HellYeah", config.extent);
 
   new_SurfaceFromGLFW(&context.surface, context.pWindow, context.instance);
+  }
  
   uint32_t graphicsIndex;
   uint32_t computeIndex;
   uint32_t presentIndex;
+  uint32_t transferIndex;
   {
     uint32_t ret1 = getQueueFamilyIndexByCapability(&graphicsIndex, context.physicalDevice, VK_QUEUE_GRAPHICS_BIT);
     uint32_t ret2 = getQueueFamilyIndexByCapability(&computeIndex, context.physicalDevice, VK_QUEUE_COMPUTE_BIT);
-    uint32_t ret3 =getPresentQueueFamilyIndex(&presentIndex, context.physicalDevice, context.surface);
+    uint32_t ret3 = VK_SUCCESS;
+    presentIndex = graphicsIndex;
+    if (!context.headless) {
+      ret3 = getPresentQueueFamilyIndex(&presentIndex, context.physicalDevice, context.surface);
+    }
    
     if (ret1 != VK_SUCCESS || ret2 != VK_SUCCESS || ret3 != VK_SUCCESS) {
       LOG_ERROR(ERR_LEVEL_FATAL, "unable to acquire indices\n");
       PANIC();
     }
+
+    /* prefer a transfer only family (usually the copy engine), else share the graphics queue */
+    if (getDedicatedQueueFamilyIndex(&transferIndex, context.physicalDevice, VK_QUEUE_TRANSFER_BIT,
+                                     VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT) != ERR_OK) {
+      transferIndex = graphicsIndex;
+    }
   };
 
+  if (context.headless) {
+    context.swapchainExtent = config.extent;
+  } else {
   getExtentWindow(&context.swapchainExtent, context.pWindow);
+  }
 
   /* we want to use swapchains to reduce tearing */
-  const uint32_t deviceExtensionCount = 1;
-  const char *ppDeviceExtensionNames[] = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+  uint32_t deviceExtensionCount = 0;
+  const char *ppDeviceExtensionNames[4];
+  if (!context.headless) {
+    ppDeviceExtensionNames[deviceExtensionCount++] = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+  }
+  // scene pipeline variants are linked from libraries where that's fast
+  bool pipelineLibrary = !config.noPipelineLibrary && getPipelineLibrarySupport(context.physicalDevice);
+  if (pipelineLibrary) {
+    ppDeviceExtensionNames[deviceExtensionCount++] = VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME;
+    ppDeviceExtensionNames[deviceExtensionCount++] = VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME;
+    LOG_ERROR(ERR_LEVEL_INFO, "linking scene pipelines from graphics pipeline libraries");
+  }
+  // optional, tells the pipeline cache stats which creations were hits
+  bool creationFeedback = hasDeviceExtension(context.physicalDevice, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+  if (creationFeedback) {
+    ppDeviceExtensionNames[deviceExtensionCount++] = VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME;
+  }
 
-  new_Device(&context.device, context.physicalDevice, graphicsIndex, deviceExtensionCount,ppDeviceExtensionNames);
+  const uint32_t pQueueFamilyIndices[] = {graphicsIndex, computeIndex, presentIndex, transferIndex};
+  new_Device(&context.device, context.physicalDevice, 4, pQueueFamilyIndices, deviceExtensionCount,
+             ppDeviceExtensionNames, pipelineLibrary);
 
   getQueue(&context.graphicsQueue, context.device, graphicsIndex);
   VkQueue computeQueue;
   getQueue(&computeQueue, context.device, computeIndex);
   VkQueue presentQueue;
   getQueue(&presentQueue, context.device, presentIndex);
+  getQueue(&context.transferQueue, context.device, transferIndex);
+  context.graphicsQueueFamilyIndex = graphicsIndex;
+  context.presentQueueFamilyIndex = presentIndex;
 
   new_CommandPool(&context.commandPool, context.device, graphicsIndex);
 
+  new_DeviceAllocator(&context.allocator, context.physicalDevice, context.device);
+
+  new_LayoutCache(&context.layouts, context.device);
+
+  context.framesInFlight = config.framesInFlight;
+  new_DeletionQueue(&context.deletions, context.framesInFlight, &context.allocator, context.device);
+  if (context.headless) {
+    context.surfaceFormat.format = OFFSCREEN_COLOR_FORMAT;
+    context.surfaceFormat.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+  } else {
   /* get preferred format of screen*/
   getPreferredSurfaceFormat(&context.surfaceFormat, context.physicalDevice, context.surface);
+  getPresentMode(&context.presentMode, context.physicalDevice, context.surface, config.presentMode);
+  }
 
-  uint32_t swapchainImageCount;
-  new_Swapchain(&context.swapchain, &swapchainImageCount, VK_NULL_HANDLE, context.surfaceFormat,context.physicalDevice,
-context.device, context.surface, context.swapchainExtent, graphicsIndex,presentIndex);
-
-  // there are swapchainImageCount swapchainImages
-  VkImage *pSwapchainImages = (VkImage *)malloc(swapchainImageCount * sizeof(VkImage));
-  getSwapchainImages(pSwapchainImages, swapchainImageCount, context.device, context.swapchain);
+  /* Everything the pipelines depend on comes first, so they compile on the
+   * pipeline builder while the swapchain, framebuffers and scene buffers are
+   * made. The first frame waits only for the ones it draws with */
+  VkShaderModule fragShaderModule;
+  VkShaderModule vertShaderModule;
+  // vertex then fragment
+  ShaderReflection pSceneReflections[2];
+  if (loadShaderModule(&vertShaderModule, &pSceneReflections[0], config.pAssetRoot, "shaders/shader.vert.spv",
+                       context.device) != ERR_OK ||
+      loadShaderModule(&fragShaderModule, &pSceneReflections[1], config.pAssetRoot, "shaders/shader.frag.spv",
+                       context.device) != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_FATAL, "failed to load the scene shaders");
+    PANIC();
+  }
 
-  // there are swapchainImageCount swapchainImageViews
-  VkImageView *pSwapchainImageViews =(VkImageView *)malloc(swapchainImageCount * sizeof(VkImageView));
-  new_SwapchainImageViews(pSwapchainImageViews, pSwapchainImages, swapchainImageCount, context.device, context.surfaceFormat.format);
+  new_VertexDisplayRenderPass(&context.renderPass, context.device, context.surfaceFormat.format,
+                              context.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
 
-  /* Create depth buffer */
-  new_DepthImage(&context.depthImage, &context.depthImageMemory, context.swapchainExtent,context.physicalDevice,
-context.device);
-  VkImageView depthImageView;
-  new_DepthImageView(&depthImageView, context.device, context.depthImage);
+  // the frame loop pushes the view projection matrix to the vertex stage
+  if (pSceneReflections[0].pushConstantSize != sizeof(mat4x4) || pSceneReflections[1].pushConstantSize != 0 ||
+      getReflectedPipelineLayout(&context.graphicsPipelineLayout, NULL, &context.layouts, pSceneReflections, 2) !=
+          ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_FATAL, "the scene shaders do not take a view projection matrix as push constants");
+    PANIC();
+  }
 
-VkShaderModule fragShaderModule;
-  {
-    uint32_t *fragShaderFileContents;
-    uint32_t fragShaderFileLength;
-readShaderFile("/home/petermiller/Desktop/vulkan-triangle-v1-master/assets/shaders/shader.frag.spv", &fragShaderFileLength,
-                   &fragShaderFileContents);
-    new_ShaderModule(&fragShaderModule, context.device, fragShaderFileLength,fragShaderFileContents);
-    free(fragShaderFileContents);
+  new_PipelineCache(&context.pipelineCache, PIPELINE_CACHE_PATH, context.physicalDevice, creationFeedback,
+                    context.device);
+  new_PipelineVariants(&context.pipelineVariants, vertShaderModule, fragShaderModule, &pSceneReflections[0],
+                       context.renderPass, context.graphicsPipelineLayout, &context.pipelineCache, pipelineLibrary,
+                       &context.deletions, context.device);
+  new_PipelineBuilder(&context.pipelineBuilder, 0, &context.pipelineCache, context.device);
+
+  // the scene pipeline, then the cull pipeline when culling may be used
+  std::vector<PipelineDesc> pipelineDescs;
+  pipelineDescs.push_back((PipelineDesc){.type = PIPELINE_BUILD_VARIANT, .pVariants = &context.pipelineVariants,
+                                         .key = config.pipelineKey});
+  VkShaderModule cullShaderModule = VK_NULL_HANDLE;
+  ShaderReflection cullReflection;
+  bool cullPipelineQueued = false;
+  if (!config.directDraws && !config.noCull) {
+    PipelineDesc cullDesc {};
+    cullDesc.type = PIPELINE_BUILD_COMPUTE;
+    VkDescriptorSetLayout cullSetLayout;
+    if (loadShaderModule(&cullShaderModule, &cullReflection, config.pAssetRoot, "shaders/cull.comp.spv",
+                         context.device) == ERR_OK &&
+        getGpuCullerLayouts(&cullDesc.pipelineLayout, &cullSetLayout, &cullReflection, &context.layouts) == ERR_OK) {
+      cullDesc.shaderModule = cullShaderModule;
+      pipelineDescs.push_back(cullDesc);
+      cullPipelineQueued = true;
+    } else {
+      delete_ShaderModule(&cullShaderModule, context.device);
+    }
   }
 
-  VkShaderModule vertShaderModule;
-  {
-    uint32_t *vertShaderFileContents;
-    uint32_t vertShaderFileLength;
-readShaderFile("/home/petermiller/Desktop/vulkan-triangle-v1-master/assets/shaders/shader.vert.spv", &vertShaderFileLength,
-                   &vertShaderFileContents);
-    new_ShaderModule(&vertShaderModule, context.device, vertShaderFileLength,vertShaderFileContents);
-    free(vertShaderFileContents);
+  // speculative builds go last, so they don't hold up the first frame
+  for (uint32_t i = 0; config.prebuildVariants && i < PIPELINE_VARIANT_COUNT; i++) {
+    PipelineKey key = getPipelineVariantKey(i);
+    if (!equalPipelineKeys(key, config.pipelineKey)) {
+      pipelineDescs.push_back((PipelineDesc){.type = PIPELINE_BUILD_VARIANT, .pVariants = &context.pipelineVariants,
+                                             .key = key});
+    }
   }
+  std::vector<PipelineTicket> pipelineTickets(pipelineDescs.size());
+  queuePipelineBuilds(&context.pipelineBuilder, pipelineDescs.data(), (uint32_t)pipelineDescs.size(),
+                      pipelineTickets.data());
+  PipelineTicket sceneTicket = pipelineTickets[0];
+  PipelineTicket cullTicket = cullPipelineQueued ? pipelineTickets[1] : 0;
 
-  /* Create graphics pipeline */
-  new_VertexDisplayRenderPass(&context.renderPass, context.device, context.surfaceFormat.format);
+  if (!context.headless) {
+  new_Swapchain(&context.swapchain, &context.swapchainImageCount, VK_NULL_HANDLE, context.surfaceFormat,context.physicalDevice,
+context.device, context.surface, context.swapchainExtent, graphicsIndex,presentIndex, context.presentMode,
+context.framesInFlight);
 
-  new_VertexDisplayPipelineLayout(&context.graphicsPipelineLayout, context.device);
+  // there are context.swapchainImageCount swapchainImages
+  context.pSwapchainImages = (VkImage *)malloc(context.swapchainImageCount * sizeof(VkImage));
+  getSwapchainImages(context.pSwapchainImages, context.swapchainImageCount, context.device, context.swapchain);
 
-  new_VertexDisplayPipeline(&context.graphicsPipeline, context.device, vertShaderModule,fragShaderModule, 
-  context.swapchainExtent, context.renderPass,context.graphicsPipelineLayout);
+  // there are context.swapchainImageCount swapchainImageViews
+  context.pSwapchainImageViews =(VkImageView *)malloc(context.swapchainImageCount * sizeof(VkImageView));
+  new_SwapchainImageViews(context.pSwapchainImageViews, context.pSwapchainImages, context.swapchainImageCount, context.device, context.surfaceFormat.format);
+  }
 
-VkFramebuffer *pSwapchainFramebuffers = (VkFramebuffer *)malloc(swapchainImageCount * sizeof(VkFramebuffer));
-new_SwapchainFramebuffers(pSwapchainFramebuffers, context.device, context.renderPass, context.swapchainExtent, 
-swapchainImageCount, depthImageView, pSwapchainImageViews);
+  /* Create depth buffer */
+  new_DepthImage(&context.depthImage, &context.depthImageMemory, context.swapchainExtent,&context.allocator,
+context.device);
+  new_DepthImageView(&context.depthImageView, context.device, context.depthImage);
 
-new_VertexBuffer(&context.vertexBuffer, &context.vertexBufferMemory, vertexData, vertexCount,context.device, 
-context.physicalDevice, context.commandPool, context.graphicsQueue);
+  if (context.headless) {
+    new_OffscreenTarget(&context.offscreen, context.swapchainExtent, context.framesInFlight,
+                        config.pOutputPath != NULL, context.renderPass, context.depthImageView, &context.allocator,
+                        context.device);
+  } else {
+context.pSwapchainFramebuffers = (VkFramebuffer *)malloc(context.swapchainImageCount * sizeof(VkFramebuffer));
+new_SwapchainFramebuffers(context.pSwapchainFramebuffers, context.device, context.renderPass, context.swapchainExtent, 
+context.swapchainImageCount, context.depthImageView, context.pSwapchainImageViews);
+  }
+
+new_UploadScheduler(&context.uploads, STAGING_RING_SIZE, context.transferQueue, transferIndex, graphicsIndex,
+&context.allocator, context.device);
+
+uint64_t meshUploadValue;
+float meshRadius = CUBE_RADIUS;
+if (config.meshSegments > 0) {
+  std::vector<Vertex> sphereVertices;
+  std::vector<uint32_t> sphereIndices;
+  buildSphereMesh(&sphereVertices, &sphereIndices, config.meshSegments);
+  new_Mesh(&context.mesh, &meshUploadValue, sphereVertices.data(), (uint32_t)sphereVertices.size(),
+           sphereIndices.data(), (uint32_t)sphereIndices.size(), context.device, &context.allocator,
+           &context.uploads);
+  meshRadius = SPHERE_RADIUS;
+} else {
+new_Mesh(&context.mesh, &meshUploadValue, cubeVertices, cubeVertexCount, cubeIndices, cubeIndexCount,
+context.device, &context.allocator, &context.uploads);
+}
 
-  new_CommandBuffers(context.pVertexDisplayCommandBuffers, MAX_FRAMES_IN_FLIGHT, context.commandPool, context.device);
-  new_Semaphores(context.pImageAvailableSemaphores, MAX_FRAMES_IN_FLIGHT, context.device);
-  new_Semaphores(context.pRenderFinishedSemaphores, MAX_FRAMES_IN_FLIGHT, context.device);
-  new_Fences(context.pInFlightFences, MAX_FRAMES_IN_FLIGHT, context.device,
+/* grids of meshes in front of the camera, each spinning about its own axis.
+ * The camera looks down +z, see getMvpCamera */
+if (new_SceneTransforms(&context.sceneTransforms, config.objectCount) != ERR_OK) {
+  PANIC();
+}
+std::vector<InstanceData> sceneInstances(config.objectCount);
+for (uint32_t i = 0; i < config.objectCount; i++) {
+  uint32_t x = i % SCENE_GRID_SIZE;
+  uint32_t y = i / SCENE_GRID_SIZE % SCENE_GRID_SIZE;
+  uint32_t layer = i / (SCENE_GRID_SIZE * SCENE_GRID_SIZE);
+  float offset = (SCENE_GRID_SIZE - 1) * SCENE_GRID_SPACING * 0.5f;
+  vec3 position = {x * SCENE_GRID_SPACING - offset, y * SCENE_GRID_SPACING - offset,
+                   SCENE_GRID_DISTANCE + layer * SCENE_LAYER_SPACING};
+  vec3 scale = {1.0f, 1.0f, 1.0f};
+  quat rotation;
+  quat_identity(rotation);
+  vec3 axis = {(float)x / SCENE_GRID_SIZE - 0.5f, 1.0f, (float)y / SCENE_GRID_SIZE - 0.5f};
+  vec3_norm(axis, axis);
+  quat spin;
+  quat_rotate(spin, SCENE_SPIN_SPEED, axis);
+  setSceneTransform(&context.sceneTransforms, i, position, rotation, scale, spin);
+
+  sceneInstances[i].color[0] = (float)x / SCENE_GRID_SIZE;
+  sceneInstances[i].color[1] = (float)y / SCENE_GRID_SIZE;
+  sceneInstances[i].color[2] = 1.0f;
+  sceneInstances[i].color[3] = 1.0f;
+}
+mat4x4_batch_trs(&sceneInstances[0].transform, NULL, sizeof(InstanceData), NULL, &context.sceneTransforms.soa, 0,
+                 sceneInstances.size());
+new_InstanceStream(&context.instances, sceneInstances.data(), (uint32_t)sceneInstances.size(),
+                   context.framesInFlight, &context.allocator, context.device);
+
+/* the objects split evenly into config.drawCount draws of consecutive
+ * instances, one by default, recorded in slices across the worker pool */
+std::vector<VkDrawIndexedIndirectCommand> sceneDraws;
+std::vector<uint32_t> sceneObjectDraws(config.objectCount);
+for (uint32_t draw = 0; draw < config.drawCount; draw++) {
+  uint32_t firstInstance = (uint32_t)((uint64_t)config.objectCount * draw / config.drawCount);
+  uint32_t endInstance = (uint32_t)((uint64_t)config.objectCount * (draw + 1) / config.drawCount);
+  for (uint32_t i = firstInstance; i < endInstance; i++) {
+    sceneObjectDraws[i] = draw;
+  }
+  sceneDraws.push_back((VkDrawIndexedIndirectCommand){.indexCount = context.mesh.indexCount,
+                                                      .instanceCount = endInstance - firstInstance,
+                                                      .firstIndex = 0, .vertexOffset = 0,
+                                                      .firstInstance = firstInstance});
+}
+logDeviceAllocatorStats(&context.allocator);
+
+  context.pVertexDisplayCommandBuffers = (VkCommandBuffer *)malloc(context.framesInFlight * sizeof(VkCommandBuffer));
+  context.pImageAvailableSemaphores = (VkSemaphore *)malloc(context.framesInFlight * sizeof(VkSemaphore));
+  context.pRenderFinishedSemaphores = (VkSemaphore *)malloc(context.framesInFlight * sizeof(VkSemaphore));
+  context.pInFlightFences = (VkFence *)malloc(context.framesInFlight * sizeof(VkFence));
+  if (!context.pVertexDisplayCommandBuffers || !context.pImageAvailableSemaphores ||
+      !context.pRenderFinishedSemaphores || !context.pInFlightFences) {
+    LOG_ERROR_ARGS(ERR_LEVEL_FATAL, "failed to allocate frame resources: %s", strerror(errno));
+    PANIC();
+  }
+  new_CommandBuffers(context.pVertexDisplayCommandBuffers, context.framesInFlight, context.commandPool, context.device);
+  new_WorkerPool(&context.workers, 0);
+  new_SecondaryCommandPools(&context.secondaryCommandPools, context.framesInFlight, context.workers.workerCount,
+                            graphicsIndex, context.device);
+  new_Semaphores(context.pImageAvailableSemaphores, context.framesInFlight, context.device);
+  new_Semaphores(context.pRenderFinishedSemaphores, context.framesInFlight, context.device);
+  new_Fences(context.pInFlightFences, context.framesInFlight, context.device,
              true); // fences start off signaled
 
+  context.pDrawList = NULL;
+  if (!config.directDraws &&
+      new_DrawList(&context.drawList, (uint32_t)sceneDraws.size(), context.framesInFlight, context.physicalDevice,
+                   &context.allocator, context.device) == ERR_OK) {
+    context.pDrawList = &context.drawList;
+  }
+
+  /* every object is one cull object of its scene draw, bounded by the sphere
+   * around its mesh whichever way it has spun */
+  context.pCuller = NULL;
+  if (cullPipelineQueued) {
+    VkPipeline cullPipeline;
+    ErrVal cullResult = waitPipelineBuild(&cullPipeline, &context.pipelineBuilder, cullTicket);
+    // the module was only needed for the build
+    delete_ShaderModule(&cullShaderModule, context.device);
+    if (cullResult == ERR_OK && context.pDrawList) {
+      std::vector<CullObject> cullObjects(context.sceneTransforms.count);
+      for (uint32_t i = 0; i < context.sceneTransforms.count; i++) {
+        CullObject *pObject = &cullObjects[i];
+        pObject->sphere[0] = context.sceneTransforms.pPosition[0][i];
+        pObject->sphere[1] = context.sceneTransforms.pPosition[1][i];
+        pObject->sphere[2] = context.sceneTransforms.pPosition[2][i];
+        pObject->sphere[3] = meshRadius;
+        pObject->drawIndex = sceneObjectDraws[i];
+      }
+
+      uint64_t cullUploadValue;
+      if (new_GpuCuller(&context.culler, &cullUploadValue, cullObjects.data(), (uint32_t)cullObjects.size(),
+                        &context.instances, context.pDrawList, cullPipeline, &cullReflection, &context.layouts,
+                        &context.allocator, &context.uploads, context.device) == ERR_OK) {
+        context.pCuller = &context.culler;
+      }
+    }
+    if (!context.pCuller && cullPipeline != VK_NULL_HANDLE) {
+      delete_Pipeline(&cullPipeline, context.device);
+    }
+  }
+
+  context.pGpuProfiler = NULL;
+  if (config.profileGpu &&
+      new_GpuProfiler(&context.gpuProfiler, context.framesInFlight, config.pipelineStatistics, graphicsIndex,
+                      context.physicalDevice, context.device) == ERR_OK) {
+    context.pGpuProfiler = &context.gpuProfiler;
+    if (context.pTracer && calibrateGpuProfiler(context.pGpuProfiler, context.commandPool,
+                                                context.graphicsQueue) == ERR_OK) {
+      context.pGpuTrack = new_TraceTrack("gpu");
+    }
+  }
+
   // create camera
   vec3 loc = {0.0f, 0.0f, 0.0f};
   Camera camera = new_Camera(loc, context.swapchainExtent);
 
   // this number counts which frame we're on
-  // up to MAX_FRAMES_IN_FLIGHT, at whcich points it resets to 0
+  // up to context.framesInFlight, at whcich points it resets to 0
   uint32_t currentFrame = 0;
+  // and this one never resets
+  uint64_t frameNumber = 0;
+
+  if (waitPipelineBuild(&context.graphicsPipeline, &context.pipelineBuilder, sceneTicket) != ERR_OK) {
+    LOG_ERROR(ERR_LEVEL_FATAL, "failed to build the scene pipeline");
+    PANIC();
+  }
+  context.pipelineGeneration = 0;
+  logPipelineCacheStats(&context.pipelineCache);
+
+  context.pShaderReloader = NULL;
+  if (config.hotReload &&
+      new_ShaderReloader(&context.shaderReloader, config.pAssetRoot, context.renderPass, &context.layouts,
+                         context.graphicsPipelineLayout, &config.pipelineKey, &context.deletions,
+                         context.device) == ERR_OK) {
+    context.pShaderReloader = &context.shaderReloader;
+  }
+
+  if (context.headless) {
+    renderHeadless(&context, &config, &camera, sceneDraws.data(), (uint32_t)sceneDraws.size());
+  }
 
   /*wait till close*/
-  while (!glfwWindowShouldClose(context.pWindow)) {
+  while (!context.headless && !glfwWindowShouldClose(context.pWindow)) {
+    TraceZone frameZone = beginTraceZone("frame");
+    TraceZone zone = beginTraceZone("glfwPollEvents");
     glfwPollEvents();
+    endTraceZone(&zone);
 
     // wait for last frame to finish
+    zone = beginTraceZone("waitAndResetFence");
     waitAndResetFence(context.pInFlightFences[currentFrame], context.device);
+    endTraceZone(&zone);
+    collectDeletionQueue(&context.deletions, frameNumber);
+    retireReplacedPipelineVariants(&context.pipelineVariants);
+    pollUploads(&context.uploads);
+    resetSecondaryCommandPools(&context.secondaryCommandPools, currentFrame, context.device);
+    if (context.pGpuProfiler && readGpuProfilerFrame(context.pGpuProfiler, currentFrame)) {
+      const GpuFrameProfile *pProfile = getGpuFrameProfile(context.pGpuProfiler);
+      traceGpuFrameProfile(context.pGpuTrack, context.pGpuProfiler, pProfile);
+      if (pProfile->frameNumber % GPU_PROFILER_LOG_INTERVAL == 0) {
+        logGpuFrameProfile(pProfile);
+      }
+    }
+    // once shaders were reloaded the variants' pipelines are out of date
+    if (!context.pShaderReloader || context.pShaderReloader->current == VK_NULL_HANDLE) {
+      refreshPipelineVariant(&context.graphicsPipeline, &context.pipelineGeneration, &context.pipelineVariants,
+                             &config.pipelineKey);
+    }
+    if (context.pShaderReloader) {
+      context.graphicsPipeline = swapReloadedPipeline(context.pShaderReloader, context.graphicsPipeline);
+    }
 
     // the imageIndex is the index of the swapchain framebuffer that is
     // available next
@@ -2043,122 +7815,148 @@ context.physicalDevice, context.commandPool, context.graphicsQueue);
     // this function will return immediately,
     //  so we use the semaphore to tell us when the image is actually available,
     //  (ready for rendering to)
+    zone = beginTraceZone("getNextSwapchainImage");
     ErrVal result =
         getNextSwapchainImage(&imageIndex, context.swapchain, context.device,
                               context.pImageAvailableSemaphores[currentFrame]);
+    endTraceZone(&zone);
 
-    // if the window is resized
-    /*if (result == ERR_OUTOFDATE) {
-      vkDeviceWaitIdle(context.device);
-
-      delete_SwapchainFramebuffers(pSwapchainFramebuffers, swapchainImageCount,
-                                   context.device);
-      free(pSwapchainFramebuffers);
-      delete_Pipeline(&context.graphicsPipeline, device);
-      delete_PipelineLayout(&graphicsPipelineLayout, device);
-      delete_RenderPass(&renderPass, device);
-      delete_SwapchainImageViews(pSwapchainImageViews, swapchainImageCount,
-                                 device);
-      free(pSwapchainImageViews);
-      free(pSwapchainImages);
-      delete_Swapchain(&swapchain, device);
-
-      // delete depth buffer
-      delete_ImageView(&depthImageView, device);
-      delete_Image(&depthImage, device);
-      delete_DeviceMemory(&depthImageMemory, device);
-
-      // get new window size
-      getExtentWindow(&swapchainExtent, pWindow);
-      resizeCamera(&camera, swapchainExtent);
-
-     
-      new_Swapchain(&swapchain, &swapchainImageCount, swapchain, surfaceFormat,
-                    physicalDevice, device, surface, swapchainExtent,
-                    graphicsIndex, presentIndex);
-
-      pSwapchainImages = malloc(swapchainImageCount * sizeof(VkImage));
-      getSwapchainImages(pSwapchainImages, swapchainImageCount, device,
-                         swapchain);
-
-      pSwapchainImageViews = malloc(swapchainImageCount * sizeof(VkImageView));
-      new_SwapchainImageViews(pSwapchainImageViews, pSwapchainImages,
-                              swapchainImageCount, device,
-                              surfaceFormat.format);
-
-      // Create depth image
-      new_DepthImage(&depthImage, &depthImageMemory, swapchainExtent,
-                     physicalDevice, device);
-      new_DepthImageView(&depthImageView, device, depthImage);
-
-      
-      new_VertexDisplayRenderPass(&renderPass, device, surfaceFormat.format);
-      new_VertexDisplayPipelineLayout(&graphicsPipelineLayout, device);
-      new_VertexDisplayPipeline(&graphicsPipeline, device, vertShaderModule,
-                                fragShaderModule, swapchainExtent, renderPass,
-                                graphicsPipelineLayout);
-      pSwapchainFramebuffers =
-          malloc(swapchainImageCount * sizeof(VkFramebuffer));
-      new_SwapchainFramebuffers(pSwapchainFramebuffers, device, renderPass,
-                                swapchainExtent, swapchainImageCount,
-                                depthImageView, pSwapchainImageViews);
+    // if the window is resized, only the swapchain side has to be rebuilt
+    if (result == ERR_OUTOFDATE) {
+      zone = beginTraceZone("recreateSwapchain");
+      recreateSwapchain(&context);
+      endTraceZone(&zone);
+      resizeCamera(&camera, context.swapchainExtent);
 
       // finally we can retry getting the swapchain
-      getNextSwapchainImage(&imageIndex, swapchain, device,
-                            pImageAvailableSemaphores[currentFrame]);
-    }*/
+      getNextSwapchainImage(&imageIndex, context.swapchain, context.device,
+                            context.pImageAvailableSemaphores[currentFrame]);
+    }
 
     // update camera
+    zone = beginTraceZone("updateCamera");
    updateCamera(&camera, context.pWindow);
     mat4x4 mvp;
     getMvpCamera(mvp, &camera);
+    endTraceZone(&zone);
 
-    // record buffer
-recordVertexDisplayCommandBuffer( context.pVertexDisplayCommandBuffers[currentFrame],pSwapchainFramebuffers[imageIndex],          
-context.vertexBuffer, vertexCount, context.renderPass, context.graphicsPipelineLayout, context.graphicsPipeline,                            //
-context.swapchainExtent, mvp, (VkClearColorValue){.float32 = {0, 0, 0, 0}});
+    // send off anything queued since the last frame; the frame below waits on
+    // it on the GPU, the CPU never does
+    uint64_t submittedUploadValue;
+    submitUploads(&submittedUploadValue, &context.uploads);
+
+    // spin the scene, straight into this frame's instance buffer
+    writeSceneTransforms(&context.workers, &context.sceneTransforms,
+                         getInstanceStreamFrame(&context.instances, currentFrame), true);
 
-drawFrame(context.pVertexDisplayCommandBuffers[currentFrame], context.swapchain, imageIndex,                                 //
+    // record buffer
+    uint64_t uploadWaitValue;
+    zone = beginTraceZone("recordVertexDisplayCommandBuffer");
+recordVertexDisplayCommandBuffer( context.pVertexDisplayCommandBuffers[currentFrame], currentFrame, &uploadWaitValue,
+&context.uploads, &context.workers, context.pGpuProfiler, &context.secondaryCommandPools, context.pDrawList, context.pCuller,
+NULL, context.pSwapchainFramebuffers[imageIndex],
+&context.mesh, context.instances.pBuffers[currentFrame], sceneDraws.data(), (uint32_t)sceneDraws.size(), context.renderPass,
+context.graphicsPipelineLayout, context.graphicsPipeline,                            //
+context.swapchainExtent, mvp, (VkClearColorValue){.float32 = {0, 0, 0, 0}}, context.device);
+    endTraceZone(&zone);
+
+    zone = beginTraceZone("drawFrame");
+ErrVal presentResult = drawFrame(context.pVertexDisplayCommandBuffers[currentFrame], context.swapchain, imageIndex,                                 //
 context.pImageAvailableSemaphores[currentFrame], context.pRenderFinishedSemaphores[currentFrame], 
-context.pInFlightFences[currentFrame], context.graphicsQueue, presentQueue);
+context.pInFlightFences[currentFrame], context.graphicsQueue, presentQueue, context.uploads.timeline, uploadWaitValue);
+    endTraceZone(&zone);
+
+    // not every platform reports out of date swapchains, so compare sizes too
+    VkExtent2D windowExtent;
+    getExtentWindow(&windowExtent, context.pWindow);
+    if (presentResult == ERR_OUTOFDATE || windowExtent.width != context.swapchainExtent.width ||
+        windowExtent.height != context.swapchainExtent.height) {
+      recreateSwapchain(&context);
+      resizeCamera(&camera, context.swapchainExtent);
+    }
 
     // increment frame
-    currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
-  }
-
-  /*cleanup*/
-  /*vkDeviceWaitIdle(device);
-  delete_ShaderModule(&fragShaderModule, device);
-  delete_ShaderModule(&vertShaderModule, device);
-
-  delete_Fences(pInFlightFences, MAX_FRAMES_IN_FLIGHT, device);
-  delete_Semaphores(pRenderFinishedSemaphores, MAX_FRAMES_IN_FLIGHT, device);
-  delete_Semaphores(pImageAvailableSemaphores, MAX_FRAMES_IN_FLIGHT, device);
-
-  delete_CommandBuffers(pVertexDisplayCommandBuffers, MAX_FRAMES_IN_FLIGHT,
-                        commandPool, device);
-  delete_CommandPool(&commandPool, device);
-
-  delete_SwapchainFramebuffers(pSwapchainFramebuffers, swapchainImageCount,
-                               device);
-  free(pSwapchainFramebuffers);
-  delete_Pipeline(&graphicsPipeline, device);
-  delete_PipelineLayout(&graphicsPipelineLayout, device);
-  delete_Buffer(&vertexBuffer, device);
-  delete_DeviceMemory(&vertexBufferMemory, device);
-  delete_RenderPass(&renderPass, device);
-  delete_SwapchainImageViews(pSwapchainImageViews, swapchainImageCount, device);
-  free(pSwapchainImageViews);
-  free(pSwapchainImages);
-  delete_Swapchain(&swapchain, device);
-  delete_ImageView(&depthImageView, device);
-  delete_Image(&depthImage, device);
-  delete_DeviceMemory(&depthImageMemory, device);
-  delete_Device(&device);
-  delete_Surface(&surface, instance);
-  delete_DebugCallback(&callback, instance);
-  delete_Instance(&instance);
-*/
+    currentFrame = (currentFrame + 1) % context.framesInFlight;
+    frameNumber++;
+    endTraceZone(&frameZone);
+  }
+
+  vkDeviceWaitIdle(context.device);
+  // the watcher thread has to be joined before exit
+  if (context.pShaderReloader) {
+    delete_ShaderReloader(context.pShaderReloader);
+  }
+
+  // drops the prebuilt variants that haven't started, so exit isn't held up
+  delete_PipelineBuilder(&context.pipelineBuilder);
+  // whatever frames in flight could still have used, now the device is idle
+  delete_DeletionQueue(&context.deletions);
+
+  /* keep whatever was compiled this run for the next launch */
+  savePipelineCache(&context.pipelineCache);
+  if (context.pTracer) {
+    delete_Tracer(context.pTracer);
+  }
+
+  /* Everything else, in reverse order of creation. The device is idle and
+   * the deletion queue empty, so nothing here is still in use */
+  delete_Fences(context.pInFlightFences, context.framesInFlight, context.device);
+  delete_Semaphores(context.pRenderFinishedSemaphores, context.framesInFlight, context.device);
+  delete_Semaphores(context.pImageAvailableSemaphores, context.framesInFlight, context.device);
+  delete_CommandBuffers(context.pVertexDisplayCommandBuffers, context.framesInFlight, context.commandPool,
+                        context.device);
+  free(context.pInFlightFences);
+  free(context.pRenderFinishedSemaphores);
+  free(context.pImageAvailableSemaphores);
+  free(context.pVertexDisplayCommandBuffers);
+  delete_SecondaryCommandPools(&context.secondaryCommandPools, context.device);
+  if (context.pCuller) {
+    delete_GpuCuller(context.pCuller, &context.allocator);
+  }
+  if (context.pDrawList) {
+    delete_DrawList(context.pDrawList, &context.allocator);
+  }
+  if (context.pGpuProfiler) {
+    delete_GpuProfiler(context.pGpuProfiler);
+  }
+  delete_WorkerPool(&context.workers);
+
+  if (context.headless) {
+    delete_OffscreenTarget(&context.offscreen, &context.allocator, context.device);
+  } else {
+    delete_SwapchainFramebuffers(context.pSwapchainFramebuffers, context.swapchainImageCount, context.device);
+    free(context.pSwapchainFramebuffers);
+  }
+  delete_InstanceStream(&context.instances, &context.allocator);
+  delete_SceneTransforms(&context.sceneTransforms);
+  delete_Mesh(&context.mesh, &context.allocator, context.device);
+  delete_UploadScheduler(&context.uploads, &context.allocator);
+  delete_ImageView(&context.depthImageView, context.device);
+  delete_Image(&context.depthImage, context.device);
+  freeDeviceMemory(&context.depthImageMemory, &context.allocator);
+  if (!context.headless) {
+    delete_SwapchainImageViews(context.pSwapchainImageViews, context.swapchainImageCount, context.device);
+    free(context.pSwapchainImageViews);
+    free(context.pSwapchainImages);
+    delete_Swapchain(&context.swapchain, context.device);
+  }
+
+  delete_PipelineVariants(&context.pipelineVariants);
+  delete_PipelineCache(&context.pipelineCache);
+  delete_RenderPass(&context.renderPass, context.device);
+  delete_LayoutCache(&context.layouts);
+  delete_DeviceAllocator(&context.allocator);
+  delete_CommandPool(&context.commandPool, context.device);
+  delete_Device(&context.device);
+
+  if (!context.headless) {
+    delete_Surface(&context.surface, context.instance);
+    glfwDestroyWindow(context.pWindow);
+  }
+  if (config.validation) {
+    delete_DebugCallback(&context.callback, context.instance);
+  }
+  delete_Instance(&context.instance);
   glfwTerminate();
   return (EXIT_SUCCESS);
 
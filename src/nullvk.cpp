@@ -0,0 +1,1179 @@
+/* A null Vulkan driver (ICD) for measuring the renderer's own CPU overhead.
+ *
+ * It implements the entry points the headless renderer uses as near no-ops:
+ * objects are handed out and freed, host visible memory is real so mapped
+ * writes land somewhere, fences and timeline semaphores are signalled at
+ * submit, and nothing is ever drawn. With no GPU or software rasterizer in
+ * the loop, frame times are recording and submission cost alone, and the
+ * renderer runs at thousands of frames per second. Query results read back
+ * as zero, so gpu frame times are 0.
+ *
+ * Every entry point call is counted. When NULLVK_CALL_COUNTS names a file the
+ * counts are written to it as JSON on vkDestroyInstance, to diff between runs
+ * for call count regressions.
+ *
+ * Loaded through the Vulkan loader like any other driver, with nullvk.json as
+ * its manifest (VK_ICD_FILENAMES or VK_DRIVER_FILES), see nullvk.sh. There is
+ * no window system support, only --headless and --bench runs work. 64-bit only,
+ * non-dispatchable handles are pointers to the driver's own objects. */
+#include <errno.h>
+#include <stdio.h>
+#include <cstdint>
+#include <cstdlib>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+static_assert(sizeof(void *) == 8, "the null driver needs 64-bit handles");
+
+// dispatchable objects start with a slot the loader keeps its dispatch table in
+#define ICD_LOADER_MAGIC 0x01CDC0DE
+#define NULLVK_INTERFACE_VERSION 5
+#define NULLVK_VENDOR_ID 0x10000
+#define NULLVK_DEVICE_ID 0x1
+#define NULLVK_DEVICE_NAME "nullvk"
+
+/* Queue family 0 does everything, family 1 is transfer only like the
+ * dedicated copy queue of a discrete GPU */
+#define NULLVK_QUEUE_FAMILY_COUNT 2
+
+/* Memory type 0 is device local and has no backing store, types 1 and 2 are
+ * host visible and backed by malloc'd memory */
+#define NULLVK_MEMORY_TYPE_COUNT 3
+#define NULLVK_BUFFER_ALIGNMENT 256
+#define NULLVK_IMAGE_ALIGNMENT 4096
+// enough bytes per texel for every format the renderer uses
+#define NULLVK_IMAGE_TEXEL_SIZE 8
+
+/* Every entry point the driver implements, as X(name without the vk prefix) */
+#define NULLVK_ENTRY_POINTS(X)                                                 \
+  X(CreateInstance)                                                            \
+  X(DestroyInstance)                                                           \
+  X(EnumerateInstanceVersion)                                                  \
+  X(EnumerateInstanceExtensionProperties)                                      \
+  X(EnumeratePhysicalDevices)                                                  \
+  X(GetInstanceProcAddr)                                                       \
+  X(GetDeviceProcAddr)                                                         \
+  X(GetPhysicalDeviceProperties)                                               \
+  X(GetPhysicalDeviceProperties2)                                              \
+  X(GetPhysicalDeviceFeatures)                                                 \
+  X(GetPhysicalDeviceFeatures2)                                                \
+  X(GetPhysicalDeviceQueueFamilyProperties)                                    \
+  X(GetPhysicalDeviceMemoryProperties)                                         \
+  X(EnumerateDeviceExtensionProperties)                                        \
+  X(CreateDevice)                                                              \
+  X(DestroyDevice)                                                             \
+  X(GetDeviceQueue)                                                            \
+  X(DeviceWaitIdle)                                                            \
+  X(QueueWaitIdle)                                                             \
+  X(QueueSubmit)                                                               \
+  X(AllocateMemory)                                                            \
+  X(FreeMemory)                                                                \
+  X(MapMemory)                                                                 \
+  X(UnmapMemory)                                                               \
+  X(FlushMappedMemoryRanges)                                                   \
+  X(InvalidateMappedMemoryRanges)                                              \
+  X(CreateBuffer)                                                              \
+  X(DestroyBuffer)                                                             \
+  X(GetBufferMemoryRequirements)                                               \
+  X(BindBufferMemory)                                                          \
+  X(CreateImage)                                                               \
+  X(DestroyImage)                                                              \
+  X(GetImageMemoryRequirements)                                                \
+  X(BindImageMemory)                                                           \
+  X(CreateImageView)                                                           \
+  X(DestroyImageView)                                                          \
+  X(CreateFence)                                                               \
+  X(DestroyFence)                                                              \
+  X(ResetFences)                                                               \
+  X(WaitForFences)                                                             \
+  X(CreateSemaphore)                                                           \
+  X(DestroySemaphore)                                                          \
+  X(GetSemaphoreCounterValue)                                                  \
+  X(WaitSemaphores)                                                            \
+  X(CreateQueryPool)                                                           \
+  X(DestroyQueryPool)                                                          \
+  X(GetQueryPoolResults)                                                       \
+  X(CreateShaderModule)                                                        \
+  X(DestroyShaderModule)                                                       \
+  X(CreatePipelineCache)                                                       \
+  X(DestroyPipelineCache)                                                      \
+  X(GetPipelineCacheData)                                                      \
+  X(CreatePipelineLayout)                                                      \
+  X(DestroyPipelineLayout)                                                     \
+  X(CreateGraphicsPipelines)                                                   \
+  X(CreateComputePipelines)                                                    \
+  X(DestroyPipeline)                                                           \
+  X(CreateDescriptorSetLayout)                                                 \
+  X(DestroyDescriptorSetLayout)                                                \
+  X(CreateDescriptorPool)                                                      \
+  X(DestroyDescriptorPool)                                                     \
+  X(AllocateDescriptorSets)                                                    \
+  X(UpdateDescriptorSets)                                                      \
+  X(CreateRenderPass)                                                          \
+  X(DestroyRenderPass)                                                         \
+  X(CreateFramebuffer)                                                         \
+  X(DestroyFramebuffer)                                                        \
+  X(CreateCommandPool)                                                         \
+  X(DestroyCommandPool)                                                        \
+  X(ResetCommandPool)                                                          \
+  X(AllocateCommandBuffers)                                                    \
+  X(FreeCommandBuffers)                                                        \
+  X(BeginCommandBuffer)                                                        \
+  X(EndCommandBuffer)                                                          \
+  X(CmdBeginQuery)                                                             \
+  X(CmdEndQuery)                                                               \
+  X(CmdResetQueryPool)                                                         \
+  X(CmdWriteTimestamp)                                                         \
+  X(CmdBeginRenderPass)                                                        \
+  X(CmdEndRenderPass)                                                          \
+  X(CmdExecuteCommands)                                                        \
+  X(CmdBindPipeline)                                                           \
+  X(CmdBindDescriptorSets)                                                     \
+  X(CmdBindVertexBuffers)                                                      \
+  X(CmdBindIndexBuffer)                                                        \
+  X(CmdPushConstants)                                                          \
+  X(CmdSetViewport)                                                            \
+  X(CmdSetScissor)                                                             \
+  X(CmdPipelineBarrier)                                                        \
+  X(CmdCopyBuffer)                                                             \
+  X(CmdCopyBufferToImage)                                                      \
+  X(CmdCopyImageToBuffer)                                                      \
+  X(CmdDispatch)                                                               \
+  X(CmdDrawIndexed)                                                            \
+  X(CmdDrawIndexedIndirect)                                                    \
+  X(CmdDrawIndexedIndirectCount)
+
+/* Extension names of core entry points, counted as the core one */
+#define NULLVK_ALIASES(X)                                                      \
+  X(GetPhysicalDeviceProperties2KHR, GetPhysicalDeviceProperties2)             \
+  X(GetPhysicalDeviceFeatures2KHR, GetPhysicalDeviceFeatures2)                 \
+  X(GetSemaphoreCounterValueKHR, GetSemaphoreCounterValue)                     \
+  X(WaitSemaphoresKHR, WaitSemaphores)                                         \
+  X(CmdDrawIndexedIndirectCountKHR, CmdDrawIndexedIndirectCount)
+
+typedef enum {
+#define NULLVK_ENTRY_ENUM(name) ENTRY_##name,
+  NULLVK_ENTRY_POINTS(NULLVK_ENTRY_ENUM)
+#undef NULLVK_ENTRY_ENUM
+  ENTRY_COUNT
+} EntryPoint;
+
+/* Call counts are kept per thread so counting never contends between the
+ * threads recording in parallel, and summed when they are written out. A
+ * thread's counts outlive it so none are lost */
+typedef struct {
+  uint64_t pCounts[ENTRY_COUNT];
+} CallCounts;
+
+static std::mutex callCountsMutex;
+static std::vector<CallCounts *> allCallCounts;
+static thread_local CallCounts *pThreadCallCounts = NULL;
+
+static void countCall(const EntryPoint entry) {
+  if (!pThreadCallCounts) {
+    CallCounts *pCounts = (CallCounts *)calloc(1, sizeof(CallCounts));
+    if (!pCounts) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(callCountsMutex);
+    allCallCounts.push_back(pCounts);
+    pThreadCallCounts = pCounts;
+  }
+  pThreadCallCounts->pCounts[entry]++;
+}
+
+#define COUNT_CALL(name) countCall(ENTRY_##name)
+
+static const char *ppEntryPointNames[ENTRY_COUNT] = {
+#define NULLVK_ENTRY_NAME(name) "vk" #name,
+    NULLVK_ENTRY_POINTS(NULLVK_ENTRY_NAME)
+#undef NULLVK_ENTRY_NAME
+};
+
+static void writeCallCounts(const char *pPath) {
+  uint64_t pTotals[ENTRY_COUNT] = {};
+  {
+    std::lock_guard<std::mutex> lock(callCountsMutex);
+    for (size_t i = 0; i < allCallCounts.size(); i++) {
+      for (uint32_t entry = 0; entry < ENTRY_COUNT; entry++) {
+        pTotals[entry] += allCallCounts[i]->pCounts[entry];
+      }
+    }
+  }
+
+  FILE *fp = fopen(pPath, "w");
+  if (!fp) {
+    fprintf(stderr, "nullvk: could not open %s: %s\n", pPath, strerror(errno));
+    return;
+  }
+  fprintf(fp, "{\n");
+  for (uint32_t entry = 0; entry < ENTRY_COUNT; entry++) {
+    fprintf(fp, "  \"%s\": %llu%s\n", ppEntryPointNames[entry], (unsigned long long)pTotals[entry],
+            entry + 1 < ENTRY_COUNT ? "," : "");
+  }
+  fprintf(fp, "}\n");
+  fclose(fp);
+}
+
+/* The driver's objects. Non-dispatchable handles without state are never
+ * dereferenced, those are just unique numbers from newHandle */
+struct VkPhysicalDevice_T {
+  uintptr_t loaderData;
+};
+
+struct VkInstance_T {
+  uintptr_t loaderData;
+  VkPhysicalDevice_T physicalDevice;
+};
+
+struct VkQueue_T {
+  uintptr_t loaderData;
+};
+
+struct VkDevice_T {
+  uintptr_t loaderData;
+  VkQueue_T pQueues[NULLVK_QUEUE_FAMILY_COUNT];
+};
+
+struct VkCommandBuffer_T {
+  uintptr_t loaderData;
+};
+
+struct VkCommandPool_T {
+  std::vector<VkCommandBuffer> commandBuffers;
+};
+
+struct VkDeviceMemory_T {
+  VkDeviceSize size;
+  // NULL for device local memory
+  uint8_t *pData;
+};
+
+struct VkBuffer_T {
+  VkDeviceSize size;
+};
+
+struct VkImage_T {
+  VkDeviceSize size;
+};
+
+struct VkFence_T {
+  std::atomic<bool> signaled;
+};
+
+struct VkSemaphore_T {
+  bool timeline;
+  std::atomic<uint64_t> value;
+};
+
+struct VkQueryPool_T {
+  // a pipeline statistics query has one value per statistic
+  uint32_t valuesPerQuery;
+};
+
+static std::atomic<uintptr_t> nextHandle(1);
+
+template <typename T> static T newHandle() {
+  // aligned like a real object, and never NULL
+  return ((T)(nextHandle.fetch_add(1, std::memory_order_relaxed) << 4));
+}
+
+static VkDeviceSize alignSize(const VkDeviceSize size, const VkDeviceSize alignment) {
+  return ((size + alignment - 1) / alignment * alignment);
+}
+
+static PFN_vkVoidFunction getProcAddr(const char *pName);
+
+/* Instance and physical device */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateInstance(const VkInstanceCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkInstance *pInstance) {
+  COUNT_CALL(CreateInstance);
+  VkInstance instance = new VkInstance_T;
+  instance->loaderData = ICD_LOADER_MAGIC;
+  instance->physicalDevice.loaderData = ICD_LOADER_MAGIC;
+  *pInstance = instance;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyInstance(VkInstance instance, const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyInstance);
+  const char *pCountsPath = getenv("NULLVK_CALL_COUNTS");
+  if (pCountsPath) {
+    writeCallCounts(pCountsPath);
+  }
+  delete instance;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullEnumerateInstanceVersion(uint32_t *pApiVersion) {
+  COUNT_CALL(EnumerateInstanceVersion);
+  *pApiVersion = VK_API_VERSION_1_2;
+  return (VK_SUCCESS);
+}
+
+// the driver has no extensions, headless rendering needs none
+static VKAPI_ATTR VkResult VKAPI_CALL nullEnumerateInstanceExtensionProperties(const char *pLayerName,
+uint32_t *pPropertyCount, VkExtensionProperties *pProperties) {
+  COUNT_CALL(EnumerateInstanceExtensionProperties);
+  *pPropertyCount = 0;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullEnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice,
+const char *pLayerName, uint32_t *pPropertyCount, VkExtensionProperties *pProperties) {
+  COUNT_CALL(EnumerateDeviceExtensionProperties);
+  *pPropertyCount = 0;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullEnumeratePhysicalDevices(VkInstance instance,
+uint32_t *pPhysicalDeviceCount, VkPhysicalDevice *pPhysicalDevices) {
+  COUNT_CALL(EnumeratePhysicalDevices);
+  if (!pPhysicalDevices) {
+    *pPhysicalDeviceCount = 1;
+    return (VK_SUCCESS);
+  }
+  if (*pPhysicalDeviceCount < 1) {
+    return (VK_INCOMPLETE);
+  }
+  *pPhysicalDeviceCount = 1;
+  pPhysicalDevices[0] = &instance->physicalDevice;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL nullGetInstanceProcAddr(VkInstance instance, const char *pName) {
+  COUNT_CALL(GetInstanceProcAddr);
+  return (getProcAddr(pName));
+}
+
+static VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL nullGetDeviceProcAddr(VkDevice device, const char *pName) {
+  COUNT_CALL(GetDeviceProcAddr);
+  return (getProcAddr(pName));
+}
+
+static void getNullDeviceProperties(VkPhysicalDeviceProperties *pProperties) {
+  memset(pProperties, 0, sizeof(VkPhysicalDeviceProperties));
+  pProperties->apiVersion = VK_API_VERSION_1_2;
+  pProperties->driverVersion = 1;
+  pProperties->vendorID = NULLVK_VENDOR_ID;
+  pProperties->deviceID = NULLVK_DEVICE_ID;
+  pProperties->deviceType = VK_PHYSICAL_DEVICE_TYPE_OTHER;
+  strcpy(pProperties->deviceName, NULLVK_DEVICE_NAME);
+  memcpy(pProperties->pipelineCacheUUID, "nullvk-cache-v01", VK_UUID_SIZE);
+
+  VkPhysicalDeviceLimits *pLimits = &pProperties->limits;
+  pLimits->maxImageDimension2D = 16384;
+  pLimits->maxImageArrayLayers = 2048;
+  pLimits->maxUniformBufferRange = 65536;
+  pLimits->maxStorageBufferRange = UINT32_MAX;
+  pLimits->maxPushConstantsSize = 256;
+  pLimits->maxMemoryAllocationCount = 4096;
+  pLimits->bufferImageGranularity = 1;
+  pLimits->maxBoundDescriptorSets = 8;
+  pLimits->maxVertexInputAttributes = 32;
+  pLimits->maxVertexInputBindings = 32;
+  pLimits->maxComputeWorkGroupCount[0] = 65535;
+  pLimits->maxComputeWorkGroupCount[1] = 65535;
+  pLimits->maxComputeWorkGroupCount[2] = 65535;
+  pLimits->maxComputeWorkGroupInvocations = 1024;
+  pLimits->maxComputeWorkGroupSize[0] = 1024;
+  pLimits->maxComputeWorkGroupSize[1] = 1024;
+  pLimits->maxComputeWorkGroupSize[2] = 64;
+  pLimits->maxDrawIndexedIndexValue = UINT32_MAX;
+  pLimits->maxDrawIndirectCount = UINT32_MAX;
+  pLimits->maxViewports = 16;
+  pLimits->maxViewportDimensions[0] = 16384;
+  pLimits->maxViewportDimensions[1] = 16384;
+  pLimits->minUniformBufferOffsetAlignment = NULLVK_BUFFER_ALIGNMENT;
+  pLimits->minStorageBufferOffsetAlignment = NULLVK_BUFFER_ALIGNMENT;
+  pLimits->maxFramebufferWidth = 16384;
+  pLimits->maxFramebufferHeight = 16384;
+  pLimits->maxFramebufferLayers = 2048;
+  pLimits->maxColorAttachments = 8;
+  pLimits->timestampComputeAndGraphics = VK_TRUE;
+  pLimits->timestampPeriod = 1.0f;
+  pLimits->optimalBufferCopyOffsetAlignment = 1;
+  pLimits->optimalBufferCopyRowPitchAlignment = 1;
+  pLimits->nonCoherentAtomSize = 64;
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceProperties(VkPhysicalDevice physicalDevice,
+VkPhysicalDeviceProperties *pProperties) {
+  COUNT_CALL(GetPhysicalDeviceProperties);
+  getNullDeviceProperties(pProperties);
+}
+
+// chained structures are left as the caller filled them
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceProperties2(VkPhysicalDevice physicalDevice,
+VkPhysicalDeviceProperties2 *pProperties) {
+  COUNT_CALL(GetPhysicalDeviceProperties2);
+  getNullDeviceProperties(&pProperties->properties);
+}
+
+static void getNullDeviceFeatures(VkPhysicalDeviceFeatures *pFeatures) {
+  memset(pFeatures, 0, sizeof(VkPhysicalDeviceFeatures));
+  pFeatures->multiDrawIndirect = VK_TRUE;
+  pFeatures->drawIndirectFirstInstance = VK_TRUE;
+  pFeatures->pipelineStatisticsQuery = VK_TRUE;
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceFeatures(VkPhysicalDevice physicalDevice,
+VkPhysicalDeviceFeatures *pFeatures) {
+  COUNT_CALL(GetPhysicalDeviceFeatures);
+  getNullDeviceFeatures(pFeatures);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
+VkPhysicalDeviceFeatures2 *pFeatures) {
+  COUNT_CALL(GetPhysicalDeviceFeatures2);
+  getNullDeviceFeatures(&pFeatures->features);
+  for (VkBaseOutStructure *pNext = (VkBaseOutStructure *)pFeatures->pNext; pNext; pNext = pNext->pNext) {
+    if (pNext->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_12_FEATURES) {
+      VkPhysicalDeviceVulkan12Features *pFeatures12 = (VkPhysicalDeviceVulkan12Features *)pNext;
+      pFeatures12->drawIndirectCount = VK_TRUE;
+      pFeatures12->timelineSemaphore = VK_TRUE;
+      pFeatures12->hostQueryReset = VK_TRUE;
+    } else if (pNext->sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES) {
+      ((VkPhysicalDeviceTimelineSemaphoreFeatures *)pNext)->timelineSemaphore = VK_TRUE;
+    }
+  }
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceQueueFamilyProperties(VkPhysicalDevice physicalDevice,
+uint32_t *pQueueFamilyPropertyCount, VkQueueFamilyProperties *pQueueFamilyProperties) {
+  COUNT_CALL(GetPhysicalDeviceQueueFamilyProperties);
+  if (!pQueueFamilyProperties) {
+    *pQueueFamilyPropertyCount = NULLVK_QUEUE_FAMILY_COUNT;
+    return;
+  }
+  VkQueueFamilyProperties pFamilies[NULLVK_QUEUE_FAMILY_COUNT] = {};
+  pFamilies[0].queueFlags = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT;
+  pFamilies[1].queueFlags = VK_QUEUE_TRANSFER_BIT;
+  for (uint32_t i = 0; i < NULLVK_QUEUE_FAMILY_COUNT; i++) {
+    pFamilies[i].queueCount = 1;
+    pFamilies[i].timestampValidBits = 64;
+    pFamilies[i].minImageTransferGranularity = (VkExtent3D){1, 1, 1};
+  }
+  if (*pQueueFamilyPropertyCount > NULLVK_QUEUE_FAMILY_COUNT) {
+    *pQueueFamilyPropertyCount = NULLVK_QUEUE_FAMILY_COUNT;
+  }
+  memcpy(pQueueFamilyProperties, pFamilies, *pQueueFamilyPropertyCount * sizeof(VkQueueFamilyProperties));
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetPhysicalDeviceMemoryProperties(VkPhysicalDevice physicalDevice,
+VkPhysicalDeviceMemoryProperties *pMemoryProperties) {
+  COUNT_CALL(GetPhysicalDeviceMemoryProperties);
+  memset(pMemoryProperties, 0, sizeof(VkPhysicalDeviceMemoryProperties));
+  pMemoryProperties->memoryTypeCount = NULLVK_MEMORY_TYPE_COUNT;
+  pMemoryProperties->memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  pMemoryProperties->memoryTypes[0].heapIndex = 0;
+  pMemoryProperties->memoryTypes[1].propertyFlags =
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  pMemoryProperties->memoryTypes[1].heapIndex = 1;
+  pMemoryProperties->memoryTypes[2].propertyFlags =
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  pMemoryProperties->memoryTypes[2].heapIndex = 1;
+  pMemoryProperties->memoryHeapCount = 2;
+  pMemoryProperties->memoryHeaps[0].size = 8ull << 30;
+  pMemoryProperties->memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+  pMemoryProperties->memoryHeaps[1].size = 16ull << 30;
+}
+
+/* Device and queues. Work is complete the moment it is submitted */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateDevice(VkPhysicalDevice physicalDevice,
+const VkDeviceCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkDevice *pDevice) {
+  COUNT_CALL(CreateDevice);
+  VkDevice device = new VkDevice_T;
+  device->loaderData = ICD_LOADER_MAGIC;
+  for (uint32_t i = 0; i < NULLVK_QUEUE_FAMILY_COUNT; i++) {
+    device->pQueues[i].loaderData = ICD_LOADER_MAGIC;
+  }
+  *pDevice = device;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyDevice);
+  delete device;
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetDeviceQueue(VkDevice device, uint32_t queueFamilyIndex,
+uint32_t queueIndex, VkQueue *pQueue) {
+  COUNT_CALL(GetDeviceQueue);
+  *pQueue = &device->pQueues[queueFamilyIndex];
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullDeviceWaitIdle(VkDevice device) {
+  COUNT_CALL(DeviceWaitIdle);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullQueueWaitIdle(VkQueue queue) {
+  COUNT_CALL(QueueWaitIdle);
+  return (VK_SUCCESS);
+}
+
+static const VkTimelineSemaphoreSubmitInfo *findTimelineSubmitInfo(const VkSubmitInfo *pSubmit) {
+  for (const VkBaseInStructure *pNext = (const VkBaseInStructure *)pSubmit->pNext; pNext; pNext = pNext->pNext) {
+    if (pNext->sType == VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO) {
+      return ((const VkTimelineSemaphoreSubmitInfo *)pNext);
+    }
+  }
+  return (NULL);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullQueueSubmit(VkQueue queue, uint32_t submitCount,
+const VkSubmitInfo *pSubmits, VkFence fence) {
+  COUNT_CALL(QueueSubmit);
+  for (uint32_t i = 0; i < submitCount; i++) {
+    const VkTimelineSemaphoreSubmitInfo *pTimelineInfo = findTimelineSubmitInfo(&pSubmits[i]);
+    for (uint32_t j = 0; j < pSubmits[i].signalSemaphoreCount; j++) {
+      VkSemaphore semaphore = pSubmits[i].pSignalSemaphores[j];
+      if (semaphore->timeline && pTimelineInfo && j < pTimelineInfo->signalSemaphoreValueCount) {
+        semaphore->value.store(pTimelineInfo->pSignalSemaphoreValues[j], std::memory_order_release);
+      }
+    }
+  }
+  if (fence != VK_NULL_HANDLE) {
+    fence->signaled.store(true, std::memory_order_release);
+  }
+  return (VK_SUCCESS);
+}
+
+/* Memory and resources */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullAllocateMemory(VkDevice device, const VkMemoryAllocateInfo *pAllocateInfo,
+const VkAllocationCallbacks *pAllocator, VkDeviceMemory *pMemory) {
+  COUNT_CALL(AllocateMemory);
+  VkDeviceMemory memory = new VkDeviceMemory_T;
+  memory->size = pAllocateInfo->allocationSize;
+  memory->pData = NULL;
+  if (pAllocateInfo->memoryTypeIndex != 0) {
+    // calloc leaves large blocks untouched until they are written
+    memory->pData = (uint8_t *)calloc(1, (size_t)pAllocateInfo->allocationSize);
+    if (!memory->pData) {
+      delete memory;
+      return (VK_ERROR_OUT_OF_HOST_MEMORY);
+    }
+  }
+  *pMemory = memory;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullFreeMemory(VkDevice device, VkDeviceMemory memory,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(FreeMemory);
+  if (memory != VK_NULL_HANDLE) {
+    free(memory->pData);
+    delete memory;
+  }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullMapMemory(VkDevice device, VkDeviceMemory memory, VkDeviceSize offset,
+VkDeviceSize size, VkMemoryMapFlags flags, void **ppData) {
+  COUNT_CALL(MapMemory);
+  if (!memory->pData) {
+    return (VK_ERROR_MEMORY_MAP_FAILED);
+  }
+  *ppData = memory->pData + offset;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullUnmapMemory(VkDevice device, VkDeviceMemory memory) {
+  COUNT_CALL(UnmapMemory);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullFlushMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+const VkMappedMemoryRange *pMemoryRanges) {
+  COUNT_CALL(FlushMappedMemoryRanges);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullInvalidateMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+const VkMappedMemoryRange *pMemoryRanges) {
+  COUNT_CALL(InvalidateMappedMemoryRanges);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateBuffer(VkDevice device, const VkBufferCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkBuffer *pBuffer) {
+  COUNT_CALL(CreateBuffer);
+  VkBuffer buffer = new VkBuffer_T;
+  buffer->size = pCreateInfo->size;
+  *pBuffer = buffer;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyBuffer(VkDevice device, VkBuffer buffer,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyBuffer);
+  delete buffer;
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetBufferMemoryRequirements(VkDevice device, VkBuffer buffer,
+VkMemoryRequirements *pMemoryRequirements) {
+  COUNT_CALL(GetBufferMemoryRequirements);
+  pMemoryRequirements->size = alignSize(buffer->size, NULLVK_BUFFER_ALIGNMENT);
+  pMemoryRequirements->alignment = NULLVK_BUFFER_ALIGNMENT;
+  pMemoryRequirements->memoryTypeBits = (1u << NULLVK_MEMORY_TYPE_COUNT) - 1;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullBindBufferMemory(VkDevice device, VkBuffer buffer, VkDeviceMemory memory,
+VkDeviceSize memoryOffset) {
+  COUNT_CALL(BindBufferMemory);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateImage(VkDevice device, const VkImageCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkImage *pImage) {
+  COUNT_CALL(CreateImage);
+  VkImage image = new VkImage_T;
+  // ignores mip levels past the first, none of the renderer's images have them
+  image->size = (VkDeviceSize)pCreateInfo->extent.width * pCreateInfo->extent.height * pCreateInfo->extent.depth *
+                pCreateInfo->arrayLayers * NULLVK_IMAGE_TEXEL_SIZE;
+  *pImage = image;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyImage(VkDevice device, VkImage image,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyImage);
+  delete image;
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullGetImageMemoryRequirements(VkDevice device, VkImage image,
+VkMemoryRequirements *pMemoryRequirements) {
+  COUNT_CALL(GetImageMemoryRequirements);
+  pMemoryRequirements->size = alignSize(image->size, NULLVK_IMAGE_ALIGNMENT);
+  pMemoryRequirements->alignment = NULLVK_IMAGE_ALIGNMENT;
+  pMemoryRequirements->memoryTypeBits = (1u << NULLVK_MEMORY_TYPE_COUNT) - 1;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullBindImageMemory(VkDevice device, VkImage image, VkDeviceMemory memory,
+VkDeviceSize memoryOffset) {
+  COUNT_CALL(BindImageMemory);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateImageView(VkDevice device, const VkImageViewCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkImageView *pView) {
+  COUNT_CALL(CreateImageView);
+  *pView = newHandle<VkImageView>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyImageView(VkDevice device, VkImageView imageView,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyImageView);
+}
+
+/* Synchronization. Waits only fail when nothing was submitted that could
+ * ever satisfy them, a real driver would hang there */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateFence(VkDevice device, const VkFenceCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkFence *pFence) {
+  COUNT_CALL(CreateFence);
+  VkFence fence = new VkFence_T;
+  fence->signaled.store((pCreateInfo->flags & VK_FENCE_CREATE_SIGNALED_BIT) != 0);
+  *pFence = fence;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyFence(VkDevice device, VkFence fence,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyFence);
+  delete fence;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullResetFences(VkDevice device, uint32_t fenceCount, const VkFence *pFences) {
+  COUNT_CALL(ResetFences);
+  for (uint32_t i = 0; i < fenceCount; i++) {
+    pFences[i]->signaled.store(false, std::memory_order_relaxed);
+  }
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullWaitForFences(VkDevice device, uint32_t fenceCount, const VkFence *pFences,
+VkBool32 waitAll, uint64_t timeout) {
+  COUNT_CALL(WaitForFences);
+  uint32_t signaledCount = 0;
+  for (uint32_t i = 0; i < fenceCount; i++) {
+    signaledCount += pFences[i]->signaled.load(std::memory_order_acquire) ? 1 : 0;
+  }
+  bool done = waitAll ? signaledCount == fenceCount : signaledCount > 0;
+  if (done) {
+    return (VK_SUCCESS);
+  }
+  /* Submitted work completes at submit, so an unsignaled fence was never
+   * submitted and no wait will see it signal. A finite timeout just expires,
+   * an infinite one would hang a real driver: report the device as lost */
+  return (timeout == UINT64_MAX ? VK_ERROR_DEVICE_LOST : VK_TIMEOUT);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateSemaphore(VkDevice device, const VkSemaphoreCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkSemaphore *pSemaphore) {
+  COUNT_CALL(CreateSemaphore);
+  VkSemaphore semaphore = new VkSemaphore_T;
+  semaphore->timeline = false;
+  semaphore->value.store(0);
+  for (const VkBaseInStructure *pNext = (const VkBaseInStructure *)pCreateInfo->pNext; pNext; pNext = pNext->pNext) {
+    if (pNext->sType == VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO) {
+      const VkSemaphoreTypeCreateInfo *pTypeInfo = (const VkSemaphoreTypeCreateInfo *)pNext;
+      semaphore->timeline = pTypeInfo->semaphoreType == VK_SEMAPHORE_TYPE_TIMELINE;
+      semaphore->value.store(pTypeInfo->initialValue);
+    }
+  }
+  *pSemaphore = semaphore;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroySemaphore(VkDevice device, VkSemaphore semaphore,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroySemaphore);
+  delete semaphore;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullGetSemaphoreCounterValue(VkDevice device, VkSemaphore semaphore,
+uint64_t *pValue) {
+  COUNT_CALL(GetSemaphoreCounterValue);
+  *pValue = semaphore->value.load(std::memory_order_acquire);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullWaitSemaphores(VkDevice device, const VkSemaphoreWaitInfo *pWaitInfo,
+uint64_t timeout) {
+  COUNT_CALL(WaitSemaphores);
+  uint32_t reachedCount = 0;
+  for (uint32_t i = 0; i < pWaitInfo->semaphoreCount; i++) {
+    reachedCount += pWaitInfo->pSemaphores[i]->value.load(std::memory_order_acquire) >= pWaitInfo->pValues[i];
+  }
+  bool done = (pWaitInfo->flags & VK_SEMAPHORE_WAIT_ANY_BIT) ? reachedCount > 0
+                                                              : reachedCount == pWaitInfo->semaphoreCount;
+  if (done) {
+    return (VK_SUCCESS);
+  }
+  /* As with fences every submit signals its values at once, so a value not
+   * yet reached was never submitted: an infinite wait would hang a real
+   * driver, report the device as lost */
+  return (timeout == UINT64_MAX ? VK_ERROR_DEVICE_LOST : VK_TIMEOUT);
+}
+
+/* Queries are always available and always zero */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateQueryPool(VkDevice device, const VkQueryPoolCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkQueryPool *pQueryPool) {
+  COUNT_CALL(CreateQueryPool);
+  VkQueryPool queryPool = new VkQueryPool_T;
+  queryPool->valuesPerQuery = 1;
+  if (pCreateInfo->queryType == VK_QUERY_TYPE_PIPELINE_STATISTICS) {
+    queryPool->valuesPerQuery = (uint32_t)__builtin_popcount(pCreateInfo->pipelineStatistics);
+  }
+  *pQueryPool = queryPool;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyQueryPool(VkDevice device, VkQueryPool queryPool,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyQueryPool);
+  delete queryPool;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullGetQueryPoolResults(VkDevice device, VkQueryPool queryPool,
+uint32_t firstQuery, uint32_t queryCount, size_t dataSize, void *pData, VkDeviceSize stride,
+VkQueryResultFlags flags) {
+  COUNT_CALL(GetQueryPoolResults);
+  size_t valueSize = (flags & VK_QUERY_RESULT_64_BIT) ? sizeof(uint64_t) : sizeof(uint32_t);
+  size_t queryValueCount = queryPool->valuesPerQuery + ((flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT) ? 1 : 0);
+  for (uint32_t i = 0; i < queryCount; i++) {
+    uint8_t *pQuery = (uint8_t *)pData + i * stride;
+    memset(pQuery, 0, queryValueCount * valueSize);
+    if (flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT) {
+      // little endian, the low bytes are the same for either size
+      pQuery[queryPool->valuesPerQuery * valueSize] = 1;
+    }
+  }
+  return (VK_SUCCESS);
+}
+
+/* Pipelines and their state objects carry nothing */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateShaderModule(VkDevice device,
+const VkShaderModuleCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator,
+VkShaderModule *pShaderModule) {
+  COUNT_CALL(CreateShaderModule);
+  *pShaderModule = newHandle<VkShaderModule>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyShaderModule(VkDevice device, VkShaderModule shaderModule,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyShaderModule);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreatePipelineCache(VkDevice device,
+const VkPipelineCacheCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator,
+VkPipelineCache *pPipelineCache) {
+  COUNT_CALL(CreatePipelineCache);
+  *pPipelineCache = newHandle<VkPipelineCache>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyPipelineCache(VkDevice device, VkPipelineCache pipelineCache,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyPipelineCache);
+}
+
+// just the header, so the renderer's cache checks see this device's identity
+static VKAPI_ATTR VkResult VKAPI_CALL nullGetPipelineCacheData(VkDevice device, VkPipelineCache pipelineCache,
+size_t *pDataSize, void *pData) {
+  COUNT_CALL(GetPipelineCacheData);
+  const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+  if (!pData) {
+    *pDataSize = headerSize;
+    return (VK_SUCCESS);
+  }
+  if (*pDataSize < headerSize) {
+    *pDataSize = 0;
+    return (VK_INCOMPLETE);
+  }
+  VkPhysicalDeviceProperties properties;
+  getNullDeviceProperties(&properties);
+  uint32_t pHeader[4] = {(uint32_t)headerSize, VK_PIPELINE_CACHE_HEADER_VERSION_ONE, properties.vendorID,
+                         properties.deviceID};
+  memcpy(pData, pHeader, sizeof(pHeader));
+  memcpy((uint8_t *)pData + sizeof(pHeader), properties.pipelineCacheUUID, VK_UUID_SIZE);
+  *pDataSize = headerSize;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreatePipelineLayout(VkDevice device,
+const VkPipelineLayoutCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator,
+VkPipelineLayout *pPipelineLayout) {
+  COUNT_CALL(CreatePipelineLayout);
+  *pPipelineLayout = newHandle<VkPipelineLayout>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyPipelineLayout(VkDevice device, VkPipelineLayout pipelineLayout,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyPipelineLayout);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateGraphicsPipelines(VkDevice device, VkPipelineCache pipelineCache,
+uint32_t createInfoCount, const VkGraphicsPipelineCreateInfo *pCreateInfos, const VkAllocationCallbacks *pAllocator,
+VkPipeline *pPipelines) {
+  COUNT_CALL(CreateGraphicsPipelines);
+  for (uint32_t i = 0; i < createInfoCount; i++) {
+    pPipelines[i] = newHandle<VkPipeline>();
+  }
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateComputePipelines(VkDevice device, VkPipelineCache pipelineCache,
+uint32_t createInfoCount, const VkComputePipelineCreateInfo *pCreateInfos, const VkAllocationCallbacks *pAllocator,
+VkPipeline *pPipelines) {
+  COUNT_CALL(CreateComputePipelines);
+  for (uint32_t i = 0; i < createInfoCount; i++) {
+    pPipelines[i] = newHandle<VkPipeline>();
+  }
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyPipeline(VkDevice device, VkPipeline pipeline,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyPipeline);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateDescriptorSetLayout(VkDevice device,
+const VkDescriptorSetLayoutCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator,
+VkDescriptorSetLayout *pSetLayout) {
+  COUNT_CALL(CreateDescriptorSetLayout);
+  *pSetLayout = newHandle<VkDescriptorSetLayout>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyDescriptorSetLayout(VkDevice device,
+VkDescriptorSetLayout descriptorSetLayout, const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyDescriptorSetLayout);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateDescriptorPool(VkDevice device,
+const VkDescriptorPoolCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator,
+VkDescriptorPool *pDescriptorPool) {
+  COUNT_CALL(CreateDescriptorPool);
+  *pDescriptorPool = newHandle<VkDescriptorPool>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyDescriptorPool(VkDevice device, VkDescriptorPool descriptorPool,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyDescriptorPool);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullAllocateDescriptorSets(VkDevice device,
+const VkDescriptorSetAllocateInfo *pAllocateInfo, VkDescriptorSet *pDescriptorSets) {
+  COUNT_CALL(AllocateDescriptorSets);
+  for (uint32_t i = 0; i < pAllocateInfo->descriptorSetCount; i++) {
+    pDescriptorSets[i] = newHandle<VkDescriptorSet>();
+  }
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullUpdateDescriptorSets(VkDevice device, uint32_t descriptorWriteCount,
+const VkWriteDescriptorSet *pDescriptorWrites, uint32_t descriptorCopyCount,
+const VkCopyDescriptorSet *pDescriptorCopies) {
+  COUNT_CALL(UpdateDescriptorSets);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateRenderPass(VkDevice device, const VkRenderPassCreateInfo *pCreateInfo,
+const VkAllocationCallbacks *pAllocator, VkRenderPass *pRenderPass) {
+  COUNT_CALL(CreateRenderPass);
+  *pRenderPass = newHandle<VkRenderPass>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyRenderPass(VkDevice device, VkRenderPass renderPass,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyRenderPass);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateFramebuffer(VkDevice device,
+const VkFramebufferCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkFramebuffer *pFramebuffer) {
+  COUNT_CALL(CreateFramebuffer);
+  *pFramebuffer = newHandle<VkFramebuffer>();
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyFramebuffer(VkDevice device, VkFramebuffer framebuffer,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyFramebuffer);
+}
+
+/* Command pools own their command buffers, which record nothing */
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullCreateCommandPool(VkDevice device,
+const VkCommandPoolCreateInfo *pCreateInfo, const VkAllocationCallbacks *pAllocator, VkCommandPool *pCommandPool) {
+  COUNT_CALL(CreateCommandPool);
+  *pCommandPool = new VkCommandPool_T;
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullDestroyCommandPool(VkDevice device, VkCommandPool commandPool,
+const VkAllocationCallbacks *pAllocator) {
+  COUNT_CALL(DestroyCommandPool);
+  if (commandPool == VK_NULL_HANDLE) {
+    return;
+  }
+  for (size_t i = 0; i < commandPool->commandBuffers.size(); i++) {
+    delete commandPool->commandBuffers[i];
+  }
+  delete commandPool;
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullResetCommandPool(VkDevice device, VkCommandPool commandPool,
+VkCommandPoolResetFlags flags) {
+  COUNT_CALL(ResetCommandPool);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullAllocateCommandBuffers(VkDevice device,
+const VkCommandBufferAllocateInfo *pAllocateInfo, VkCommandBuffer *pCommandBuffers) {
+  COUNT_CALL(AllocateCommandBuffers);
+  for (uint32_t i = 0; i < pAllocateInfo->commandBufferCount; i++) {
+    VkCommandBuffer commandBuffer = new VkCommandBuffer_T;
+    commandBuffer->loaderData = ICD_LOADER_MAGIC;
+    pAllocateInfo->commandPool->commandBuffers.push_back(commandBuffer);
+    pCommandBuffers[i] = commandBuffer;
+  }
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullFreeCommandBuffers(VkDevice device, VkCommandPool commandPool,
+uint32_t commandBufferCount, const VkCommandBuffer *pCommandBuffers) {
+  COUNT_CALL(FreeCommandBuffers);
+  std::vector<VkCommandBuffer> *pPoolBuffers = &commandPool->commandBuffers;
+  for (uint32_t i = 0; i < commandBufferCount; i++) {
+    for (size_t j = 0; j < pPoolBuffers->size(); j++) {
+      if ((*pPoolBuffers)[j] == pCommandBuffers[i]) {
+        delete (*pPoolBuffers)[j];
+        (*pPoolBuffers)[j] = pPoolBuffers->back();
+        pPoolBuffers->pop_back();
+        break;
+      }
+    }
+  }
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullBeginCommandBuffer(VkCommandBuffer commandBuffer,
+const VkCommandBufferBeginInfo *pBeginInfo) {
+  COUNT_CALL(BeginCommandBuffer);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR VkResult VKAPI_CALL nullEndCommandBuffer(VkCommandBuffer commandBuffer) {
+  COUNT_CALL(EndCommandBuffer);
+  return (VK_SUCCESS);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBeginQuery(VkCommandBuffer commandBuffer, VkQueryPool queryPool,
+uint32_t query, VkQueryControlFlags flags) {
+  COUNT_CALL(CmdBeginQuery);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdEndQuery(VkCommandBuffer commandBuffer, VkQueryPool queryPool,
+uint32_t query) {
+  COUNT_CALL(CmdEndQuery);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdResetQueryPool(VkCommandBuffer commandBuffer, VkQueryPool queryPool,
+uint32_t firstQuery, uint32_t queryCount) {
+  COUNT_CALL(CmdResetQueryPool);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdWriteTimestamp(VkCommandBuffer commandBuffer,
+VkPipelineStageFlagBits pipelineStage, VkQueryPool queryPool, uint32_t query) {
+  COUNT_CALL(CmdWriteTimestamp);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBeginRenderPass(VkCommandBuffer commandBuffer,
+const VkRenderPassBeginInfo *pRenderPassBegin, VkSubpassContents contents) {
+  COUNT_CALL(CmdBeginRenderPass);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdEndRenderPass(VkCommandBuffer commandBuffer) {
+  COUNT_CALL(CmdEndRenderPass);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdExecuteCommands(VkCommandBuffer commandBuffer, uint32_t commandBufferCount,
+const VkCommandBuffer *pCommandBuffers) {
+  COUNT_CALL(CmdExecuteCommands);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBindPipeline(VkCommandBuffer commandBuffer,
+VkPipelineBindPoint pipelineBindPoint, VkPipeline pipeline) {
+  COUNT_CALL(CmdBindPipeline);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBindDescriptorSets(VkCommandBuffer commandBuffer,
+VkPipelineBindPoint pipelineBindPoint, VkPipelineLayout layout, uint32_t firstSet, uint32_t descriptorSetCount,
+const VkDescriptorSet *pDescriptorSets, uint32_t dynamicOffsetCount, const uint32_t *pDynamicOffsets) {
+  COUNT_CALL(CmdBindDescriptorSets);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBindVertexBuffers(VkCommandBuffer commandBuffer, uint32_t firstBinding,
+uint32_t bindingCount, const VkBuffer *pBuffers, const VkDeviceSize *pOffsets) {
+  COUNT_CALL(CmdBindVertexBuffers);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdBindIndexBuffer(VkCommandBuffer commandBuffer, VkBuffer buffer,
+VkDeviceSize offset, VkIndexType indexType) {
+  COUNT_CALL(CmdBindIndexBuffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdPushConstants(VkCommandBuffer commandBuffer, VkPipelineLayout layout,
+VkShaderStageFlags stageFlags, uint32_t offset, uint32_t size, const void *pValues) {
+  COUNT_CALL(CmdPushConstants);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdSetViewport(VkCommandBuffer commandBuffer, uint32_t firstViewport,
+uint32_t viewportCount, const VkViewport *pViewports) {
+  COUNT_CALL(CmdSetViewport);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdSetScissor(VkCommandBuffer commandBuffer, uint32_t firstScissor,
+uint32_t scissorCount, const VkRect2D *pScissors) {
+  COUNT_CALL(CmdSetScissor);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdPipelineBarrier(VkCommandBuffer commandBuffer,
+VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, VkDependencyFlags dependencyFlags,
+uint32_t memoryBarrierCount, const VkMemoryBarrier *pMemoryBarriers, uint32_t bufferMemoryBarrierCount,
+const VkBufferMemoryBarrier *pBufferMemoryBarriers, uint32_t imageMemoryBarrierCount,
+const VkImageMemoryBarrier *pImageMemoryBarriers) {
+  COUNT_CALL(CmdPipelineBarrier);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdCopyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer,
+VkBuffer dstBuffer, uint32_t regionCount, const VkBufferCopy *pRegions) {
+  COUNT_CALL(CmdCopyBuffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdCopyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer srcBuffer,
+VkImage dstImage, VkImageLayout dstImageLayout, uint32_t regionCount, const VkBufferImageCopy *pRegions) {
+  COUNT_CALL(CmdCopyBufferToImage);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdCopyImageToBuffer(VkCommandBuffer commandBuffer, VkImage srcImage,
+VkImageLayout srcImageLayout, VkBuffer dstBuffer, uint32_t regionCount, const VkBufferImageCopy *pRegions) {
+  COUNT_CALL(CmdCopyImageToBuffer);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdDispatch(VkCommandBuffer commandBuffer, uint32_t groupCountX,
+uint32_t groupCountY, uint32_t groupCountZ) {
+  COUNT_CALL(CmdDispatch);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdDrawIndexed(VkCommandBuffer commandBuffer, uint32_t indexCount,
+uint32_t instanceCount, uint32_t firstIndex, int32_t vertexOffset, uint32_t firstInstance) {
+  COUNT_CALL(CmdDrawIndexed);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdDrawIndexedIndirect(VkCommandBuffer commandBuffer, VkBuffer buffer,
+VkDeviceSize offset, uint32_t drawCount, uint32_t stride) {
+  COUNT_CALL(CmdDrawIndexedIndirect);
+}
+
+static VKAPI_ATTR void VKAPI_CALL nullCmdDrawIndexedIndirectCount(VkCommandBuffer commandBuffer, VkBuffer buffer,
+VkDeviceSize offset, VkBuffer countBuffer, VkDeviceSize countBufferOffset, uint32_t maxDrawCount, uint32_t stride) {
+  COUNT_CALL(CmdDrawIndexedIndirectCount);
+}
+
+/* Entry point lookup, for the loader and vkGet*ProcAddr alike */
+
+typedef struct {
+  const char *pName;
+  PFN_vkVoidFunction pFunction;
+} EntryPointAddress;
+
+static const EntryPointAddress pEntryPointAddresses[] = {
+#define NULLVK_ENTRY_ADDRESS(name) {"vk" #name, (PFN_vkVoidFunction)null##name},
+    NULLVK_ENTRY_POINTS(NULLVK_ENTRY_ADDRESS)
+#undef NULLVK_ENTRY_ADDRESS
+#define NULLVK_ALIAS_ADDRESS(alias, name) {"vk" #alias, (PFN_vkVoidFunction)null##name},
+    NULLVK_ALIASES(NULLVK_ALIAS_ADDRESS)
+#undef NULLVK_ALIAS_ADDRESS
+};
+
+// only called while the loader builds its dispatch tables, a scan is enough
+static PFN_vkVoidFunction getProcAddr(const char *pName) {
+  for (size_t i = 0; i < sizeof(pEntryPointAddresses) / sizeof(pEntryPointAddresses[0]); i++) {
+    if (strcmp(pEntryPointAddresses[i].pName, pName) == 0) {
+      return (pEntryPointAddresses[i].pFunction);
+    }
+  }
+  return (NULL);
+}
+
+/* The loader's driver interface, the only symbols the library exports */
+
+extern "C" __attribute__((visibility("default"))) VKAPI_ATTR VkResult VKAPI_CALL
+vk_icdNegotiateLoaderICDInterfaceVersion(uint32_t *pSupportedVersion) {
+  if (*pSupportedVersion > NULLVK_INTERFACE_VERSION) {
+    *pSupportedVersion = NULLVK_INTERFACE_VERSION;
+  }
+  return (VK_SUCCESS);
+}
+
+extern "C" __attribute__((visibility("default"))) VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+vk_icdGetInstanceProcAddr(VkInstance instance, const char *pName) {
+  return (getProcAddr(pName));
+}
+
+extern "C" __attribute__((visibility("default"))) VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL
+vk_icdGetPhysicalDeviceProcAddr(VkInstance instance, const char *pName) {
+  return (getProcAddr(pName));
+}
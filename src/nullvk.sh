@@ -0,0 +1,10 @@
+# Builds the null Vulkan driver and the renderer from src/, then benchmarks
+# the renderer against the driver: no GPU or rasterizer is involved, so the
+# frame times are our own recording and submission overhead. Writes
+# bench-null.json and the per entry point call counts to calls.json. Extra
+# arguments go to the renderer, e.g. --objects 100000 --draws 1000.
+../assets/shaders/compile.sh || exit 1
+g++ -std=c++17 -O2 -shared -fPIC -fvisibility=hidden nullvk.cpp -o libnullvk.so || exit 1
+g++ -std=c++17 -O2 main.cpp -o nullvk-bench -lglfw -lvulkan -ldl -lpthread -lX11 -lXxf86vm -lXrandr -lXi || exit 1
+VK_ICD_FILENAMES="$PWD/nullvk.json" VK_DRIVER_FILES="$PWD/nullvk.json" NULLVK_CALL_COUNTS=calls.json \
+  ./nullvk-bench --bench 5000 --warmup 100 --bench-json bench-null.json "$@"
@@ -1,7 +1,7 @@
 cd ..
 cd assets
 cd shaders
-./compile.sh 
+./compile.sh || exit 1
 cd ..
 cd ..
 cd src